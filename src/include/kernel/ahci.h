@@ -0,0 +1,105 @@
+#ifndef _AHCI_H
+#define _AHCI_H
+
+#include <sys/types.h>
+
+/*
+ * Driver for AHCI SATA controllers (e.g. QEMU's -device ahci, or the ICH9 on q35).
+ * Each port with a disk attached is registered as a block device; disks that support
+ * native command queuing get up to 32 commands in flight at once.
+ */
+
+void ahci_init(void); /* finds the controllers and disks, and registers the disks as block devices */
+
+#define AHCI_MAX_HBAS 2
+#define AHCI_MAX_PORTS 32
+#define AHCI_MAX_SLOTS 32
+#define AHCI_ABAR_SIZE 0x1100 /* the generic host control registers, plus 32 ports' */
+
+/* The largest request merging may create; a PRD table always has room for it */
+#define AHCI_MAX_SECTORS 256
+#define AHCI_PRDT_ENTRIES 40 /* per command table; 256 sectors may span 33 pages */
+
+/* Generic host control registers (offsets from the ABAR, PCI BAR5) */
+#define AHCI_CAP 0x00
+#define AHCI_GHC 0x04
+#define AHCI_IS 0x08 /* one bit per port with an interrupt pending; write 1 to clear */
+#define AHCI_PI 0x0c /* ports implemented */
+#define AHCI_VS 0x10
+
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1f) + 1) /* command slots per port */
+#define AHCI_CAP_SNCQ (1 << 30)
+
+#define AHCI_GHC_IE (1 << 1) /* interrupt enable */
+#define AHCI_GHC_AE (1U << 31) /* AHCI enable */
+
+/* Port registers (offsets from AHCI_PORT_BASE(port)) */
+#define AHCI_PORT_BASE(port) (0x100 + (port) * 0x80)
+#define AHCI_PxCLB 0x00 /* command list base, 1 kiB aligned */
+#define AHCI_PxCLBU 0x04
+#define AHCI_PxFB 0x08 /* FIS receive area, 256-byte aligned */
+#define AHCI_PxFBU 0x0c
+#define AHCI_PxIS 0x10
+#define AHCI_PxIE 0x14
+#define AHCI_PxCMD 0x18
+#define AHCI_PxTFD 0x20 /* task file data: the ATA status and error registers */
+#define AHCI_PxSIG 0x24
+#define AHCI_PxSSTS 0x28
+#define AHCI_PxSERR 0x30
+#define AHCI_PxSACT 0x34 /* NCQ commands outstanding */
+#define AHCI_PxCI 0x38 /* commands issued */
+
+#define AHCI_PxCMD_ST (1 << 0) /* start processing the command list */
+#define AHCI_PxCMD_FRE (1 << 4) /* FIS receive enable */
+#define AHCI_PxCMD_FR (1 << 14) /* FIS receive running */
+#define AHCI_PxCMD_CR (1 << 15) /* command list running */
+
+#define AHCI_PxIS_DHRS (1 << 0) /* D2H register FIS: a non-queued command is done */
+#define AHCI_PxIS_PSS (1 << 1) /* PIO setup FIS */
+#define AHCI_PxIS_DSS (1 << 2) /* DMA setup FIS */
+#define AHCI_PxIS_SDBS (1 << 3) /* set device bits FIS: NCQ commands are done */
+#define AHCI_PxIS_DPS (1 << 5) /* a PRD with the interrupt bit was processed */
+#define AHCI_PxIS_IFS (1 << 27) /* interface fatal error */
+#define AHCI_PxIS_HBDS (1 << 28) /* host bus data error */
+#define AHCI_PxIS_HBFS (1 << 29) /* host bus fatal error */
+#define AHCI_PxIS_TFES (1 << 30) /* task file error: the device reported an error */
+#define AHCI_PxIS_ERRORS (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+#define AHCI_PxIE_DEFAULT (AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | AHCI_PxIS_SDBS | AHCI_PxIS_DPS | AHCI_PxIS_ERRORS)
+
+#define AHCI_SSTS_DET(ssts) ((ssts) & 0xf)
+#define AHCI_SSTS_DET_PRESENT 3 /* device present, and communication established */
+
+#define AHCI_SIG_ATA 0x00000101 /* what a SATA disk puts in PxSIG; ATAPI devices use 0xeb140101 */
+
+/* Command header flags; the low 5 bits are the command FIS length in dwords */
+#define AHCI_CMD_WRITE (1 << 6) /* data goes to the device */
+
+#define SATA_FIS_TYPE_REG_H2D 0x27
+#define SATA_FIS_H2D_LENGTH 5 /* in dwords */
+#define SATA_FIS_H2D_COMMAND 0x80 /* in byte 1: this FIS carries a command */
+
+/* One entry in a port's command list */
+typedef struct ahci_cmd_header {
+	uint16 flags; /* FIS length, and AHCI_CMD_* */
+	uint16 prdtl; /* PRD table entries */
+	volatile uint32 prdbc; /* bytes transferred, as updated by the HBA */
+	uint32 ctba; /* the command table's physical address, 128-byte aligned */
+	uint32 ctbau;
+	uint32 reserved[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+
+typedef struct ahci_prd {
+	uint32 dba; /* physical address, word aligned */
+	uint32 dbau;
+	uint32 reserved;
+	uint32 dbc; /* byte count - 1; bit 31 requests an interrupt */
+} __attribute__((packed)) ahci_prd_t;
+
+typedef struct ahci_cmd_table {
+	uint8 cfis[64]; /* the command FIS */
+	uint8 acmd[16]; /* ATAPI command */
+	uint8 reserved[48];
+	ahci_prd_t prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+#endif
@@ -4,12 +4,18 @@
 #include <sys/types.h>
 
 struct ata_device;
-#include <kernel/partition.h> /* partition_t */
+#include <kernel/blkdev.h>
+#include <kernel/mutex.h>
 
 typedef struct ata_channel {
 	uint16 base; /* IO base address */
 	uint16 ctrl; /* Control reg base */
-	uint16 bmide; /* Bus master IDE */
+	uint16 bmide; /* Bus master IDE registers for this channel; 0 if there is no bus master controller */
+	uint32 *prdt; /* Physical Region Descriptor Table used for DMA (2 dwords per entry) */
+	uint32 prdt_phys;
+	struct task *waiter; /* the task sleeping until the current command completes, if any */
+	mutex_t *mutex; /* held while a command is in progress; the two channels work independently */
+	volatile uint32 interrupts_handled; /* mostly used for debugging, to ensure interrupts aren't missed */
 } ata_channel_t;
 
 typedef struct ata_device {
@@ -22,19 +28,20 @@ typedef struct ata_device {
 	char model[41]; /* model as a NULL-terminated string. May be padded to 40 characters. */
 	char serial[21]; /* serial number as a NULL-terminated string. May be padded to 20 characters. */
 	uint8 ata_ver; /* the ATA version this disk conforms to */
-	uint8 max_udma_mode; /* 0 through 5; other values are invalid */
+	uint8 max_udma_mode; /* 0 through 5; 0xff if UDMA isn't supported */
+	uint8 max_mwdma_mode; /* 0 through 2; 0xff if multiword DMA isn't supported */
+	bool use_dma; /* transfer data with bus master DMA rather than PIO, where possible */
 	uint8 max_pio_mode; /* should be at least 3 for all ATA drives */
-	partition_t partition[4]; /* the 4 primary MBR partitions on this disk */
-	uint8 max_sectors_multiple; /* how many sectors READ MULTIPLE can work with per block */
+	uint8 max_sectors_multiple; /* how many sectors READ/WRITE MULTIPLE transfer per block (per interrupt); 0 if unsupported */
+	blkdev_t blkdev; /* this disk's request queue */
 } ata_device_t;
 
 void ata_init(void); /* detects drives and creates the structures used */
+
+/* Synchronous I/O through the disk's request queue (see blkdev.h). Use blk_submit() for asynchronous I/O. */
 bool ata_read(ata_device_t *dev, uint64 lba, void *buffer, int sectors);
 bool ata_write(ata_device_t *dev, uint64 lba, void *buffer, int sectors);
 
-bool disk_read(ata_device_t *dev, uint64 start_lba, uint32 bytes, void *buffer); /* reads a buffer */
-bool disk_write(ata_device_t *dev, uint64 start_lba, uint32 bytes, void *buffer);
-
 extern ata_channel_t channels[2];
 extern ata_device_t devices[4];
 
@@ -71,10 +78,55 @@ extern ata_device_t devices[4];
 #define ATA_CMD_WRITE_MULTIPLE 0xc5
 #define ATA_CMD_SET_MULTIPLE_MODE 0xc6
 #define ATA_CMD_SET_FEATURES 0xef
+#define ATA_CMD_READ_DMA 0xc8
+#define ATA_CMD_WRITE_DMA 0xca
+#define ATA_CMD_READ_SECTORS_EXT 0x24
+#define ATA_CMD_WRITE_SECTORS_EXT 0x34
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_FLUSH_CACHE 0xe7
+#define ATA_CMD_FLUSH_CACHE_EXT 0xea
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60 /* NCQ; SATA only, see ahci.c */
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
 
 /* SET FEATURES subcommands */
 #define ATA_SF_SET_TRANSFER_MODE 0x03
 
+/* Transfer mode values for ATA_SF_SET_TRANSFER_MODE; OR in the mode number */
+#define ATA_XFER_PIO 0x08
+#define ATA_XFER_MWDMA 0x20
+#define ATA_XFER_UDMA 0x40
+
+/* Bus master IDE registers (PCI IDE controller BAR4), as offsets from ata_channel_t.bmide */
+#define ATA_BM_COMMAND 0
+#define ATA_BM_STATUS 2
+#define ATA_BM_PRDT 4
+
+#define ATA_BM_CMD_START (1 << 0)
+#define ATA_BM_CMD_READ (1 << 3) /* the controller writes to memory, i.e. a disk read */
+
+#define ATA_BM_SR_ACTIVE (1 << 0)
+#define ATA_BM_SR_ERR (1 << 1) /* write 1 to clear */
+#define ATA_BM_SR_IRQ (1 << 2) /* write 1 to clear */
+#define ATA_BM_SR_DRV0_DMA (1 << 5) /* set by the driver if drive 0 (master) is DMA capable */
+#define ATA_BM_SR_DRV1_DMA (1 << 6)
+
+/* The last entry in a PRD table has this bit set in its second dword */
+#define ATA_PRD_EOT 0x80000000
+
+/* The most sectors one READ/WRITE DMA command can transfer; limited by our one-page PRD table,
+ * which has room for 256 sectors even if every page of the buffer is discontiguous */
+#define ATA_DMA_MAX_SECTORS 256
+
+/* The most sectors one command can transfer (a sector count of 0 means 256 or 65536, respectively) */
+#define ATA_LBA28_MAX_SECTORS 256
+#define ATA_LBA48_MAX_SECTORS 65536
+
+/* LBA28 commands can address sectors below this */
+#define ATA_LBA28_LIMIT (1 << 28)
+
 /* Drive IDs to be sent to the drive select IO port */
 #define ATA_DRIVE 0xa0 /* base command */
 #define ATA_MASTER 0 /* usage: ATA_DRIVE | (ATA_MASTER << 4) */
@@ -2,13 +2,38 @@
 #define _BACKTRACE_H
 
 #include <sys/types.h>
+#include <kernel/ilist.h>
 
 struct symbol {
 	uint32 eip;
+	uint32 size; // in bytes; if the ELF file doesn't say, the distance to the next symbol (0 for the last one)
 	const char *name;
 };
 
+// A symbol table, sorted by address so that lookups can use binary search.
+// User symbol tables are shared (and reference counted) between all tasks running
+// the same executable; see symtab_load() in elf.c.
+struct symtab {
+	struct symbol *syms;
+	uint32 num;
+	char *strtab; // the names point into this; NULL for the kernel, whose string table is never moved
+	size_t strtab_size;
+
+	uint32 refcount;
+	ilist_node_t link; // on the list of loaded symbol tables
+	// Identifies the executable, so that later execs of the same file can reuse the table
+	uint32 dev;
+	uint32 ino;
+	uint32 mtime;
+	uint32 file_size;
+};
+
+extern struct symtab kernel_symtab;
+
 struct symbol *addr_to_func(uint32 eip);
+struct symbol *symtab_find_addr(struct symtab *tab, uint32 addr);
+struct symtab *symtab_get(struct symtab *tab);
+void symtab_put(struct symtab *tab);
 
 #define BACKTRACE_MAX 16
 // Lower indexes = deeper nesting
@@ -0,0 +1,107 @@
+#ifndef _BCACHE_H
+#define _BCACHE_H
+
+#include <sys/types.h>
+#include <kernel/ilist.h>
+#include <kernel/blkdev.h>
+
+/*
+ * The block buffer cache, used by the file systems for metadata (inodes, directories,
+ * indirect blocks, FAT sectors), and by FAT for file data.
+ * Buffers are keyed by (device, first sector, size); a file system should always use
+ * the same size for a given part of the disk, e.g. its block or cluster size.
+ * Unused buffers are kept on an LRU list, and the least recently used ones are freed
+ * once the cache grows past its size limit.
+ *
+ * bcache_prefetch() starts reading a buffer without waiting for it, which is used for
+ * read-ahead; queueing several adjacent buffers at once also lets the block layer
+ * merge them into one disk request.
+ *
+ * Writes are write-back: a modified buffer is marked dirty with bdirty() (or written with
+ * bcache_write()), and the flusher task writes it to disk later, once it's been dirty for
+ * BCACHE_DIRTY_EXPIRE_MS, or sooner if there's a lot of dirty data. Dirty buffers are never
+ * evicted. bcache_sync() writes everything back, and flushes the disks' write caches.
+ * A buffer may be modified while it's being written back; it's then dirty again afterwards.
+ */
+
+struct bcache_batch;
+
+typedef struct buf {
+	blkdev_t *dev;
+	uint64 lba;
+	uint32 size; /* in bytes; a multiple of 512 */
+	uint8 *data;
+	uint32 flags;
+	uint32 refcount; /* a read in progress holds one reference */
+	bool readahead; /* prefetched as read-ahead, and not used yet */
+	blk_io_t io; /* used while reading or writing */
+	wait_queue_t wq; /* tasks waiting for the read to finish */
+	uint32 dirtied; /* tick count when it last became dirty */
+	struct bcache_batch *batch; /* the writeback this buffer is part of, while BUF_WRITING */
+	ilist_node_t hash_node; /* unlinked once the buffer is invalidated */
+	ilist_node_t lru_node; /* on the LRU list while refcount == 0 and clean */
+	ilist_node_t dirty_node; /* on the dirty list while BUF_DIRTY */
+} buf_t;
+
+#define BUF_VALID (1 << 0) /* the data has been read successfully */
+#define BUF_BUSY (1 << 1) /* being read from disk */
+#define BUF_DIRTY (1 << 2) /* modified, and not yet written back */
+#define BUF_WRITING (1 << 3) /* being written to disk; holds a reference */
+
+#define BCACHE_DEFAULT_SIZE (2 * 1024 * 1024) /* bytes */
+
+#define BCACHE_FLUSH_INTERVAL_MS 1000 /* how often the flusher task looks for old dirty buffers */
+#define BCACHE_DIRTY_EXPIRE_MS 5000 /* buffers that have been dirty this long are written back */
+
+struct bcache_stats {
+	uint32 lookups;
+	uint32 hits;
+	uint32 misses;
+	uint32 evictions;
+	uint32 invalidations;
+	uint32 readahead; /* buffers read because of read-ahead */
+	uint32 readahead_hits; /* ... that were used later */
+	uint32 readahead_unused; /* ... that were evicted unused */
+	uint32 buffers; /* currently cached */
+	uint32 bytes;
+	uint32 limit;
+	uint32 dirty_buffers; /* currently dirty, or dirty again after their write started */
+	uint32 dirty_bytes;
+	uint32 written; /* buffers written back */
+	uint64 written_bytes;
+	uint32 writeback_ms; /* time spent waiting for writebacks to finish */
+	uint32 write_errors;
+	uint32 syncs;
+};
+
+void bcache_init(void);
+
+/* Returns a referenced buffer with the data of /size/ bytes starting at /lba/, reading it from
+ * disk if necessary; NULL if the read failed. Release it with brelse(). */
+buf_t *bread(blkdev_t *dev, uint64 lba, uint32 size);
+void brelse(buf_t *b);
+
+/* Starts reading a buffer into the cache, unless it's already there; doesn't wait for the read.
+ * /readahead/ is only used for the statistics. */
+void bcache_prefetch(blkdev_t *dev, uint64 lba, uint32 size, bool readahead);
+
+/* Marks a referenced, valid buffer as modified, so that it's written back later */
+void bdirty(buf_t *b);
+
+/* Replaces the data of /size/ bytes starting at /lba/, without reading it first; the data is written back later.
+ * Returns 0 or -errno. */
+int bcache_write(blkdev_t *dev, uint64 lba, const void *data, uint32 size);
+
+/* Writes back all dirty buffers for /dev/ (all devices if NULL), and flushes the write cache.
+ * Returns 0 or -errno. */
+int bcache_sync(blkdev_t *dev);
+
+/* Drops any cached data for the given sectors, after writing back dirty buffers;
+ * used when they're written behind the cache's back */
+void bcache_invalidate(blkdev_t *dev, uint64 lba, uint32 sectors);
+
+/* Sets the cache size limit, in bytes, freeing unused buffers as needed */
+void bcache_set_limit(uint32 bytes);
+void bcache_get_stats(struct bcache_stats *st);
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef _BLKDEV_H
+#define _BLKDEV_H
+
+#include <sys/types.h>
+#include <kernel/ilist.h>
+#include <kernel/task.h> /* wait_queue_t */
+#include <kernel/partition.h> /* partition_t */
+
+/*
+ * The block layer. Each block device has a request queue, served by a kernel task
+ * of its own ("the worker"); callers submit I/O and either sleep until it's done,
+ * or get a callback. That way, many tasks can have I/O outstanding at once.
+ *
+ * Queued I/O is merged into larger requests where the sectors are adjacent, and
+ * dispatched in ascending LBA order (a one-way elevator, wrapping around at the end),
+ * except that a request that has waited past its deadline goes first.
+ * I/O that overlaps earlier I/O (where either one is a write) is never reordered with it.
+ *
+ * A driver either carries out one request at a time (transfer), or starts requests and
+ * reports their completion later (submit), in which case up to /queue_depth/ requests may
+ * be in flight at once; the completions are then handled by the worker task.
+ */
+
+struct blkdev;
+
+/* One caller's I/O: a number of consecutive sectors to or from one buffer */
+typedef struct blk_io {
+	uint64 lba;
+	uint32 sectors;
+	void *buffer; /* sectors * 512 bytes */
+	bool write;
+
+	/* If set, this is called by the worker task when the I/O is done, and blk_wait() may not be used.
+	 * The callback may free the blk_io_t. */
+	void (*callback)(struct blk_io *io);
+	void *private; /* for use by the callback */
+
+	/* The rest is set up by blk_submit() */
+	int error; /* 0 or -errno, once done */
+	volatile bool done;
+	wait_queue_t wq;
+	struct blk_io *next; /* the next I/O in the same request, in LBA order */
+} blk_io_t;
+
+/* What a driver carries out: one or more merged blk_io_t, covering consecutive sectors */
+typedef struct blk_request {
+	uint64 lba;
+	uint32 sectors;
+	bool write;
+	blk_io_t *ios; /* linked through io->next, in LBA order */
+	blk_io_t *last_io;
+	uint32 seq; /* submission order, to keep overlapping I/O in order */
+	uint32 deadline; /* tick count after which this request is dispatched ahead of the elevator order */
+	ilist_node_t sorted_node; /* on dev->sorted while queued; on dev->done once completed by the driver */
+	ilist_node_t fifo_node; /* on dev->fifo[write] while queued; on dev->active while in flight */
+	int error; /* set by blk_end_request() */
+	uint32 parts; /* for the driver's use while in flight, e.g. for requests split into several commands */
+} blk_request_t;
+
+typedef struct blkdev_ops {
+	/* Carries out a request, sleeping until it's done; returns 0 or -errno. Called from the worker task only. */
+	int (*transfer)(struct blkdev *dev, blk_request_t *req);
+	/* Used instead of transfer if set: starts a request without waiting for it. The driver must call
+	 * blk_end_request() once it's done (or has failed), typically from its interrupt handler.
+	 * Called from the worker task only. */
+	void (*submit)(struct blkdev *dev, blk_request_t *req);
+	/* Optional: makes completed writes durable, i.e. writes back the device's own write cache; returns 0 or -errno.
+	 * May be called from any task. */
+	int (*flush)(struct blkdev *dev);
+} blkdev_ops_t;
+
+typedef struct blkdev {
+	char name[16]; /* also the worker task's name */
+	uint64 size; /* in sectors */
+	uint32 max_sectors; /* the largest request merging may create */
+	uint32 queue_depth; /* how many requests the driver can have in flight (with submit); 0 means 1 */
+	const blkdev_ops_t *ops;
+	void *driver_data;
+	partition_t partition[4]; /* the 4 primary MBR partitions on this disk; see parse_mbr() */
+
+	/* Queue state; modified with interrupts disabled */
+	ilist_t sorted; /* queued requests, by LBA */
+	ilist_t fifo[2]; /* the same requests by age, for reads [0] and writes [1] */
+	uint64 next_lba; /* where the elevator is; the sector after the last request dispatched */
+	uint32 next_seq;
+	ilist_t active; /* requests in flight */
+	ilist_t done; /* requests the driver has completed, waiting for the worker to finish them */
+	uint32 in_flight;
+	wait_queue_t worker_wq;
+	struct task *worker;
+	ilist_node_t node; /* on the list of all block devices */
+
+	/* Statistics */
+	uint32 stat_ios;
+	uint32 stat_merges;
+	uint32 stat_requests;
+	uint32 stat_expired; /* requests dispatched because of their deadline */
+} blkdev_t;
+
+/* How long requests may be passed over by the elevator */
+#define BLK_READ_EXPIRE_MS 500
+#define BLK_WRITE_EXPIRE_MS 5000
+
+/* All registered block devices, linked through /node/ */
+extern ilist_t blkdevs;
+
+/* Sets up the queue and starts the worker task. /name/, /size/, /max_sectors/, /ops/ and
+ * /driver_data/ must be filled in by the caller, and /queue_depth/ for drivers with submit. */
+void blkdev_register(blkdev_t *dev);
+
+/* Queues /io/; it must stay valid until it's done. Fill in lba, sectors, buffer, write, and optionally callback/private. */
+void blk_submit(blkdev_t *dev, blk_io_t *io);
+
+/* Sleeps until /io/ (which has no callback) is done; returns its error code */
+int blk_wait(blk_io_t *io);
+
+/* Synchronous I/O: submits, then waits. Returns 0 or -errno. */
+int blk_rw(blkdev_t *dev, uint64 lba, void *buffer, uint32 sectors, bool write);
+
+/* Flushes the device's write cache (see blkdev_ops_t), or that of every device. Writes that
+ * haven't completed yet aren't covered. Returns 0 or -errno (the first error, for blk_flush_all). */
+int blk_flush(blkdev_t *dev);
+int blk_flush_all(void);
+
+/* Called by drivers with submit (see blkdev_ops_t) when a request is done; /error/ is 0 or -errno.
+ * May be called from interrupt handlers. */
+void blk_end_request(blkdev_t *dev, blk_request_t *req, int error);
+
+/* Reads a buffer of "any" size (make sure that the buffer passed is large enough -
+ * for bytes=640, the buffer must be at least 1024 bytes large; always in multiples of 512) */
+bool disk_read(blkdev_t *dev, uint64 start_lba, uint32 bytes, void *buffer);
+/* Writes a buffer the same way; the data goes to the buffer cache, and is written back later; see bcache_sync() */
+bool disk_write(blkdev_t *dev, uint64 start_lba, uint32 bytes, void *buffer);
+
+#endif
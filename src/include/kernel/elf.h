@@ -6,6 +6,7 @@
 #include <kernel/task.h>
 
 bool elf_load(const char *path, task_t *task, void *data /* command line stuff */);
+int elf_load_argv(const char *path, task_t *task, char *argv[], char *envp[]);
 void load_kernel_symbols(void *addr, uint32 num, uint32 size, uint32 shndx);
 typedef uint32 Elf32_Addr;
 typedef uint16 Elf32_Half;
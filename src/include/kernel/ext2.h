@@ -2,10 +2,10 @@
 #define _EXT2_H
 
 #include <sys/types.h>
-#include <kernel/ata.h>
+#include <kernel/blkdev.h>
 #include <kernel/vfs.h>
 
-bool ext2_detect(ata_device_t *dev, uint8 part);
+bool ext2_detect(blkdev_t *dev, uint8 part);
 
 #define EXT2_ROOT_INO 2
 
@@ -216,7 +216,7 @@ typedef struct ext2_direntry {
 typedef struct ext2_partition {
 	struct ext2_superblock super;
 	mountpoint_t *mp;
-	ata_device_t *dev;
+	blkdev_t *dev;
 	partition_t *part;
 	ext2_bgd_t *bgdt;
 	uint32 blocksize;
@@ -2,10 +2,10 @@
 #define _FAT_H
 
 #include <sys/types.h>
-#include <kernel/ata.h>
+#include <kernel/blkdev.h>
 #include <kernel/vfs.h>
 
-bool fat_detect(ata_device_t *dev, uint8 part);
+bool fat_detect(blkdev_t *dev, uint8 part);
 
 #define ATTRIB_READONLY 0x1
 #define ATTRIB_HIDDEN 0x2
@@ -57,7 +57,7 @@ typedef struct fat32_bpb fat32_bpb_t;
 #define FAT32_MAGIC 0x1234fedc
 typedef struct fat32_partition {
 	uint32 magic; // used to verify this entry in the device table
-	ata_device_t *dev; /* the device that holds this partition */
+	blkdev_t *dev; /* the device that holds this partition */
 	uint32 fat_start_lba; /* the LBA where the FAT begins */
 	uint32 end_lba; /* last valid LBA for this partition */
 	uint32 cluster_start_lba;
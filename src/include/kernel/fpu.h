@@ -1,10 +1,33 @@
 #ifndef _FPU_H
 #define _FPU_H
 
+#include <sys/types.h>
+#include <sys/cpufeature.h>
+
+struct task;
+
 void fpu_init(void);
 
+/* Writes the FPU/SSE registers back to task->fpu_state, if /task/ currently owns them (e.g. before copying the state) */
+void fpu_sync_state(struct task *task);
+
+/* Called when a task is destroyed, so that we don't try to save the registers to freed memory */
+void fpu_forget_task(struct task *task);
+
+/*
+ * Lets the kernel use the MMX/SSE registers, e.g. for large memcpy()s. Interrupts are
+ * disabled in between, so keep the sections short; kernel_fpu_end() takes the return value of
+ * kernel_fpu_begin().
+ */
+bool kernel_fpu_begin(void);
+void kernel_fpu_end(bool reenable_interrupts);
+
+/* CPU_FEATURE_* bits (see sys/cpufeature.h); set up by fpu_init() */
+extern uint32 cpu_features;
+
 // Note: this struct must always be 16-byte aligned, e.g. using __attribute__((aligned(16))), or
 // page-aligned kmalloc.
+// With FXSR, this is the FXSAVE area; without it, FSAVE uses the first 108 bytes.
 typedef struct fpu_mmx_state {
 	char data[512];
 } fpu_mmx_state_t;
@@ -17,7 +17,12 @@ struct gdt_ptr {
 	uint32 base;
 } __attribute__((packed));
 
+/* User mode data segment whose base is switched per task; used for thread-local storage */
+#define GDT_TLS_ENTRY 7
+#define GDT_TLS_SELECTOR ((GDT_TLS_ENTRY * 8) | 3)
+
 void gdt_set_gate(sint32 num, uint32 base, uint32 limit, uint8 access, uint8 gran);
+void gdt_set_tls_base(uint32 base);
 void gdt_install(void);
 void gdt_flush(void);
 
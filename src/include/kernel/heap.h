@@ -3,7 +3,7 @@
 
 #include <sys/types.h>
 #include <kernel/mutex.h>
-#include <kernel/ordered_array.h>
+#include <kernel/rbtree.h>
 #include <kernel/vmm.h>
 
 /************************
@@ -22,6 +22,7 @@
 
 /* Describes an area header; placed before every block (free or used) */
 typedef struct {
+	rb_node_t node; /* in free_index if the area is free, used_index if it is used */
 	uint32 size; /* includes the header and footer! */
 	uint8 type; /* == AREA_USED (0) || AREA_FREE (1) */
 	uint32 magic;
@@ -33,40 +34,40 @@ typedef struct {
 	area_header_t *header;
 } area_footer_t;
 
+/* The smallest area worth creating: room for a header, a footer and a dword of data */
+#define MIN_AREA_SIZE (sizeof(area_header_t) + sizeof(area_footer_t) + 4)
+
 /* Describes a heap structure - only one is used in the entire kernel */
 typedef struct {
 	uint32 start_address;
 	uint32 end_address;
-	uint32 _min_address; // start address is for the storage; _min_address for the entire heap w/ indexes etc.
+	uint32 _min_address; // the first address used by the heap; start_address may be rounded up from it
 	uint32 max_address;
 	uint8 supervisor;
 	uint8 readonly;
 
-	ordered_array_t free_index; /* Stores an array of area_header_t pointers */
-	ordered_array_t used_index; /* Stores an array of area_header_t pointers */
+	rb_tree_t free_index; /* Free areas, sorted by size (then address); the nodes are stored in the area headers */
+	rb_tree_t used_index; /* Used areas, sorted by address; likewise */
 
 	area_header_t *rightmost_area; /* A pointer to the rightmost area, free or used. Used in both alloc() and free(). */
 
 	mutex_t *mutex;
 } heap_t;
 
-/* 65536 areas (per array; one for free areas, one for used areas) */
-#define HEAP_INDEX_SIZE 0x10000
-
 #define KHEAP_START 0xc0000000
 #define KHEAP_MAX_ADDR 0xcffff000 /* one page less than 0xd000000 */
 
 /* Set up the heap location, and start off with a 4 MiB heap */
-//#define KHEAP_INITIAL_SIZE 0x400000 /* 4 MiB; KEEP IN MIND that this MUST be larger than 2 * sizeof(type_t) * HEAP_INDEX_SIZE! */
+//#define KHEAP_INITIAL_SIZE 0x400000 /* 4 MiB */
 //#define HEAP_MIN_GROWTH 0x200000 /* 2 MiB; the smallest amount the heap is expanded by for each call to heap_expand() */
 //#define HEAP_MAX_WASTE 0x400000 /* 4 MiB; the largest the rightmost area (if it's free) is allowed to be before the heap is contracted */
 
 /* Values for heap debugging */
-#define KHEAP_INITIAL_SIZE 0x90000 /* 64 kiB + 512k for the indexes */
+#define KHEAP_INITIAL_SIZE 0x50000 /* 320 kiB */
 #define KHEAP_MIN_GROWTH 0x8000 /* 32 kiB */
 #define KHEAP_MAX_WASTE 0x120000 /* must be >1 MiB */
 
-#define USER_HEAP_INITIAL_SIZE 0x90000
+#define USER_HEAP_INITIAL_SIZE 0x50000
 #define USER_HEAP_MIN_GROWTH 0x8000
 #define USER_HEAP_MAX_WASTE 0x120000
 
@@ -0,0 +1,97 @@
+#ifndef _ILIST_H
+#define _ILIST_H
+
+#include <sys/types.h>
+
+/*
+ * An intrusive doubly-linked list: the links are embedded in the objects themselves,
+ * so adding an object never allocates memory, and removing one is O(1).
+ * Unlike list_t (see list.h), an object can only be on as many lists as it has
+ * ilist_node_t members.
+ *
+ * The list is circular, with the list head acting as a sentinel node.
+ * No locking is done; callers use INTERRUPT_LOCK or a mutex, as appropriate.
+ *
+ * Usage:
+ *   struct foo { int x; ilist_node_t link; };
+ *   ilist_t foos = ILIST_INIT(foos);
+ *   ilist_append(&foos, &f->link);
+ *   ilist_foreach(&foos, it) {
+ *       struct foo *f = ilist_entry(it, struct foo, link);
+ *   }
+ */
+
+typedef struct ilist_node {
+	struct ilist_node *prev;
+	struct ilist_node *next;
+} ilist_node_t;
+
+typedef struct ilist {
+	ilist_node_t head;
+	uint32 count;
+} ilist_t;
+
+#define ILIST_INIT(name) { .head = { .prev = &(name).head, .next = &(name).head }, .count = 0 }
+
+/* Gets the object an ilist_node_t is embedded in */
+#define ilist_entry(node, type, member) ((type *)((char *)(node) - __builtin_offsetof(type, member)))
+
+/* Note: the list may not be modified while iterating, except with ilist_foreach_safe (and only /it/) */
+#define ilist_foreach(list, it) for (ilist_node_t *it = (list)->head.next; it != &(list)->head; it = it->next)
+#define ilist_foreach_safe(list, it, tmp) \
+	for (ilist_node_t *it = (list)->head.next, *tmp = it->next; it != &(list)->head; it = tmp, tmp = it->next)
+
+static inline void ilist_init(ilist_t *list) {
+	list->head.prev = &list->head;
+	list->head.next = &list->head;
+	list->count = 0;
+}
+
+static inline bool ilist_empty(const ilist_t *list) {
+	return list->head.next == &list->head;
+}
+
+/* Whether /node/ is on a list; nodes that were never added must be zeroed for this to work */
+static inline bool ilist_linked(const ilist_node_t *node) {
+	return node->next != NULL;
+}
+
+/* Inserts /node/ after /pos/, which is on /list/ (or is &list->head) */
+static inline void ilist_insert_after(ilist_t *list, ilist_node_t *pos, ilist_node_t *node) {
+	node->prev = pos;
+	node->next = pos->next;
+	pos->next->prev = node;
+	pos->next = node;
+	list->count++;
+}
+
+static inline void ilist_prepend(ilist_t *list, ilist_node_t *node) {
+	ilist_insert_after(list, &list->head, node);
+}
+
+static inline void ilist_append(ilist_t *list, ilist_node_t *node) {
+	ilist_insert_after(list, list->head.prev, node);
+}
+
+static inline void ilist_remove(ilist_t *list, ilist_node_t *node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->prev = NULL;
+	node->next = NULL;
+	list->count--;
+}
+
+/* The first node, or NULL if the list is empty */
+static inline ilist_node_t *ilist_first(ilist_t *list) {
+	return ilist_empty(list) ? NULL : list->head.next;
+}
+
+/* The node after /node/, treating the list as a ring (i.e. the first node follows the last) */
+static inline ilist_node_t *ilist_next_wrap(ilist_t *list, ilist_node_t *node) {
+	node = node->next;
+	if (node == &list->head)
+		node = node->next;
+	return node;
+}
+
+#endif
@@ -59,7 +59,7 @@ typedef struct
 
 /* Used to register callbacks for interrupts. */
 typedef uint32 (*isr_t)(uint32);
-void register_interrupt_handler(uint8 n, isr_t handler);
+bool register_interrupt_handler(uint8 n, isr_t handler); /* fails if the vector has another handler */
 
 /* The mapping of IRQs to ISR handlers. */
 #define IRQ0 32
@@ -0,0 +1,35 @@
+#ifndef _MEMOPS_H
+#define _MEMOPS_H
+
+#include <sys/types.h>
+
+/*
+ * memcpy() and memset() (src/lib/memcpy.s and memset.s) handle small and medium sizes
+ * themselves, and hand sizes above a threshold to a variant chosen at boot,
+ * based on what the CPU supports.
+ */
+
+typedef struct mem_variant {
+	const char *name;
+	uint32 required_features; /* CPU_FEATURE_* */
+	size_t threshold; /* used for memcpy/memset sizes of at least this many bytes */
+	void *(*memcpy)(void *dst, const void *src, size_t len);
+	void *(*memset)(void *dst, int c, size_t len);
+} mem_variant_t;
+
+extern const mem_variant_t mem_variants[];
+extern const int num_mem_variants;
+
+/* Picks the best variant for this CPU; called after fpu_init() */
+void mem_select_variant(void);
+
+/* The variant in use */
+const mem_variant_t *mem_current_variant(void);
+
+/* Used by memcpy.s and memset.s */
+extern void *(*memcpy_large)(void *dst, const void *src, size_t len);
+extern void *(*memset_large)(void *dst, int c, size_t len);
+extern size_t memcpy_large_threshold;
+extern size_t memset_large_threshold;
+
+#endif
@@ -3,7 +3,8 @@
 
 #include <sys/types.h>
 
-/* This array is sorted on insertion and thus is always sorted. It stores anything that can be cast to a void*. */
+/* This array is sorted on insertion and thus is always sorted. It stores anything that can be cast to a void*.
+ * Lookups are binary searches (O(log n)); inserting and removing also shift the elements after the position. */
 typedef void* type_t;
 
 /* A predicate that should return nonzero if the first argument is less than the second. */
@@ -28,6 +29,9 @@ void insert_ordered_array(type_t item, ordered_array_t *array);
 /* Replace an element */
 void update_ordered_array(uint32 i, type_t item, ordered_array_t *array);
 
+/* Returns the index of the first element that is not less than /item/, or the array size if there is none */
+uint32 lowerbound_ordered_array(type_t item, ordered_array_t *array);
+
 /* Returns the index of the element specified, or -1 if not found. If multiple exists, returns the first item. */
 sint32 indexof_ordered_array(type_t item, ordered_array_t *array);
 
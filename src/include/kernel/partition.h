@@ -22,9 +22,10 @@ typedef struct partition {
 	 */
 } partition_t;
 
-#include <kernel/ata.h>
+struct blkdev;
 
-void parse_mbr(struct ata_device *dev);
+/* Reads the MBR, and sets up the partition entries for the disk */
+void parse_mbr(struct blkdev *dev);
 
 /* System ID byte values */
 #define PART_EXTENDED_8GB 0x05
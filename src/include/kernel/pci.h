@@ -13,12 +13,19 @@ typedef struct {
 	uint8 irq;
 	uint8 classcode;
 	uint8 subclasscode;
+	uint8 bus, slot, func; /* where to find the configuration space */
 } pci_device_t;
 
 // Looks through the PCI database to find the details (BARs, IRQ etc.)
 // for a PCI device
 pci_device_t *find_pci_device(uint32 vendor_id, uint32 device_id);
 
+uint32 pci_read_config(uint8 bus, uint8 slot, uint8 func, uint8 reg);
+void pci_write_config(uint8 bus, uint8 slot, uint8 func, uint8 reg, uint32 value);
+
+/* Lets the device perform DMA, by setting the Bus Master bit in its command register */
+void pci_enable_bus_master(pci_device_t *dev);
+
 /* The IO registers used to access PCI registers */
 #define PCI_CONFIG_ADDRESS 0xcf8
 #define PCI_CONFIG_DATA 0xcfc
@@ -45,6 +52,11 @@ pci_device_t *find_pci_device(uint32 vendor_id, uint32 device_id);
 #define PCI_CONF_BAR5			0x24
 #define PCI_CONF_IRQ			0x3C /* 0x000000ff */
 
+/* Bits in the command register */
+#define PCI_COMMAND_IO			(1 << 0)
+#define PCI_COMMAND_MEMORY		(1 << 1)
+#define PCI_COMMAND_BUS_MASTER	(1 << 2)
+
 /* bit 0 has these values for the two BAR types */
 #define BAR_MEM 0
 #define BAR_IO 1
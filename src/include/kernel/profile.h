@@ -0,0 +1,28 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <sys/types.h>
+#include <kernel/interrupts.h> /* registers_t */
+
+/*
+ * A statistical CPU profiler. While it's running, every timer tick records the
+ * interrupted EIP (plus a few callers, for kernel mode), privilege level and task
+ * into a ring buffer; the oldest samples are overwritten once it's full.
+ */
+
+#define PROF_MAX_SAMPLES 4096 /* must be a power of two; ~41 seconds at 100 Hz */
+#define PROF_STACK_DEPTH 6
+
+void prof_start(void);
+void prof_stop(void);
+
+/* Called by the scheduler on each timer tick, with interrupts disabled */
+void prof_tick(registers_t *regs);
+
+/* Prints the most sampled functions */
+void prof_report(void);
+
+/* Writes every sample to the serial port, in the "folded" format used by flamegraph.pl */
+void prof_dump(void);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _RAMDISK_H
+#define _RAMDISK_H
+
+#include <sys/types.h>
+
+/*
+ * Block devices that serve sectors from memory, through the same block layer as the disk
+ * drivers; used to measure the file systems without the cost of (emulated) disk I/O.
+ * Every GRUB module after the initrd is a disk image, served in place; e.g.
+ *     module /boot/disk.img
+ * The kernel command line option ramdisk=<MiB> adds an empty one.
+ */
+
+#define RAMDISK_MAX_IMAGES 4
+#define RAMDISK_MAX_SECTORS 256 /* the largest request merging may create, as for the disk drivers */
+
+/* Remembers a disk image at the given (identity mapped) physical addresses, to be registered
+ * by ramdisk_init(). Called from kmain() before paging is set up; the memory is never freed. */
+void ramdisk_add_image(uint32 start, uint32 end);
+
+/* Registers a block device for each image, plus the empty one, if any */
+void ramdisk_init(void);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _RBTREE_H
+#define _RBTREE_H
+
+#include <sys/types.h>
+
+/*
+ * An intrusive red-black tree: the nodes are embedded in the objects stored, so the tree
+ * never allocates memory (which is why the kernel heap can use it for its own index).
+ * Insert, remove and lookups are O(log n); removal needs only the node.
+ * Equal keys are allowed; they are stored in insertion order.
+ * No locking is done; that's up to the caller.
+ */
+
+typedef struct rb_node {
+	struct rb_node *parent;
+	struct rb_node *left;
+	struct rb_node *right;
+	uint32 color;
+} rb_node_t;
+
+/* Returns <0, 0 or >0 if a sorts before, equal to, or after b */
+typedef int (*rb_compare_t)(const rb_node_t *a, const rb_node_t *b);
+
+/* Returns <0, 0 or >0 if /key/ sorts before, equal to, or after the node */
+typedef int (*rb_key_compare_t)(const void *key, const rb_node_t *node);
+
+typedef struct rb_tree {
+	rb_node_t *root;
+	uint32 count;
+	rb_compare_t compare;
+} rb_tree_t;
+
+/* Gets the object an rb_node_t is embedded in */
+#define rb_entry(node, type, member) ((type *)((char *)(node) - __builtin_offsetof(type, member)))
+
+void rb_init(rb_tree_t *tree, rb_compare_t compare);
+void rb_insert(rb_tree_t *tree, rb_node_t *node);
+void rb_remove(rb_tree_t *tree, rb_node_t *node);
+
+/* In-order traversal; these return NULL past either end */
+rb_node_t *rb_first(rb_tree_t *tree);
+rb_node_t *rb_last(rb_tree_t *tree);
+rb_node_t *rb_next(rb_node_t *node);
+rb_node_t *rb_prev(rb_node_t *node);
+
+/* The first node whose key is >= /key/, or NULL if there is none */
+rb_node_t *rb_lower_bound(rb_tree_t *tree, rb_key_compare_t compare, const void *key);
+
+/* The first node whose key equals /key/, or NULL */
+rb_node_t *rb_find(rb_tree_t *tree, rb_key_compare_t compare, const void *key);
+
+#define rb_foreach(tree, it) for (rb_node_t *it = rb_first(tree); it != NULL; it = rb_next(it))
+
+#endif
@@ -8,10 +8,22 @@
 #include <kernel/vfs.h> /* struct open_file */
 #include <kernel/heap.h>
 #include <kernel/fpu.h>
+#include <kernel/ilist.h>
 #include <reent.h>
 
 #define TASK_NAME_LEN 64
 
+struct task;
+
+/*
+ * A queue of tasks blocked until some event occurs, e.g. a child exiting.
+ * Tasks are linked through task->wq_next, so no memory is allocated, and
+ * wait_queue_wake() may be called from interrupt handlers.
+ */
+typedef struct wait_queue {
+	struct task *head;
+} wait_queue_t;
+
 typedef struct task {
 	int id;                // Process ID.
 	char name[TASK_NAME_LEN];
@@ -24,8 +36,8 @@ typedef struct task {
 	console_t *console;
 	struct task_mm *mm; /* memory info, including the page directory pointer */
 	struct task_mm *old_mm; // used by execve, to ensure that we can return on failure
-	struct open_file **fdtable;
-	char *pwd;
+	struct fdtable *fdtable;
+	struct pwd *pwd; // shared between tasks; see pwd_get/pwd_put
 	struct _reent *reent; // Used by Newlib
 
 	fpu_mmx_state_t *fpu_state;
@@ -35,12 +47,36 @@ typedef struct task {
 	bool did_execve;
 	uint32 new_entry;
 
-	struct task *parent;
-	list_t *children;
+	ilist_node_t rq_node; // links this task into ready_queue
 
-	struct symbol *symbols;
-	char *symbol_string_table;
-	size_t symbol_string_table_size;
+	struct task *parent;
+	ilist_node_t sibling; // links this task into its parent's children or zombies list
+	ilist_t children; // children that are still alive
+	ilist_t zombies; // children that have exited, but not yet been wait()ed for
+	wait_queue_t child_exit_wq; // woken when a child exits
+
+	struct wait_queue *wq; // the wait queue this task is blocked on, if any
+	struct task *wq_next;
+	bool wait_timed_out; // set if wait_queue_sleep_timeout() gave up
+	page_directory_t *futex_dir; // futex key (see sys_futex), valid while waiting on a futex
+	uint32 futex_addr;
+	struct task *exit_next; // next task waiting to be destroyed by the reaper
+
+	// Threads (see sys_clone) share mm, fdtable and pwd with the rest of their process.
+	// A thread's parent is always the main thread, which has is_thread == false.
+	bool is_thread;
+	bool detached; // a thread that nobody will join; freed as soon as it exits (see sys_thread_detach)
+	uint32 tls_base; // base address of the GDT_TLS_SELECTOR segment, or 0
+
+	struct symtab *symtab; // symbols for the executable, shared with other tasks running it; NULL if none
+
+	// Accounting; see sys_taskstats(). Counters start over at zero in fork().
+	uint32 utime_ticks; // timer ticks spent in user mode
+	uint32 stime_ticks; // timer ticks spent in kernel mode
+	uint32 nvcsw; // voluntary context switches (sleep, I/O, wait, yield)
+	uint32 nivcsw; // involuntary context switches (preempted while runnable)
+	uint32 page_faults;
+	uint32 syscalls;
 
 	// XXX: when adding entries, remember to copy them in fork(), if necessary!
 
@@ -59,7 +95,7 @@ extern task_t kernel_task;
 #define TASK_EXITING (1 << 3)
 #define TASK_IDLE (1 << 4) // used for the idle_task process
 #define TASK_DEAD (1 << 5) // task has _exit()'ed, but has not been wait()ed on
-#define TASK_WAITING (1 << 6) // wait()ing for a child
+#define TASK_WAITING (1 << 6) // blocked on a wait queue, e.g. wait()ing for a child
 
 void user_exit(void); // called from user mode
 
@@ -73,24 +109,42 @@ void user_exit(void); // called from user mode
 
 char **parse_command_line(const char *cmdline, uint32 *argc, task_t *task);
 void set_entry_point(task_t *task, uint32 addr);
+uint32 task_kernel_footprint(task_t *task); /* bytes of kernel memory used to manage the task */
 void set_next_task(task_t *task);
 bool does_task_exist(task_t *task);
+
+/* All tasks that haven't been destroyed yet, linked through task->rq_node. Modify with interrupts disabled. */
+extern ilist_t ready_queue;
 void init_tasking(uint32 kerntask_esp0);
 int getpid(void);
 int getppid(void);
+void task_set_pwd(task_t *task, struct pwd *pwd); /* for all threads in task's process; consumes the caller's reference */
 task_t *create_task_elf(const char *path, console_t *con, void *data, uint32 length);
+struct spawn_action;
+int spawn(const char *path, char *argv[], char *envp[], const struct spawn_action *actions, int num_actions);
 task_t *create_task( void (*entry_point)(void *, uint32), const char *name, console_t *con, void *data, uint32 length);
 uint32 scheduler_taskSwitch(uint32 esp);
 uint32 switch_task(task_t *new_task, uint32 esp);
 bool kill_pid(int pid); /* calls kill on the correct task */
 void kill(task_t *task); /* sets a task to TASK_EXITING so that it never runs */
+void kill_threads(task_t *task); /* kills all threads of a process except the main thread, /task/ */
 void destroy_task(task_t *task); /* actually kills the task for good */
 void sleep(uint32 milliseconds);
 int fork(void);
 uint32 *set_task_stack(task_t *task, void *data, uint32 data_len, uint32 entry_point);
 
+/* Blocks the current task on /wq/ until woken. Interrupts must be disabled by the caller, so that
+ * the condition waited for can be checked without racing the wakeup. */
+void wait_queue_sleep(wait_queue_t *wq);
+/* As above, but gives up after /milliseconds/ (0 means never). Returns false if it timed out. */
+bool wait_queue_sleep_timeout(wait_queue_t *wq, uint32 milliseconds);
+/* Wakes all tasks blocked on /wq/; returns the number of tasks woken */
+int wait_queue_wake(wait_queue_t *wq);
+/* Wakes up to /max/ tasks blocked on /wq/ for which /match/ returns true; returns the number woken */
+int wait_queue_wake_match(wait_queue_t *wq, bool (*match)(struct task *, void *), void *data, int max);
+
 /* Used in the ATA driver, to make tasks sleep while waiting for the disk to read data */
 void scheduler_set_iowait(void);
-uint32 scheduler_wake_iowait(uint32 esp);
+uint32 scheduler_wake_iowait(task_t *task, uint32 esp);
 
 #endif
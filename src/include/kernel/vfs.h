@@ -55,6 +55,7 @@ typedef struct open_file_ops {
 	off_t (*lseek)(int /* fd */, off_t /* offset */, int /* whence */);
 	int   (*fstat)(int /* fd */, struct stat *);
 	int (*getdents)(int /* fd */, void * /* buffer */, int /* count */);
+	int   (*fsync)(int /* fd */);
 } open_file_ops_t;
 
 typedef struct mountpoint {
@@ -72,7 +73,8 @@ mountpoint_t *find_mountpoint_for_path(const char *path);
 
 #include <sys/dirent.h>
 
-#define MAX_OPEN_FILES 128
+#define MAX_OPEN_FILES 128 // per task; the fd table grows up to this size
+#define FDTABLE_INITIAL_SIZE 16
 
 #define O_RDONLY 0
 #define O_DIRECTORY 0x10000
@@ -83,6 +85,17 @@ extern uint32 next_dev;
 
 #define DEV_PIPE 0x7fff
 
+/* Sequential access detection and read-ahead state, for file systems that do read-ahead (see fat_readahead) */
+struct file_ra {
+	off_t prev_end; // where the last read ended; a read that starts here is sequential
+	uint32 window; // read-ahead size in bytes; 0 while reads aren't sequential
+	uint32 end; // reads have been queued up to this offset...
+	uint32 cluster; // ... and this is the cluster at that offset
+};
+
+#define FILE_RA_MIN (16 * 1024)
+#define FILE_RA_MAX (128 * 1024)
+
 typedef struct open_file {
 	int count; // number of fds that link to this file
 	dev_t dev;
@@ -95,14 +108,49 @@ typedef struct open_file {
 	char *path;
 	struct open_file_ops fops;
 	void *data; // implementation specific data
+	struct file_ra ra;
 } open_file_t;
 
+/*
+ * A task's file descriptor table. It starts out with FDTABLE_INITIAL_SIZE slots
+ * and is grown (doubled) as needed; the bitmap tracks which fds are in use,
+ * so that we can find the lowest free fd without scanning the table.
+ */
+struct fdtable {
+	struct open_file **files;
+	int size; // number of slots allocated in files
+	uint32 used[MAX_OPEN_FILES / 32];
+	int refcount; // threads share the table; see fdtable_get/fdtable_release
+};
+
+struct fdtable *fdtable_create(void);
+struct fdtable *fdtable_clone(struct fdtable *parent);
+struct fdtable *fdtable_get(struct fdtable *fdt); // adds a reference
+bool fdtable_release(struct fdtable *fdt); // drops a reference; true if it was the last, i.e. the caller should close all fds and destroy it
+void fdtable_destroy(struct fdtable *fdt); // all fds must be closed first
+size_t fdtable_footprint(struct fdtable *fdt); // bytes of kernel memory used
+
+/*
+ * A task's working directory. Since the path never changes once created (chdir
+ * creates a new object), tasks can share it, e.g. after fork().
+ */
+struct pwd {
+	int refcount;
+	char path[]; // allocated to fit
+};
+
+struct pwd *pwd_create(const char *path);
+struct pwd *pwd_get(struct pwd *pwd); // adds a reference
+void pwd_put(struct pwd *pwd); // drops a reference, freeing the object if it was the last one
+
+int get_free_fd(struct task *task);
 struct open_file *get_filp(int fd);
 struct open_file *new_filp(int *fd);
 void destroy_filp(int fd);
 
 struct open_file *do_get_filp(int fd, struct task *task);
 int do_close(int fd, struct task *task);
+int do_dup2(int fd, int fd2, struct task *task);
 
 // Resolves all symlinks in a given path.
 int resolve_actual_path(char *out_path, size_t bufsize);
@@ -119,6 +167,7 @@ int closedir(DIR *dir);
 int chdir(const char *path);
 off_t lseek(int fd, off_t offset, int whence);
 int getdents (int fd, void *dp, int count);
+int fsync(int fd);
 //int lstat(const char *path, struct stat *buf);
 ssize_t readlink(const char *pathname, char *buf, size_t bufsiz);
 
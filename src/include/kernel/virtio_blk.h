@@ -0,0 +1,98 @@
+#ifndef _VIRTIO_BLK_H
+#define _VIRTIO_BLK_H
+
+#include <sys/types.h>
+
+/*
+ * Driver for virtio block devices (e.g. QEMU's -drive if=virtio), using the legacy PCI interface:
+ * the registers are in I/O space (BAR0), and there's a single virtqueue, whose ring is
+ * given to the device by its physical page number.
+ */
+
+void virtio_blk_init(void); /* finds the devices, and registers them as block devices */
+
+#define VIRTIO_PCI_VENDOR 0x1af4
+#define VIRTIO_PCI_DEVICE_BLK 0x1001 /* legacy/transitional block device */
+
+/* Legacy register offsets from BAR0 */
+#define VIRTIO_REG_HOST_FEATURES 0x00 /* 32 bits */
+#define VIRTIO_REG_GUEST_FEATURES 0x04 /* 32 bits */
+#define VIRTIO_REG_QUEUE_PFN 0x08 /* 32 bits: physical address of the ring >> 12 */
+#define VIRTIO_REG_QUEUE_NUM 0x0c /* 16 bits: the selected queue's size; read-only */
+#define VIRTIO_REG_QUEUE_SEL 0x0e /* 16 bits */
+#define VIRTIO_REG_QUEUE_NOTIFY 0x10 /* 16 bits: write a queue index here after adding buffers */
+#define VIRTIO_REG_STATUS 0x12 /* 8 bits */
+#define VIRTIO_REG_ISR 0x13 /* 8 bits; reading it acknowledges the interrupt */
+#define VIRTIO_REG_CONFIG 0x14 /* device-specific configuration, when MSI-X is disabled */
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FAILED 0x80
+
+/* ISR status bits */
+#define VIRTIO_ISR_QUEUE 1
+#define VIRTIO_ISR_CONFIG 2
+
+/* Block device feature bits */
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2) /* seg_max in the configuration is valid */
+#define VIRTIO_BLK_F_RO (1 << 5) /* read-only */
+#define VIRTIO_BLK_F_FLUSH (1 << 9) /* supports VIRTIO_BLK_T_FLUSH */
+
+/* Block device configuration, as offsets from VIRTIO_REG_CONFIG */
+#define VIRTIO_BLK_CFG_CAPACITY 0x00 /* 64 bits, in 512-byte sectors */
+#define VIRTIO_BLK_CFG_SEG_MAX 0x0c /* 32 bits: data descriptors per request */
+
+/* Request types and status values */
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+/* Descriptor flags */
+#define VRING_DESC_F_NEXT 1 /* the chain continues at /next/ */
+#define VRING_DESC_F_WRITE 2 /* the device writes to this buffer */
+
+/* Set by the device in the used ring's flags if it doesn't need to be notified of new buffers */
+#define VRING_USED_F_NO_NOTIFY 1
+
+#define VRING_ALIGN 4096 /* the used ring starts on a new page */
+
+struct vring_desc {
+	uint64 addr; /* physical */
+	uint32 len;
+	uint16 flags;
+	uint16 next;
+} __attribute__((packed));
+
+struct vring_avail {
+	uint16 flags;
+	uint16 idx; /* where the driver puts the next entry; never wraps to the ring size, only to 65536 */
+	uint16 ring[];
+} __attribute__((packed));
+
+struct vring_used_elem {
+	uint32 id; /* the head descriptor of a chain the device is done with */
+	uint32 len; /* bytes written by the device */
+} __attribute__((packed));
+
+struct vring_used {
+	uint16 flags;
+	uint16 idx;
+	struct vring_used_elem ring[];
+} __attribute__((packed));
+
+/* The first descriptor of every request */
+struct virtio_blk_req_hdr {
+	uint32 type; /* VIRTIO_BLK_T_* */
+	uint32 ioprio;
+	uint64 sector;
+} __attribute__((packed));
+
+#define VIRTIO_BLK_MAX_DEVICES 4
+#define VIRTIO_BLK_MAX_SECTORS 256 /* the largest request merging may create, as for ATA DMA */
+
+#endif
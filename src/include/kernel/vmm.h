@@ -86,6 +86,7 @@ struct task_mm {
 	uint32 user_stack_guard_page; // Lowest address of the user stack (the lowest usable is this + PAGE_SIZE)
 
 	uint32 frames_used; // number of frames used by this task
+	int users; // number of tasks sharing this mm; more than 1 for multithreaded processes
 };
 
 typedef struct vm_area {
@@ -94,6 +95,14 @@ typedef struct vm_area {
 	bool writable;
 } vm_area_t;
 
+// Kernel stacks are allocated from this region rather than from the kernel heap; see vmm_alloc_kernel_stack()
+#define KSTACK_REGION_START 0xd0000000
+#define KSTACK_REGION_END   0xd1000000
+
+// Physically continuous memory that devices access directly (e.g. virtqueues) is mapped here; see vmm_alloc_dma()
+#define DMA_REGION_START 0xd1000000
+#define DMA_REGION_END   0xd1400000
+
 // Clones a userspace task's memory structures etc.
 struct task_mm *vmm_clone_mm(struct task_mm *parent_mm);
 
@@ -106,6 +115,10 @@ void vmm_alloc_user(uint32 start_virtual, uint32 end_virtual, struct task_mm *mm
 // Free all memory allocated to a userspace task
 void vmm_destroy_task_mm(struct task_mm *mm);
 
+// Add/drop a reference to an mm shared between threads; the last user destroys it (and its page directory)
+struct task_mm *vmm_get_task_mm(struct task_mm *mm);
+void vmm_put_task_mm(struct task_mm *mm);
+
 // Map a virtual address to a physical address, with no allocotion (e.g. for MMIO), with the page set te kernel mode
 void vmm_map_kernel(uint32 virtual, uint32 physical, bool writable);
 
@@ -122,6 +135,14 @@ uint32 vmm_get_phys(uint32 virtual, page_directory_t *dir);
 void vmm_set_guard(uint32 virtual, page_directory_t *dir);
 void vmm_clear_guard(uint32 virtual, page_directory_t *dir);
 
+// Allocate/free a kernel stack with guard pages around it; returns/takes the *top* of the stack
+void *vmm_alloc_kernel_stack(void);
+void vmm_free_kernel_stack(void *stack);
+
+// Allocate page-aligned, physically continuous kernel memory for devices to access; it's never freed.
+// The physical address is stored in *phys.
+void *vmm_alloc_dma(uint32 size, uint32 *phys);
+
 struct task_mm *vmm_create_user_mm(void);
 struct task_mm *vmm_create_kernel_mm(void);
 
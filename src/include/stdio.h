@@ -2,8 +2,13 @@
 #define _STDIO_H
 
 #include <stdarg.h>
+#include <sys/types.h>
 
 int sprintf(char *buf, const char *fmt, ...);
 int vsprintf(char *buf, const char *fmt, __gnuc_va_list args);
 
+/* Bounded versions; these return the length the output would have had, given enough space */
+int snprintf(char *buf, size_t size, const char *fmt, ...);
+int vsnprintf(char *buf, size_t size, const char *fmt, __gnuc_va_list args);
+
 #endif
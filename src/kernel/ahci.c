@@ -0,0 +1,527 @@
+#include <sys/types.h>
+#include <kernel/ahci.h>
+#include <kernel/ata.h> /* ATA_CMD_*, ATA_CAPABILITY_* */
+#include <kernel/kernutil.h>
+#include <kernel/console.h>
+#include <kernel/interrupts.h>
+#include <kernel/pci.h>
+#include <kernel/list.h>
+#include <kernel/vmm.h>
+#include <kernel/heap.h>
+#include <kernel/blkdev.h>
+#include <sys/errno.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * How requests work:
+ * 1) The disk's worker task (see blkdev.c) picks a request off the queue, and calls ahci_submit()
+ * 2) ahci_submit() takes a free command slot, fills in its command table (the command FIS, and
+ *    a PRD table with one entry per physically continuous piece of the buffers), and issues it.
+ *    With NCQ, the worker then goes on to the next request while this one is in flight.
+ * 3) The disk interrupts once one or more commands are done (with a D2H register FIS for
+ *    non-queued commands, or a set device bits FIS for NCQ), and the interrupt handler
+ *    compares PxCI/PxSACT with the slots in use to find out which ones.
+ *
+ * Non-queued commands (IDENTIFY, FLUSH CACHE, and everything on disks without NCQ) may not be
+ * mixed with queued ones, so a flush waits until all slots are free, and keeps new commands
+ * out until it's done.
+ */
+
+extern list_t *pci_devices;
+
+#define AHCI_SPIN_LIMIT 1000000 /* register reads before giving up on the controller; about a second, on real hardware; the spec allows 500 ms */
+
+struct ahci_hba;
+
+typedef struct ahci_port {
+	struct ahci_hba *hba;
+	uint32 num; /* on the HBA */
+	uint8 *regs;
+	uint64 size; /* in sectors */
+	uint32 capabilities; /* ATA_CAPABILITY_* */
+	bool ncq;
+	uint32 slots; /* command slots in use; 1 without NCQ */
+
+	/* Command list, FIS receive area and command tables, all in one physically continuous allocation */
+	ahci_cmd_header_t *cmd_list;
+	ahci_cmd_table_t *tables;
+	uint32 dma_phys;
+
+	/* Modified with interrupts disabled */
+	uint32 active; /* slots with a command in flight */
+	blk_request_t *slot_req[AHCI_MAX_SLOTS]; /* NULL for internal commands (flushes) */
+	bool flushing; /* no new commands may be issued */
+	volatile bool internal_done;
+	int internal_error;
+	wait_queue_t wq; /* for free slots, and for flushes */
+
+	blkdev_t blkdev;
+} ahci_port_t;
+
+typedef struct ahci_hba {
+	pci_device_t *pci;
+	uint8 *abar;
+	uint32 slots; /* per port */
+	bool ncq;
+	ahci_port_t *ports[AHCI_MAX_PORTS]; /* NULL where there's no disk we use */
+} ahci_hba_t;
+
+static ahci_hba_t hbas[AHCI_MAX_HBAS];
+static uint32 num_hbas = 0;
+static uint32 num_disks = 0;
+
+/* Command list (1 kiB), then the FIS receive area (256 bytes), then the command tables (128-byte aligned) */
+#define AHCI_FIS_OFFSET 1024
+#define AHCI_TABLES_OFFSET 2048
+#define AHCI_PORT_DMA_SIZE (AHCI_TABLES_OFFSET + AHCI_MAX_SLOTS * sizeof(ahci_cmd_table_t))
+
+static void ahci_submit(blkdev_t *bdev, blk_request_t *req);
+static int ahci_flush(blkdev_t *bdev);
+
+static const blkdev_ops_t ahci_blkdev_ops = {
+	.submit = ahci_submit,
+	.flush = ahci_flush,
+};
+
+static inline uint32 ahci_read(ahci_hba_t *hba, uint32 reg) {
+	return *(volatile uint32 *)(hba->abar + reg);
+}
+
+static inline void ahci_write(ahci_hba_t *hba, uint32 reg, uint32 value) {
+	*(volatile uint32 *)(hba->abar + reg) = value;
+}
+
+static inline uint32 ahci_port_read(ahci_port_t *port, uint32 reg) {
+	return *(volatile uint32 *)(port->regs + reg);
+}
+
+static inline void ahci_port_write(ahci_port_t *port, uint32 reg, uint32 value) {
+	*(volatile uint32 *)(port->regs + reg) = value;
+}
+
+/* Spins until the bits in /mask/ are clear in a port register; false if that didn't happen in time */
+static bool ahci_wait_clear(ahci_port_t *port, uint32 reg, uint32 mask) {
+	for (uint32 i = 0; i < AHCI_SPIN_LIMIT; i++) {
+		if ((ahci_port_read(port, reg) & mask) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static bool ahci_stop_port(ahci_port_t *port) {
+	ahci_port_write(port, AHCI_PxCMD, ahci_port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+	if (!ahci_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_CR))
+		return false;
+	ahci_port_write(port, AHCI_PxCMD, ahci_port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+	return ahci_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_FR);
+}
+
+static bool ahci_start_port(ahci_port_t *port) {
+	ahci_port_write(port, AHCI_PxSERR, 0xffffffff);
+	ahci_port_write(port, AHCI_PxIS, 0xffffffff);
+	ahci_port_write(port, AHCI_PxCMD, ahci_port_read(port, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+	if (!ahci_wait_clear(port, AHCI_PxTFD, ATA_SR_BSY | ATA_SR_DRQ))
+		return false;
+	ahci_port_write(port, AHCI_PxCMD, ahci_port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+	return true;
+}
+
+/* Fills in PRD entries for a buffer, starting at /prd/; returns the next free entry. As for ATA DMA,
+ * each entry covers the part of the buffer that lies in one page. */
+static ahci_prd_t *ahci_prdt_add(ahci_prd_t *prd, uint8 *buffer, uint32 bytes) {
+	assert(IS_KERNEL_SPACE(buffer));
+	assert(((uint32)buffer & 1) == 0);
+
+	while (bytes > 0) {
+		uint32 len = PAGE_SIZE - ((uint32)buffer & (PAGE_SIZE - 1));
+		if (len > bytes)
+			len = bytes;
+
+		prd->dba = vmm_get_phys((uint32)buffer, kernel_directory);
+		prd->dbau = 0;
+		prd->reserved = 0;
+		prd->dbc = len - 1;
+
+		buffer += len;
+		bytes -= len;
+		prd++;
+	}
+
+	return prd;
+}
+
+/* How many PRD entries a buffer needs, at most */
+static uint32 ahci_count_prds(uint8 *buffer, uint32 bytes) {
+	uint32 offset = (uint32)buffer & (PAGE_SIZE - 1);
+	return (offset + bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+/* Sets up a host-to-device register FIS with an LBA48 command */
+static void ahci_setup_fis(uint8 *fis, uint8 cmd, uint64 lba, uint32 sectors, uint32 tag, bool ncq) {
+	memset(fis, 0, SATA_FIS_H2D_LENGTH * 4);
+	fis[0] = SATA_FIS_TYPE_REG_H2D;
+	fis[1] = SATA_FIS_H2D_COMMAND;
+	fis[2] = cmd;
+	fis[4] = lba & 0xff;
+	fis[5] = (lba >> 8) & 0xff;
+	fis[6] = (lba >> 16) & 0xff;
+	fis[7] = 0x40; /* LBA mode */
+	fis[8] = (lba >> 24) & 0xff;
+	fis[9] = (lba >> 32) & 0xff;
+	fis[10] = (lba >> 40) & 0xff;
+
+	if (ncq) {
+		/* The sector count goes in the features field, and the tag in the count field */
+		fis[3] = sectors & 0xff;
+		fis[11] = (sectors >> 8) & 0xff;
+		fis[12] = tag << 3;
+	}
+	else {
+		fis[12] = sectors & 0xff;
+		fis[13] = (sectors >> 8) & 0xff;
+	}
+}
+
+/* Starts the command in /slot/; called with interrupts disabled */
+static void ahci_issue(ahci_port_t *port, uint32 slot, blk_request_t *req, bool ncq) {
+	assert((port->active & (1U << slot)) == 0);
+	port->active |= (1U << slot);
+	port->slot_req[slot] = req;
+
+	if (ncq)
+		ahci_port_write(port, AHCI_PxSACT, 1U << slot);
+	ahci_port_write(port, AHCI_PxCI, 1U << slot);
+}
+
+/* A command is finished; called with interrupts disabled */
+static void ahci_slot_done(ahci_port_t *port, uint32 slot, int error) {
+	port->active &= ~(1U << slot);
+	blk_request_t *req = port->slot_req[slot];
+	port->slot_req[slot] = NULL;
+
+	if (req == NULL) {
+		port->internal_error = error;
+		port->internal_done = true;
+		return;
+	}
+
+	if (error != 0)
+		req->error = error;
+	assert(req->parts > 0);
+	if (--req->parts == 0)
+		blk_end_request(&port->blkdev, req, req->error);
+}
+
+/* Completes the commands that the HBA no longer lists as issued or outstanding */
+static void ahci_reap_done(ahci_port_t *port) {
+	uint32 done = port->active & ~(ahci_port_read(port, AHCI_PxCI) | ahci_port_read(port, AHCI_PxSACT));
+	for (uint32 slot = 0; done != 0; slot++) {
+		if (done & (1U << slot)) {
+			ahci_slot_done(port, slot, 0);
+			done &= ~(1U << slot);
+		}
+	}
+}
+
+/*
+ * The disk reported an error, or the HBA had one. Commands that had already completed are
+ * reaped as usual. Queued commands don't say which one failed (that would take READ LOG EXT),
+ * so everything still in flight fails, and the port is restarted, which makes the HBA forget about them.
+ */
+static void ahci_port_error(ahci_port_t *port, uint32 is) {
+	ahci_reap_done(port);
+
+	printk("%s: error: IS=0x%08x TFD=0x%08x SERR=0x%08x; failing the commands in flight (0x%08x)\n", port->blkdev.name, is,
+			ahci_port_read(port, AHCI_PxTFD), ahci_port_read(port, AHCI_PxSERR), port->active);
+
+	if (!ahci_stop_port(port) || !ahci_start_port(port))
+		printk("%s: port didn't restart\n", port->blkdev.name);
+
+	for (uint32 slot = 0; slot < port->slots; slot++) {
+		if (port->active & (1U << slot))
+			ahci_slot_done(port, slot, -EIO);
+	}
+}
+
+static void ahci_port_interrupt(ahci_port_t *port) {
+	uint32 is = ahci_port_read(port, AHCI_PxIS);
+	ahci_port_write(port, AHCI_PxIS, is);
+
+	if (is & AHCI_PxIS_ERRORS)
+		ahci_port_error(port, is);
+	else
+		ahci_reap_done(port);
+
+	wait_queue_wake(&port->wq);
+}
+
+static uint32 ahci_interrupt_handler(uint32 esp) {
+	uint8 irq = ((registers_t *)esp)->int_no - 32;
+
+	for (uint32 i = 0; i < num_hbas; i++) {
+		ahci_hba_t *hba = &hbas[i];
+		if (hba->pci->irq != irq)
+			continue;
+
+		uint32 is = ahci_read(hba, AHCI_IS);
+		for (uint32 p = 0; p < AHCI_MAX_PORTS; p++) {
+			if ((is & (1U << p)) == 0)
+				continue;
+			if (hba->ports[p] != NULL)
+				ahci_port_interrupt(hba->ports[p]);
+			else
+				*(volatile uint32 *)(hba->abar + AHCI_PORT_BASE(p) + AHCI_PxIS) = 0xffffffff;
+		}
+		/* Cleared after the ports' bits, or it would be set again right away */
+		ahci_write(hba, AHCI_IS, is);
+	}
+
+	return esp;
+}
+
+/* Returns a free slot, or AHCI_MAX_SLOTS if there's none; called with interrupts disabled */
+static uint32 ahci_free_slot(ahci_port_t *port) {
+	for (uint32 slot = 0; slot < port->slots; slot++) {
+		if ((port->active & (1U << slot)) == 0)
+			return slot;
+	}
+
+	return AHCI_MAX_SLOTS;
+}
+
+/* Issues a read or write for the I/O from /first/ up to (not including) /end/, sleeping until a slot is free */
+static void ahci_queue(ahci_port_t *port, blk_request_t *req, uint64 lba, uint32 sectors, blk_io_t *first, blk_io_t *end) {
+	assert(sectors <= AHCI_MAX_SECTORS);
+
+	INTERRUPT_LOCK;
+	uint32 slot = AHCI_MAX_SLOTS;
+	while (port->flushing || (slot = ahci_free_slot(port)) == AHCI_MAX_SLOTS)
+		wait_queue_sleep(&port->wq);
+
+	ahci_cmd_table_t *table = &port->tables[slot];
+	ahci_prd_t *prd = table->prdt;
+	for (blk_io_t *io = first; io != end; io = io->next) {
+		prd = ahci_prdt_add(prd, io->buffer, io->sectors * 512);
+	}
+	assert(prd - table->prdt <= AHCI_PRDT_ENTRIES);
+
+	uint8 cmd;
+	if (port->ncq)
+		cmd = req->write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+	else
+		cmd = req->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+	ahci_setup_fis(table->cfis, cmd, lba, sectors, slot, port->ncq);
+
+	ahci_cmd_header_t *hdr = &port->cmd_list[slot];
+	hdr->flags = SATA_FIS_H2D_LENGTH | (req->write ? AHCI_CMD_WRITE : 0);
+	hdr->prdtl = prd - table->prdt;
+	hdr->prdbc = 0;
+
+	ahci_issue(port, slot, req, port->ncq);
+	INTERRUPT_UNLOCK;
+}
+
+static void ahci_submit(blkdev_t *bdev, blk_request_t *req) {
+	ahci_port_t *port = (ahci_port_t *)bdev->driver_data;
+
+	uint32 prds = 0, ios = 0;
+	for (blk_io_t *io = req->ios; io != NULL; io = io->next) {
+		prds += ahci_count_prds(io->buffer, io->sectors * 512);
+		ios++;
+	}
+
+	req->error = 0;
+	if (prds <= AHCI_PRDT_ENTRIES) {
+		req->parts = 1;
+		ahci_queue(port, req, req->lba, req->sectors, req->ios, NULL);
+		return;
+	}
+
+	// Too scattered for one PRD table; every blk_io_t fits in one, since it's at most AHCI_MAX_SECTORS long
+	req->parts = ios;
+	for (blk_io_t *io = req->ios; io != NULL; io = io->next) {
+		ahci_queue(port, req, io->lba, io->sectors, io, io->next);
+	}
+}
+
+static int ahci_flush(blkdev_t *bdev) {
+	ahci_port_t *port = (ahci_port_t *)bdev->driver_data;
+	if (!(port->capabilities & ATA_CAPABILITY_FLUSH_CACHE))
+		return 0;
+
+	INTERRUPT_LOCK;
+	while (port->flushing)
+		wait_queue_sleep(&port->wq);
+	port->flushing = true;
+	// FLUSH CACHE isn't a queued command, so wait for everything in flight
+	while (port->active != 0)
+		wait_queue_sleep(&port->wq);
+
+	ahci_setup_fis(port->tables[0].cfis, ATA_CMD_FLUSH_CACHE_EXT, 0, 0, 0, false);
+	port->cmd_list[0].flags = SATA_FIS_H2D_LENGTH;
+	port->cmd_list[0].prdtl = 0;
+	port->internal_done = false;
+	ahci_issue(port, 0, NULL, false);
+	while (!port->internal_done)
+		wait_queue_sleep(&port->wq);
+
+	int error = port->internal_error;
+	port->flushing = false;
+	wait_queue_wake(&port->wq);
+	INTERRUPT_UNLOCK;
+
+	return error;
+}
+
+/* Runs IDENTIFY DEVICE while the port's interrupts are still off; returns false if it failed */
+static bool ahci_identify(ahci_port_t *port, uint16 *words) {
+	ahci_cmd_table_t *table = &port->tables[0];
+	ahci_prd_t *prd = ahci_prdt_add(table->prdt, (uint8 *)words, 512);
+	ahci_setup_fis(table->cfis, ATA_CMD_IDENTIFY, 0, 0, 0, false);
+	port->cmd_list[0].flags = SATA_FIS_H2D_LENGTH;
+	port->cmd_list[0].prdtl = prd - table->prdt;
+	port->cmd_list[0].prdbc = 0;
+
+	ahci_port_write(port, AHCI_PxCI, 1);
+	if (!ahci_wait_clear(port, AHCI_PxCI, 1))
+		return false;
+
+	uint32 is = ahci_port_read(port, AHCI_PxIS);
+	ahci_port_write(port, AHCI_PxIS, is);
+	return (is & AHCI_PxIS_ERRORS) == 0 && (ahci_port_read(port, AHCI_PxTFD) & ATA_SR_ERR) == 0;
+}
+
+static void ahci_init_port(ahci_hba_t *hba, uint32 num) {
+	uint8 *regs = hba->abar + AHCI_PORT_BASE(num);
+	if (AHCI_SSTS_DET(*(volatile uint32 *)(regs + AHCI_PxSSTS)) != AHCI_SSTS_DET_PRESENT)
+		return;
+	if (*(volatile uint32 *)(regs + AHCI_PxSIG) != AHCI_SIG_ATA)
+		return; /* ATAPI, port multipliers etc. aren't supported */
+
+	ahci_port_t *port = kmalloc(sizeof(ahci_port_t));
+	memset(port, 0, sizeof(ahci_port_t));
+	port->hba = hba;
+	port->num = num;
+	port->regs = regs;
+
+	if (!ahci_stop_port(port)) {
+		printk("AHCI: port %u didn't stop; ignoring it\n", num);
+		kfree(port);
+		return;
+	}
+
+	uint8 *dma = vmm_alloc_dma(AHCI_PORT_DMA_SIZE, &port->dma_phys);
+	port->cmd_list = (ahci_cmd_header_t *)dma;
+	port->tables = (ahci_cmd_table_t *)(dma + AHCI_TABLES_OFFSET);
+	for (uint32 slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+		port->cmd_list[slot].ctba = port->dma_phys + AHCI_TABLES_OFFSET + slot * sizeof(ahci_cmd_table_t);
+		port->cmd_list[slot].ctbau = 0;
+	}
+
+	ahci_port_write(port, AHCI_PxIE, 0);
+	ahci_port_write(port, AHCI_PxCLB, port->dma_phys);
+	ahci_port_write(port, AHCI_PxCLBU, 0);
+	ahci_port_write(port, AHCI_PxFB, port->dma_phys + AHCI_FIS_OFFSET);
+	ahci_port_write(port, AHCI_PxFBU, 0);
+
+	uint16 *words = kmalloc(512);
+	if (!ahci_start_port(port) || !ahci_identify(port, words)) {
+		printk("AHCI: port %u: IDENTIFY DEVICE failed; ignoring it\n", num);
+		ahci_stop_port(port);
+		kfree(words);
+		return; /* the DMA memory is never freed, so the port struct stays allocated, too */
+	}
+
+	/* Every SATA disk should support LBA48; we use nothing else, since the NCQ commands need it anyway */
+	if ((words[83] & (1 << 10)) == 0) {
+		printk("AHCI: port %u: disk doesn't support LBA48; ignoring it\n", num);
+		ahci_stop_port(port);
+		kfree(words);
+		return;
+	}
+	port->capabilities = ATA_CAPABILITY_LBA28 | ATA_CAPABILITY_LBA48;
+	port->size = *((uint64 *)&words[100]);
+	if (words[82] & (1 << 5))
+		port->capabilities |= ATA_CAPABILITY_WRITE_CACHE;
+	if (words[86] & (1 << 13))
+		port->capabilities |= ATA_CAPABILITY_FLUSH_CACHE;
+
+	/* NCQ needs support from both sides; the disk reports its queue depth - 1 */
+	port->ncq = hba->ncq && (words[76] & (1 << 8));
+	port->slots = 1;
+	if (port->ncq) {
+		port->slots = (words[75] & 0x1f) + 1;
+		if (port->slots > hba->slots)
+			port->slots = hba->slots;
+	}
+	kfree(words);
+
+	hba->ports[num] = port;
+	ahci_port_write(port, AHCI_PxIE, AHCI_PxIE_DEFAULT);
+
+	snprintf(port->blkdev.name, sizeof(port->blkdev.name), "ahci%u", num_disks++);
+	port->blkdev.size = port->size;
+	port->blkdev.max_sectors = AHCI_MAX_SECTORS;
+	port->blkdev.queue_depth = port->slots;
+	port->blkdev.ops = &ahci_blkdev_ops;
+	port->blkdev.driver_data = port;
+	blkdev_register(&port->blkdev);
+}
+
+static void ahci_init_hba(pci_device_t *pci) {
+	if (num_hbas >= AHCI_MAX_HBAS) {
+		printk("WARNING: more than %u AHCI controllers found; ignoring the rest\n", AHCI_MAX_HBAS);
+		return;
+	}
+	if (pci->bar[5].type != BAR_MEM || pci->bar[5].address == 0 || !IS_KERNEL_SPACE(pci->bar[5].address)) {
+		printk("WARNING: AHCI controller with an unusable ABAR (0x%08x); ignoring it\n", pci->bar[5].address);
+		return;
+	}
+	/* All our controllers share one handler, but it can't be shared with other drivers */
+	if (!register_interrupt_handler(32 + pci->irq, ahci_interrupt_handler)) {
+		printk("WARNING: AHCI controller on IRQ %u, which another driver uses; ignoring it\n", pci->irq);
+		return;
+	}
+
+	ahci_hba_t *hba = &hbas[num_hbas];
+	memset(hba, 0, sizeof(ahci_hba_t));
+	hba->pci = pci;
+	hba->abar = (uint8 *)pci->bar[5].address;
+
+	// Map the registers at their physical address, like the RTL8139 driver does
+	for (uint32 addr = (uint32)hba->abar & ~(PAGE_SIZE - 1); addr < (uint32)hba->abar + AHCI_ABAR_SIZE; addr += PAGE_SIZE) {
+		vmm_map_kernel(addr, addr, PAGE_RW);
+	}
+	pci_enable_bus_master(pci);
+
+	ahci_write(hba, AHCI_GHC, (ahci_read(hba, AHCI_GHC) | AHCI_GHC_AE) & ~AHCI_GHC_IE);
+	uint32 cap = ahci_read(hba, AHCI_CAP);
+	hba->slots = AHCI_CAP_NCS(cap);
+	hba->ncq = (cap & AHCI_CAP_SNCQ) != 0;
+
+	num_hbas++;
+
+	uint32 pi = ahci_read(hba, AHCI_PI);
+	for (uint32 p = 0; p < AHCI_MAX_PORTS; p++) {
+		if (pi & (1U << p))
+			ahci_init_port(hba, p);
+	}
+
+	ahci_write(hba, AHCI_IS, 0xffffffff);
+	ahci_write(hba, AHCI_GHC, ahci_read(hba, AHCI_GHC) | AHCI_GHC_IE);
+}
+
+void ahci_init(void) {
+	assert(sizeof(ahci_cmd_header_t) == 32);
+	assert(sizeof(ahci_cmd_table_t) % 128 == 0);
+	assert(pci_devices != NULL);
+
+	list_foreach(pci_devices, it) {
+		pci_device_t *dev = (pci_device_t *)it->data;
+		// Class 0x1 is for storage controllers, subclass 0x6 for SATA controllers
+		if (dev->classcode == 0x1 && dev->subclasscode == 0x6)
+			ahci_init_hba(dev);
+	}
+}
@@ -6,16 +6,22 @@
 #include <kernel/interrupts.h>
 #include <string.h>
 #include <kernel/mutex.h>
+#include <kernel/heap.h>
+#include <kernel/vmm.h>
+#include <kernel/blkdev.h>
+#include <kernel/bcache.h>
+#include <sys/errno.h>
+#include <stdio.h>
 
 /* TODO:
  * TODO: error handling
  * TODO: timeouts
  */
 
-mutex_t *ata_mutex = NULL;
 extern list_t *pci_devices;
 
 static uint16 busmaster_port = 0;
+static pci_device_t *ide_controller = NULL;
 
 /* 
  * This is the exscapeOS ATA driver. It's written based on the ATA/ATAPI-6
@@ -24,8 +30,9 @@ static uint16 busmaster_port = 0;
  * Unfortunately, not supporting SATA is easier than supporting SATA.
  * At the time of this writing, easier = better.
  *
- * For the same reason, this driver is currently PIO only, and thus
- * will use quite a lot of CPU time, and be limited to (in theory)
+ * Transfers use PCI bus master DMA (as on the Intel PIIX, which QEMU
+ * emulates) when the controller and drive support it, and PIO otherwise.
+ * PIO uses quite a lot of CPU time, and is limited to (in theory)
  * 33 MiB/s. In practice, I've seen ~24 MiB/s in QEMU.
  */
 
@@ -37,23 +44,28 @@ static uint16 busmaster_port = 0;
 ata_channel_t channels[2];
 ata_device_t devices[4];
 
-/* Mostly used for debugging, to ensure ATA interrupts aren't missed */
-static volatile uint32 ata_interrupts_handled = 0;
-
 /* Static functions, i.e. ones we don't want in ata.h */
 static void ata_cmd(uint8 channel, uint8 cmd);
 static uint8 ata_reg_read(uint8 channel, uint16 reg);
 static void ata_reg_write(uint8 channel, uint16 reg, uint8 data);
+static int ata_transfer(blkdev_t *bdev, blk_request_t *req);
+static int ata_flush(blkdev_t *bdev);
+
+static const blkdev_ops_t ata_blkdev_ops = {
+	.transfer = ata_transfer,
+	.flush = ata_flush,
+};
 
 /*
  * The ATA interrupt handler.
  * The driver works a bit like this:
- * 1) Someone (within the kernel) calls ata_read/ata_write()
- * 2) ata_*() prepares and sends the command to the drive, 
- *    and sets the current task to the IOWAIT state, taking
- *    it off the run queue. 
- * 3) The drive causes an interrupt, which calls this function.
- *    Its purpose is simply to wake up the task that called ata_*(),
+ * 1) Someone (within the kernel) queues I/O for a disk, e.g. with ata_read/ata_write()
+ * 2) The disk's worker task (see blkdev.c) picks a request off the queue, and calls ata_transfer()
+ * 3) ata_*() prepares and sends the command to the drive, records
+ *    the worker as the channel's waiter, and sets it to the IOWAIT
+ *    state, taking it off the run queue.
+ * 4) The drive causes an interrupt, which calls this function.
+ *    Its purpose is simply to wake up the waiting task,
  *    and pass control back to it.
  */
 uint32 ata_interrupt_handler(uint32 esp) {
@@ -66,16 +78,19 @@ uint32 ata_interrupt_handler(uint32 esp) {
 	// Read the bus master status register, to figure out whether
 	// this interrupt was because of disk activity or something else
 	// (shared IRQs, weird IRQ controllers, etc).
-	// The status register is offset 2 and 10 bytes from the base address,
-	// respectively, for the primary and secondary channels.
-	uint8 bmstatus = inb(busmaster_port + (channel == 0 ? 0x2 : 0xA));
-	if ((bmstatus & (1 << 2)) == 0) {
-		// If this bit was not set, this interrupt was not generated by the disk controller.
-		return esp;
-	}
+	// The controller sets the IRQ bit for PIO commands, too.
+	uint16 bmide = channels[channel].bmide;
+	if (bmide != 0) {
+		uint8 bmstatus = inb(bmide + ATA_BM_STATUS);
+		if ((bmstatus & ATA_BM_SR_IRQ) == 0) {
+			// If this bit was not set, this interrupt was not generated by the disk controller.
+			return esp;
+		}
 
-	// Clear the BM IRQ bit.
-	outb(bmstatus + (channel == 0 ? 0x2 : 0xA), 0x4);
+		// Clear the BM IRQ bit. The error bit is left for ata_dma_int() to look at,
+		// and the drive DMA capable bits must be written back unchanged.
+		outb(bmide + ATA_BM_STATUS, (bmstatus & (ATA_BM_SR_DRV0_DMA | ATA_BM_SR_DRV1_DMA)) | ATA_BM_SR_IRQ);
+	}
 
 	/* In this state, "the host shall read the device Status register."
 	 * However, we must wait 400 ns first.
@@ -86,9 +101,14 @@ uint32 ata_interrupt_handler(uint32 esp) {
 	/* Read the *regular* status register */
 	ata_reg_read(channel, ATA_REG_STATUS);
 
-	ata_interrupts_handled++;
+	channels[channel].interrupts_handled++;
 
-	return scheduler_wake_iowait(esp);
+	task_t *waiter = channels[channel].waiter;
+	if (waiter == NULL)
+		return esp;
+	channels[channel].waiter = NULL;
+
+	return scheduler_wake_iowait(waiter, esp);
 }
 
 /* Looks slightly better than to use ata_reg_write() for commands */
@@ -200,12 +220,14 @@ void ata_init(void) {
 
 	INTERRUPT_LOCK;
 
-	ata_mutex = mutex_create();
-
 	/* make sure there's no nonsense in the structures we use */
 	memset(&channels, 0, sizeof(channels));
 	memset(&devices, 0, sizeof(devices));
 
+	/* The channels are separate controllers with IRQs of their own, so each one gets its own lock */
+	channels[ATA_PRIMARY].mutex = mutex_create();
+	channels[ATA_SECONDARY].mutex = mutex_create();
+
 	register_interrupt_handler(IRQ14, ata_interrupt_handler);
 	register_interrupt_handler(IRQ15, ata_interrupt_handler);
 
@@ -228,6 +250,7 @@ void ata_init(void) {
 			busmaster_port = dev->bar[4].address;
 			if (busmaster_port == 0)
 				panic("Bus master port (BAR4 of first disk controller) is 0!");
+			ide_controller = dev;
 		}
 	}
 
@@ -239,6 +262,16 @@ void ata_init(void) {
 	channels[ATA_SECONDARY].ctrl = ATA_REG_DEV_CONTROL_SEC;
 	channels[ATA_SECONDARY].bmide = 0;
 
+	if (busmaster_port != 0) {
+		/* The bus master registers for the secondary channel follow those for the primary */
+		for (int ch = 0; ch < 2; ch++) {
+			channels[ch].bmide = busmaster_port + 8 * ch;
+			/* The PRD table must not cross a 64 kiB boundary; a page never does */
+			channels[ch].prdt = kmalloc_ap(PAGE_SIZE, &channels[ch].prdt_phys);
+		}
+		pci_enable_bus_master(ide_controller);
+	}
+
 	/* Check for "float", before *any* value is written to the bus */
 	uint8 fl[2] = {0};
 
@@ -397,7 +430,7 @@ void ata_init(void) {
 			if (devices[dev].ata_ver < 2)
 				panic("Invalid ATA version for disk");
 
-			/* Figure out the highest UDMA mode supported (not that we use it at the moment) */
+			/* Figure out the highest UDMA mode supported */
 			devices[dev].max_udma_mode = 0xff;
 			for (int i = 0; i <= 5; i++) {
 				if (words[88] & (1 << i))
@@ -430,7 +463,7 @@ void ata_init(void) {
 			/* Set the subcommand and argument, and send the command. */
 			assert(devices[dev].max_pio_mode >= 3);
 			ata_reg_write(ch, ATA_REG_FEATURES, ATA_SF_SET_TRANSFER_MODE);
-			ata_reg_write(ch, ATA_REG_SECTOR_COUNT, ((1 << 3)) | devices[dev].max_pio_mode);
+			ata_reg_write(ch, ATA_REG_SECTOR_COUNT, ATA_XFER_PIO | devices[dev].max_pio_mode);
 			ata_cmd(ch, ATA_CMD_SET_FEATURES);
 
 			/* Wait for the command to complete */
@@ -442,6 +475,62 @@ void ata_init(void) {
 #if ATA_VERBOSE > 0
 			printk("Set ch=%u drive=%u to PIO mode %u\n", ch, drive, devices[dev].max_pio_mode);
 #endif
+
+			/* Set the block size for READ/WRITE MULTIPLE once and for all, rather than per command.
+			 * Drives without support for them use READ/WRITE SECTORS instead. */
+			if (devices[dev].max_sectors_multiple > 0) {
+				ata_reg_write(ch, ATA_REG_SECTOR_COUNT, devices[dev].max_sectors_multiple);
+				ata_cmd(ch, ATA_CMD_SET_MULTIPLE_MODE);
+
+				do {
+					status = ata_reg_read(ch, ATA_REG_ALT_STATUS);
+				} while (status & ATA_SR_BSY);
+
+				if (status & ATA_SR_ERR) {
+					printk("ATA: ch=%u drive=%u didn't accept %u sectors per block; not using READ/WRITE MULTIPLE\n",
+							ch, drive, devices[dev].max_sectors_multiple);
+					devices[dev].max_sectors_multiple = 0;
+				}
+			}
+
+			/* Set the DMA mode as well, if we can use DMA; PIO commands still use the PIO mode set above.
+			 * Note that we don't program the controller's timing registers, and rely on the
+			 * BIOS (or emulator) having set them up. */
+			devices[dev].max_mwdma_mode = 0xff;
+			for (int i = 0; i <= 2; i++) {
+				if (words[63] & (1 << i))
+					devices[dev].max_mwdma_mode = i;
+			}
+
+			devices[dev].use_dma = false;
+			if (channels[ch].bmide != 0 && (devices[dev].max_udma_mode != 0xff || devices[dev].max_mwdma_mode != 0xff)) {
+				uint8 mode;
+				if (devices[dev].max_udma_mode != 0xff)
+					mode = ATA_XFER_UDMA | devices[dev].max_udma_mode;
+				else
+					mode = ATA_XFER_MWDMA | devices[dev].max_mwdma_mode;
+
+				ata_reg_write(ch, ATA_REG_FEATURES, ATA_SF_SET_TRANSFER_MODE);
+				ata_reg_write(ch, ATA_REG_SECTOR_COUNT, mode);
+				ata_cmd(ch, ATA_CMD_SET_FEATURES);
+
+				do {
+					status = ata_reg_read(ch, ATA_REG_ALT_STATUS);
+				} while (status & ATA_SR_BSY);
+
+				if (status & ATA_SR_ERR)
+					printk("ATA: ch=%u drive=%u didn't accept DMA mode 0x%02x; using PIO\n", ch, drive, mode);
+				else {
+					devices[dev].use_dma = true;
+					/* Tell the controller that this drive is DMA capable */
+					uint8 bmstatus = inb(channels[ch].bmide + ATA_BM_STATUS);
+					bmstatus &= (ATA_BM_SR_DRV0_DMA | ATA_BM_SR_DRV1_DMA);
+					outb(channels[ch].bmide + ATA_BM_STATUS, bmstatus | (drive == ATA_MASTER ? ATA_BM_SR_DRV0_DMA : ATA_BM_SR_DRV1_DMA));
+#if ATA_VERBOSE > 0
+					printk("Set ch=%u drive=%u to DMA mode 0x%02x\n", ch, drive, mode);
+#endif
+				}
+			}
 		} /* end drive loop */
 	} /* end channel loop */
 
@@ -483,73 +572,243 @@ void ata_init(void) {
 	ata_reg_write(ATA_SECONDARY, ATA_REG_DEV_CONTROL, 0);
 
 	INTERRUPT_UNLOCK;
+
+	/* Set up a request queue (and worker task) for each disk */
+	for (int dev = 0; dev < 4; dev++) {
+		ata_device_t *d = &devices[dev];
+		if (!d->exists || d->is_atapi)
+			continue;
+
+		snprintf(d->blkdev.name, sizeof(d->blkdev.name), "ata%d", dev);
+		d->blkdev.size = d->size;
+		d->blkdev.max_sectors = ATA_DMA_MAX_SECTORS;
+		d->blkdev.ops = &ata_blkdev_ops;
+		d->blkdev.driver_data = d;
+		blkdev_register(&d->blkdev);
+	}
 }
 
-/* This function assumes that the caller specifes correct sector values! */
-static bool ata_read_int(ata_device_t *dev, uint64 lba, uint8 *buffer, int sectors) {
-	assert(dev != NULL);
-	assert(dev->exists);
-	assert(dev->size - 1 >= lba + (sectors - 1));
-	assert(buffer != NULL);
+/* DMA needs a word aligned buffer that's mapped in the kernel's page tables */
+static bool ata_can_dma(ata_device_t *dev, void *buffer) {
+	return dev->use_dma && ((uint32)buffer & 1) == 0 && IS_KERNEL_SPACE(buffer);
+}
 
-	/* TODO: LBA48 */
+/*
+ * Adds PRD table entries for a transfer to/from /buffer/, starting at /prd/; returns the next free entry.
+ * Each entry covers the part of the buffer that lies in one page, since consecutive
+ * virtual pages needn't be physically contiguous. (That also keeps entries from
+ * crossing a 64 kiB boundary, which isn't allowed.)
+ */
+static uint32 *ata_prdt_add(uint32 *prd, uint8 *buffer, uint32 bytes) {
+	assert(bytes > 0);
+	assert(bytes <= ATA_DMA_MAX_SECTORS * 512);
+	assert(((uint32)buffer & 1) == 0);
+
+	while (bytes > 0) {
+		uint32 len = PAGE_SIZE - ((uint32)buffer & (PAGE_SIZE - 1));
+		if (len > bytes)
+			len = bytes;
+
+		prd[0] = vmm_get_phys((uint32)buffer, kernel_directory);
+		prd[1] = len; /* at most 4096, so never 0 (which would mean 64 kiB) */
+
+		buffer += len;
+		bytes -= len;
+		prd += 2;
+	}
 
-	INTERRUPT_LOCK;
+	return prd;
+}
+
+/* Marks the entry before /end/ as the last one in the channel's PRD table */
+static void ata_prdt_finish(ata_channel_t *chan, uint32 *end) {
+	assert(end > chan->prdt);
+	assert((uint32)(end - chan->prdt) <= PAGE_SIZE / sizeof(uint32));
+	end[-1] |= ATA_PRD_EOT;
+}
+
+/* Whether a command for these sectors needs LBA48: past the first 2^28 sectors, or more than 256 of them */
+static bool ata_need_lba48(ata_device_t *dev, uint64 lba, uint32 sectors) {
+	bool lba48 = (lba + sectors > ATA_LBA28_LIMIT || sectors > ATA_LBA28_MAX_SECTORS);
+	assert(!lba48 || (dev->capabilities & ATA_CAPABILITY_LBA48));
+	return lba48;
+}
+
+/* The most sectors one PIO command can transfer on this drive */
+static uint32 ata_max_command_sectors(ata_device_t *dev) {
+	return (dev->capabilities & ATA_CAPABILITY_LBA48) ? ATA_LBA48_MAX_SECTORS : ATA_LBA28_MAX_SECTORS;
+}
+
+/*
+ * Selects the drive, and writes the sector count and LBA address for the next command.
+ * LBA48 commands take 16-bit counts and 48-bit addresses, written as two bytes to the
+ * same registers: the high ("previous") byte first, then the low byte.
+ * Called with interrupts disabled.
+ */
+static void ata_setup_lba(ata_device_t *dev, uint64 lba, uint32 sectors, bool lba48) {
+	assert(sectors > 0 && sectors <= (lba48 ? ATA_LBA48_MAX_SECTORS : ATA_LBA28_MAX_SECTORS));
 
-	/* Select the drive, and write the 4 high LBA bits */
-	ata_reg_write(dev->channel, ATA_REG_DRIVE_SELECT, 0xe0 | (dev->drive << 4) | ((lba >> 24) & 0x0f));
+	if (lba48) {
+		/* Select the drive; bit 6 selects LBA addressing */
+		ata_reg_write(dev->channel, ATA_REG_DRIVE_SELECT, 0x40 | (dev->drive << 4));
+	}
+	else {
+		/* Select the drive, and write the 4 high LBA bits */
+		ata_reg_write(dev->channel, ATA_REG_DRIVE_SELECT, 0xe0 | (dev->drive << 4) | ((lba >> 24) & 0x0f));
+	}
 
 	/* Wait for a while for the selection to stick... */
 	for (int i=0; i<4; i++)
 		ata_reg_read(dev->channel, ATA_REG_ALT_STATUS);
 
-	/* Temporarily disable ATA interrupts for this drive (TODO: channel?!) */
-	ata_reg_write(dev->channel, ATA_REG_DEV_CONTROL, ATA_REG_DEV_CONTROL_NIEN);
-
-	ata_reg_write(dev->channel, ATA_REG_SECTOR_COUNT, sectors);
-	ata_cmd(dev->channel, ATA_CMD_SET_MULTIPLE_MODE);
+	if (lba48) {
+		/* The high byte of the sector count (65536 is written as 0), and LBA bits 24-47 */
+		ata_reg_write(dev->channel, ATA_REG_SECTOR_COUNT, (sectors >> 8) & 0xff);
+		ata_reg_write(dev->channel, ATA_REG_LBA_LO, ((lba >> 24) & 0xff));
+		ata_reg_write(dev->channel, ATA_REG_LBA_MID, ((lba >> 32) & 0xff));
+		ata_reg_write(dev->channel, ATA_REG_LBA_HI, ((lba >> 40) & 0xff));
+	}
 
-	/* Set the sector count and the lower 24 bits of the LBA address */
-	ata_reg_write(dev->channel, ATA_REG_SECTOR_COUNT, sectors);
+	/* Set the sector count (0 means 256 for LBA28) and the lower 24 bits of the LBA address */
+	ata_reg_write(dev->channel, ATA_REG_SECTOR_COUNT, sectors & 0xff);
 	ata_reg_write(dev->channel, ATA_REG_LBA_LO, (lba & 0xff));
 	ata_reg_write(dev->channel, ATA_REG_LBA_MID, ((lba >> 8) & 0xff));
 	ata_reg_write(dev->channel, ATA_REG_LBA_HI, ((lba >> 16) & 0xff));
+}
+
+/*
+ * Transfers up to ATA_DMA_MAX_SECTORS sectors with bus master DMA, to/from the memory described
+ * by the channel's PRD table, sleeping until the transfer completes. On failure, DMA is disabled
+ * for the device, and false is returned so that the caller can use PIO instead.
+ */
+static bool ata_dma_int(ata_device_t *dev, uint64 lba, int sectors, bool write) {
+	assert(dev != NULL);
+	assert(dev->exists);
+	assert(dev->size - 1 >= lba + (sectors - 1));
+	assert(sectors > 0 && sectors <= ATA_DMA_MAX_SECTORS);
+
+	ata_channel_t *chan = &channels[dev->channel];
+	assert(chan->bmide != 0);
+	const uint8 direction = write ? 0 : ATA_BM_CMD_READ;
+	const bool lba48 = ata_need_lba48(dev, lba, sectors);
+
+	INTERRUPT_LOCK;
+
+	/* Set up the controller: stop any previous transfer, set the PRDT and direction,
+	 * and clear the IRQ and error bits (by writing ones to them) */
+	outb(chan->bmide + ATA_BM_COMMAND, 0);
+	outl(chan->bmide + ATA_BM_PRDT, chan->prdt_phys);
+	outb(chan->bmide + ATA_BM_COMMAND, direction);
+	uint8 bmstatus = inb(chan->bmide + ATA_BM_STATUS);
+	outb(chan->bmide + ATA_BM_STATUS, bmstatus | ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
+
+	ata_setup_lba(dev, lba, sectors, lba48);
 
 	/* Take this process off the run queue; the ATA interrupt handler (IRQ14/15)
-	 * will wake it back up, hopefully just below the INTERRUPT_UNLOCK line. */
+	 * will wake it back up once the whole transfer is done. */
+	channels[dev->channel].waiter = (task_t *)current_task;
 	scheduler_set_iowait();
 
-	/* Send the READ SECTOR(S) command */
-	uint32 old_handled = ata_interrupts_handled;
+	uint32 old_handled = channels[dev->channel].interrupts_handled;
 	ata_reg_write(dev->channel, ATA_REG_DEV_CONTROL, 0); /* enable ATA interrupts */
-	ata_cmd(dev->channel, ATA_CMD_READ_MULTIPLE);
+	if (lba48)
+		ata_cmd(dev->channel, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+	else
+		ata_cmd(dev->channel, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+
+	/* Start the transfer */
+	outb(chan->bmide + ATA_BM_COMMAND, direction | ATA_BM_CMD_START);
 
-	/* The process state is set, the ATA command is sent... take us out of here! */
 	INTERRUPT_UNLOCK;
 	YIELD; /* force a task switch */
 
-	/*************************************************************************
-	 * This void between these two lines is where we should return           *
-	 * once the interrupt has fired and the drive is ready to transfer data. *
-	 *************************************************************************/
+	/* The interrupt handler should have increased this variable by one at this point! */
+	assert(channels[dev->channel].interrupts_handled == old_handled + 1);
+
+	/* Stop the controller, and check how things went */
+	outb(chan->bmide + ATA_BM_COMMAND, direction);
+	bmstatus = inb(chan->bmide + ATA_BM_STATUS);
+	uint8 status = ata_reg_read(dev->channel, ATA_REG_STATUS);
+
+	if ((bmstatus & ATA_BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+		printk("ATA: DMA %s failed on ch=%u drive=%u (status 0x%02x, BM status 0x%02x); using PIO from now on\n",
+				write ? "write" : "read", dev->channel, dev->drive, status, bmstatus);
+		outb(chan->bmide + ATA_BM_STATUS, (bmstatus & (ATA_BM_SR_DRV0_DMA | ATA_BM_SR_DRV1_DMA)) | ATA_BM_SR_ERR);
+		dev->use_dma = false;
+		return false;
+	}
 
-	asm volatile("nop");
+	return true;
+}
 
-	/* The interrupt handler should have increased this variable by one at this point! */
-	assert(ata_interrupts_handled == old_handled + 1);
+/*
+ * Reads up to ata_max_command_sectors() sectors with one PIO command. The drive interrupts once
+ * per block of max_sectors_multiple sectors (or per sector, if it lacks READ MULTIPLE);
+ * the last block may be shorter. This function assumes that the caller specifes correct sector values!
+ */
+static bool ata_read_int(ata_device_t *dev, uint64 lba, uint8 *buffer, uint32 sectors) {
+	assert(dev != NULL);
+	assert(dev->exists);
+	assert(dev->size - 1 >= lba + (sectors - 1));
+	assert(buffer != NULL);
 
-	/* The 400ns wait is in the interrupt handler */
-	uint8 status = ata_reg_read(dev->channel, ATA_REG_STATUS); /* read the REGULAR status reg to clear the INTRQ */
+	const bool lba48 = ata_need_lba48(dev, lba, sectors);
+	const uint32 block = (dev->max_sectors_multiple > 0) ? dev->max_sectors_multiple : 1;
+	uint8 cmd;
+	if (dev->max_sectors_multiple > 0)
+		cmd = lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+	else
+		cmd = lba48 ? ATA_CMD_READ_SECTORS_EXT : ATA_CMD_READ_SECTORS;
 
-	assert(!(status & ATA_SR_BSY));
-	assert(status & ATA_SR_DRQ);
-	assert(!(status & ATA_SR_ERR));
+	/*
+	 * Interrupts stay disabled throughout, including while we sleep (like in wait_queue_sleep);
+	 * that way, the interrupt for the next block can't arrive before we're set up to wait for it.
+	 */
+	INTERRUPT_LOCK;
+
+	ata_setup_lba(dev, lba, sectors, lba48);
+
+	/* Take this process off the run queue; the ATA interrupt handler (IRQ14/15)
+	 * will wake it back up once the drive has the first block ready. */
+	channels[dev->channel].waiter = (task_t *)current_task;
+	scheduler_set_iowait();
+
+	/* Send the READ command */
+	uint32 old_handled = channels[dev->channel].interrupts_handled;
+	ata_reg_write(dev->channel, ATA_REG_DEV_CONTROL, 0); /* enable ATA interrupts */
+	ata_cmd(dev->channel, cmd);
 
-	/* Let's do this thing */
-	uint16 *words = (uint16 *)buffer;
-	uint32 count = 256 * sectors; // number of words, i.e. bytes / 2
 	uint16 port = channels[dev->channel].base;
-	asm volatile("rep insw" : : "c"(count), "d"(port), "D"(words)); /* c for ecx, d for dx, D for edi */
+	uint32 remaining = sectors;
+	uint8 status;
+	while (remaining > 0) {
+		YIELD; /* force a task switch; we return once the interrupt has fired */
+
+		/* The interrupt handler should have increased this variable by one at this point! */
+		assert(channels[dev->channel].interrupts_handled == old_handled + 1);
+
+		/* The 400ns wait is in the interrupt handler */
+		status = ata_reg_read(dev->channel, ATA_REG_STATUS); /* read the REGULAR status reg to clear the INTRQ */
+		if (status & ATA_SR_ERR)
+			ata_error(dev->channel, status, ATA_CMD_READ_SECTORS);
+
+		assert(!(status & ATA_SR_BSY));
+		assert(status & ATA_SR_DRQ);
+
+		uint32 n = (remaining < block) ? remaining : block;
+		remaining -= n;
+
+		/* Sleep again after this block, if there's another one coming */
+		if (remaining > 0) {
+			channels[dev->channel].waiter = (task_t *)current_task;
+			scheduler_set_iowait();
+			old_handled = channels[dev->channel].interrupts_handled;
+		}
+
+		/* Let's do this thing */
+		uint32 count = 256 * n; // number of words, i.e. bytes / 2
+		asm volatile("rep insw" : "+c"(count), "+D"(buffer) : "d"(port) : "memory"); /* c for ecx, d for dx, D for edi */
+	}
 
 	/* Make sure no error occured */
 
@@ -557,7 +816,8 @@ static bool ata_read_int(ata_device_t *dev, uint64 lba, uint8 *buffer, int secto
 		status = ata_reg_read(dev->channel, ATA_REG_ALT_STATUS);
 	} while (status & ATA_SR_BSY);
 
-	assert(!(status & ATA_SR_BSY));
+	INTERRUPT_UNLOCK;
+
 	assert(!(status & ATA_SR_DF));
 
 	if (status & ATA_SR_ERR)
@@ -566,200 +826,264 @@ static bool ata_read_int(ata_device_t *dev, uint64 lba, uint8 *buffer, int secto
 	return true;
 }
 
-bool ata_read(ata_device_t *dev, uint64 lba, void *buffer, int sectors_total) {
+/* Reads into one buffer, with DMA if possible and PIO otherwise. Called with the channel's mutex held. */
+static bool ata_read_buffer(ata_device_t *dev, uint64 lba, void *buffer, int sectors_total) {
 	assert(sectors_total > 0);
 	assert(dev != NULL);
 	assert(dev->exists);
 	assert(dev->size - 1 >= lba + (sectors_total - 1));
 	assert(buffer != NULL);
 
-	mutex_lock(ata_mutex);
-
 	int sectors_read = 0;
 
-	/*
-	 * Calls ata_read_int with blocks of sectors, as large as possible.
-	 * The limiting factors are:
-	 * 1) the maximum supported block length, i.e. dev->max_sectors_multiple (from IDENTIFY DEVICE),
-	 * 2) the number of sector the caller wants, and
-	 * 3) it must be a power of 2, so for 3 sectors, two reads are issued: first for 2 sectors, then for 1 sector.
-	 */
+	/* Use DMA where possible; if it fails, the rest is read with PIO below */
+	while (sectors_read < sectors_total && ata_can_dma(dev, buffer)) {
+		int sectors_to_read = sectors_total - sectors_read;
+		if (sectors_to_read > ATA_DMA_MAX_SECTORS)
+			sectors_to_read = ATA_DMA_MAX_SECTORS;
 
-	while (sectors_read < sectors_total) {
-		int sectors_to_read = 1; // sectors to read in this loop; the total may be greater
-		while (sectors_to_read < (sectors_total - sectors_read) && sectors_to_read < dev->max_sectors_multiple) {
-			sectors_to_read *= 2;
-		}
-		while (sectors_to_read > dev->max_sectors_multiple || sectors_to_read > sectors_total)
-			sectors_to_read /= 2;
+		ata_channel_t *chan = &channels[dev->channel];
+		ata_prdt_finish(chan, ata_prdt_add(chan->prdt, (uint8 *)buffer + sectors_read*512, sectors_to_read * 512));
+		if (!ata_dma_int(dev, lba + sectors_read, sectors_to_read, false))
+			break;
+		sectors_read += sectors_to_read;
+	}
 
-		assert(sectors_to_read > 0);
+	/* Read the rest with as few commands as possible; any number of sectors can be read at once,
+	 * up to the command's limit (256 sectors, or 65536 with LBA48) */
+	while (sectors_read < sectors_total) {
+		uint32 sectors_to_read = sectors_total - sectors_read;
+		if (sectors_to_read > ata_max_command_sectors(dev))
+			sectors_to_read = ata_max_command_sectors(dev);
 
-		if (!ata_read_int(dev, lba + sectors_read, (uint8 *)buffer + sectors_read*512, sectors_to_read)) {
-			mutex_unlock(ata_mutex);
+		if (!ata_read_int(dev, lba + sectors_read, (uint8 *)buffer + sectors_read*512, sectors_to_read))
 			return false;
-		}
 		sectors_read += sectors_to_read;
 	}
 
-	mutex_unlock(ata_mutex);
 	return true;
 }
 
-static bool ata_write_int(ata_device_t *dev, uint64 lba, uint8 *buffer, int sectors) {
+/*
+ * Writes up to ata_max_command_sectors() sectors with one PIO command, one block of
+ * max_sectors_multiple sectors (or one sector) at a time. The drive asks for the first block
+ * by setting DRQ, and for the following ones, and finally reports completion, with an interrupt.
+ */
+static bool ata_write_int(ata_device_t *dev, uint64 lba, uint8 *buffer, uint32 sectors) {
 	assert(dev != NULL);
 	assert(dev->exists);
-	assert(dev->size - 1 >= lba);
+	assert(dev->size - 1 >= lba + (sectors - 1));
 	assert(buffer != NULL);
 
-	/* TODO: LBA48 */
+	const bool lba48 = ata_need_lba48(dev, lba, sectors);
+	const uint32 block = (dev->max_sectors_multiple > 0) ? dev->max_sectors_multiple : 1;
+	uint8 cmd;
+	if (dev->max_sectors_multiple > 0)
+		cmd = lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
+	else
+		cmd = lba48 ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_WRITE_SECTORS;
 
+	/* As in ata_read_int, interrupts stay disabled, even while we sleep */
 	INTERRUPT_LOCK;
 
-	/* Select the drive, and write the 4 high LBA bits */
-	ata_reg_write(dev->channel, ATA_REG_DRIVE_SELECT, 0xe0 | (dev->drive << 4) | ((lba >> 24) & 0x0f));
-
-	/* Wait for a while for the selection to stick... */
-	for (int i=0; i<4; i++)
-		ata_reg_read(dev->channel, ATA_REG_ALT_STATUS);
-
-	/* Temporarily disable ATA interrupts for this drive (TODO: channel?!) */
-	ata_reg_write(dev->channel, ATA_REG_DEV_CONTROL, ATA_REG_DEV_CONTROL_NIEN);
-
-	ata_reg_write(dev->channel, ATA_REG_SECTOR_COUNT, sectors);
-	ata_cmd(dev->channel, ATA_CMD_SET_MULTIPLE_MODE);
-
-	/* Set the sector count and the lower 24 bits of the LBA address */
-	ata_reg_write(dev->channel, ATA_REG_SECTOR_COUNT, sectors);
-	ata_reg_write(dev->channel, ATA_REG_LBA_LO, (lba & 0xff));
-	ata_reg_write(dev->channel, ATA_REG_LBA_MID, ((lba >> 8) & 0xff));
-	ata_reg_write(dev->channel, ATA_REG_LBA_HI, ((lba >> 16) & 0xff));
+	ata_setup_lba(dev, lba, sectors, lba48);
 
-	uint32 old_handled = ata_interrupts_handled;
 	ata_reg_write(dev->channel, ATA_REG_DEV_CONTROL, 0); /* enable ATA interrupts */
-	ata_cmd(dev->channel, ATA_CMD_WRITE_MULTIPLE);
+	ata_cmd(dev->channel, cmd);
 
 	/* State HPIOO0: Check_Status State */
-	uint8 test = 0;
+	uint8 status;
 	do {
-		test = ata_reg_read(dev->channel, ATA_REG_ALT_STATUS);
-	} while (test & ATA_SR_BSY);
-
-	assert(test & ATA_SR_DRQ);
+		status = ata_reg_read(dev->channel, ATA_REG_ALT_STATUS);
+	} while (status & ATA_SR_BSY);
 
-	/* If the above was true, we're now in state HPIOO1: Transfer_Data */
+	if (status & ATA_SR_ERR)
+		ata_error(dev->channel, status, ATA_CMD_WRITE_SECTORS);
+	assert(status & ATA_SR_DRQ);
 
-	/* Let's do this thing */
-	uint16 *words = (uint16 *)buffer;
 	uint16 port = channels[dev->channel].base;
-	for (int i=0; i < 256 * sectors; i++) {
-		// NOTE: don't use rep outsw; we need the tiny bit of delay the loop provides
-		outw(port, words[i]);
-	}
-
-	/* We're done writing. That puts us in the HPIOO2: INTRQ_Wait state */
-
-	/* Take this process off the run queue; the ATA interrupt handler (IRQ14/15)
-	 * will wake it back up, hopefully just below the INTERRUPT_UNLOCK line. */
-	scheduler_set_iowait();
+	uint32 remaining = sectors;
+	while (remaining > 0) {
+		/* We're now in state HPIOO1: Transfer_Data */
+		uint32 n = (remaining < block) ? remaining : block;
+		uint16 *words = (uint16 *)buffer;
+		for (uint32 i=0; i < 256 * n; i++) {
+			// NOTE: don't use rep outsw; we need the tiny bit of delay the loop provides
+			outw(port, words[i]);
+		}
+		buffer += n * 512;
+		remaining -= n;
 
-	/* The process state is set. Let's go! */
-	INTERRUPT_UNLOCK;
-	YIELD; /* force a task switch */
+		/* That puts us in the HPIOO2: INTRQ_Wait state. The interrupt means that the drive
+		 * wants the next block, or, after the last one, that the command is done.
+		 * Take this process off the run queue until then. */
+		channels[dev->channel].waiter = (task_t *)current_task;
+		scheduler_set_iowait();
+		uint32 old_handled = channels[dev->channel].interrupts_handled;
 
-	/*************************************************************************
-	 * This void between these two lines is where we should return           *
-	 * once the interrupt has fired.                                         *
-	 *************************************************************************/
+		YIELD; /* force a task switch */
 
-	asm volatile("nop");
+		/* The interrupt handler should have increased this variable by one at this point! */
+		assert(channels[dev->channel].interrupts_handled == old_handled + 1);
 
-	/* The interrupt handler should have increased this variable by one at this point! */
-	assert(ata_interrupts_handled == old_handled + 1);
+		/* The 400ns wait is in the interrupt handler */
+		do {
+			status = ata_reg_read(dev->channel, ATA_REG_STATUS); /* read the REGULAR status reg to clear the INTRQ */
+		} while (status & ATA_SR_BSY);
 
-	/* The 400ns wait is in the interrupt handler */
-	uint8 status;
+		assert(!(status & ATA_SR_DF));
 
-	do {
-		status = ata_reg_read(dev->channel, ATA_REG_STATUS); /* read the REGULAR status reg to clear the INTRQ */
-	} while (status & ATA_SR_BSY);
+		if (status & ATA_SR_ERR)
+			ata_error(dev->channel, status, ATA_CMD_WRITE_SECTORS);
 
-	assert(!(status & ATA_SR_DF));
+		assert(remaining == 0 || (status & ATA_SR_DRQ));
+	}
 
-	if (status & ATA_SR_ERR)
-		ata_error(dev->channel, status, ATA_CMD_WRITE_SECTORS);
+	INTERRUPT_UNLOCK;
 
 	return true;
 }
 
-bool ata_write(ata_device_t *dev, uint64 lba, void *buffer, int sectors_total) {
+/* Writes from one buffer, with DMA if possible and PIO otherwise. Called with the channel's mutex held. */
+static bool ata_write_buffer(ata_device_t *dev, uint64 lba, void *buffer, int sectors_total) {
 	assert(sectors_total > 0);
 	assert(dev != NULL);
 	assert(dev->exists);
 	assert(dev->size - 1 >= lba + (sectors_total - 1));
 	assert(buffer != NULL);
 
-	mutex_lock(ata_mutex);
-
 	int sectors_written = 0;
 
-	/*
-	 * Calls ata_write_int with blocks of sectors, as large as possible.
-	 * The limiting factors are:
-	 * 1) the maximum supported block length, i.e. dev->max_sectors_multiple (from IDENTIFY DEVICE),
-	 * 2) the number of sector the caller wants to write, and
-	 * 3) it must be a power of 2, so for 3 sectors, two writes are issued: first for 2 sectors, then for 1 sector.
-	 */
+	/* Use DMA where possible; if it fails, the rest is written with PIO below */
+	while (sectors_written < sectors_total && ata_can_dma(dev, buffer)) {
+		int sectors_to_write = sectors_total - sectors_written;
+		if (sectors_to_write > ATA_DMA_MAX_SECTORS)
+			sectors_to_write = ATA_DMA_MAX_SECTORS;
 
+		ata_channel_t *chan = &channels[dev->channel];
+		ata_prdt_finish(chan, ata_prdt_add(chan->prdt, (uint8 *)buffer + sectors_written*512, sectors_to_write * 512));
+		if (!ata_dma_int(dev, lba + sectors_written, sectors_to_write, true))
+			break;
+		sectors_written += sectors_to_write;
+	}
+
+	/* Write the rest with as few commands as possible, as in ata_read_buffer */
 	while (sectors_written < sectors_total) {
-		int sectors_to_write = 1; // sectors to write in this loop; the total may be greater
-		while (sectors_to_write < (sectors_total - sectors_written) && sectors_to_write < dev->max_sectors_multiple) {
-			sectors_to_write *= 2;
-		}
-		if (sectors_to_write > dev->max_sectors_multiple)
-			sectors_to_write /= 2;
-		assert(sectors_to_write > 0);
+		uint32 sectors_to_write = sectors_total - sectors_written;
+		if (sectors_to_write > ata_max_command_sectors(dev))
+			sectors_to_write = ata_max_command_sectors(dev);
 
-		if (!ata_write_int(dev, lba + sectors_written, (uint8 *)buffer + sectors_written*512, sectors_to_write)) {
-			mutex_unlock(ata_mutex);
+		if (!ata_write_int(dev, lba + sectors_written, (uint8 *)buffer + sectors_written*512, sectors_to_write))
 			return false;
-		}
 		sectors_written += sectors_to_write;
 	}
 
-	mutex_unlock(ata_mutex);
 	return true;
 }
 
-/* Reads a buffer of "any" size (make sure that the buffer passed is large enough -
- * for bytes=640, the buffer must be at least 1024 bytes large. For bytes=1900,
- * the buffer must be at least 2048 bytes, etc. Always in multiples of 512. */
-bool disk_read(ata_device_t *dev, uint64 start_lba, uint32 bytes, void *buffer) {
-	uint32 sectors = bytes/512;
-	if (bytes % 512)
-		sectors++;
+/* Whether a whole request can be done with a single DMA command */
+static bool ata_can_dma_request(ata_device_t *dev, blk_request_t *req) {
+	if (req->sectors > ATA_DMA_MAX_SECTORS)
+		return false;
+	for (blk_io_t *io = req->ios; io != NULL; io = io->next) {
+		if (!ata_can_dma(dev, io->buffer))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Carries out a block layer request; called by the disk's worker task.
+ * Merged requests are done with one DMA command where possible, with PRD table entries
+ * for each caller's buffer; otherwise, each buffer is transferred separately.
+ */
+static int ata_transfer(blkdev_t *bdev, blk_request_t *req) {
+	ata_device_t *dev = (ata_device_t *)bdev->driver_data;
+	bool ok = false;
+
+	mutex_lock(channels[dev->channel].mutex);
 
-	// TODO: read the last sector to a local buffer and copy the data over,
-	// such that we never write more than /bytes/ bytes to the buffer.
+	if (ata_can_dma_request(dev, req)) {
+		ata_channel_t *chan = &channels[dev->channel];
+		uint32 *prd = chan->prdt;
+		for (blk_io_t *io = req->ios; io != NULL; io = io->next)
+			prd = ata_prdt_add(prd, io->buffer, io->sectors * 512);
+		ata_prdt_finish(chan, prd);
 
-	assert(dev != NULL);
-	assert(dev->exists && !dev->is_atapi);
-	assert(start_lba + sectors <= dev->size - 1); /* TODO: OBOE? */
+		ok = ata_dma_int(dev, req->lba, req->sectors, req->write);
+	}
 
-	return ata_read(dev, start_lba, buffer, sectors);
+	if (!ok) {
+		ok = true;
+		for (blk_io_t *io = req->ios; io != NULL && ok; io = io->next) {
+			if (req->write)
+				ok = ata_write_buffer(dev, io->lba, io->buffer, io->sectors);
+			else
+				ok = ata_read_buffer(dev, io->lba, io->buffer, io->sectors);
+		}
+	}
+
+	mutex_unlock(channels[dev->channel].mutex);
+
+	return ok ? 0 : -EIO;
 }
 
-/* Writes a buffer of "any" size (make sure that the buffer passed is large enough -
- * for bytes=640, the buffer must be at least 1024 bytes large. For bytes=1900,
- * the buffer must be at least 2048 bytes, etc. Always in multiples of 512. */
-bool disk_write(ata_device_t *dev, uint64 start_lba, uint32 bytes, void *buffer) {
-	uint32 sectors = bytes/512;
-	if (bytes % 512)
-		sectors++;
+/* Writes the drive's write cache to the disk, with FLUSH CACHE (EXT); used by sync/fsync */
+static int ata_flush(blkdev_t *bdev) {
+	ata_device_t *dev = (ata_device_t *)bdev->driver_data;
+	if (!(dev->capabilities & ATA_CAPABILITY_FLUSH_CACHE))
+		return 0;
+
+	mutex_lock(channels[dev->channel].mutex);
+
+	uint8 status;
+	{
+		INTERRUPT_LOCK;
+
+		/* Select the drive, and wait for a while for the selection to stick... */
+		ata_reg_write(dev->channel, ATA_REG_DRIVE_SELECT, 0xe0 | (dev->drive << 4));
+		for (int i=0; i<4; i++)
+			ata_reg_read(dev->channel, ATA_REG_ALT_STATUS);
+
+		/* Take this process off the run queue; the interrupt wakes it once the cache is written */
+		channels[dev->channel].waiter = (task_t *)current_task;
+		scheduler_set_iowait();
+
+		uint32 old_handled = channels[dev->channel].interrupts_handled;
+		ata_reg_write(dev->channel, ATA_REG_DEV_CONTROL, 0); /* enable ATA interrupts */
+		ata_cmd(dev->channel, (dev->capabilities & ATA_CAPABILITY_LBA48) ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+
+		YIELD; /* force a task switch */
+
+		/* The interrupt handler should have increased this variable by one at this point! */
+		assert(channels[dev->channel].interrupts_handled == old_handled + 1);
+
+		status = ata_reg_read(dev->channel, ATA_REG_STATUS); /* read the REGULAR status reg to clear the INTRQ */
 
+		INTERRUPT_UNLOCK;
+	}
+
+	mutex_unlock(channels[dev->channel].mutex);
+
+	if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+		printk("ATA: FLUSH CACHE failed on ch=%u drive=%u (status 0x%02x)\n", dev->channel, dev->drive, status);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+bool ata_read(ata_device_t *dev, uint64 lba, void *buffer, int sectors) {
+	assert(sectors > 0);
 	assert(dev != NULL);
 	assert(dev->exists && !dev->is_atapi);
-	assert(start_lba + sectors <= dev->size - 1); /* TODO: OBOE? */
+	return blk_rw(&dev->blkdev, lba, buffer, sectors, false) == 0;
+}
 
-	return ata_write(dev, start_lba, buffer, sectors);
+bool ata_write(ata_device_t *dev, uint64 lba, void *buffer, int sectors) {
+	assert(sectors > 0);
+	assert(dev != NULL);
+	assert(dev->exists && !dev->is_atapi);
+	bcache_invalidate(&dev->blkdev, lba, sectors);
+	return blk_rw(&dev->blkdev, lba, buffer, sectors, true) == 0;
 }
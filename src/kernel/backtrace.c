@@ -2,57 +2,47 @@
 #include <kernel/kernutil.h>
 #include <kernel/console.h>
 #include <kernel/backtrace.h>
+#include <kernel/vmm.h>
 
-extern struct symbol *kernel_syms;
-
-// Translate an EIP value (e.g. 0x104e3c) to a function name
-struct symbol *addr_to_func(uint32 addr) {
-	if (!(
-		(addr >= 0x100000 && addr <= 0x200000) ||   // possibly valid kernel EIP
-		(addr >= 0x10000000 && addr <= 0x20000000)  // possibly valid userspace EIP
-		))
+// Find the symbol containing addr, using binary search; the table must be sorted by address
+struct symbol *symtab_find_addr(struct symtab *tab, uint32 addr) {
+	if (tab == NULL || tab->num == 0 || addr < tab->syms[0].eip)
 		return NULL;
 
-	struct symbol tmp = { .eip = 0xffffffff, .name = NULL };
-	struct symbol *best_match = &tmp;
-	uint32 min_diff = 0xffffffff;
-
-	struct symbol *all_syms[] = { kernel_syms, current_task->symbols, NULL };
-
-	// So this is a bit messy, but here's the idea behind each symbol pointer, whether * or **
-	// kernel_syms: pointer to an array of struct symbol entries
-	// current_task->symbols: as above, for the current userspace task
-	// all_syms: contains pointers to both of the above, to make looping easier. might be extended in the future.
-	// symp (defined below): the current symbol we're testing
-	// Note that we loop until eip == 0; the array is "null terminated", so to speak, with
-	// a null strect entry (eip == 0, name == NULL).
-	for (int symlist = 0; all_syms[symlist] != NULL; symlist++) {
-		struct symbol *symp = all_syms[symlist];
-		while (symp->eip && symp->name) {
-			// Compare all symbols to the address, and see if there's a better match.
-			// "Better match" is defined as the symbol starting BEFORE the address, such
-			// that the address may be INSIDE the symbol function, *and* closer to it than
-			// previously. We don't know the function length, so this will have to do.
-			// So far, it's worked 100%.
-			if (symp->eip <= addr && (addr - symp->eip) < min_diff) {
-				best_match = symp;
-				min_diff = addr - symp->eip;
-			}
-			symp++;
-		}
+	// Find the last symbol starting at or before addr
+	uint32 lo = 0, hi = tab->num;
+	while (hi - lo > 1) {
+		uint32 mid = lo + (hi - lo) / 2;
+		if (tab->syms[mid].eip <= addr)
+			lo = mid;
+		else
+			hi = mid;
 	}
 
-	// We didn't find anything if the best match hasn't been updated properly.
-	// Either that, or we DID find something, but it has no name.
-	//printk("best_match = 0x%p, name ADDRESS = 0x%p\n", best_match, &best_match->name);
-	if (best_match->eip == 0xffffffff || best_match->name == NULL || *(best_match->name) == 0)
+	struct symbol *sym = &tab->syms[lo];
+	if (sym->name == NULL || *sym->name == 0)
 		return NULL;
 
-	// This "best" match is so bad that it's certain to be incorrect
-	if (addr - best_match->eip > 0x200000)
+	if (sym->size != 0) {
+		if (addr - sym->eip >= sym->size)
+			return NULL; // past the end of the function, e.g. in assembly code without symbol info
+	}
+	else if (addr - sym->eip > 0x200000) {
+		// The last symbol has no known size; this "match" is so bad that it's certain to be incorrect
 		return NULL;
+	}
+
+	return sym;
+}
 
-	return best_match;
+// Translate an EIP value (e.g. 0x104e3c) to a function name
+struct symbol *addr_to_func(uint32 addr) {
+	if (addr >= 0x100000 && addr <= 0x200000) // possibly valid kernel EIP
+		return symtab_find_addr(&kernel_symtab, addr);
+	else if (addr >= 0x10000000 && addr <= 0x20000000) // possibly valid userspace EIP
+		return symtab_find_addr(current_task->symtab, addr);
+	else
+		return NULL;
 }
 
 // Find a backtrace from the passed EBP value, and store it in bt.
@@ -65,7 +55,9 @@ void get_backtrace(uint32 _ebp, struct backtrace *bt) {
 	while (ebp != NULL) {
 		if (i >= BACKTRACE_MAX)
 			break;
-		if (ebp > (uint32 *)0xcfff0000 || ebp < (uint32 *)0x100000) {
+		// Kernel stacks are in the kernel stack region (except the initial one, in the kernel image),
+		// and user stacks are below the kernel heap; nothing valid is above the stack region.
+		if ((uint32)ebp + 8 > KSTACK_REGION_END || ebp < (uint32 *)0x100000) {
 			break;
 		}
 
@@ -0,0 +1,515 @@
+#include <kernel/bcache.h>
+#include <kernel/heap.h>
+#include <kernel/mutex.h>
+#include <kernel/kernutil.h>
+#include <kernel/interrupts.h>
+#include <kernel/console.h>
+#include <kernel/timer.h>
+#include <string.h>
+
+#define BCACHE_HASH_SIZE 256 /* must be a power of two */
+
+static ilist_t hash[BCACHE_HASH_SIZE];
+static ilist_t lru = ILIST_INIT(lru); /* least recently used first */
+static ilist_t dirty = ILIST_INIT(dirty); /* least recently dirtied first */
+static struct bcache_stats stats;
+
+/* Protects everything above, and the flags, refcounts and list links of all buffers */
+static mutex_t *bcache_mutex = NULL;
+
+/* Buffers written back together, e.g. by one flusher run; the submitter sleeps until pending is 0 */
+struct bcache_batch {
+	uint32 pending;
+	int error;
+	wait_queue_t wq;
+};
+
+static volatile uint32 writes_in_flight = 0; /* modified with interrupts disabled */
+static wait_queue_t writeback_wq; /* woken whenever a write finishes */
+static wait_queue_t flusher_wq; /* the flusher task sleeps here between runs */
+
+#define hash_entry(node) ilist_entry(node, buf_t, hash_node)
+#define lru_entry(node) ilist_entry(node, buf_t, lru_node)
+#define dirty_entry(node) ilist_entry(node, buf_t, dirty_node)
+
+/* With more dirty data than this, the flusher writes back the oldest buffers without waiting for them to expire... */
+static uint32 bcache_dirty_background(void) {
+	return stats.limit / 4;
+}
+
+/* ... and with more than this, tasks that dirty buffers have to help out */
+static uint32 bcache_dirty_max(void) {
+	return stats.limit / 2;
+}
+
+static void bcache_flusher(void *data, uint32 length);
+
+void bcache_init(void) {
+	for (int i = 0; i < BCACHE_HASH_SIZE; i++)
+		ilist_init(&hash[i]);
+	memset(&stats, 0, sizeof(stats));
+	stats.limit = BCACHE_DEFAULT_SIZE;
+	bcache_mutex = mutex_create();
+	writeback_wq.head = NULL;
+	flusher_wq.head = NULL;
+
+	create_task(bcache_flusher, "bflush", &kernel_console, NULL, 0);
+}
+
+static ilist_t *bcache_bucket(blkdev_t *dev, uint64 lba) {
+	uint32 h = (uint32)lba ^ ((uint32)dev >> 4);
+	h ^= h >> 8;
+	return &hash[h & (BCACHE_HASH_SIZE - 1)];
+}
+
+static buf_t *bcache_lookup(blkdev_t *dev, uint64 lba, uint32 size) {
+	ilist_foreach(bcache_bucket(dev, lba), it) {
+		buf_t *b = hash_entry(it);
+		if (b->dev == dev && b->lba == lba && b->size == size)
+			return b;
+	}
+
+	return NULL;
+}
+
+/* Adds a reference to a cached buffer. Called with the mutex held. */
+static void bcache_ref(buf_t *b) {
+	if (b->refcount++ == 0 && ilist_linked(&b->lru_node))
+		ilist_remove(&lru, &b->lru_node);
+}
+
+/* Frees an unreferenced, clean buffer. Called with the mutex held. */
+static void bcache_free(buf_t *b) {
+	assert(b->refcount == 0);
+	assert(!(b->flags & (BUF_DIRTY | BUF_WRITING)));
+	if (ilist_linked(&b->hash_node))
+		ilist_remove(bcache_bucket(b->dev, b->lba), &b->hash_node);
+	if (ilist_linked(&b->lru_node))
+		ilist_remove(&lru, &b->lru_node);
+
+	if (b->readahead)
+		stats.readahead_unused++;
+	stats.buffers--;
+	stats.bytes -= b->size;
+	kfree(b->data);
+	kfree(b);
+}
+
+/* Evicts unused buffers until the cache is within its limit (or nothing more can be evicted) */
+static void bcache_shrink(void) {
+	while (stats.bytes > stats.limit && !ilist_empty(&lru)) {
+		bcache_free(lru_entry(ilist_first(&lru)));
+		stats.evictions++;
+	}
+}
+
+/* Sleeps until the buffer's read is done */
+static void bcache_wait(buf_t *b) {
+	INTERRUPT_LOCK;
+	while (b->flags & BUF_BUSY)
+		wait_queue_sleep(&b->wq);
+	INTERRUPT_UNLOCK;
+}
+
+/* Clears BUF_BUSY, setting BUF_VALID if /valid/, and wakes up anyone waiting for the buffer */
+static void bcache_unbusy(buf_t *b, bool valid) {
+	INTERRUPT_LOCK;
+	b->flags &= ~BUF_BUSY;
+	if (valid)
+		b->flags |= BUF_VALID;
+	wait_queue_wake(&b->wq);
+	INTERRUPT_UNLOCK;
+}
+
+/* Called by the device's worker task when a read finishes */
+static void bcache_read_done(blk_io_t *io) {
+	buf_t *b = (buf_t *)io->private;
+
+	bcache_unbusy(b, io->error == 0);
+
+	// Drop the reference held by the read
+	brelse(b);
+}
+
+/* Creates a busy buffer with /refs/ references, to be filled in by the caller. Called with the mutex held. */
+static buf_t *bcache_alloc(blkdev_t *dev, uint64 lba, uint32 size, uint32 refs) {
+	buf_t *b = kmalloc(sizeof(buf_t));
+	memset(b, 0, sizeof(buf_t));
+	b->dev = dev;
+	b->lba = lba;
+	b->size = size;
+	b->data = kmalloc(size);
+	b->flags = BUF_BUSY;
+	b->refcount = refs;
+	ilist_append(bcache_bucket(dev, lba), &b->hash_node);
+	stats.buffers++;
+	stats.bytes += size;
+	bcache_shrink();
+
+	return b;
+}
+
+/* Creates a buffer and starts reading it, with /refs/ references besides the read's own.
+ * Called with the mutex held; releases it. */
+static buf_t *bcache_start_read(blkdev_t *dev, uint64 lba, uint32 size, uint32 refs, bool readahead) {
+	buf_t *b = bcache_alloc(dev, lba, size, refs + 1);
+	b->readahead = readahead;
+	mutex_unlock(bcache_mutex);
+
+	b->io.lba = lba;
+	b->io.sectors = size / 512;
+	b->io.buffer = b->data;
+	b->io.write = false;
+	b->io.callback = bcache_read_done;
+	b->io.private = b;
+	blk_submit(dev, &b->io);
+
+	return b;
+}
+
+buf_t *bread(blkdev_t *dev, uint64 lba, uint32 size) {
+	assert(dev != NULL);
+	assert(size > 0 && size % 512 == 0);
+
+	mutex_lock(bcache_mutex);
+	stats.lookups++;
+
+	buf_t *b = bcache_lookup(dev, lba, size);
+	if (b != NULL) {
+		stats.hits++;
+		bcache_ref(b);
+		if (b->readahead) {
+			b->readahead = false;
+			stats.readahead_hits++;
+		}
+		mutex_unlock(bcache_mutex);
+	}
+	else {
+		stats.misses++;
+		b = bcache_start_read(dev, lba, size, 1, false);
+	}
+
+	bcache_wait(b);
+	if (!(b->flags & BUF_VALID)) {
+		// The read failed
+		brelse(b);
+		return NULL;
+	}
+
+	return b;
+}
+
+void bcache_prefetch(blkdev_t *dev, uint64 lba, uint32 size, bool readahead) {
+	assert(dev != NULL);
+	assert(size > 0 && size % 512 == 0);
+
+	mutex_lock(bcache_mutex);
+	if (bcache_lookup(dev, lba, size) != NULL) {
+		mutex_unlock(bcache_mutex);
+		return;
+	}
+
+	if (readahead)
+		stats.readahead++;
+	bcache_start_read(dev, lba, size, 0, readahead);
+}
+
+void brelse(buf_t *b) {
+	assert(b != NULL);
+
+	mutex_lock(bcache_mutex);
+	assert(b->refcount > 0);
+	if (--b->refcount == 0) {
+		if (b->flags & BUF_DIRTY) {
+			// Stays on the dirty list; the writeback takes a reference of its own
+		}
+		else if ((b->flags & BUF_VALID) && ilist_linked(&b->hash_node)) {
+			ilist_append(&lru, &b->lru_node);
+			bcache_shrink();
+		}
+		else
+			bcache_free(b);
+	}
+	mutex_unlock(bcache_mutex);
+}
+
+/* Called with the mutex held */
+static void bcache_mark_dirty(buf_t *b) {
+	if (b->flags & BUF_DIRTY)
+		return;
+
+	b->flags |= BUF_DIRTY;
+	b->dirtied = gettickcount();
+	ilist_append(&dirty, &b->dirty_node);
+	stats.dirty_buffers++;
+	stats.dirty_bytes += b->size;
+}
+
+/* Called by the device's worker task when a write finishes */
+static void bcache_write_done(blk_io_t *io) {
+	buf_t *b = (buf_t *)io->private;
+	struct bcache_batch *batch = b->batch;
+
+	mutex_lock(bcache_mutex);
+	b->flags &= ~BUF_WRITING;
+	b->batch = NULL;
+	if (io->error == 0) {
+		stats.written++;
+		stats.written_bytes += b->size;
+	}
+	else {
+		// Keep the data, and try again later
+		stats.write_errors++;
+		bcache_mark_dirty(b);
+	}
+	mutex_unlock(bcache_mutex);
+
+	{
+		INTERRUPT_LOCK;
+		if (io->error != 0)
+			batch->error = io->error;
+		batch->pending--;
+		writes_in_flight--;
+		// The batch may go away as soon as the submitter wakes up
+		wait_queue_wake(&batch->wq);
+		wait_queue_wake(&writeback_wq);
+		INTERRUPT_UNLOCK;
+	}
+
+	// Drop the reference held by the write
+	brelse(b);
+}
+
+/* Whether /a/ should be written before /b/ */
+static bool bcache_before(buf_t *a, buf_t *b) {
+	if (a->dev != b->dev)
+		return (uint32)a->dev < (uint32)b->dev;
+	return a->lba < b->lba;
+}
+
+/*
+ * Writes back dirty buffers, and waits for the writes to finish. Returns 0 or -errno.
+ * With /all/ set, that's every dirty buffer of /dev/ that overlaps /sectors/ sectors at /lba/,
+ * or every dirty buffer, if /dev/ is NULL. Otherwise (for background writeback), it's those that
+ * have expired, plus the oldest ones while there's more dirty data than the background threshold.
+ * Buffers that are already being written are skipped.
+ */
+static int bcache_writeback(blkdev_t *dev, uint64 lba, uint64 sectors, bool all) {
+	struct bcache_batch batch;
+	memset(&batch, 0, sizeof(batch));
+
+	mutex_lock(bcache_mutex);
+	if (stats.dirty_buffers == 0) {
+		mutex_unlock(bcache_mutex);
+		return 0;
+	}
+
+	buf_t **bufs = kmalloc(stats.dirty_buffers * sizeof(buf_t *));
+	uint32 n = 0;
+	uint32 now = gettickcount();
+	ilist_foreach_safe(&dirty, it, tmp) {
+		buf_t *b = dirty_entry(it);
+		if (!all && (sint32)(now - b->dirtied) < BCACHE_DIRTY_EXPIRE_MS / TIMER_MS && stats.dirty_bytes <= bcache_dirty_background())
+			break; // the rest are younger still
+		if (b->flags & BUF_WRITING)
+			continue;
+		if (dev != NULL && (b->dev != dev || b->lba >= lba + sectors || lba >= b->lba + b->size / 512))
+			continue;
+
+		// Unreferenced dirty buffers are on no list but this one, so there's no LRU entry to remove
+		ilist_remove(&dirty, &b->dirty_node);
+		b->flags = (b->flags & ~BUF_DIRTY) | BUF_WRITING;
+		b->refcount++;
+		b->batch = &batch;
+		stats.dirty_buffers--;
+		stats.dirty_bytes -= b->size;
+		bufs[n++] = b;
+	}
+	mutex_unlock(bcache_mutex);
+
+	if (n == 0) {
+		kfree(bufs);
+		return 0;
+	}
+
+	// Submit them in LBA order, so that adjacent buffers end up merged into one request
+	for (uint32 i = 1; i < n; i++) {
+		buf_t *tmp = bufs[i];
+		uint32 j = i;
+		for (; j > 0 && bcache_before(tmp, bufs[j - 1]); j--)
+			bufs[j] = bufs[j - 1];
+		bufs[j] = tmp;
+	}
+
+	{
+		// Set up front, since writes may finish before they've all been submitted
+		INTERRUPT_LOCK;
+		batch.pending = n;
+		writes_in_flight += n;
+		INTERRUPT_UNLOCK;
+	}
+
+	uint32 start = gettickcount();
+	for (uint32 i = 0; i < n; i++) {
+		buf_t *b = bufs[i];
+		b->io.lba = b->lba;
+		b->io.sectors = b->size / 512;
+		b->io.buffer = b->data;
+		b->io.write = true;
+		b->io.callback = bcache_write_done;
+		b->io.private = b;
+		blk_submit(b->dev, &b->io);
+	}
+	kfree(bufs);
+
+	{
+		INTERRUPT_LOCK;
+		while (batch.pending > 0)
+			wait_queue_sleep(&batch.wq);
+		INTERRUPT_UNLOCK;
+	}
+
+	mutex_lock(bcache_mutex);
+	stats.writeback_ms += (gettickcount() - start) * TIMER_MS;
+	mutex_unlock(bcache_mutex);
+
+	return batch.error;
+}
+
+/* Writes back every dirty buffer in the given range (see bcache_writeback), including those
+ * that were being written when we started, and have been dirtied again since */
+static int bcache_writeback_all(blkdev_t *dev, uint64 lba, uint64 sectors) {
+	int err = bcache_writeback(dev, lba, sectors, true);
+
+	{
+		INTERRUPT_LOCK;
+		while (writes_in_flight > 0)
+			wait_queue_sleep(&writeback_wq);
+		INTERRUPT_UNLOCK;
+	}
+
+	int err2 = bcache_writeback(dev, lba, sectors, true);
+	return (err != 0) ? err : err2;
+}
+
+/* Called after dirtying a buffer. With too much dirty data, the caller does some writeback
+ * itself, which also keeps it from dirtying more buffers faster than the disk can keep up. */
+static void bcache_balance_dirty(void) {
+	uint32 dirty_bytes = stats.dirty_bytes;
+	if (dirty_bytes > bcache_dirty_max())
+		bcache_writeback(NULL, 0, 0, false);
+	else if (dirty_bytes > bcache_dirty_background())
+		wait_queue_wake(&flusher_wq);
+}
+
+void bdirty(buf_t *b) {
+	assert(b != NULL);
+
+	mutex_lock(bcache_mutex);
+	assert(b->refcount > 0);
+	assert(b->flags & BUF_VALID);
+	bcache_mark_dirty(b);
+	mutex_unlock(bcache_mutex);
+
+	bcache_balance_dirty();
+}
+
+int bcache_write(blkdev_t *dev, uint64 lba, const void *data, uint32 size) {
+	assert(dev != NULL);
+	assert(data != NULL);
+	assert(size > 0 && size % 512 == 0);
+
+	// Buffers that overlap this one, but start elsewhere or have another size, would go stale
+	bcache_invalidate(dev, lba, size / 512);
+
+	mutex_lock(bcache_mutex);
+	buf_t *b = bcache_lookup(dev, lba, size);
+	if (b != NULL) {
+		// Someone read it in since; wait for that read, then overwrite the data
+		bcache_ref(b);
+		mutex_unlock(bcache_mutex);
+		bcache_wait(b);
+	}
+	else {
+		b = bcache_alloc(dev, lba, size, 1);
+		mutex_unlock(bcache_mutex);
+	}
+
+	memcpy(b->data, data, size);
+	bcache_unbusy(b, true);
+
+	mutex_lock(bcache_mutex);
+	bcache_mark_dirty(b);
+	mutex_unlock(bcache_mutex);
+
+	brelse(b);
+	bcache_balance_dirty();
+
+	return 0;
+}
+
+int bcache_sync(blkdev_t *dev) {
+	int err = bcache_writeback_all(dev, 0, (uint64)-1);
+
+	int flush_err = (dev != NULL) ? blk_flush(dev) : blk_flush_all();
+	if (err == 0)
+		err = flush_err;
+
+	mutex_lock(bcache_mutex);
+	stats.syncs++;
+	mutex_unlock(bcache_mutex);
+
+	return err;
+}
+
+void bcache_invalidate(blkdev_t *dev, uint64 lba, uint32 sectors) {
+	if (bcache_mutex == NULL)
+		return;
+
+	// Dirty data in the range would otherwise be written on top of the caller's, later on
+	bcache_writeback_all(dev, lba, sectors);
+
+	mutex_lock(bcache_mutex);
+	for (int i = 0; i < BCACHE_HASH_SIZE; i++) {
+		ilist_foreach_safe(&hash[i], it, tmp) {
+			buf_t *b = hash_entry(it);
+			if (b->dev != dev || b->lba >= lba + sectors || lba >= b->lba + b->size / 512)
+				continue;
+
+			// Buffers still in use (or dirtied again) are freed by brelse(), now that they're unhashed
+			ilist_remove(&hash[i], &b->hash_node);
+			if (b->refcount == 0 && !(b->flags & BUF_DIRTY))
+				bcache_free(b);
+			stats.invalidations++;
+		}
+	}
+	mutex_unlock(bcache_mutex);
+}
+
+/* The flusher task: writes back expired buffers every so often, and more when there's a lot of dirty data */
+static void bcache_flusher(void *data, uint32 length) {
+	while (true) {
+		{
+			INTERRUPT_LOCK;
+			wait_queue_sleep_timeout(&flusher_wq, BCACHE_FLUSH_INTERVAL_MS);
+			INTERRUPT_UNLOCK;
+		}
+
+		bcache_writeback(NULL, 0, 0, false);
+	}
+}
+
+void bcache_set_limit(uint32 bytes) {
+	mutex_lock(bcache_mutex);
+	stats.limit = bytes;
+	bcache_shrink();
+	mutex_unlock(bcache_mutex);
+
+	bcache_balance_dirty();
+}
+
+void bcache_get_stats(struct bcache_stats *st) {
+	mutex_lock(bcache_mutex);
+	memcpy(st, &stats, sizeof(struct bcache_stats));
+	mutex_unlock(bcache_mutex);
+}
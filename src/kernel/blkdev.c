@@ -0,0 +1,346 @@
+#include <kernel/blkdev.h>
+#include <kernel/bcache.h>
+#include <kernel/task.h>
+#include <kernel/heap.h>
+#include <kernel/kernutil.h>
+#include <kernel/console.h>
+#include <kernel/timer.h>
+#include <kernel/interrupts.h>
+#include <string.h>
+
+#define sorted_entry(node) ilist_entry(node, blk_request_t, sorted_node)
+#define fifo_entry(node) ilist_entry(node, blk_request_t, fifo_node)
+#define active_entry(node) fifo_entry(node)
+#define done_entry(node) sorted_entry(node)
+
+static void blk_worker(void *data, uint32 length);
+
+ilist_t blkdevs = ILIST_INIT(blkdevs); /* all registered devices; never removed from */
+
+void blkdev_register(blkdev_t *dev) {
+	assert(dev != NULL);
+	assert(dev->ops != NULL && (dev->ops->transfer != NULL || dev->ops->submit != NULL));
+	assert(dev->size > 0);
+	assert(dev->max_sectors > 0);
+
+	if (dev->queue_depth == 0 || dev->ops->submit == NULL)
+		dev->queue_depth = 1;
+
+	ilist_init(&dev->sorted);
+	ilist_init(&dev->fifo[0]);
+	ilist_init(&dev->fifo[1]);
+	ilist_init(&dev->active);
+	ilist_init(&dev->done);
+	dev->in_flight = 0;
+	dev->next_lba = 0;
+	dev->next_seq = 0;
+	dev->worker_wq.head = NULL;
+	dev->stat_ios = dev->stat_merges = dev->stat_requests = dev->stat_expired = 0;
+
+	dev->worker = create_task(blk_worker, dev->name, &kernel_console, dev, sizeof(blkdev_t));
+	ilist_append(&blkdevs, &dev->node);
+}
+
+/* Whether an I/O of the given range must not be reordered with /req/ */
+static bool blk_conflicts(blk_request_t *req, uint64 lba, uint32 sectors, bool write) {
+	if (!write && !req->write)
+		return false;
+	return (lba < req->lba + req->sectors && req->lba < lba + sectors);
+}
+
+static void blk_insert_sorted(blkdev_t *dev, blk_request_t *req) {
+	ilist_node_t *pos = &dev->sorted.head;
+	ilist_foreach(&dev->sorted, it) {
+		if (sorted_entry(it)->lba > req->lba)
+			break;
+		pos = it;
+	}
+	ilist_insert_after(&dev->sorted, pos, &req->sorted_node);
+}
+
+/*
+ * Adds /io/ to a queued request that ends where it begins, or begins where it ends.
+ * I/O that conflicts with anything queued is never merged, since the merged request
+ * would take the place (in submission order) of the older one.
+ */
+static bool blk_try_merge(blkdev_t *dev, blk_io_t *io) {
+	blk_request_t *target = NULL;
+	bool front = false;
+
+	ilist_foreach(&dev->sorted, it) {
+		blk_request_t *req = sorted_entry(it);
+		if (blk_conflicts(req, io->lba, io->sectors, io->write))
+			return false;
+		if (target != NULL || req->write != io->write || req->sectors + io->sectors > dev->max_sectors)
+			continue;
+
+		if (req->lba + req->sectors == io->lba)
+			target = req;
+		else if (io->lba + io->sectors == req->lba) {
+			target = req;
+			front = true;
+		}
+	}
+
+	if (target == NULL)
+		return false;
+
+	if (front) {
+		io->next = target->ios;
+		target->ios = io;
+		target->lba = io->lba;
+		// Overlapping reads may now sort after it; put it back in its place
+		ilist_remove(&dev->sorted, &target->sorted_node);
+		blk_insert_sorted(dev, target);
+	}
+	else {
+		target->last_io->next = io;
+		target->last_io = io;
+	}
+	target->sectors += io->sectors;
+	dev->stat_merges++;
+
+	return true;
+}
+
+void blk_submit(blkdev_t *dev, blk_io_t *io) {
+	assert(dev != NULL && dev->worker != NULL);
+	assert(io != NULL);
+	assert(io->buffer != NULL);
+	assert(io->sectors > 0);
+	assert(io->lba + io->sectors <= dev->size);
+
+	io->error = 0;
+	io->done = false;
+	io->wq.head = NULL;
+	io->next = NULL;
+
+	// Allocated up front, rather than with interrupts disabled; freed below if it isn't needed
+	blk_request_t *req = kmalloc(sizeof(blk_request_t));
+
+	{
+		INTERRUPT_LOCK;
+		dev->stat_ios++;
+		if (!blk_try_merge(dev, io)) {
+			memset(req, 0, sizeof(blk_request_t));
+			req->lba = io->lba;
+			req->sectors = io->sectors;
+			req->write = io->write;
+			req->ios = req->last_io = io;
+			req->seq = dev->next_seq++;
+			req->deadline = gettickcount() + (io->write ? BLK_WRITE_EXPIRE_MS : BLK_READ_EXPIRE_MS) / TIMER_MS;
+			blk_insert_sorted(dev, req);
+			ilist_append(&dev->fifo[req->write], &req->fifo_node);
+			req = NULL;
+		}
+		wait_queue_wake(&dev->worker_wq);
+		INTERRUPT_UNLOCK;
+	}
+
+	if (req != NULL)
+		kfree(req);
+}
+
+int blk_wait(blk_io_t *io) {
+	assert(io->callback == NULL);
+
+	INTERRUPT_LOCK;
+	while (!io->done)
+		wait_queue_sleep(&io->wq);
+	INTERRUPT_UNLOCK;
+
+	return io->error;
+}
+
+int blk_rw(blkdev_t *dev, uint64 lba, void *buffer, uint32 sectors, bool write) {
+	blk_io_t io;
+	memset(&io, 0, sizeof(io));
+	io.lba = lba;
+	io.sectors = sectors;
+	io.buffer = buffer;
+	io.write = write;
+
+	blk_submit(dev, &io);
+	return blk_wait(&io);
+}
+
+int blk_flush(blkdev_t *dev) {
+	assert(dev != NULL);
+	if (dev->ops->flush == NULL)
+		return 0;
+
+	return dev->ops->flush(dev);
+}
+
+int blk_flush_all(void) {
+	int err = 0;
+	ilist_foreach(&blkdevs, it) {
+		int r = blk_flush(ilist_entry(it, blkdev_t, node));
+		if (err == 0)
+			err = r;
+	}
+
+	return err;
+}
+
+bool disk_read(blkdev_t *dev, uint64 start_lba, uint32 bytes, void *buffer) {
+	uint32 sectors = bytes/512;
+	if (bytes % 512)
+		sectors++;
+
+	// TODO: read the last sector to a local buffer and copy the data over,
+	// such that we never write more than /bytes/ bytes to the buffer.
+
+	assert(dev != NULL);
+	assert(start_lba + sectors <= dev->size - 1); /* TODO: OBOE? */
+
+	return blk_rw(dev, start_lba, buffer, sectors, false) == 0;
+}
+
+bool disk_write(blkdev_t *dev, uint64 start_lba, uint32 bytes, void *buffer) {
+	uint32 sectors = bytes/512;
+	if (bytes % 512)
+		sectors++;
+
+	assert(dev != NULL);
+	assert(start_lba + sectors <= dev->size - 1); /* TODO: OBOE? */
+
+	return bcache_write(dev, start_lba, buffer, sectors * 512) == 0;
+}
+
+/* The oldest queued request that /req/ may not pass, if any */
+static blk_request_t *blk_earlier_conflict(blkdev_t *dev, blk_request_t *req) {
+	ilist_foreach(&dev->sorted, it) {
+		blk_request_t *r = sorted_entry(it);
+		if (r != req && (sint32)(r->seq - req->seq) < 0 && blk_conflicts(r, req->lba, req->sectors, req->write))
+			return r;
+	}
+
+	return NULL;
+}
+
+/* Whether /req/ must wait for a request that is in flight; the driver may complete those in any order */
+static bool blk_active_conflict(blkdev_t *dev, blk_request_t *req) {
+	ilist_foreach(&dev->active, it) {
+		if (blk_conflicts(active_entry(it), req->lba, req->sectors, req->write))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Picks the next request to carry out, takes it off the queue and marks it as in flight.
+ * Returns NULL if there's nothing to do, if the driver is busy, or if the request must wait
+ * for one that's in flight. Called with interrupts disabled.
+ */
+static blk_request_t *blk_next_request(blkdev_t *dev) {
+	if (ilist_empty(&dev->sorted) || dev->in_flight >= dev->queue_depth)
+		return NULL;
+
+	blk_request_t *req = NULL;
+	bool expired = false;
+
+	// Expired requests first; reads before writes, since someone is usually waiting for them
+	uint32 now = gettickcount();
+	for (int w = 0; w <= 1 && req == NULL; w++) {
+		ilist_node_t *oldest = ilist_first(&dev->fifo[w]);
+		if (oldest != NULL && (sint32)(now - fifo_entry(oldest)->deadline) >= 0) {
+			req = fifo_entry(oldest);
+			expired = true;
+		}
+	}
+
+	// Otherwise, continue upwards from the last request, or start over from the lowest LBA
+	if (req == NULL) {
+		ilist_foreach(&dev->sorted, it) {
+			if (sorted_entry(it)->lba >= dev->next_lba) {
+				req = sorted_entry(it);
+				break;
+			}
+		}
+		if (req == NULL)
+			req = sorted_entry(ilist_first(&dev->sorted));
+	}
+
+	blk_request_t *earlier;
+	while ((earlier = blk_earlier_conflict(dev, req)) != NULL)
+		req = earlier;
+
+	if (blk_active_conflict(dev, req))
+		return NULL;
+
+	ilist_remove(&dev->sorted, &req->sorted_node);
+	ilist_remove(&dev->fifo[req->write], &req->fifo_node);
+	ilist_append(&dev->active, &req->fifo_node);
+	dev->in_flight++;
+	dev->next_lba = req->lba + req->sectors;
+	dev->stat_requests++;
+	if (expired)
+		dev->stat_expired++;
+
+	return req;
+}
+
+void blk_end_request(blkdev_t *dev, blk_request_t *req, int error) {
+	INTERRUPT_LOCK;
+	assert(dev->in_flight > 0);
+	req->error = error;
+	ilist_remove(&dev->active, &req->fifo_node);
+	dev->in_flight--;
+	ilist_append(&dev->done, &req->sorted_node);
+	wait_queue_wake(&dev->worker_wq);
+	INTERRUPT_UNLOCK;
+}
+
+static void blk_complete(blk_request_t *req, int error) {
+	blk_io_t *next;
+	for (blk_io_t *io = req->ios; io != NULL; io = next) {
+		// Read this first: the I/O may be freed as soon as it's marked done
+		next = io->next;
+		io->error = error;
+
+		if (io->callback != NULL)
+			io->callback(io);
+		else {
+			INTERRUPT_LOCK;
+			io->done = true;
+			wait_queue_wake(&io->wq);
+			INTERRUPT_UNLOCK;
+		}
+	}
+
+	kfree(req);
+}
+
+static void blk_worker(void *data, uint32 length) {
+	blkdev_t *dev = (blkdev_t *)data;
+
+	while (true) {
+		blk_request_t *req = NULL;
+		bool finished = false;
+		{
+			// Completed requests are finished first, so that their callers don't wait behind new ones
+			INTERRUPT_LOCK;
+			while (ilist_empty(&dev->done) && (req = blk_next_request(dev)) == NULL)
+				wait_queue_sleep(&dev->worker_wq);
+			if (req == NULL) {
+				req = done_entry(ilist_first(&dev->done));
+				ilist_remove(&dev->done, &req->sorted_node);
+				finished = true;
+			}
+			INTERRUPT_UNLOCK;
+		}
+
+		if (finished) {
+			if (req->error != 0)
+				printk("%s: %s of %u sectors at LBA %u failed (%d)\n", dev->name, req->write ? "write" : "read",
+						req->sectors, (uint32)req->lba, req->error);
+			blk_complete(req, req->error);
+		}
+		else if (dev->ops->submit != NULL)
+			dev->ops->submit(dev, req);
+		else
+			blk_end_request(dev, req, dev->ops->transfer(dev, req));
+	}
+}
@@ -594,7 +594,7 @@ size_t printc(int back_color, int text_color, const char *fmt, ...) {
 	int i;
 
 	va_start(args, fmt);
-	i = vsprintf(_printk_buf, fmt, args);
+	i = vsnprintf(_printk_buf, sizeof(_printk_buf), fmt, args);
 	va_end(args);
 
 	if (i > 0) {
@@ -620,7 +620,7 @@ size_t printk(const char *fmt, ...) {
 	//mutex_lock(printk_mutex);
 
 	va_start(args, fmt);
-	i = vsprintf(_printk_buf, fmt, args);
+	i = vsnprintf(_printk_buf, sizeof(_printk_buf), fmt, args);
 	va_end(args);
 
 	if (i > 0) {
@@ -647,3 +647,15 @@ int sprintf(char *sprintf_buf, const char *fmt, ...)
 
 	return i;
 }
+
+int snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list args;
+	int i;
+
+	va_start(args, fmt);
+	i = vsnprintf(buf, size, fmt, args);
+	va_end(args);
+
+	return i;
+}
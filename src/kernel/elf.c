@@ -7,17 +7,21 @@
 #include <string.h>
 #include <kernel/vmm.h>
 #include <sys/errno.h>
+#include <sys/spawn.h>
 #include <kernel/backtrace.h>
 
 //#define ELF_DEBUG
 
 // Kernel symbols are stored here; userspace symbols are linked in
 // their task structs, so access them via current_task.
-// This is a pointer to an array of structs; the last entry contains eip=0 and name=NULL,
-// so it's safe to loop until that one is encountered. The same goes for the one in current_task.
-struct symbol *kernel_syms = NULL;
+// Both are sorted by address; see addr_to_func() in backtrace.c.
+struct symtab kernel_symtab = { .refcount = 1 };
 
-int load_symbols(Elf32_Sym *symhdr, const char *sym_string_table, struct symbol **syms, uint32 num_syms);
+// All loaded user symbol tables, so that tasks running the same executable can share one.
+// Protected by disabling interrupts.
+static ilist_t symtabs = ILIST_INIT(symtabs);
+
+static void load_symbols(Elf32_Sym *symhdr, const char *sym_string_table, uint32 num_syms, struct symtab *tab);
 
 void load_kernel_symbols(void *addr, uint32 num, uint32 size, uint32 shndx) {
 	// These cryptic parameters are given to us by GRUB/multiboot.
@@ -74,54 +78,182 @@ void load_kernel_symbols(void *addr, uint32 num, uint32 size, uint32 shndx) {
 #endif
 	}
 
-	if (load_symbols(symhdr, sym_string_table, &kernel_syms, num_syms) != 0)
-		panic("unable to load kernel symbols");
+	// The kernel's string table stays where GRUB put it, so there's no need to copy it
+	load_symbols(symhdr, sym_string_table, num_syms, &kernel_symtab);
 }
 
-int load_symbols(Elf32_Sym *symhdr, const char *sym_string_table, struct symbol **syms, uint32 num_syms) {
-	assert(syms != NULL);
+static inline bool symbol_before(const struct symbol *a, const struct symbol *b) {
+	return a->eip < b->eip;
+}
 
-	struct symbol *old_syms = *syms;
-	*syms = kmalloc(sizeof(struct symbol) * (num_syms + 1));
-	assert(*syms != NULL);
-	memset(*syms, 0, sizeof(struct symbol) * (num_syms + 1));
+static void sift_down(struct symbol *syms, uint32 root, uint32 num) {
+	struct symbol tmp = syms[root];
+	uint32 child;
+	while ((child = 2 * root + 1) < num) {
+		if (child + 1 < num && symbol_before(&syms[child], &syms[child + 1]))
+			child++;
+		if (!symbol_before(&tmp, &syms[child]))
+			break;
+		syms[root] = syms[child];
+		root = child;
+	}
+	syms[root] = tmp;
+}
 
-	struct symbol *symp = *syms;
+// Heapsort by address; in place, and O(n log n) even for already sorted input (which is common)
+static void sort_symbols(struct symbol *syms, uint32 num) {
+	if (num < 2)
+		return;
+	for (uint32 i = num / 2; i > 0; i--)
+		sift_down(syms, i - 1, num);
+	for (uint32 end = num - 1; end > 0; end--) {
+		struct symbol tmp = syms[0];
+		syms[0] = syms[end];
+		syms[end] = tmp;
+		sift_down(syms, 0, end);
+	}
+}
 
-	for (uint32 i = 1; i <= num_syms; i++) {
-		symhdr++;
+// Builds a sorted table of the function symbols in symhdr[1 ... num_syms - 1].
+static void load_symbols(Elf32_Sym *symhdr, const char *sym_string_table, uint32 num_syms, struct symtab *tab) {
+	assert(tab != NULL);
+	assert(tab->syms == NULL);
+
+	// Count the functions first, so that we don't allocate space for the (many) other symbols
+	uint32 num_funcs = 0;
+	for (uint32 i = 1; i < num_syms; i++) {
+		if (ELF32_ST_TYPE(symhdr[i].st_info) == STT_FUNC && symhdr[i].st_value != 0)
+			num_funcs++;
+	}
 
-		if (ELF32_ST_TYPE(symhdr->st_info) != STT_FUNC)
+	tab->num = 0;
+	if (num_funcs == 0)
+		return;
+
+	tab->syms = kmalloc(sizeof(struct symbol) * num_funcs);
+	struct symbol *symp = tab->syms;
+
+	for (uint32 i = 1; i < num_syms; i++) {
+		Elf32_Sym *s = &symhdr[i];
+		if (ELF32_ST_TYPE(s->st_info) != STT_FUNC || s->st_value == 0)
 			continue;
 
 		const char *name;
-		if (symhdr->st_name != 0) {
+		if (s->st_name != 0) {
 			// Note: ensure that this sym_string_table is stored such that
 			// it remains valid to read long after elf_load etc. has finished!
 			// For the kernel, this happense automatically, as the entire binary
 			// is loaded into RAM and never moved.
 			// For userspace, the ELF loader duplicates the string table
-			// and stores t as a malloc'ed member of struct task.
-			name = (char *)&sym_string_table[symhdr->st_name];
+			// and stores it in the (shared) struct symtab.
+			name = (char *)&sym_string_table[s->st_name];
 		}
 		else
 			name = "N/A";
 #if ELF_DEBUG
-		printk("%03d 0x%08x %s\n", i, (uint32)symhdr->st_value, name);
+		printk("%03d 0x%08x %s\n", i, (uint32)s->st_value, name);
 #endif
 
-		symp->eip = symhdr->st_value;
+		symp->eip = s->st_value;
+		symp->size = s->st_size;
 		symp->name = name;
 		symp++;
 	}
-	assert(symp && symp->eip == 0 && symp->name == NULL);
+	assert(symp == tab->syms + num_funcs);
 
-	if (old_syms) {
-		// Happens during execve
-		kfree(old_syms);
+	sort_symbols(tab->syms, num_funcs);
+
+	// Functions written in assembly usually don't have a size; assume they extend to the next symbol
+	for (uint32 i = 0; i < num_funcs; i++) {
+		if (tab->syms[i].size == 0 && i + 1 < num_funcs)
+			tab->syms[i].size = tab->syms[i + 1].eip - tab->syms[i].eip;
 	}
 
-	return 0;
+	tab->num = num_funcs;
+}
+
+// Returns the symbol table for an ELF file (already read into data), with a new reference.
+// If another task is running the same file, its table is reused rather than loaded again.
+// Returns NULL if the file has no symbols.
+static struct symtab *symtab_load(const struct stat *st, unsigned char *data) {
+	assert(interrupts_enabled() == false);
+
+	ilist_foreach(&symtabs, it) {
+		struct symtab *tab = ilist_entry(it, struct symtab, link);
+		if (tab->dev == (uint32)st->st_dev && tab->ino == (uint32)st->st_ino &&
+			tab->mtime == (uint32)st->st_mtime && tab->file_size == (uint32)st->st_size)
+		{
+			return symtab_get(tab);
+		}
+	}
+
+	elf_header_t *header = (elf_header_t *)data;
+	Elf32_Sym *symhdr = NULL;
+	uint32 num_syms = 0;
+	const char *sym_string_table = NULL;
+	uint32 string_table_size = 0;
+
+	for (uint32 i=1; i < header->e_shnum; i++) { // skip #0, which is always empty
+		Elf32_Shdr *shdr = (Elf32_Shdr *)((uint32)data + header->e_shoff + (header->e_shentsize * i));
+
+		if (shdr->sh_type == SHT_SYMTAB) {
+			symhdr = (Elf32_Sym *)(data + shdr->sh_offset);
+			num_syms = shdr->sh_size / shdr->sh_entsize;
+			Elf32_Shdr *string_table_hdr = (Elf32_Shdr *)((uint32)data + header->e_shoff + shdr->sh_link * header->e_shentsize);
+			string_table_size = string_table_hdr->sh_size;
+			sym_string_table = (char *)(data + string_table_hdr->sh_offset);
+			break;
+		}
+	}
+
+	if (!symhdr || !sym_string_table || num_syms < 2)
+		return NULL;
+
+	struct symtab *tab = kmalloc(sizeof(struct symtab));
+	memset(tab, 0, sizeof(struct symtab));
+
+	// Clone the string table. Because load_symbols doesn't strdup() names
+	// for performance reasons, we need the string table to keep existing
+	// for as long as the symbol table does.
+	tab->strtab = kmalloc(string_table_size);
+	tab->strtab_size = string_table_size;
+	memcpy(tab->strtab, sym_string_table, string_table_size);
+
+	load_symbols(symhdr, tab->strtab, num_syms, tab);
+
+	tab->dev = st->st_dev;
+	tab->ino = st->st_ino;
+	tab->mtime = st->st_mtime;
+	tab->file_size = st->st_size;
+	tab->refcount = 1;
+	ilist_append(&symtabs, &tab->link);
+
+	return tab;
+}
+
+struct symtab *symtab_get(struct symtab *tab) {
+	assert(tab != NULL);
+	INTERRUPT_LOCK;
+	assert(tab->refcount > 0);
+	tab->refcount++;
+	INTERRUPT_UNLOCK;
+	return tab;
+}
+
+void symtab_put(struct symtab *tab) {
+	assert(tab != NULL);
+	assert(tab != &kernel_symtab);
+
+	INTERRUPT_LOCK;
+	assert(tab->refcount > 0);
+	if (--tab->refcount == 0) {
+		ilist_remove(&symtabs, &tab->link);
+		if (tab->syms)
+			kfree(tab->syms);
+		kfree(tab->strtab);
+		kfree(tab);
+	}
+	INTERRUPT_UNLOCK;
 }
 
 // Takes an array of argument (argv or envp) and copies it *FROM THE KERNEL HEAP*
@@ -196,6 +328,12 @@ bool elf_load(const char *path, task_t *task, void *cmdline) {
 	return elf_load_int(path, task, argv, envp) == 0;
 }
 
+// Like elf_load, but with argv/envp already split up; both must be on the kernel heap.
+// They are freed on success; if this returns an error, the caller still owns them.
+int elf_load_argv(const char *path, task_t *task, char *argv[], char *envp[]) {
+	return elf_load_int(path, task, argv, envp);
+}
+
 static int elf_load_int(const char *path, task_t *task, char *argv[], char *envp[]) {
 	// Loads to a fixed address of 0x10000000 for now; not a HUGE deal
 	// since each (user mode) task has its own address space
@@ -375,7 +513,7 @@ static int elf_load_int(const char *path, task_t *task, char *argv[], char *envp
 	// Update the task's name
 	strlcpy((char *)task->name, argv[0], TASK_NAME_LEN);
 
-	if (old_dir != kernel_directory) {
+	if (task == current_task) {
 		// execve, stay with the new dir
 	}
 	else
@@ -429,45 +567,15 @@ static int elf_load_int(const char *path, task_t *task, char *argv[], char *envp
 	}
 #endif // ELF_DEBUG
 
-	// Try to find symbols, so we can get nice backtrace displays
-	Elf32_Sym *symhdr = NULL;
-	uint32 num_syms = 0;
-	const char *sym_string_table = NULL;
-	uint32 string_table_size = 0;
-
-	for (uint32 i=1; i < header->e_shnum; i++) { // skip #0, which is always empty
-		Elf32_Shdr *shdr = (Elf32_Shdr *)((uint32)data + header->e_shoff + (header->e_shentsize * i));
-
-		if (shdr->sh_type == SHT_SYMTAB) {
-			symhdr = (Elf32_Sym *)(data + shdr->sh_offset);
-			num_syms = shdr->sh_size / shdr->sh_entsize;
-			Elf32_Shdr *string_table_hdr = (Elf32_Shdr *)((uint32)data + header->e_shoff + shdr->sh_link * header->e_shentsize);
-			string_table_size = string_table_hdr->sh_size;
-			sym_string_table = (char *)(data + string_table_hdr->sh_offset);
-			break;
-		}
-	}
-
-	// Load symbols for this file, so that we can display them in backtraces
-	if (!symhdr || !sym_string_table || num_syms < 1) {
+	// Load symbols for this file, so that we can display them in backtraces.
+	// Other tasks running the same file share the table.
+	struct symtab *old_symtab = task->symtab;
+	task->symtab = symtab_load(&st, data);
+	if (task->symtab == NULL)
 		printk("Warning: failed to load symbols for %s\n", path);
-	}
-	else {
-		// Clone the string table. Because load_symbols doesn't strdup() names
-		// for performance reasons, we need the string table to keep existing
-		// for as long as the task lives.
-		char *old_table = task->symbol_string_table;
-		task->symbol_string_table = kmalloc(string_table_size);
-		task->symbol_string_table_size = string_table_size;
-		memcpy(task->symbol_string_table, sym_string_table, string_table_size);
-
-		if (load_symbols(symhdr, task->symbol_string_table, &task->symbols, num_syms) != 0) {
-			printk("Warning: failed to load symbols for %s\n", path);
-		}
-		else if (old_table) {
-			// execve, so free the old one, or it'll leak
-			kfree(old_table);
-		}
+	if (old_symtab) {
+		// execve
+		symtab_put(old_symtab);
 	}
 
 	// If we're still here: set the program entry point
@@ -495,9 +603,13 @@ int execve(const char *path, char *argv[], char *envp[]) {
 	if (r == 0) {
 		assert(interrupts_enabled() == false);
 		current_task->state = TASK_RUNNING;
-		destroy_user_page_dir(current_task->old_mm->page_directory);
-		vmm_destroy_task_mm(current_task->old_mm);
+
+		// The new image starts out single-threaded; the other threads may still
+		// use the old address space until the reaper gets to them
+		kill_threads((task_t *)current_task);
+		vmm_put_task_mm(current_task->old_mm);
 		current_task->old_mm = NULL;
+		current_task->tls_base = 0;
 
 		current_task->did_execve = true;
 		current_task->esp = (uint32)current_task->stack - 84 + 12;
@@ -522,8 +634,7 @@ int execve(const char *path, char *argv[], char *envp[]) {
 		current_task->mm = current_task->old_mm;
 		switch_page_directory(current_task->mm->page_directory);
 
-		destroy_user_page_dir(new_mm->page_directory);
-		vmm_destroy_task_mm(new_mm);
+		vmm_put_task_mm(new_mm);
 
 		INTERRUPT_UNLOCK;
 		return r;
@@ -532,10 +643,55 @@ int execve(const char *path, char *argv[], char *envp[]) {
 	return 0; // To silence warnings
 }
 
+// Copies a NULL-terminated array of strings (argv or envp) from userspace to the kernel heap,
+// after checking that all memory is valid; both the pointers themselves, and the actual string data they point to.
+// Returns 0 or -EFAULT.
+static int copy_user_string_array(char *uarr[], char ***out) {
+	assert(out != NULL);
+	if (uarr == NULL || !CHECK_ACCESS_READ(uarr, sizeof(char *)))
+		return -EFAULT;
+
+	uint32 count = 0;
+	for (;; count++) {
+		if (!CHECK_ACCESS_READ(&uarr[count], sizeof(char *)))
+			return -EFAULT;
+		if (uarr[count] != NULL && !CHECK_ACCESS_STR(uarr[count]))
+			return -EFAULT;
+		else if (uarr[count] == NULL)
+			break;
+	}
+
+	// OK, it all seems valid. Nice. We now also know the number of entries,
+	// which makes the copying process easier: we can allocate memory up-front
+	// without any risk of wasting memory or needing to realloc().
+	char **karr = kmalloc(sizeof(char *) * (count + 1));
+	memset(karr, 0, sizeof(char *) * (count + 1));
+
+	for (uint32 i = 0; i < count; i++) {
+		uint32 len = user_strlen(uarr[i]) + 1;
+		karr[i] = kmalloc(len);
+		strlcpy(karr[i], uarr[i], len);
+	}
+	assert(karr[count] == NULL);
+
+	*out = karr;
+	return 0;
+}
+
+static void free_string_array(char **arr) {
+	for (uint32 i = 0; arr[i] != NULL; i++)
+		kfree(arr[i]);
+	kfree(arr);
+}
+
 int sys_execve(const char *path, char *argv[], char *envp[]) {
 	if (path == NULL || !CHECK_ACCESS_STR(path))
 		return -EFAULT;
 
+	// The process ID belongs to the main thread, so only it can replace the process image
+	if (current_task->is_thread)
+		return -EBUSY;
+
 	// Newlib calls execve() with invalid paths while attempting to find
 	// the correct one from $PATH; check whether the path exists early on,
 	// so that we don't waste time copying arguments and allocating memory
@@ -544,28 +700,11 @@ int sys_execve(const char *path, char *argv[], char *envp[]) {
 	if (stat(path, &st) != 0)
 		return -ENOENT;
 
-	if (argv == NULL || !CHECK_ACCESS_READ(argv, sizeof(char *)))
-		return -EFAULT;
-	if (envp != NULL && !CHECK_ACCESS_READ(envp, sizeof(char *)))
-		return -EFAULT;
-
 	// Unfortunately for us, all the arguments are stored in userspace.
 	// That would be fine, if not for the fact that we are about to free
 	// all that memory, in preparation for replacing this task!
 	// We copy it to the kernel heap temporarily, and if that works out,
 	// call execve() which requires kernelspace arguments.
-	uint32 argc = 0, envc = 0;
-
-	// First, check that all memory is valid; both the pointers themselves,
-	// and the actual string data they point to.
-	for (;; argc++) {
-		if (!CHECK_ACCESS_READ(&argv[argc], sizeof(char *)))
-			return -EFAULT;
-		if (argv[argc] != NULL && !CHECK_ACCESS_STR(argv[argc]))
-			return -EFAULT;
-		else if (argv[argc] == NULL)
-			break;
-	}
 
 	// If the caller (the user, prior to the Newlib glue) passes env == NULL,
 	// syscalls.c will provide us with "environ" to copy, instead.
@@ -574,37 +713,15 @@ int sys_execve(const char *path, char *argv[], char *envp[]) {
 	// 2) The user explicitly bypasses Newlib and uses the syscall,
 	//    in which case he'll have to take care of this.
 	assert(envp != NULL);
-	for (;; envc++) {
-		if (!CHECK_ACCESS_READ(&envp[envc], sizeof(char *)))
-			return -EFAULT;
-		if (envp[envc] != NULL && !CHECK_ACCESS_STR(envp[envc]))
-			return -EFAULT;
-		else if (envp[envc] == NULL)
-			break;
-	}
 
-	// OK, it all seems valid. Nice. We now also know the number of entries
-	// in each array, which makes the copying process easier: we can allocate
-	// memory up-front without any risk of wasting memory or needing to realloc().
-	char **kargv = kmalloc(sizeof(char *) * (argc + 1));
-	memset(kargv, 0, sizeof(char *) * (argc + 1));
-
-	for (uint32 i = 0; i < argc; i++) {
-		uint32 len = user_strlen(argv[i]) + 1;
-		kargv[i] = kmalloc(len);
-		strlcpy(kargv[i], argv[i], len);
-	}
-	assert(kargv[argc] == NULL);
-
-	char **kenvp = kmalloc(sizeof(char *) * (envc + 1));
-	memset(kenvp, 0, sizeof(char *) * (envc + 1));
-
-	for (uint32 i = 0; i < envc; i++) {
-		uint32 len = user_strlen(envp[i]) + 1;
-		kenvp[i] = kmalloc(len);
-		strlcpy(kenvp[i], envp[i], len);
+	char **kargv = NULL, **kenvp = NULL;
+	int err;
+	if ((err = copy_user_string_array(argv, &kargv)) != 0)
+		return err;
+	if ((err = copy_user_string_array(envp, &kenvp)) != 0) {
+		free_string_array(kargv);
+		return err;
 	}
-	assert(kenvp[envc] == NULL);
 
 	// And, finally, copy the path.
 	size_t len = strlen(path);
@@ -619,3 +736,42 @@ int sys_execve(const char *path, char *argv[], char *envp[]) {
 	printk("WARNING: execve failed with return value %d\n", r);
 	return r;
 }
+
+int sys_spawn(const char *path, char *argv[], char *envp[], const struct spawn_action *actions, int num_actions) {
+	if (path == NULL || !CHECK_ACCESS_STR(path))
+		return -EFAULT;
+	if (num_actions < 0 || num_actions > SPAWN_MAX_ACTIONS)
+		return -EINVAL;
+	if (num_actions > 0 && (actions == NULL || !CHECK_ACCESS_READ(actions, num_actions * sizeof(struct spawn_action))))
+		return -EFAULT;
+
+	// As in sys_execve, fail early if the file doesn't exist; posix_spawnp tries every $PATH entry
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return -ENOENT;
+
+	assert(envp != NULL); // see sys_execve
+
+	char **kargv = NULL, **kenvp = NULL;
+	int err;
+	if ((err = copy_user_string_array(argv, &kargv)) != 0)
+		return err;
+	if ((err = copy_user_string_array(envp, &kenvp)) != 0) {
+		free_string_array(kargv);
+		return err;
+	}
+
+	struct spawn_action kactions[SPAWN_MAX_ACTIONS];
+	if (num_actions > 0)
+		memcpy(kactions, actions, num_actions * sizeof(struct spawn_action));
+
+	size_t len = strlen(path);
+	char *kpath = kmalloc(len + 1);
+	strlcpy(kpath, path, len + 1);
+
+	// kargv and kenvp are freed by spawn(), whether it succeeds or not
+	int r = spawn(kpath, kargv, kenvp, kactions, num_actions);
+	kfree(kpath);
+
+	return r;
+}
@@ -13,6 +13,7 @@
 #include <kernel/pmm.h>
 #include <kernel/time.h>
 #include <kernel/backtrace.h>
+#include <kernel/bcache.h>
 
 list_t *ext2_partitions = NULL;
 
@@ -30,6 +31,7 @@ static int ext2_open(uint32 dev, const char *path, int mode);
 static int ext2_read(int fd, void *buf, size_t length);
 static int ext2_close(int fd, struct open_file *file);
 static int ext2_fstat(int fd, struct stat *buf);
+static int ext2_fsync(int fd);
 static int ext2_getdents(int fd, void *dp, int count);
 static int ext2_stat(mountpoint_t *mp, const char *path, struct stat *st);
 static int ext2_lstat(mountpoint_t *mp, const char *path, struct stat *st);
@@ -65,7 +67,7 @@ struct inode_ret {
 
 static int ext2_stat_inode(ext2_partition_t *part, mountpoint_t *mp, struct stat *st, uint32 inode_num);
 
-char *ext2_read_file(ext2_partition_t *part, uint32 inode_num, uint32 *size); // read an ENTIRE FILE and return a malloc'ed buffer with it
+char *ext2_read_file(ext2_partition_t *part, uint32 inode_num, uint32 *size); // read an ENTIRE FILE and return a malloc'ed buffer with it, or NULL on read errors
 
 static uint32 block_to_abs_lba(ext2_partition_t *part, uint32 block) {
 	assert(part != NULL);
@@ -73,6 +75,11 @@ static uint32 block_to_abs_lba(ext2_partition_t *part, uint32 block) {
 	return part->part->start_lba + block * sectors_per_block;
 }
 
+// Reads a block through the buffer cache; returns NULL if the read failed
+static buf_t *ext2_bread(ext2_partition_t *part, uint32 block) {
+	return bread(part->dev, block_to_abs_lba(part, block), part->blocksize);
+}
+
 static uint32 bgrp_for_inode(ext2_partition_t *part, uint32 inode) {
 	assert(part != NULL);
 	return (inode - 1) / part->super.s_inodes_per_group;
@@ -83,7 +90,8 @@ static uint32 local_index_for_inode(ext2_partition_t *part, uint32 inode) {
 	return (inode - 1) % part->super.s_inodes_per_group;
 }
 
-static void ext2_read_inode(ext2_partition_t *part, uint32 inode, void *buf) {
+// Returns false if the inode couldn't be read from disk
+static bool ext2_read_inode(ext2_partition_t *part, uint32 inode, void *buf) {
 	assert(part != NULL);
 	assert(inode >= EXT2_ROOT_INO);
 	assert(buf != NULL);
@@ -101,14 +109,16 @@ static void ext2_read_inode(ext2_partition_t *part, uint32 inode, void *buf) {
 
 	assert(offset % sizeof(ext2_inode_t) == 0);
 
-	char *inode_buf = kmalloc(512);
-	int ret = ata_read(part->dev, block_to_abs_lba(part, inode_table_block + block_offset) + offset/512, inode_buf, 1);
-	assert(ret != 0);
-	memcpy(buf, inode_buf + (offset % 512), sizeof(ext2_inode_t));
-	kfree(inode_buf);
+	buf_t *b = ext2_bread(part, inode_table_block + block_offset);
+	if (b == NULL)
+		return false;
+	memcpy(buf, b->data + offset, sizeof(ext2_inode_t));
+	brelse(b);
+	return true;
 }
 
-static uint32 read_direct_blocks(ext2_partition_t *part, uint32 *blocklist, uint32 num, void *buf) {
+// These return the number of blocks read, or -EIO
+static int read_direct_blocks(ext2_partition_t *part, uint32 *blocklist, uint32 num, void *buf) {
 	assert(part != NULL);
 	assert(blocklist != NULL);
 	assert(*blocklist != 0);
@@ -121,14 +131,17 @@ static uint32 read_direct_blocks(ext2_partition_t *part, uint32 *blocklist, uint
 		if (blocklist[i] == 0) {
 			continue;
 		}
-		int ret = ata_read(part->dev, block_to_abs_lba(part, blocklist[i]), (char *)buf + i * part->blocksize, part->blocksize / 512);
-		assert(ret != 0);
+		buf_t *b = ext2_bread(part, blocklist[i]);
+		if (b == NULL)
+			return -EIO;
+		memcpy((char *)buf + i * part->blocksize, b->data, part->blocksize);
+		brelse(b);
 	}
 
 	return num;
 }
 
-static uint32 read_singly_indirect_blocks(ext2_partition_t *part, uint32 singly_block, uint32 max_num, void *buf) {
+static int read_singly_indirect_blocks(ext2_partition_t *part, uint32 singly_block, uint32 max_num, void *buf) {
 	assert(part != NULL);
 	assert(singly_block > EXT2_ROOT_INO);
 	assert(max_num <= part->blocksize / 4); // This may be relaxed later, in case blocklists are consecutive on disk
@@ -136,27 +149,28 @@ static uint32 read_singly_indirect_blocks(ext2_partition_t *part, uint32 singly_
 	
 	// To begin with, we read the contents of the indirect block into a buffer;
 	// this is really just an array of uint32s.
-	uint32 *blocklist = kmalloc(part->blocksize);
-	int ret =ata_read(part->dev, block_to_abs_lba(part, singly_block), blocklist, part->blocksize / 512);
-	assert(ret != 0);
+	buf_t *b = ext2_bread(part, singly_block);
+	if (b == NULL)
+		return -EIO;
 
 	// Next, read the blocks.
-	read_direct_blocks(part, blocklist, max_num, buf);
+	int ret = read_direct_blocks(part, (uint32 *)b->data, max_num, buf);
 
-	kfree(blocklist);
+	brelse(b);
 
-	return max_num;
+	return ret;
 }
 
-static uint32 read_doubly_indirect_blocks(ext2_partition_t *part, uint32 doubly_block, uint32 num, void *buf) {
+static int read_doubly_indirect_blocks(ext2_partition_t *part, uint32 doubly_block, uint32 num, void *buf) {
 	assert(part != NULL);
 	assert(doubly_block > EXT2_ROOT_INO);
 	assert(num <= (part->blocksize/4) * (part->blocksize/4));
 	assert(buf != NULL);
 
-	uint32 *singly_blocks = kmalloc(part->blocksize);
-	int ret = ata_read(part->dev, block_to_abs_lba(part, doubly_block), singly_blocks, part->blocksize / 512);
-	assert(ret != 0);
+	buf_t *b = ext2_bread(part, doubly_block);
+	if (b == NULL)
+		return -EIO;
+	uint32 *singly_blocks = (uint32 *)b->data;
 
 	// Next, read through as many of these singly indirect blocks as required.
 	uint32 read_data_blocks = 0;
@@ -165,21 +179,27 @@ static uint32 read_doubly_indirect_blocks(ext2_partition_t *part, uint32 doubly_
 		if (singly == 0)
 			continue;
 		uint32 data_blocks_to_read = min(num - read_data_blocks, part->blocksize/4);
-		read_data_blocks += read_singly_indirect_blocks(part, singly, data_blocks_to_read, (char *)buf + read_data_blocks * part->blocksize);
+		int ret = read_singly_indirect_blocks(part, singly, data_blocks_to_read, (char *)buf + read_data_blocks * part->blocksize);
+		if (ret < 0) {
+			brelse(b);
+			return ret;
+		}
+		read_data_blocks += ret;
 	}
-	kfree(singly_blocks);
+	brelse(b);
 
 	return read_data_blocks;
 }
 
-static uint32 read_triply_indirect_blocks(ext2_partition_t *part, uint32 triply_block, uint32 num, void *buf) {
+static int read_triply_indirect_blocks(ext2_partition_t *part, uint32 triply_block, uint32 num, void *buf) {
 	assert(part != NULL);
 	assert(triply_block > EXT2_ROOT_INO);
 	assert(buf != NULL);
 
-	uint32 *doubly_blocks = kmalloc(part->blocksize);
-	int ret = ata_read(part->dev, block_to_abs_lba(part, triply_block), doubly_blocks, part->blocksize / 512);
-	assert(ret != 0);
+	buf_t *b = ext2_bread(part, triply_block);
+	if (b == NULL)
+		return -EIO;
+	uint32 *doubly_blocks = (uint32 *)b->data;
 
 	// Next, read through as many of these doubly indirect blocks as required.
 	uint32 read_data_blocks = 0;
@@ -188,9 +208,14 @@ static uint32 read_triply_indirect_blocks(ext2_partition_t *part, uint32 triply_
 		if (doubly == 0)
 			continue;
 		uint32 data_blocks_to_read = min(num - read_data_blocks, part->blocksize/4 * part->blocksize/4); // how many data blocks to read from THIS doubly indir block
-		read_data_blocks += read_doubly_indirect_blocks(part, doubly, data_blocks_to_read, (char *)buf + read_data_blocks * part->blocksize);
+		int ret = read_doubly_indirect_blocks(part, doubly, data_blocks_to_read, (char *)buf + read_data_blocks * part->blocksize);
+		if (ret < 0) {
+			brelse(b);
+			return ret;
+		}
+		read_data_blocks += ret;
 	}
-	kfree(doubly_blocks);
+	brelse(b);
 
 	return read_data_blocks;
 }
@@ -200,7 +225,10 @@ char *ext2_read_file(ext2_partition_t *part, uint32 inode_num, uint32 *size /* o
 	assert(inode_num >= EXT2_ROOT_INO);
 
 	ext2_inode_t *inode = kmalloc(sizeof(ext2_inode_t));
-	ext2_read_inode(part, inode_num, inode);
+	if (!ext2_read_inode(part, inode_num, inode)) {
+		kfree(inode);
+		return NULL;
+	}
 
 	uint32 num_blocks = inode->i_blocks/(2 << part->super.s_log_block_size);
 	assert(num_blocks > 0);
@@ -212,50 +240,54 @@ char *ext2_read_file(ext2_partition_t *part, uint32 inode_num, uint32 *size /* o
 	memset(file_data, 0, num_blocks * part->blocksize);
 
 	uint32 read_blocks = 0;
+	int err = 0;
 
 	// Begin by reading the 12 direct blocks (or fewer, if the file is small).
-	read_direct_blocks(part, &inode->i_direct[0], min(12, num_blocks), file_data);
+	err = read_direct_blocks(part, &inode->i_direct[0], min(12, num_blocks), file_data);
 	read_blocks += min(12, num_blocks);
 
-	if (num_blocks > read_blocks) {
+	if (err >= 0 && num_blocks > read_blocks) {
 		// The 12 direct blocks weren't enough, so we'll have to use singly indirect ones.
 		uint32 blocks_to_read = min(num_blocks - read_blocks, part->blocksize/4);
-		read_singly_indirect_blocks(part, inode->i_singly, blocks_to_read, file_data + read_blocks * part->blocksize);
+		err = read_singly_indirect_blocks(part, inode->i_singly, blocks_to_read, file_data + read_blocks * part->blocksize);
 		read_blocks += blocks_to_read;
 	}
 
-	if (num_blocks > read_blocks) {
+	if (err >= 0 && num_blocks > read_blocks) {
 		// The 12 direct + (blocksize/4) singly indirect ones weren't enough, either!
 		uint32 blocks_to_read = min(num_blocks - read_blocks, part->blocksize/4 * part->blocksize/4);
-		read_doubly_indirect_blocks(part, inode->i_doubly, blocks_to_read, file_data + read_blocks * part->blocksize);
+		err = read_doubly_indirect_blocks(part, inode->i_doubly, blocks_to_read, file_data + read_blocks * part->blocksize);
 		read_blocks += blocks_to_read;
 	}
 
-	if (num_blocks > read_blocks) {
+	if (err >= 0 && num_blocks > read_blocks) {
 		// Triply indirect blocks are required to read this file.
 		uint32 blocks_to_read = num_blocks - read_blocks;
-		read_triply_indirect_blocks(part, inode->i_triply, blocks_to_read, file_data + read_blocks * part->blocksize);
+		err = read_triply_indirect_blocks(part, inode->i_triply, blocks_to_read, file_data + read_blocks * part->blocksize);
 		read_blocks += blocks_to_read;
 	}
 
 	kfree(inode);
 
+	if (err < 0) {
+		kfree(file_data);
+		return NULL;
+	}
+
 	return file_data;
 }
 
-bool ext2_detect(ata_device_t *dev, uint8 part) {
+bool ext2_detect(blkdev_t *dev, uint8 part) {
 	/* Quite a few sanity checks */
 	assert(dev != NULL);
-	assert(dev->exists);
-	assert(!dev->is_atapi);
 	assert(part <= 3);
 	assert(dev->partition[part].exists);
 	assert(dev->partition[part].type == PART_LINUX);
 
 	uint8 buf[1024] = {0};
 	/* Read the superblock, 1024 bytes (2 sectors) in, 1024 bytes (2 sectors) long */
-	int ret = ata_read(dev, dev->partition[part].start_lba + 2, buf, 2);
-	assert(ret != 0);
+	int ret = blk_rw(dev, dev->partition[part].start_lba + 2, buf, 2, false);
+	assert(ret == 0);
 
 	/* Create the list of partitions if it doesn't already exist) */
 	if (ext2_partitions == NULL)
@@ -277,8 +309,8 @@ bool ext2_detect(ata_device_t *dev, uint8 part) {
 	uint32 num_bgdt_sectors = (bgdt_size % 512 == 0) ? bgdt_size/512 : bgdt_size/512 + 1;
 
 	ext2_bgd_t *bgd = kmalloc(num_bgdt_sectors * 512);
-	ret = ata_read(dev, block_to_abs_lba(part_info, part_info->super.s_log_block_size == 0 ? 2 : 1), bgd, num_bgdt_sectors);
-	assert(ret != 0);
+	ret = blk_rw(dev, block_to_abs_lba(part_info, part_info->super.s_log_block_size == 0 ? 2 : 1), bgd, num_bgdt_sectors, false);
+	assert(ret == 0);
 	part_info->bgdt = bgd; // Array of block group descriptors
 
 	// Set up the mountpoint
@@ -332,6 +364,8 @@ static ssize_t ext2_readlink_inode(ext2_partition_t *part, uint32 inode_num, ext
 	// No such luck... but we still have a relatively easy job, thanks to helper functions.
 	uint32 size = 0;
 	char *buf = ext2_read_file(part, inode_num, &size);
+	if (buf == NULL)
+		return -EIO;
 	assert(inode->i_size == size);
 
 	memcpy(link_path, buf, inode->i_size);
@@ -370,7 +404,10 @@ ssize_t ext2_readlink(struct mountpoint *mp, const char *pathname, char *buf, si
 
 	// OK, we have _ino.value; use it to read the inode data for this inode number
 	ext2_inode_t *inode = kmalloc(sizeof(ext2_inode_t));
-	ext2_read_inode(part, _ino.value, inode);
+	if (!ext2_read_inode(part, _ino.value, inode)) {
+		kfree(inode);
+		return -EIO;
+	}
 
 	char *link = kmalloc(PATH_MAX+1);
 	memset(link, 0, PATH_MAX+1);
@@ -538,15 +575,27 @@ static struct inode_ret _inode_for_path(ext2_partition_t *part, const char *path
 	// as opposed to how it was until ~5 Dec 2014.
 
 	ext2_inode_t *parent_inode = kmalloc(sizeof(ext2_inode_t));
-	ext2_read_inode(part, parent_inode_num, parent_inode);
+	if (!ext2_read_inode(part, parent_inode_num, parent_inode)) {
+		struct inode_ret ret;
+		ret.type = TYPE_RETVAL;
+		ret.value = -EIO;
+		kfree(parent_inode);
+		kfree(cur_entry);
+		return ret;
+	}
 
 	if (EXT2_ISLNK(parent_inode->i_mode)) {
 		// This is a symbolic link, used as a directory in a sub-path,
 	   //  e.g. /a/b/c where the symlink is a or b, but *not* c.
 		char *link_path = kmalloc(PATH_MAX+1);
-		ext2_readlink_inode(part, parent_inode_num, parent_inode, link_path, PATH_MAX+1);
-
-		struct inode_ret ret = ext2_handle_symlink_in_path(part, path, link_path, parent_info, parent_inode_num, op_param);
+		struct inode_ret ret;
+		ssize_t err = ext2_readlink_inode(part, parent_inode_num, parent_inode, link_path, PATH_MAX+1);
+		if (err < 0) {
+			ret.type = TYPE_RETVAL;
+			ret.value = err;
+		}
+		else
+			ret = ext2_handle_symlink_in_path(part, path, link_path, parent_info, parent_inode_num, op_param);
 		kfree(parent_inode);
 		kfree(link_path);
 		kfree(cur_entry);
@@ -572,6 +621,13 @@ static struct inode_ret _inode_for_path(ext2_partition_t *part, const char *path
 
 	uint32 size;
 	ext2_direntry_t *dir = (ext2_direntry_t *)ext2_read_file(part, parent_inode_num, &size);
+	if (dir == NULL) {
+		struct inode_ret ret;
+		ret.type = TYPE_RETVAL;
+		ret.value = -EIO;
+		kfree(cur_entry);
+		return ret;
+	}
 	ext2_direntry_t * const orig_ptr = dir; // required for kfree, as we modify dir() below, and thus can't pass it to kfree
 
 	uint32 i = 0;
@@ -597,13 +653,23 @@ static struct inode_ret _inode_for_path(ext2_partition_t *part, const char *path
 				if (dir->file_type == EXT2_FT_SYMLINK) {
 					// Yup, it is.
 					ext2_inode_t *tmp_inode = kmalloc(sizeof(ext2_inode_t));
-					ext2_read_inode(part, dir->inode, tmp_inode);
-
-					// OK, so we now have the inode info. Find out where it points.
 					char *path_buf = kmalloc(PATH_MAX+1);
 					memset(path_buf, 0, PATH_MAX+1);
-					ext2_readlink_inode(part, dir->inode, tmp_inode, path_buf, PATH_MAX+1);
+
+					// Find out where it points
+					ssize_t err = -EIO;
+					if (ext2_read_inode(part, dir->inode, tmp_inode))
+						err = ext2_readlink_inode(part, dir->inode, tmp_inode, path_buf, PATH_MAX+1);
 					kfree(tmp_inode); tmp_inode = NULL;
+					if (err < 0) {
+						struct inode_ret ret;
+						ret.value = err;
+						ret.type = TYPE_RETVAL;
+						kfree(orig_ptr);
+						kfree(path_buf);
+						kfree(cur_entry);
+						return ret;
+					}
 
 					// path_buf is the path we need to open. However, it may be a relative path.
 					// If so, we CANNOT simply call open/stat/etc.; the reason is that the path
@@ -717,7 +783,10 @@ static int ext2_stat_inode(ext2_partition_t *part, mountpoint_t *mp, struct stat
 	assert(inode_num >= EXT2_ROOT_INO);
 
 	ext2_inode_t *inode = kmalloc(sizeof(ext2_inode_t));
-	ext2_read_inode(part, inode_num, inode);
+	if (!ext2_read_inode(part, inode_num, inode)) {
+		kfree(inode);
+		return -EIO;
+	}
 
 	memset(st, 0, sizeof(struct stat));
 
@@ -979,7 +1048,11 @@ static int ext2_open(uint32 dev, const char *path, int mode) {
 	}
 
 	ext2_inode_t *inode = kmalloc(sizeof(ext2_inode_t));
-	ext2_read_inode(part, inode_num, inode);
+	if (!ext2_read_inode(part, inode_num, inode)) {
+		destroy_filp(fd);
+		kfree(inode);
+		return -EIO;
+	}
 
 	if (inode_num >= EXT2_ROOT_INO) {
 		if ((mode & O_DIRECTORY) && !EXT2_ISDIR(inode->i_mode)) {
@@ -1001,6 +1074,7 @@ static int ext2_open(uint32 dev, const char *path, int mode) {
 		file->fops.lseek = NULL; //ext2_lseek;
 		file->fops.fstat = ext2_fstat;
 		file->fops.getdents = ext2_getdents;
+		file->fops.fsync = ext2_fsync;
 		list_foreach(mountpoints, it) {
 			mountpoint_t *mp = (mountpoint_t *)it->data;
 			if (mp->dev == dev) {
@@ -1042,6 +1116,13 @@ static int ext2_close(int fd, struct open_file *file) {
 	return 0;
 }
 
+// We don't keep track of which buffers belong to which file, so this syncs the whole disk.
+static int ext2_fsync(int fd) {
+	struct open_file *file = get_filp(fd);
+	ext2_partition_t *part = devtable[file->dev];
+	return bcache_sync(part->dev);
+}
+
 static int ext2_closedir(DIR *dir) {
 	assert(dir != NULL);
 
@@ -1147,17 +1228,23 @@ static int ext2_getdents(int fd, void *dp, int count) {
 		// This directory was just opened, and we haven't actually fetched any entries yet! Do so.
 
 		struct stat st;
-		fstat(fd, &st);
+		int err = fstat(fd, &st);
+		if (err != 0)
+			return err;
 		if (!S_ISDIR(st.st_mode))
 			return -ENOTDIR;
 
+		uint32 len = 0;
+		char *dir_buf = ext2_read_file(part, st.st_ino, &len);
+		if (dir_buf == NULL)
+			return -EIO;
+		assert(len > 0);
+
 		info = kmalloc(sizeof(struct ext2_getdents_info));
 		memset(info, 0, sizeof(struct ext2_getdents_info));
+		info->dir_buf = dir_buf;
+		info->len = len;
 		file->data = info;
-
-		info->dir_buf = ext2_read_file(part, st.st_ino, &info->len);
-		assert(info->dir_buf != NULL);
-		assert(info->len > 0);
 	}
 
 	memset(dp, 0, count);
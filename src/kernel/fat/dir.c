@@ -478,8 +478,10 @@ void fat_parse_dir(DIR *dir, bool (*callback)(fat32_direntry_t *, DIR *, char *,
 	uint8 *disk_data = kmalloc(part->cluster_size);
 
 	/* Read the first cluster from disk */
-	int ret = fat_read_cluster(part, cur_cluster, disk_data);
-	assert(ret != 0);
+	if (!fat_read_cluster(part, cur_cluster, disk_data)) {
+		kfree(disk_data);
+		return;
+	}
 
 	fat32_direntry_t *disk_direntry = (fat32_direntry_t *)disk_data;
 
@@ -11,6 +11,7 @@
 #include <sys/errno.h>
 #include <kernel/pmm.h>
 #include <kernel/time.h>
+#include <kernel/bcache.h>
 
 /* TODO: Add more comments! */
 /* TODO: FAT is case-insensitive!!! */
@@ -22,6 +23,7 @@ int fat_fstat(int fd, struct stat *buf);
 int fat_open(uint32 dev, const char *path, int mode);
 int fat_read(int fd, void *buf, size_t length);
 int fat_close(int fd, struct open_file *file);
+static int fat_fsync(int fd);
 static bool fat_callback_stat(fat32_direntry_t *disk_direntry, DIR *dir, char *lfn_buf, void *in_data);
 void fat_parse_dir(DIR *dir, bool (*callback)(fat32_direntry_t *, DIR *, char *, void *), void *data);
 void fat_parse_short_name(char *buf, const char *name);
@@ -41,14 +43,13 @@ DIR *fat_opendir_cluster(fat32_partition_t *part, uint32 cluster, mountpoint_t *
 uint32 fat_cluster_for_path(fat32_partition_t *part, const char *in_path, int type);
 bool fat_read_cluster(fat32_partition_t *part, uint32 cluster, uint8 *buffer);
 static uint32 fat_next_cluster(fat32_partition_t *part, uint32 cur_cluster);
+#define FAT_READ_ERROR 0xffffffff /* returned by fat_next_cluster; never a valid (28-bit) FAT entry */
 int fat_stat(mountpoint_t *mp, const char *in_path, struct stat *buf);
 int fat_getdents (int fd, void *dp, int count);
 
-bool fat_detect(ata_device_t *dev, uint8 part) {
+bool fat_detect(blkdev_t *dev, uint8 part) {
 	/* Quite a few sanity checks */
 	assert(dev != NULL);
-	assert(dev->exists);
-	assert(!dev->is_atapi);
 	assert(part <= 3);
 	assert(dev->partition[part].exists);
 	assert(dev->partition[part].type == PART_FAT32 || \
@@ -60,8 +61,8 @@ bool fat_detect(ata_device_t *dev, uint8 part) {
 
 	uint8 *buf = kmalloc(512);
 	/* Read the Volume ID sector */
-	int ret = ata_read(dev, dev->partition[part].start_lba, buf, 1);
-	assert(ret != 0);
+	int ret = blk_rw(dev, dev->partition[part].start_lba, buf, 1, false);
+	assert(ret == 0);
 
 	assert( *( (uint16 *)(buf + 510) ) == 0xAA55);
 
@@ -193,7 +194,13 @@ off_t fat_lseek(int fd, off_t offset, int whence) {
 		file->cur_block = file->ino; // TODO: only start from the first cluster/inode if truly necessary
 
 		while (local_offset >= part->cluster_size) {
-			file->cur_block = fat_next_cluster(part, file->cur_block);
+			uint32 next = fat_next_cluster(part, file->cur_block);
+			if (next == FAT_READ_ERROR) {
+				file->cur_block = file->ino; // consistent with offset 0 again
+				file->offset = 0;
+				return -EIO;
+			}
+			file->cur_block = next;
 			if (file->cur_block >= 0x0ffffff8) {
 				// End of cluster chain
 				panic("lseek: seek beyond file ending despite checks to make this impossible - bug in fat_lseek");
@@ -236,6 +243,7 @@ int fat_open(uint32 dev, const char *path, int mode) {
 		file->fops.lseek = fat_lseek;
 		file->fops.fstat = fat_fstat;
 		file->fops.getdents = fat_getdents;
+		file->fops.fsync = fat_fsync;
 		list_foreach(mountpoints, it) {
 			mountpoint_t *mp = (mountpoint_t *)it->data;
 			if (mp->dev == dev) {
@@ -257,6 +265,59 @@ int fat_open(uint32 dev, const char *path, int mode) {
 	}
 }
 
+/*
+ * Queues reads for the clusters that a read of /length/ bytes at the file's offset needs, and,
+ * if the file is being read sequentially, for the clusters after them (read-ahead).
+ * Since the reads are queued together, adjacent clusters are merged into larger disk requests.
+ *
+ * The read-ahead window starts at FILE_RA_MIN bytes and doubles (up to FILE_RA_MAX) each time
+ * it's refilled, which happens when the reader gets within half a window of its end.
+ * A read anywhere else than where the last one ended turns read-ahead off, until the next
+ * sequential read.
+ */
+static void fat_readahead(fat32_partition_t *part, struct open_file *file, uint32 length) {
+	struct file_ra *ra = &file->ra;
+	const uint32 cs = part->cluster_size;
+	const uint32 read_end = (uint32)file->offset + length;
+	bool sequential = (file->offset == ra->prev_end);
+
+	if (!sequential || ra->end <= (uint32)file->offset) {
+		// Start over from the cluster that holds the offset
+		ra->end = (uint32)file->offset - (uint32)file->offset % cs;
+		ra->cluster = file->cur_block;
+	}
+
+	uint32 target = read_end;
+	if (!sequential)
+		ra->window = 0;
+	else if (ra->window == 0) {
+		ra->window = FILE_RA_MIN;
+		target += ra->window;
+	}
+	else if (ra->end < read_end + ra->window / 2) {
+		ra->window = min(ra->window * 2, FILE_RA_MAX);
+		target += ra->window;
+	}
+
+	if (target > (uint32)file->size)
+		target = (uint32)file->size;
+
+	while (ra->end < target) {
+		bcache_prefetch(part->dev, fat_lba_from_cluster(part, ra->cluster), cs, ra->end >= read_end);
+		ra->end += cs;
+		if (ra->end < (uint32)file->size) {
+			ra->cluster = fat_next_cluster(part, ra->cluster);
+			if (ra->cluster == FAT_READ_ERROR) {
+				// Stop here, and start over the next time; fat_read will run into the error itself
+				ra->end = 0;
+				ra->window = 0;
+				break;
+			}
+			assert(ra->cluster >= 2 && ra->cluster < 0x0ffffff7);
+		}
+	}
+}
+
 int fat_read(int fd, void *buf, size_t length) {
 	struct open_file *file = get_filp(fd);
 
@@ -290,82 +351,59 @@ int fat_read(int fd, void *buf, size_t length) {
 		file->size = st.st_size;
 	}
 
-	uint32 bytes_read = 0; // this call to read() only
-
-	const uint32 max_clusters = 32; // How many clusters to read at once (to keep the buffer size down)
-
-	uint8 *cluster_buf = kmalloc(part->cluster_size * max_clusters);
-
-	if (file->offset >= file->size) {
-		goto done;
-	}
+	if (file->offset >= file->size)
+		return 0;
 
 	assert(file->offset >= 0);
-	uint32 local_offset = (uint32)file->offset % part->cluster_size;
-
-	uint32 continuous_clusters = 1;
-	do {
-		if (length > part->cluster_size) {
-			// The request is for more than one cluster, so at least two need to be
-			// read from disk; if they are continuous on disk, we can read them faster
-			// by coalescing them into a single disk request.
-			uint32 next = 0, cur = file->cur_block;
-			while ((next = fat_next_cluster(part, cur)) == cur + 1 && \
-					continuous_clusters * part->cluster_size < length && \
-					continuous_clusters < max_clusters)
-			{
-				cur = next;
-				continuous_clusters++;
-			}
-		}
-
-		uint32 nbytes_read_from_disk = continuous_clusters * part->cluster_size;
-
-		int ret = disk_read(part->dev, fat_lba_from_cluster(part, file->cur_block), nbytes_read_from_disk, cluster_buf);
-		assert(ret != 0);
-		file->cur_block += continuous_clusters - 1; // the last one is taken care of later in all cases
+	if ((off_t)length > file->size - file->offset)
+		length = file->size - file->offset;
 
-		// We need to stop if either the file size is up, or if the user didn't want more bytes.
-		uint32 bytes_copied = min(min(file->size - file->offset, (off_t)length), nbytes_read_from_disk);
-
-		if (bytes_copied >= nbytes_read_from_disk - local_offset) {
-			// We'd read outside the buffer we've read from disk! Limit this read size.
-			bytes_copied = nbytes_read_from_disk - local_offset;
-		}
-
-		// Copy the data to the buffer
-		memcpy((void *)( (uint8 *)buf + bytes_read), cluster_buf + local_offset, bytes_copied);
-
-		bytes_read += bytes_copied;
-		file->offset += bytes_copied;
-		local_offset += bytes_copied;
-
-		assert(file->offset <= file->size);
-
-		assert(length >= bytes_copied);
-		length -= bytes_copied;
+	uint32 bytes_read = 0; // this call to read() only
+	uint32 local_offset = (uint32)file->offset % part->cluster_size;
 
-		if (local_offset >= part->cluster_size) {
-			ino_t next = fat_next_cluster(part, file->cur_block);
-			if (file->cur_block >= 0x0ffffff8 || file->cur_block < 2) {
-				// End of cluster chain / no data
-				assert(file->offset == file->size);
-				goto done;
+	while (length > 0) {
+		// Large reads are done in pieces, so that the clusters queued by fat_readahead()
+		// aren't evicted from the cache before we get to them
+		uint32 piece = min(length, FILE_RA_MAX);
+		fat_readahead(part, file, piece);
+
+		while (piece > 0) {
+			buf_t *b = bread(part->dev, fat_lba_from_cluster(part, file->cur_block), part->cluster_size);
+			if (b == NULL)
+				return (bytes_read > 0) ? (int)bytes_read : -EIO;
+
+			uint32 bytes_copied = min(part->cluster_size - local_offset, piece);
+			memcpy((uint8 *)buf + bytes_read, b->data + local_offset, bytes_copied);
+			brelse(b);
+
+			bytes_read += bytes_copied;
+			file->offset += bytes_copied;
+			local_offset += bytes_copied;
+			piece -= bytes_copied;
+			length -= bytes_copied;
+
+			assert(file->offset <= file->size);
+
+			if (local_offset == part->cluster_size) {
+				// cur_block is the cluster that holds file->offset, so move on if there's more to the file
+				local_offset = 0;
+				if (file->offset < file->size) {
+					uint32 next = fat_next_cluster(part, file->cur_block);
+					if (next == FAT_READ_ERROR) {
+						// Give back the last bytes, so that the offset is still inside cur_block
+						file->offset -= bytes_copied;
+						bytes_read -= bytes_copied;
+						return (bytes_read > 0) ? (int)bytes_read : -EIO;
+					}
+					file->cur_block = next;
+					assert(file->cur_block >= 2 && file->cur_block < 0x0ffffff7);
+				}
 			}
-			else
-				file->cur_block = next;
-		}
-		while (local_offset >= part->cluster_size) {
-			local_offset -= part->cluster_size;
 		}
 
-		if (length == 0 || file->offset >= file->size)
-			break;
-
-	} while (length > 0);
+		file->ra.prev_end = file->offset;
+	}
 
-done:
-	kfree(cluster_buf);
 	return bytes_read;
 }
 
@@ -375,7 +413,14 @@ int fat_close(int fd, struct open_file *file) {
 	return 0;
 }
 
-/* Finds the next cluster in the chain, if there is one. */
+// We don't keep track of which buffers belong to which file, so this syncs the whole disk.
+static int fat_fsync(int fd) {
+	struct open_file *file = get_filp(fd);
+	fat32_partition_t *part = devtable[file->dev];
+	return bcache_sync(part->dev);
+}
+
+/* Finds the next cluster in the chain, if there is one. Returns FAT_READ_ERROR if the FAT couldn't be read. */
 static uint32 fat_next_cluster(fat32_partition_t *part, uint32 cur_cluster) {
 	assert(part != NULL);
 	assert(cur_cluster >= 2);
@@ -394,19 +439,26 @@ static uint32 fat_next_cluster(fat32_partition_t *part, uint32 cur_cluster) {
 		/* Make sure the FAT LBA is within the FAT on disk */
 		assert((fat_sector >= part->fat_start_lba) && (fat_sector <= part->fat_start_lba + part->bpb->sectors_per_fat));
 
-		/* Read the FAT sector to RAM */
-		uint8 fat[512];
-		int ret = disk_read(part->dev, fat_sector, 512, (uint8 *)fat);
-		assert(ret != 0);
+		/* Read the FAT sector, through the buffer cache */
+		buf_t *b = bread(part->dev, fat_sector, 512);
+		if (b == NULL)
+			return FAT_READ_ERROR;
 
 		/* Read the FAT */
-		val = *(uint32 *)(&fat[entry_offset]);
+		val = *(uint32 *)(&b->data[entry_offset]);
+		brelse(b);
 	}
 
 	return (val & 0x0fffffff);
 }
+/* Reads a cluster of directory data through the buffer cache, like fat_read does for file data */
 bool fat_read_cluster(fat32_partition_t *part, uint32 cluster, uint8 *buffer) {
-	return disk_read(part->dev, fat_lba_from_cluster(part, cluster), part->cluster_size, buffer);
+	buf_t *b = bread(part->dev, fat_lba_from_cluster(part, cluster), part->cluster_size);
+	if (b == NULL)
+		return false;
+	memcpy(buffer, b->data, part->cluster_size);
+	brelse(b);
+	return true;
 }
 
 /* Follows the cluster chain for *cur_cluster to find the next cluster
@@ -417,6 +469,8 @@ bool fat_read_next_cluster(fat32_partition_t *part, uint8 *buffer, uint32 *cur_c
 	assert(cur_cluster != NULL);
 
 	uint32 next_cluster = fat_next_cluster(part, *cur_cluster);
+	if (next_cluster == FAT_READ_ERROR)
+		return false; // read errors end the directory early, like for its first cluster
 	if (next_cluster == 0x0ffffff7) { panic("bad cluster!"); }
 	if (next_cluster >= 0x0FFFFFF8) {
 		return false;
@@ -426,10 +480,7 @@ bool fat_read_next_cluster(fat32_partition_t *part, uint8 *buffer, uint32 *cur_c
 	*cur_cluster = next_cluster;
 
 	/* Read this cluster from disk */
-	int ret = fat_read_cluster(part, *cur_cluster, buffer);
-	assert(ret != 0);
-
-	return true;
+	return fat_read_cluster(part, *cur_cluster, buffer);
 }
 
 /* Locates the (first) cluster number associated with a path. */
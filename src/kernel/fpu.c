@@ -6,10 +6,71 @@
 // x87_MMX_SSE_SSE2_SSE3_StateOwner from the Intel docs
 task_t *last_fpu_task = NULL;
 
+uint32 cpu_features = 0;
+
+// Whether to use FXSAVE/FXRSTOR (which also save the SSE state) rather than FSAVE/FRSTOR
+static bool use_fxsr = false;
+
+#define MXCSR_DEFAULT 0x1f80 /* all SIMD exceptions masked, round to nearest */
+
 static uint32 no_fpu_interrupt_handler(uint32 esp);
+static uint32 fpu_error_handler(uint32 esp);
+static uint32 simd_exception_handler(uint32 esp);
+
+static void cpuid(uint32 leaf, uint32 *eax, uint32 *ebx, uint32 *ecx, uint32 *edx) {
+	asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf));
+}
+
+// Find out what the CPU supports; only features we also enable end up in cpu_features
+static void detect_features(void) {
+	uint32 eax, ebx, ecx, edx;
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+
+	if (edx & (1 << 0))
+		cpu_features |= CPU_FEATURE_FPU;
+	if (edx & (1 << 23))
+		cpu_features |= CPU_FEATURE_MMX;
+	if (edx & (1 << 24))
+		cpu_features |= CPU_FEATURE_FXSR;
+
+	// SSE state can only be saved with FXSAVE
+	if (!(cpu_features & CPU_FEATURE_FXSR) || !(edx & (1 << 25)))
+		return;
+	cpu_features |= CPU_FEATURE_SSE;
+
+	if (edx & (1 << 26))
+		cpu_features |= CPU_FEATURE_SSE2;
+	if (ecx & (1 << 0))
+		cpu_features |= CPU_FEATURE_SSE3;
+	if (ecx & (1 << 9))
+		cpu_features |= CPU_FEATURE_SSSE3;
+	if (ecx & (1 << 19))
+		cpu_features |= CPU_FEATURE_SSE4_1;
+	if (ecx & (1 << 20))
+		cpu_features |= CPU_FEATURE_SSE4_2;
+	if (ecx & (1 << 23))
+		cpu_features |= CPU_FEATURE_POPCNT;
+}
+
+static inline void fpu_save(fpu_mmx_state_t *state) {
+	if (use_fxsr)
+		asm volatile("fxsave %0" : "=m"(*state) : : "memory");
+	else
+		asm volatile("fnsave %0; fwait" : "=m"(*state) : : "memory");
+}
+
+static inline void fpu_restore(fpu_mmx_state_t *state) {
+	if (use_fxsr)
+		asm volatile("fxrstor %0" : : "m"(*state));
+	else
+		asm volatile("frstor %0" : : "m"(*state));
+}
 
 void fpu_init(void) {
+	detect_features();
+
 	register_interrupt_handler(EXCEPTION_NO_COPROCESSOR, no_fpu_interrupt_handler);
+	register_interrupt_handler(EXCEPTION_X86_FPU_ERROR, fpu_error_handler);
 	asm volatile("fninit");
 
 	// Enable FPU native exceptions (NE) and set the Task Switched (TS) bits.
@@ -22,13 +83,89 @@ void fpu_init(void) {
 				 : /* no inputs */
 				 : "%eax", "cc");
 
-	// Set the CR4 OSFXSR flag, which enables FXSAVE/FXRSTOR to save SSE* state.
-	asm volatile("mov %%cr4, %%eax;"
-				 "or $0x00000200, %%eax;" /* OSFXSR = 1 */
-				 "mov %%eax, %%cr4;"
-				 : /* no outputs */
-				 : /* no inputs */
-				 : "%eax", "cc");
+	if (cpu_features & CPU_FEATURE_FXSR) {
+		// Set the CR4 OSFXSR flag, which enables FXSAVE/FXRSTOR to save SSE* state,
+		// and lets user mode use SSE instructions.
+		asm volatile("mov %%cr4, %%eax;"
+					 "or $0x00000200, %%eax;" /* OSFXSR = 1 */
+					 "mov %%eax, %%cr4;"
+					 : /* no outputs */
+					 : /* no inputs */
+					 : "%eax", "cc");
+		use_fxsr = true;
+	}
+
+	if (cpu_features & CPU_FEATURE_SSE) {
+		// Unmasked SIMD floating-point exceptions raise #XM, rather than #UD
+		register_interrupt_handler(EXCEPTION_SIMD_FP_EXCEPTION, simd_exception_handler);
+		asm volatile("mov %%cr4, %%eax;"
+					 "or $0x00000400, %%eax;" /* OSXMMEXCPT = 1 */
+					 "mov %%eax, %%cr4;"
+					 : /* no outputs */
+					 : /* no inputs */
+					 : "%eax", "cc");
+	}
+}
+
+void fpu_sync_state(task_t *task) {
+	assert(task != NULL);
+
+	// The owner may change at any task switch, so check it with interrupts disabled
+	INTERRUPT_LOCK;
+	if (task != last_fpu_task) {
+		// The registers belong to someone else; task->fpu_state is up to date
+		INTERRUPT_UNLOCK;
+		return;
+	}
+
+	asm volatile("clts");
+	fpu_save(task->fpu_state);
+	if (!use_fxsr) {
+		// FSAVE reinitializes the FPU, so we need to load the state back
+		fpu_restore(task->fpu_state);
+	}
+	if (task != current_task) {
+		// Keep the #NM trap armed; switch_task() only clears TS when switching to last_fpu_task
+		asm volatile("mov %%cr0, %%eax;"
+					 "or $0x00000008, %%eax;" /* TS = 1 */
+					 "mov %%eax, %%cr0;"
+					 : : : "%eax", "cc");
+	}
+	INTERRUPT_UNLOCK;
+}
+
+bool kernel_fpu_begin(void) {
+	bool reenable_interrupts = interrupts_enabled();
+	disable_interrupts();
+
+	asm volatile("clts");
+	if (last_fpu_task != NULL) {
+		// Save the owner's registers; it will trap (#NM) and get them back the next time it uses them
+		assert(last_fpu_task->fpu_state != NULL);
+		fpu_save(last_fpu_task->fpu_state);
+		last_fpu_task = NULL;
+	}
+
+	return reenable_interrupts;
+}
+
+void kernel_fpu_end(bool reenable_interrupts) {
+	asm volatile("mov %%cr0, %%eax;"
+				 "or $0x00000008, %%eax;" /* TS = 1 */
+				 "mov %%eax, %%cr0;"
+				 : : : "%eax", "cc");
+	if (reenable_interrupts)
+		enable_interrupts();
+}
+
+// Lets userspace find out which instruction set extensions it may use
+uint32 sys_cpu_features(void) {
+	return cpu_features;
+}
+
+void fpu_forget_task(task_t *task) {
+	if (last_fpu_task == task)
+		last_fpu_task = NULL;
 }
 
 static uint32 no_fpu_interrupt_handler(uint32 esp) {
@@ -39,23 +176,68 @@ static uint32 no_fpu_interrupt_handler(uint32 esp) {
 	// Next, save the state for the previous FPU task, if any
 	if (last_fpu_task != NULL) {
 		assert(last_fpu_task->fpu_state != NULL);
-		asm volatile("fxsave %0" : "=m"(*last_fpu_task->fpu_state) : : "memory");
+		fpu_save(last_fpu_task->fpu_state);
 	}
 
 	if (!current_task->has_used_fpu) {
 		// Initialize the FPU registers and set the state to something sane.
 		asm volatile("fninit");
-		asm volatile("fxsave %0"
-					 :"=m"(*current_task->fpu_state) : : "memory");
+		if (cpu_features & CPU_FEATURE_SSE) {
+			uint32 mxcsr = MXCSR_DEFAULT;
+			asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+		}
+		fpu_save(current_task->fpu_state);
 
 		current_task->has_used_fpu = true;
 	}
 	else {
 		// Restore the state for the current task, as it's currently trying to use it
-		asm volatile("fxrstor %0" : : "m"(*current_task->fpu_state));
+		fpu_restore(current_task->fpu_state);
 	}
 
 	last_fpu_task = (task_t *)current_task;
 
 	return esp;
 }
+
+// Unmasked x87 exception (#MF); we don't support signals, so the task dies
+static uint32 fpu_error_handler(uint32 esp) {
+	uint16 status;
+	asm volatile("fnstsw %0; fnclex" : "=m"(status));
+
+	if (current_task != &kernel_task) {
+		printk("x87 FPU exception (status word 0x%04x) in task %d (%s), killing!\n", status, current_task->id, current_task->name);
+		kill((task_t *)current_task);
+		YIELD;
+	}
+	else
+		panic("x87 FPU exception in kernel_task! Status word 0x%04x", status);
+
+	return esp;
+}
+
+// Unmasked SSE floating-point exception (#XM)
+static uint32 simd_exception_handler(uint32 esp) {
+	uint32 mxcsr;
+	asm volatile("stmxcsr %0" : "=m"(mxcsr));
+
+	static const char *names[] = { "invalid operation", "denormal operand", "divide by zero", "overflow", "underflow", "precision" };
+	const char *name = "unknown";
+	for (int i = 0; i < 6; i++) {
+		// An exception is raised if its flag (bits 0-5) is set and it's not masked (bits 7-12)
+		if ((mxcsr & (1 << i)) && !(mxcsr & (1 << (i + 7)))) {
+			name = names[i];
+			break;
+		}
+	}
+
+	if (current_task != &kernel_task) {
+		printk("SIMD floating-point exception (%s, MXCSR 0x%08x) in task %d (%s), killing!\n", name, mxcsr, current_task->id, current_task->name);
+		kill((task_t *)current_task);
+		YIELD;
+	}
+	else
+		panic("SIMD floating-point exception (%s) in kernel_task!", name);
+
+	return esp;
+}
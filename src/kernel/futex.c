@@ -0,0 +1,80 @@
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/time.h> /* struct timespec */
+#include <sys/futex.h>
+#include <kernel/kernutil.h>
+#include <kernel/vmm.h>
+#include <kernel/task.h>
+
+/*
+ * Futexes let userspace implement locks that only enter the kernel on contention.
+ * A futex is simply an aligned int in user memory, identified by (page directory,
+ * virtual address); threads share a page directory, and so share futexes.
+ * Waiters are kept in a small hash table of wait queues, keyed on that pair;
+ * the key itself is stored in the waiting task, so that FUTEX_WAKE only wakes
+ * tasks waiting on the right address.
+ */
+
+#define FUTEX_HASH_SIZE 64
+
+static wait_queue_t futex_queues[FUTEX_HASH_SIZE];
+
+static wait_queue_t *futex_queue(page_directory_t *dir, uint32 addr) {
+	uint32 hash = (addr >> 2) ^ ((uint32)dir >> 12);
+	hash ^= (hash >> 6) ^ (hash >> 12);
+	return &futex_queues[hash % FUTEX_HASH_SIZE];
+}
+
+static bool futex_match(task_t *task, void *data) {
+	return (task->futex_dir == current_task->mm->page_directory && task->futex_addr == (uint32)data);
+}
+
+int sys_futex(int *uaddr, int op, int val, const struct timespec *timeout) {
+	assert(current_task->privilege == 3);
+	if (((uint32)uaddr & 3) != 0)
+		return -EINVAL;
+	if (!CHECK_ACCESS_WRITE(uaddr, sizeof(int)))
+		return -EFAULT;
+
+	page_directory_t *dir = current_task->mm->page_directory;
+	wait_queue_t *wq = futex_queue(dir, (uint32)uaddr);
+
+	if (op == FUTEX_WAKE) {
+		if (val <= 0)
+			return 0;
+		return wait_queue_wake_match(wq, futex_match, uaddr, val);
+	}
+	else if (op != FUTEX_WAIT)
+		return -EINVAL;
+
+	uint32 ms = 0;
+	if (timeout != NULL) {
+		if (!CHECK_ACCESS_READ(timeout, sizeof(struct timespec)))
+			return -EFAULT;
+		if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000)
+			return -EINVAL;
+		// Clamp very long timeouts (about 49 days), rather than letting them wrap around to short ones
+		const time_t max_sec = 0xffffffffU / 1000 - 1;
+		uint32 sec = (uint32)((timeout->tv_sec < max_sec) ? timeout->tv_sec : max_sec);
+		ms = sec * 1000 + timeout->tv_nsec / 1000000;
+		if (ms == 0)
+			return -ETIMEDOUT;
+	}
+
+	// The value check and going to sleep must be atomic with respect to FUTEX_WAKE,
+	// or we could miss a wakeup that happened in between
+	INTERRUPT_LOCK;
+	if (*uaddr != val) {
+		INTERRUPT_UNLOCK;
+		return -EAGAIN;
+	}
+
+	current_task->futex_dir = dir;
+	current_task->futex_addr = (uint32)uaddr;
+	bool woken = wait_queue_sleep_timeout(wq, ms);
+	current_task->futex_dir = NULL;
+	current_task->futex_addr = 0;
+	INTERRUPT_UNLOCK;
+
+	return woken ? 0 : -ETIMEDOUT;
+}
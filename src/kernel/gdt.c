@@ -6,7 +6,7 @@
 #include <kernel/heap.h>
 
 /* Create three kernel-global instances of GDT entries, and a pointer */
-#define NUM_GDT_ENTRIES 7
+#define NUM_GDT_ENTRIES 8
 struct gdt_entry gdt[NUM_GDT_ENTRIES];
 struct gdt_ptr *gp = (struct gdt_ptr *)&gdt[0]; /* store the GDT pointer in the null descriptor */
 
@@ -89,6 +89,9 @@ void gdt_install(void) {
 	// the double fault handler.
 	memset(&gdt[6], 0, 8);
 
+	/* Thread-local storage segment for user mode; the base is set per task, see gdt_set_tls_base() */
+	gdt_set_gate(GDT_TLS_ENTRY, 0, 0xffffffff, 0xf2, 0xcf);
+
 	/* Install the new GDT! */
 	gdt_flush();
 	tss_flush();
@@ -140,6 +143,16 @@ static void write_tss(sint32 num, uint16 ss0, uint32 esp0) {
 	tss_entry.ss = tss_entry.ds = tss_entry.es = tss_entry.fs = tss_entry.gs = 0x13;
 }
 
+/*
+ * Points the TLS segment at /base/. Segment registers cache their descriptor, so
+ * this takes effect when GS is reloaded, i.e. when returning to user mode.
+ */
+void gdt_set_tls_base(uint32 base) {
+	gdt[GDT_TLS_ENTRY].base_low = (base & 0xFFFF);
+	gdt[GDT_TLS_ENTRY].base_middle = (base >> 16) & 0xff;
+	gdt[GDT_TLS_ENTRY].base_high = (base >> 24) & 0xff;
+}
+
 void tss_switch(uint32 esp0, uint32 esp, uint32 ss) {
 	tss_entry.esp0 = esp0;
 	tss_entry.esp = esp;
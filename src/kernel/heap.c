@@ -34,8 +34,57 @@ extern bool in_isr;
 
 uint32 placement_address; // set up in kmain()
 
-static sint8 area_header_t_less_than(void *a, void*b) {
-	return ( ((area_header_t *)a)->size < ((area_header_t *)b)->size ) ? 1 : 0;
+/* The index node of an area, and vice versa; an area is in exactly one of the indexes */
+#define AREA_NODE(__h) (&(__h)->node)
+#define NODE_AREA(__n) rb_entry(__n, area_header_t, node)
+
+/* Sorts free areas by size, then by address, so that the smallest (best fitting) area comes first */
+static int free_area_compare(const rb_node_t *a, const rb_node_t *b) {
+	area_header_t *ha = NODE_AREA(a), *hb = NODE_AREA(b);
+	if (ha->size != hb->size)
+		return (ha->size < hb->size) ? -1 : 1;
+	if (ha != hb)
+		return (ha < hb) ? -1 : 1;
+	return 0;
+}
+
+/* Compares a size (the key) to a free area, for rb_lower_bound() */
+static int free_area_size_compare(const void *key, const rb_node_t *node) {
+	uint32 size = *(const uint32 *)key;
+	uint32 area_size = NODE_AREA(node)->size;
+	if (size != area_size)
+		return (size < area_size) ? -1 : 1;
+	return 0;
+}
+
+/* Sorts used areas by address */
+static int used_area_compare(const rb_node_t *a, const rb_node_t *b) {
+	area_header_t *ha = NODE_AREA(a), *hb = NODE_AREA(b);
+	if (ha != hb)
+		return (ha < hb) ? -1 : 1;
+	return 0;
+}
+
+/* Since the index is sorted by size, areas must be removed before they are resized, and added back afterwards */
+static void free_index_insert(area_header_t *area, heap_t *heap) {
+	assert(area->type == AREA_FREE);
+	assert(area->size >= MIN_AREA_SIZE);
+	rb_insert(&heap->free_index, AREA_NODE(area));
+}
+
+static void free_index_remove(area_header_t *area, heap_t *heap) {
+	assert(area->type == AREA_FREE);
+	rb_remove(&heap->free_index, AREA_NODE(area));
+}
+
+static void used_index_insert(area_header_t *area, heap_t *heap) {
+	assert(area->type == AREA_USED);
+	rb_insert(&heap->used_index, AREA_NODE(area));
+}
+
+static void used_index_remove(area_header_t *area, heap_t *heap) {
+	assert(area->type == AREA_USED);
+	rb_remove(&heap->used_index, AREA_NODE(area));
 }
 
 uint32 kheap_used_bytes(void) {
@@ -44,11 +93,8 @@ uint32 kheap_used_bytes(void) {
 
 	uint32 used = 0;
 
-	ordered_array_t *index = &kheap->used_index;
-	for (uint32 i = 0; i < index->size; i++) {
-		area_header_t *header = lookup_ordered_array(i, index);
-		used += header->size;
-	}
+	rb_foreach(&kheap->used_index, it)
+		used += NODE_AREA(it)->size;
 
 	return used;
 }
@@ -122,14 +168,13 @@ void validate_heap_index(bool print_areas) {
 
 	INTERRUPT_LOCK;
 
-	ordered_array_t *indexes[] = { &kheap->used_index, &kheap->free_index };
 	uint32 total_index = 0;
 	for (uint32 index_num=0; index_num < 2; index_num++) {
 		/* The index we're working with right now */
-		ordered_array_t *index = indexes[index_num];
+		rb_tree_t *index = (index_num == 0) ? &kheap->used_index : &kheap->free_index;
 
-		for (uint32 i=0; i < index->size; i++, total_index++) {
-			area_header_t *found_header = lookup_ordered_array(i, index);
+		rb_foreach(index, it) {
+			area_header_t *found_header = NODE_AREA(it);
 			area_footer_t *found_footer = FOOTER_FROM_HEADER(found_header);
 
 			if (index_num == 0) {
@@ -155,6 +200,7 @@ void validate_heap_index(bool print_areas) {
 			assert(found_header->magic == HEAP_MAGIC);
 			assert(found_footer->magic == HEAP_MAGIC);
 			assert(found_footer->header == found_header);
+			total_index++;
 		}
 	}
 
@@ -169,19 +215,8 @@ void print_heap_index(void) {
 }
 
 /* Does a bunch of sanity checks; expensive, but also priceless during development/debugging. */
-void do_asserts_for_index(heap_t *heap, ordered_array_t *index, area_header_t *header_to_create, area_footer_t *footer_to_create, uint32 size) {
-
-	/* First, make sure the paremeters make sense! */
-	assert(index != NULL);
-	assert(header_to_create != NULL);
-	assert(footer_to_create != NULL);
-	assert(size > sizeof(area_header_t) + sizeof(area_footer_t));
-
-#if HEAP_DEBUG >= 2
-	/* Loop through the entire index */
-	for (uint32 i = 0; i < index->size; i++) {
-		area_header_t *found_header = (area_header_t *)lookup_ordered_array(i, index);
-		area_footer_t *found_footer = FOOTER_FROM_HEADER(found_header);
+static void do_asserts_for_area(area_header_t *found_header, area_header_t *header_to_create, area_footer_t *footer_to_create, uint32 size) {
+	area_footer_t *found_footer = FOOTER_FROM_HEADER(found_header);
 
 		/* Equality tests */
 		assert(found_header != header_to_create);
@@ -203,7 +238,21 @@ void do_asserts_for_index(heap_t *heap, ordered_array_t *index, area_header_t *h
 			/* We're to the right; make sure we don't write inside the area that begins at found_header */
 			assert((uint32)found_header + found_header->size <= (uint32)header_to_create);
 		}
-	}
+}
+
+void do_asserts_for_index(heap_t *heap, area_header_t *header_to_create, area_footer_t *footer_to_create, uint32 size) {
+
+	/* First, make sure the paremeters make sense! */
+	assert(header_to_create != NULL);
+	assert(footer_to_create != NULL);
+	assert(size > sizeof(area_header_t) + sizeof(area_footer_t));
+
+#if HEAP_DEBUG >= 2
+	/* Loop through both indexes in their entirety */
+	rb_foreach(&heap->used_index, it)
+		do_asserts_for_area(NODE_AREA(it), header_to_create, footer_to_create, size);
+	rb_foreach(&heap->free_index, it)
+		do_asserts_for_area(NODE_AREA(it), header_to_create, footer_to_create, size);
 #endif
 }
 
@@ -224,8 +273,7 @@ static area_header_t *create_area(uint32 address, uint32 size, uint8 type, heap_
 #if HEAP_DEBUG
 	/* Very expensive, but very useful sanity checks! */
 	/* Due to the fact that we have TWO indexes, these checks are in a separate function. */
-	do_asserts_for_index(heap, &heap->free_index, header_to_create, footer_to_create, size);
-	do_asserts_for_index(heap, &heap->used_index, header_to_create, footer_to_create, size);
+	do_asserts_for_index(heap, header_to_create, footer_to_create, size);
 #endif
 
 	/* Write the header and footer to memory */
@@ -249,9 +297,9 @@ area_header_t *find_smallest_hole(uint32 size, bool page_align, heap_t *heap) {
 
 	area_header_t *header = NULL;
 
-	/* Loop through all the free areas */
-	for (uint32 i = 0; i < heap->free_index.size; i++) {
-		header = lookup_ordered_array(i, &heap->free_index);
+	/* Loop through the free areas, starting with the smallest one that is large enough */
+	for (rb_node_t *node = rb_lower_bound(&heap->free_index, free_area_size_compare, &size); node != NULL; node = rb_next(node)) {
+		header = NODE_AREA(node);
 
 #if HEAP_DEBUG >= 1
 	/* More checks never hurt! Unless you count performance, of course... */
@@ -374,8 +422,8 @@ void heap_contract(uint32 bytes_to_shrink, heap_t *heap) {
 
 #if HEAP_DEBUG >= 2
 	// Make sure NO used area is located past the new end address
-	for (uint32 i = 0; i < kheap->used_index.size; i++) {
-		area_header_t *found_header = (area_header_t *)lookup_ordered_array(i, &kheap->used_index);
+	rb_foreach(&kheap->used_index, it) {
+		area_header_t *found_header = NODE_AREA(it);
 		if ((char *)found_header + found_header->size > (char *)new_end_address) {
 			panic("contract_heap with used area outside of the new heap end address!");
 		}
@@ -419,6 +467,9 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 	if (!page_align)
 		size += 3;
 
+	if (size < MIN_AREA_SIZE)
+		size = MIN_AREA_SIZE;
+
 	area_header_t *area = find_smallest_hole(size, page_align, heap);
 
 	if (area == NULL) {
@@ -443,6 +494,7 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 		if (rightmost_area != NULL && rightmost_area->type == AREA_FREE) {
 			/* Add the space to this area */
 			area_footer_t *rightmost_footer = FOOTER_FROM_HEADER(rightmost_area);
+			free_index_remove(rightmost_area, heap);
 
 			/* "Delete" the old footer */
 			rightmost_footer->magic = 0;
@@ -455,7 +507,8 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 			rightmost_footer->magic = HEAP_MAGIC;
 			rightmost_footer->header = rightmost_area;
 
-			/* We're done! The hole was found in the index, so we don't need to add it. */
+			/* Add it back to the index, now that its size has changed */
+			free_index_insert(rightmost_area, heap);
 		}
 		else {
 			/* We didn't find anything useful! We need to add a new area. */
@@ -472,7 +525,7 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 			create_area((uint32)new_header, new_heap_size - old_heap_size, AREA_FREE, heap);
 
 			/* Since we created an area, we need to add it to the index. */
-			insert_ordered_array((void *)new_header, &heap->free_index);
+			free_index_insert(new_header, heap);
 		}
 
 		/* Then try again: */
@@ -485,7 +538,7 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 	 * An assert() checks that to prevent errors, and will fail if we try to create that hole before we do this.
 	 * This must also be done before the if (page_align) clause below, since that part will actually modify the /area/ variable.
 	 */
-	remove_ordered_array_item((void *)area, &heap->free_index);
+	free_index_remove(area, heap);
 
 	if (page_align && !IS_PAGE_ALIGNED((uint32)area + sizeof(area_header_t))) {
 		/* The caller has requested the memory be page-aligned; sure, can do! */
@@ -502,11 +555,11 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 		area_header_t *orig_area = area;
 		uint32 cached_size = area->size;
 
-		if (offset > sizeof(area_header_t) + sizeof(area_footer_t)) {
+		if (offset >= MIN_AREA_SIZE) {
 			/* Create a free area in the otherwise wasted space between /area/ and /area + offset/ that we're going to use now */
 			create_area((uint32)area, offset /* size */, AREA_FREE, heap);
 			/* Add the "waste area" to the index */
-			insert_ordered_array((void *)area, &heap->free_index);
+			free_index_insert(area, heap);
 		}
 		else {
 			/* This is rare, but happens... If we get here, the area between the previous area and the page-aligned area we want to create
@@ -519,6 +572,9 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 				area_header_t *test_header = test_footer->header;
 				if (test_header->magic == HEAP_MAGIC) {
 					/* Yep, we found another area! Increase it in size, and create a new footer for it. */
+					bool is_free = (test_header->type == AREA_FREE);
+					if (is_free)
+						free_index_remove(test_header, heap);
 					test_footer->magic = 0; /* invalidate the old footer */
 					test_header->size += offset;
 
@@ -526,6 +582,8 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 					test_footer = FOOTER_FROM_HEADER(test_header);
 					test_footer->magic = HEAP_MAGIC;
 					test_footer->header = test_header;
+					if (is_free)
+						free_index_insert(test_header, heap);
 				}
 			}
 		}
@@ -544,7 +602,7 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 	}
 
 	/* Is there enough space in the free area we're using to fit us AND another free area? */
-	if (area->size - size >= (16 + sizeof(area_header_t) + sizeof(area_footer_t))) {
+	if (area->size - size >= MIN_AREA_SIZE) {
 		/* The area we are allocating (/area/) is large enough to not only fit our data, but ANOTHER free area. */
 		/* Create a new area of size (area->size - size), where /size/ is the user-requested size for the allocation. */
 
@@ -555,7 +613,7 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 		create_area((uint32)free_space_header, (area->size - size), AREA_FREE, heap);
 
 		/* Write it to the index */
-		insert_ordered_array((void *)free_space_header, &heap->free_index);
+		free_index_insert(free_space_header, heap);
 	}
 	else {
 		/* There's not enough space to bother making a new area.
@@ -567,7 +625,7 @@ void *heap_alloc(uint32 size, bool page_align, heap_t *heap) {
 	create_area((uint32)area, size, AREA_USED, heap);
 
 	/* Add this area to the used_index */
-	insert_ordered_array((void *)area, &heap->used_index);
+	used_index_insert(area, heap);
 
 	uint32 ret = (uint32)area + sizeof(area_header_t);
 
@@ -662,20 +720,14 @@ void heap_free(void *p, heap_t *heap) {
 	}
 
 	/* Remove this area from the used index. We'll wait a little before adding it as a free area, though. */
-	remove_ordered_array_item((void *)header, &heap->used_index);
+	used_index_remove(header, heap);
 
 	/* Mark this area as free in memory */
 	header->type = AREA_FREE;
 
-	/* Should we add this hole to the index? This depends on whether we unify, and how (below). */
-	bool add_to_index = true;
-
 	/*
-	 * Here's how the index should work with the four possible cases:
-  	 * 1) free() without any bordering free areas: add to index; thus this is the default (above)
-	 * 2) free() + unify left (and left only): don't add to index (the left area is already there)
-	 * 3) free() + unify right (and right only): *DO* add, and also remove the right area from the index
-	 * 4) free() + unify both ways: DON'T add, or the area will end up a duplicate in the index.
+	 * Free areas we merge with are removed from the index, since their sizes change;
+	 * the merged area is then added at the end.
 	 */
 
 	/* Check if the area to our left is another free area; if so, merge with it, aka. unify left */
@@ -687,6 +739,7 @@ void heap_free(void *p, heap_t *heap) {
 		   area_header_t *left_area_header = left_area_footer->header;
 		   if (left_area_header->magic == HEAP_MAGIC && left_area_header->type == AREA_FREE) {
 			   /* Yep! Merge with this one. */
+			   free_index_remove(left_area_header, heap);
 
 			   /* Update the header with the new size from "us" */
 			   left_area_header->size += header->size;
@@ -706,10 +759,6 @@ void heap_free(void *p, heap_t *heap) {
 
 			   /* Re-point "our" header to the new area; this completes the merge */
 			   header = left_area_header;
-
-			   /* This area should not be added to the index, because "we" are now the area we found to the left,
-				* and THAT should already be in the index. */
-			   add_to_index = false;
 		   }
 	}
 
@@ -722,7 +771,7 @@ void heap_free(void *p, heap_t *heap) {
 			/* Yep! Merge with this one. */
 
 			/* Delete the rightmost hole from the index before we merge */
-			remove_ordered_array_item((void *)right_area_header, &heap->free_index);
+			free_index_remove(right_area_header, heap);
 
 			/* Add the newfound space to the leftmost header */
 			header->size += right_area_header->size;
@@ -741,18 +790,10 @@ void heap_free(void *p, heap_t *heap) {
 			assert(footer == FOOTER_FROM_HEADER(header));
 			footer->header = header;
 			header->type = AREA_FREE; /* just to be sure */
-
-			if (add_to_index == true) {
-				/* This could really be rewritten as "if (we_did_NOT_unify_left)", which is what we're really asking */
-				/* If we did unify left, we should NOT add this to the index, or there will be a duplicate entry. */
-				/* So, this statement does nothing... still. */
-				add_to_index = true;
-			}
 		}
 	}
 
-	if (add_to_index)
-		insert_ordered_array((void *)header, &heap->free_index);
+	free_index_insert(header, heap);
 
 	/* Contract the heap, if there is enough space at the end that we can consider it a waste of physical frames */
 	const uint32 max_waste = (heap == kheap ? KHEAP_MAX_WASTE : USER_HEAP_MAX_WASTE);
@@ -783,15 +824,15 @@ void heap_free(void *p, heap_t *heap) {
 		uint32 bytes_shrunk = old_heap_size - new_heap_size;
 		if (bytes_shrunk > 0) {
 			/* Resize the area, now that the old footer should be outside the heap */
+			free_index_remove(rightmost_area, heap);
 			rightmost_area->size -= bytes_shrunk;
 
 			/* Write a new footer */
 			rightmost_footer = FOOTER_FROM_HEADER(rightmost_area);
 			rightmost_footer->magic = HEAP_MAGIC;
 			rightmost_footer->header = rightmost_area;
+			free_index_insert(rightmost_area, heap);
 		}
-
-		/* Since the header address hasn't changed, we don't need to modify the index. We're done! */
 	}
 
 	INTERRUPT_UNLOCK;
@@ -814,19 +855,12 @@ heap_t *heap_create(uint32 start_address, uint32 initial_size, uint32 max_addres
 		vmm_alloc_user(USER_HEAP_START, USER_HEAP_START + USER_HEAP_INITIAL_SIZE + PAGE_SIZE, mm, PAGE_RW);
 	}
 
-	// Remember the first address used by the heap. Actual storage will start later,
-	// because the indexes are stored first. However, we need to free the entire thing
-	// in heap_destroy!
+	// Remember the first address used by the heap; we need to free the entire thing in heap_destroy!
 	heap->_min_address = start_address;
 
-	/* Create the indexes; they are zeroed in place_ordered_array */
-	heap->used_index = place_ordered_array((void *)start_address, HEAP_INDEX_SIZE, &area_header_t_less_than);
-	start_address += HEAP_INDEX_SIZE * sizeof(type_t);
-	heap->free_index = place_ordered_array((void *)start_address, HEAP_INDEX_SIZE, &area_header_t_less_than);
-	start_address += HEAP_INDEX_SIZE * sizeof(type_t);
-
-	/* Reduce the size of the actual heap to account for the indexes */
-	initial_size -= HEAP_INDEX_SIZE * sizeof(type_t) * 2;
+	/* Create the indexes. They need no storage of their own, since the nodes are in the area headers. */
+	rb_init(&heap->free_index, free_area_compare);
+	rb_init(&heap->used_index, used_area_compare);
 
 	/* Make sure the start address is page aligned, now that we've modified it */
 	if (!IS_PAGE_ALIGNED(start_address)) {
@@ -858,7 +892,7 @@ heap_t *heap_create(uint32 start_address, uint32 initial_size, uint32 max_addres
 	footer_to_create->header = header_to_create;
 
 	/* Add the area to the index */
-	insert_ordered_array((void *)header_to_create, &heap->free_index);
+	free_index_insert(header_to_create, heap);
 
 	/* Keep track of the rightmost area - since this is the ONLY area, it's also the rightmost area! */
 	heap->rightmost_area = header_to_create;
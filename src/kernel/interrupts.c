@@ -88,8 +88,18 @@ extern void irq126(void);
 /* The array of ISRs */
 isr_t interrupt_handlers[256] = {0};
 
-void register_interrupt_handler(uint8 n, isr_t handler) {
+/*
+ * Each vector has a single handler, so a handler can't take over a vector that has a different one
+ * (e.g. a PCI interrupt line shared between drivers); that would silently break the other driver.
+ * Returns false, and leaves the old handler in place, in that case.
+ */
+bool register_interrupt_handler(uint8 n, isr_t handler) {
+	if (interrupt_handlers[n] != NULL && interrupt_handlers[n] != handler) {
+		printk("WARNING: interrupt %u already has a handler (%p); not replacing it with %p\n", n, interrupt_handlers[n], handler);
+		return false;
+	}
 	interrupt_handlers[n] = handler;
+	return true;
 }
 
 /*
@@ -58,7 +58,7 @@ void panic(const char *fmt, ...) {
 	printk("\nPANIC: ");
 
 	va_start(args, fmt);
-	i = vsprintf(_printk_buf, fmt, args);
+	i = vsnprintf(_printk_buf, sizeof(_printk_buf), fmt, args);
 	va_end(args);
 
 	if (i > 0) {
@@ -17,6 +17,9 @@
 #include <kernel/syscall.h>
 #include <kernel/kshell.h>
 #include <kernel/ata.h>
+#include <kernel/ahci.h>
+#include <kernel/virtio_blk.h>
+#include <kernel/ramdisk.h>
 #include <kernel/partition.h>
 #include <kernel/fat.h>
 #include <kernel/ext2.h>
@@ -28,6 +31,8 @@
 #include <kernel/serial.h>
 #include <kernel/elf.h>
 #include <kernel/fpu.h>
+#include <kernel/memops.h>
+#include <kernel/bcache.h>
 
 /* kheap.c */
 extern uint32 placement_address;
@@ -41,7 +46,6 @@ extern list_t *fat32_partitions;
 extern nethandler_t *nethandler_arp;
 extern nethandler_t *nethandler_icmp;
 
-extern volatile list_t ready_queue;
 
 char *kernel_cmdline = NULL;
 bool quiet = false;
@@ -64,8 +68,15 @@ void kmain(multiboot_info_t *mbd, unsigned int magic, uint32 init_esp0) {
 	if (initrd_end > placement_address)
 		placement_address = initrd_end;
 
+	/* The same goes for any other modules, which are RAM disk images */
+	for (uint32 i = 1; i < mbd->mods_count; i++) {
+		module_t *mod = (module_t *)mbd->mods_addr + i;
+		if (mod->mod_end > placement_address)
+			placement_address = mod->mod_end;
+		ramdisk_add_image(mod->mod_start, mod->mod_end);
+	}
+
 	kernel_console.tasks->mutex = mutex_create();
-	ready_queue.mutex = mutex_create();
 
 	/* Set up the kernel console keybuffer, to prevent panics on keyboard input.
 	 * The kernel console isn't dynamically allocated, so this can be done
@@ -127,6 +138,7 @@ void kmain(multiboot_info_t *mbd, unsigned int magic, uint32 init_esp0) {
 	// CPUID support is assumed; it was added in the Pentium (and some 486 CPUs),
 	// which is about as far back as I'm willing to go. I've always had the Pentium
 	// in mind when developing.
+	// FXSAVE/FXRSTOR (and SSE) are used if available; see fpu_init().
 	int edx;
 	asm volatile("movl $1, %%eax;"
 			     "cpuid;"
@@ -138,8 +150,6 @@ void kmain(multiboot_info_t *mbd, unsigned int magic, uint32 init_esp0) {
 	if ((edx & (1 << 23)) == 0)
 		panic("exscapeOS requires MMX support! Halting.");
 
-	if ((edx & (1 << 24)) == 0)
-		panic("Your CPU doesn't support the FXSAVE/FXRSTOR instructions!");
 
 #define do_init(str, func) do { if (!quiet) printk(str); func; if (!quiet) printc(BLACK, GREEN, "done\n"); } while(0);
 
@@ -151,6 +161,7 @@ void kmain(multiboot_info_t *mbd, unsigned int magic, uint32 init_esp0) {
 	do_init("Initializing keyboard... ", init_keyboard());
 	do_init("Initializing the PIT... ", timer_install());
 	do_init("Initializing the FPU... ", fpu_init());
+	mem_select_variant(); // picks the large memcpy/memset variant; needs cpu_features
 
 	/* Initialize the initrd */
 	/* (do this before paging, so that it doesn't end up in the kernel heap) */
@@ -181,24 +192,26 @@ void kmain(multiboot_info_t *mbd, unsigned int magic, uint32 init_esp0) {
 	do_init("Initializing multitasking and setting up the kernel task... ", init_tasking(init_esp0));
 
 #if 1
+	do_init("Setting up the block buffer cache... ", bcache_init());
 	do_init("Detecting ATA devices and initializing them... ", ata_init());
-	do_init("Parsing MBRs... ", for (int i=0; i<3; i++) parse_mbr(&devices[i]));
+	do_init("Detecting AHCI controllers and disks... ", ahci_init());
+	do_init("Detecting virtio block devices... ", virtio_blk_init());
+	do_init("Setting up RAM disks... ", ramdisk_init());
+	do_init("Parsing MBRs... ", ilist_foreach(&blkdevs, it) parse_mbr(ilist_entry(it, blkdev_t, node)));
 
 	/* Detect FAT and ext2 filesystems on all partitions */
-	for (int disk = 0; disk < 4; disk++) {
-
-		if (!devices[disk].exists || devices[disk].is_atapi)
-			continue;
+	ilist_foreach(&blkdevs, it) {
+		blkdev_t *disk = ilist_entry(it, blkdev_t, node);
 
 		for (int part = 0; part < 4; part++) {
-			if (devices[disk].partition[part].exists && 
-					(devices[disk].partition[part].type == PART_FAT32 ||
-					 devices[disk].partition[part].type == PART_FAT32_LBA))
+			if (disk->partition[part].exists && 
+					(disk->partition[part].type == PART_FAT32 ||
+					 disk->partition[part].type == PART_FAT32_LBA))
 			{
-				fat_detect(&devices[disk], part);
+				fat_detect(disk, part);
 			}
-			else if (devices[disk].partition[part].exists && devices[disk].partition[part].type == PART_LINUX) {
-				ext2_detect(&devices[disk], part);
+			else if (disk->partition[part].exists && disk->partition[part].type == PART_LINUX) {
+				ext2_detect(disk, part);
 			}
 		}
 	}
@@ -21,6 +21,9 @@
 #include <kernel/vmm.h>
 #include <kernel/pmm.h>
 #include <kernel/timer.h>
+#include <kernel/memops.h>
+#include <kernel/fpu.h>
+#include <kernel/profile.h>
 #include <stdlib.h>
 
 /* for ls_initrd() */
@@ -28,12 +31,12 @@
 
 /* for lspci() */
 #include <kernel/pci.h>
+#include <kernel/bcache.h>
 
 #define MAX_PATH 1024 // TODO: move this
 
 void heaptest(void *data, uint32 length);
 
-extern volatile list_t ready_queue;
 
 static void infinite_loop(void *data, uint32 length) {
 	for(;;);
@@ -84,24 +87,179 @@ static void create_pagefault_delay(void *data, uint32 length) {
 	create_pagefault(NULL, 0);
 }
 
+#define ATABENCH_READS 2000
+#define ATABENCH_SECTORS 64
+
+// Reads the start of the disk over and over, and reports the throughput and CPU time used
+static void atabench_one(ata_device_t *dev, char *buf, bool dma) {
+	bool old_dma = dev->use_dma;
+	dev->use_dma = dma;
+
+	// The transfers are done by the disk's worker task, so count its CPU time as well
+	task_t *worker = dev->blkdev.worker;
+	uint32 cpu_start = current_task->utime_ticks + current_task->stime_ticks + worker->utime_ticks + worker->stime_ticks;
+	uint32 start = gettickcount();
+	for (int i = 0; i < ATABENCH_READS; i++) {
+		ata_read(dev, 0, buf, ATABENCH_SECTORS);
+	}
+	uint32 ms = (gettickcount() - start) * TIMER_MS;
+	uint32 cpu_ms = (current_task->utime_ticks + current_task->stime_ticks + worker->utime_ticks + worker->stime_ticks - cpu_start) * TIMER_MS;
+
+	if (dma && !dev->use_dma)
+		printk("DMA failed during the benchmark; the numbers below are (partly) for PIO\n");
+	else
+		dev->use_dma = old_dma;
+
+	if (ms == 0)
+		ms = 1;
+	uint32 kib = ATABENCH_READS * ATABENCH_SECTORS / 2;
+	uint32 kib_per_sec = kib * 1000 / ms;
+	printk("%s: read %u KiB in %u ms: %u.%02u MiB/s, CPU time %u ms (%u%%)\n", dma ? "DMA" : "PIO",
+			kib, ms, kib_per_sec / 1024, (kib_per_sec % 1024) * 100 / 1024, cpu_ms, cpu_ms * 100 / ms);
+}
+
 static void atabench(void *data, uint32 length) {
-	char *buf = kmalloc(64*512);
-	int start = gettickcount();
 	ata_device_t *dev = &devices[0];
-#define NUM_READS 10000
-	for (int i = 0; i < NUM_READS; i++) {
-		ata_read(dev, 0, buf, 64);
+	if (!dev->exists || dev->is_atapi) {
+		printk("atabench: no ATA disk found as primary master\n");
+		return;
 	}
 
-	int end = gettickcount();
+	char *buf = kmalloc(ATABENCH_SECTORS * 512);
+	atabench_one(dev, buf, false);
+	if (dev->use_dma)
+		atabench_one(dev, buf, true);
+	else
+		printk("DMA: not supported by the controller or drive\n");
+	kfree(buf);
+}
+
+static void blkstat(void) {
+	printk("%-8s %10s %10s %10s %10s %7s\n", "DEVICE", "IOS", "MERGES", "REQUESTS", "EXPIRED", "QUEUED");
+	ilist_foreach(&blkdevs, it) {
+		blkdev_t *b = ilist_entry(it, blkdev_t, node);
+		printk("%-8s %10u %10u %10u %10u %7u\n", b->name, b->stat_ios, b->stat_merges, b->stat_requests, b->stat_expired, b->sorted.count);
+	}
+}
+
+static void bcache_show(void) {
+	struct bcache_stats st;
+	bcache_get_stats(&st);
+
+	uint32 hit_pct = 0;
+	if (st.lookups >= 0x1000000)
+		hit_pct = st.hits / (st.lookups / 100); // avoid overflowing hits * 100
+	else if (st.lookups > 0)
+		hit_pct = st.hits * 100 / st.lookups;
+	printk("Buffer cache: %u buffers, %u of %u KiB used\n", st.buffers, st.bytes / 1024, st.limit / 1024);
+	printk("%u lookups: %u hits (%u%%), %u misses; %u evictions, %u invalidations\n",
+			st.lookups, st.hits, hit_pct, st.misses, st.evictions, st.invalidations);
+	printk("Read-ahead: %u buffers read, %u used, %u evicted unused\n", st.readahead, st.readahead_hits, st.readahead_unused);
+
+	uint32 written_kib = (uint32)(st.written_bytes >> 10);
+	uint32 kib_per_sec = 0;
+	if (written_kib >= 0x400000)
+		kib_per_sec = written_kib / (st.writeback_ms / 1000 + 1); // avoid overflowing written_kib * 1000
+	else if (st.writeback_ms > 0)
+		kib_per_sec = written_kib * 1000 / st.writeback_ms;
+	printk("Dirty: %u buffers, %u KiB; %u syncs\n", st.dirty_buffers, st.dirty_bytes / 1024, st.syncs);
+	printk("Writeback: %u buffers, %u KiB in %u ms (%u KiB/s); %u errors\n",
+			st.written, written_kib, st.writeback_ms, kib_per_sec, st.write_errors);
+}
 
-	printk("Reading %d sectors (64 at a time) took %u ms\n", 64*NUM_READS, 10 * (end - start));
+static inline uint32 rdtsc_low(void) {
+	uint32 lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return lo;
+}
+
+// Prints bytes/cycle (as x.yy, since we can't printk floats) for a memcpy/memset function
+static void membench_one(const char *name, void *(*cpy)(void *, const void *, size_t),
+		void *(*set)(void *, int, size_t), uint8 *dst, uint8 *src) {
+	static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 };
+#define MEMBENCH_TOTAL (4*1024*1024) /* bytes per measurement; keeps the cycle counts within 32 bits */
+
+	printk("%-6s", name);
+	for (uint32 i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		uint32 iterations = MEMBENCH_TOTAL / sizes[i];
+		uint32 start = rdtsc_low();
+		if (cpy != NULL) {
+			for (uint32 j = 0; j < iterations; j++)
+				cpy(dst, src, sizes[i]);
+		}
+		else {
+			for (uint32 j = 0; j < iterations; j++)
+				set(dst, j, sizes[i]);
+		}
+		uint32 cycles = rdtsc_low() - start;
+		if (cycles == 0)
+			cycles = 1;
+		uint32 hundredths = (100 * MEMBENCH_TOTAL) / cycles; // fits in 32 bits
+		printk(" %3u.%02u", hundredths / 100, hundredths % 100);
+	}
+	printk("\n");
+}
+
+static void membench(void *data, uint32 length) {
+	// Page aligned, with room to spare for the misaligned-source run
+	uint8 *src = kmalloc_a(1048576 + PAGE_SIZE);
+	uint8 *dst = kmalloc_a(1048576 + PAGE_SIZE);
+	memset(src, 0xaa, 1048576 + PAGE_SIZE);
+
+	printk("Bytes/cycle; the large memcpy/memset variant in use is \"%s\" (used from %u bytes)\n",
+			mem_current_variant()->name, mem_current_variant()->threshold);
+	const char *header = "    16     64    256     1K     4K    16K    64K   256K     1M\n";
+
+	printk("memcpy, aligned:\n      %s", header);
+	membench_one("memcpy", memcpy, NULL, dst, src);
+	for (int i = 0; i < num_mem_variants; i++) {
+		if ((cpu_features & mem_variants[i].required_features) == mem_variants[i].required_features)
+			membench_one(mem_variants[i].name, mem_variants[i].memcpy, NULL, dst, src);
+	}
+
+	printk("memcpy, misaligned source:\n      %s", header);
+	membench_one("memcpy", memcpy, NULL, dst, src + 1);
+	for (int i = 0; i < num_mem_variants; i++) {
+		if ((cpu_features & mem_variants[i].required_features) == mem_variants[i].required_features)
+			membench_one(mem_variants[i].name, mem_variants[i].memcpy, NULL, dst, src + 1);
+	}
+
+	printk("memset:\n      %s", header);
+	membench_one("memset", NULL, memset, dst, NULL);
+	for (int i = 0; i < num_mem_variants; i++) {
+		if ((cpu_features & mem_variants[i].required_features) == mem_variants[i].required_features)
+			membench_one(mem_variants[i].name, NULL, mem_variants[i].memset, dst, NULL);
+	}
+
+	kfree(src);
+	kfree(dst);
+}
+
+// Cycles per call for some typical debug output formats
+static void fmtbench(void *data, uint32 length) {
+	static const char *names[] = { "syscall trace", "hex dump", "strings" };
+	char buf[256];
+#define FMTBENCH_ITERATIONS 10000
+
+	for (int i = 0; i < 3; i++) {
+		uint32 start = rdtsc_low();
+		for (uint32 j = 0; j < FMTBENCH_ITERATIONS; j++) {
+			if (i == 0)
+				snprintf(buf, sizeof(buf), "syscall %d (%s) from pid %d: args 0x%08x 0x%08x %u -> %d\n", j & 63, "read", 12, 0xc0001000, j, 4096, -11);
+			else if (i == 1)
+				snprintf(buf, sizeof(buf), "%08x: %02x %02x %02x %02x %02x %02x %02x %02x\n", j, j & 0xff, 1, 2, 3, 4, 5, 6, 7);
+			else
+				snprintf(buf, sizeof(buf), "%-16s %10s %s/%s\n", "initrd", "ext2", "/usr/bin", "eshell");
+		}
+		uint32 cycles = rdtsc_low() - start;
+		printk("%-14s %u cycles/call\n", names[i], cycles / FMTBENCH_ITERATIONS);
+	}
 }
 
 /*
 static void cat(void *data, uint32 length) {
 	char path[1024] = {0};
-	strcpy(path, current_task->pwd);
+	strcpy(path, current_task->pwd->path);
 	path_join(path, (char *)data);
 	int fd = open(path, O_RDONLY);
 	assert(fd >= 0);
@@ -120,16 +278,16 @@ static void cat(void *data, uint32 length) {
 */
 
 static void lsk(void *data, uint32 length) {
-	DIR *dir = opendir(current_task->pwd);
+	DIR *dir = opendir(current_task->pwd->path);
 	if (!dir) {
-		printk("ls: unable to opendir(%s) (PWD)!\n", current_task->pwd);
+		printk("ls: unable to opendir(%s) (PWD)!\n", current_task->pwd->path);
 		return;
 	}
 	struct dirent *dirent;
 	struct stat st;
 	while ((dirent = readdir(dir)) != NULL) {
 		char fullpath[1024] = {0};
-		strcpy(fullpath, current_task->pwd);
+		strcpy(fullpath, current_task->pwd->path);
 		path_join(fullpath, dirent->d_name);
 
 		stat(fullpath, &st);
@@ -174,7 +332,7 @@ static void lsk(void *data, uint32 length) {
 }
 
 static void pwd(void *data, uint32 length) {
-	printk("%s\n", current_task->pwd);
+	printk("%s\n", current_task->pwd->path);
 }
 
 static void cd(void *data, uint32 length) {
@@ -460,6 +618,9 @@ void kshell(void *data, uint32 length) {
 			printk("exscapeOS kernel shell help\n\nAvailable commands:\n");
 
 			printk("!!               - re-execute last command\n");
+			printk("bcache           - show buffer cache statistics\n");
+			printk("bcache size <n>  - set the buffer cache size limit, in KiB\n");
+			printk("blkstat          - show disk request queue statistics\n");
 			printk("clear            - clear the screen\n");
 			printk("exit             - exit the shell\n");
 			printk("free             - display how much memory is used/free\n");
@@ -470,10 +631,15 @@ void kshell(void *data, uint32 length) {
 			printk("lsk              - list files (in-kernel)\n");
 			printk("lspci            - print the PCI device database\n");
 			printk("print_heap       - print the kernel heap index (used/free areas)\n");
+			printk("profdump         - write the profiler samples to the serial port, for flame graphs\n");
+			printk("profreport       - show where the CPU time went while profiling\n");
+			printk("profstart        - start the sampling profiler\n");
+			printk("profstop         - stop the sampling profiler\n");
 			printk("ps               - show processes\n");
 			printk("pwd              - print the current working directory\n");
 			printk("reboot           - restart the system cleanly (not yet! calls reset)\n");
 			printk("reset            - cause a triple fault immediately\n");
+			printk("sync             - write all dirty buffers to disk\n");
 			printk("testbench        - run a simple test benchmark in-kernel\n");
 			printk("testbench_task   - run a simple test benchmark as a task in-kernel\n");
 			printk("uptime           - show the current system uptime\n");
@@ -485,13 +651,16 @@ void kshell(void *data, uint32 length) {
 
 			if (strcmp(p, "help all") == 0) {
 				printk("\nTesting commands:\n");
+				printk("atabench         - benchmark ATA disk reads, with PIO and DMA\n");
 				printk("delaypanic       - cause a kernel panic after a delay\n");
 				printk("divzero          - divide by zero in-kernel\n");
 				printk("divzero_task     - divide by zero in a task\n");
 				printk("fill_scrollback  - fill the scrollback buffer\n");
+				printk("fmtbench         - benchmark printf-style formatting\n");
 				printk("fpu_task         - create a task that uses the FPU\n");
 				printk("infloop_task     - start a task that loops forever\n");
 				printk("kernel_stress    - process starting stress test (kernel mode)\n");
+				printk("membench         - benchmark the memcpy/memset variants\n");
 				printk("mutex_test       - test kernel mutexes\n");
 				printk("pagefault        - create a page fault\n");
 				printk("pagefault_delay  - create a page fault after a delay\n");
@@ -577,6 +746,47 @@ void kshell(void *data, uint32 length) {
 		else if (strcmp(p, "atabench") == 0) {
 			task = create_task(&atabench, "atabench", con, NULL, 0);
 		}
+		else if (strcmp(p, "bcache") == 0) {
+			bcache_show();
+		}
+		else if (strncmp(p, "bcache size ", 12) == 0) {
+			p += 12;
+			int kib = atoi(p);
+			if (kib <= 0)
+				printk("bcache: invalid size\n");
+			else {
+				bcache_set_limit(kib * 1024);
+				bcache_show();
+			}
+		}
+		else if (strcmp(p, "blkstat") == 0) {
+			blkstat();
+		}
+		else if (strcmp(p, "sync") == 0) {
+			int err = bcache_sync(NULL);
+			if (err != 0)
+				printk("sync: error %d\n", err);
+		}
+		else if (strcmp(p, "fmtbench") == 0) {
+			task = create_task(&fmtbench, "fmtbench", con, NULL, 0);
+		}
+		else if (strcmp(p, "membench") == 0) {
+			task = create_task(&membench, "membench", con, NULL, 0);
+		}
+		else if (strcmp(p, "profstart") == 0) {
+			prof_start();
+			printk("Profiling started\n");
+		}
+		else if (strcmp(p, "profstop") == 0) {
+			prof_stop();
+			printk("Profiling stopped\n");
+		}
+		else if (strcmp(p, "profreport") == 0) {
+			prof_report();
+		}
+		else if (strcmp(p, "profdump") == 0) {
+			prof_dump();
+		}
 		else if (strcmp(p, "uptime") == 0) {
 			uint32 up = uptime();
 			uint32 ticks = gettickcount();
@@ -590,11 +800,10 @@ void kshell(void *data, uint32 length) {
 		}
 		else if (strcmp(p, "ps") == 0) {
 			INTERRUPT_LOCK;
-			node_t *cur_task_node = ready_queue.head;
 			int n = 0;
-			printk("%5s %6s %10s %10s %6s %s\n", "PID", "RSS", "STACK_BTM", "PAGEDIR", "STATE", "NAME");
-			while (cur_task_node != NULL) {
-				task_t *cur_task = (task_t *)cur_task_node->data;
+			printk("%5s %6s %6s %10s %10s %6s %s\n", "PID", "RSS", "KMEM", "STACK_BTM", "PAGEDIR", "STATE", "NAME");
+			ilist_foreach(&ready_queue, it) {
+				task_t *cur_task = ilist_entry(it, task_t, rq_node);
 				n++;
 				const char *state_str;
 				switch(cur_task->state) {
@@ -625,14 +834,12 @@ void kshell(void *data, uint32 length) {
 				if (cur_task->state != TASK_DEAD) {
 					assert(cur_task != NULL);
 					assert(cur_task->mm != NULL);
-					printk("% 5d % 5dk 0x%08x 0x%08x %06s %s\n", cur_task->id, cur_task->mm->frames_used * 4, cur_task->stack, cur_task->mm->page_directory, state_str, cur_task->name);
+					printk("% 5d % 5dk % 5dk 0x%08x 0x%08x %06s %s\n", cur_task->id, cur_task->mm->frames_used * 4, task_kernel_footprint(cur_task) / 1024, cur_task->stack, cur_task->mm->page_directory, state_str, cur_task->name);
 				}
 				else {
 					assert(cur_task != NULL);
-					printk("% 5d ?????? 0x%08x NO DIR     %06s %s\n", cur_task->id, cur_task->stack, state_str, cur_task->name);
+					printk("% 5d ?????? % 5dk 0x%08x NO DIR     %06s %s\n", cur_task->id, task_kernel_footprint(cur_task) / 1024, cur_task->stack, state_str, cur_task->name);
 				}
-
-				cur_task_node = cur_task_node->next;
 			}
 			printk("%d tasks running\n", n);
 			INTERRUPT_UNLOCK;
@@ -672,6 +879,7 @@ void kshell(void *data, uint32 length) {
 			ext2_partition_t *tmp = (ext2_partition_t *)ext2_partitions->head->data;
 			uint32 size;
 			char *file_data = ext2_read_file(tmp, inode, &size);
+			if (file_data == NULL) { printk("error: read failed\n"); goto exit_loop; }
 			printk("cksum for inode %u = %04x\n", inode, internet_checksum(file_data, size));
 			kfree(file_data);
 		}
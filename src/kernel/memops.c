@@ -0,0 +1,211 @@
+#include <sys/types.h>
+#include <kernel/memops.h>
+#include <kernel/fpu.h>
+#include <kernel/console.h>
+
+// Interrupts are disabled while the kernel uses the MMX/SSE registers, so large
+// operations are split into chunks of this size.
+#define CHUNK_SIZE (64*1024)
+
+/* Plain rep movsd/stosd, which is what memcpy.s and memset.s use below the threshold */
+
+static void *memcpy_rep(void *dst, const void *src, size_t len) {
+	uint32 d0, d1, d2;
+	asm volatile("rep movsl;"
+				 "mov %[rest], %%ecx;"
+				 "rep movsb;"
+				 : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+				 : "0"(len >> 2), "1"(dst), "2"(src), [rest] "g"(len & 3)
+				 : "memory");
+	return dst;
+}
+
+static void *memset_rep(void *dst, int c, size_t len) {
+	uint32 d0, d1;
+	uint32 pattern = (c & 0xff) * 0x01010101;
+	asm volatile("rep stosl;"
+				 "mov %[rest], %%ecx;"
+				 "rep stosb;"
+				 : "=&c"(d0), "=&D"(d1)
+				 : "0"(len >> 2), "1"(dst), "a"(pattern), [rest] "g"(len & 3)
+				 : "memory");
+	return dst;
+}
+
+/* MMX: 64 bytes per iteration through the eight MMX registers */
+
+static void memcpy_mmx_chunk(uint8 *dst, const uint8 *src, size_t blocks) {
+	for (; blocks > 0; blocks--, src += 64, dst += 64) {
+		asm volatile("movq   (%0), %%mm0;"
+					 "movq  8(%0), %%mm1;"
+					 "movq 16(%0), %%mm2;"
+					 "movq 24(%0), %%mm3;"
+					 "movq 32(%0), %%mm4;"
+					 "movq 40(%0), %%mm5;"
+					 "movq 48(%0), %%mm6;"
+					 "movq 56(%0), %%mm7;"
+					 "movq %%mm0,   (%1);"
+					 "movq %%mm1,  8(%1);"
+					 "movq %%mm2, 16(%1);"
+					 "movq %%mm3, 24(%1);"
+					 "movq %%mm4, 32(%1);"
+					 "movq %%mm5, 40(%1);"
+					 "movq %%mm6, 48(%1);"
+					 "movq %%mm7, 56(%1);"
+					 : : "r"(src), "r"(dst) : "memory");
+	}
+}
+
+static void memset_mmx_chunk(uint8 *dst, const uint32 *pattern, size_t blocks) {
+	asm volatile("movd %0, %%mm0; punpckldq %%mm0, %%mm0" : : "m"(*pattern));
+	for (; blocks > 0; blocks--, dst += 64) {
+		asm volatile("movq %%mm0,   (%0);"
+					 "movq %%mm0,  8(%0);"
+					 "movq %%mm0, 16(%0);"
+					 "movq %%mm0, 24(%0);"
+					 "movq %%mm0, 32(%0);"
+					 "movq %%mm0, 40(%0);"
+					 "movq %%mm0, 48(%0);"
+					 "movq %%mm0, 56(%0);"
+					 : : "r"(dst) : "memory");
+	}
+}
+
+/*
+ * SSE: non-temporal stores, which bypass the cache. That's a loss for data that is used
+ * again soon, which is why this variant is only used for large sizes.
+ * The destination must be 16-byte aligned; the source needn't be.
+ */
+
+static void memcpy_sse_chunk(uint8 *dst, const uint8 *src, size_t blocks) {
+	for (; blocks > 0; blocks--, src += 64, dst += 64) {
+		asm volatile("prefetchnta 256(%0);"
+					 "movups   (%0), %%xmm0;"
+					 "movups 16(%0), %%xmm1;"
+					 "movups 32(%0), %%xmm2;"
+					 "movups 48(%0), %%xmm3;"
+					 "movntps %%xmm0,   (%1);"
+					 "movntps %%xmm1, 16(%1);"
+					 "movntps %%xmm2, 32(%1);"
+					 "movntps %%xmm3, 48(%1);"
+					 : : "r"(src), "r"(dst) : "memory");
+	}
+	asm volatile("sfence" : : : "memory");
+}
+
+static void memset_sse_chunk(uint8 *dst, const uint32 *pattern, size_t blocks) {
+	asm volatile("movss %0, %%xmm0; shufps $0, %%xmm0, %%xmm0" : : "m"(*pattern));
+	for (; blocks > 0; blocks--, dst += 64) {
+		asm volatile("movntps %%xmm0,   (%0);"
+					 "movntps %%xmm0, 16(%0);"
+					 "movntps %%xmm0, 32(%0);"
+					 "movntps %%xmm0, 48(%0);"
+					 : : "r"(dst) : "memory");
+	}
+	asm volatile("sfence" : : : "memory");
+}
+
+/*
+ * Common code for the SIMD variants: align the destination, run the block loop in chunks
+ * (with the FPU state saved and interrupts disabled), then do the tail the normal way.
+ */
+static void *memcpy_simd(void *dst, const void *src, size_t len, uint32 align,
+		void (*copy_chunk)(uint8 *, const uint8 *, size_t), bool emms) {
+	uint8 *d = dst;
+	const uint8 *s = src;
+
+	size_t head = (align - ((uint32)d & (align - 1))) & (align - 1);
+	if (head > len)
+		head = len;
+	memcpy_rep(d, s, head);
+	d += head; s += head; len -= head;
+
+	while (len >= 64) {
+		size_t bytes = (len < CHUNK_SIZE ? len : CHUNK_SIZE) & ~63;
+		bool reenable_interrupts = kernel_fpu_begin();
+		copy_chunk(d, s, bytes / 64);
+		if (emms)
+			asm volatile("emms");
+		kernel_fpu_end(reenable_interrupts);
+		d += bytes; s += bytes; len -= bytes;
+	}
+
+	memcpy_rep(d, s, len);
+	return dst;
+}
+
+static void *memset_simd(void *dst, int c, size_t len, uint32 align,
+		void (*set_chunk)(uint8 *, const uint32 *, size_t), bool emms) {
+	uint8 *d = dst;
+	uint32 pattern = (c & 0xff) * 0x01010101;
+
+	size_t head = (align - ((uint32)d & (align - 1))) & (align - 1);
+	if (head > len)
+		head = len;
+	memset_rep(d, c, head);
+	d += head; len -= head;
+
+	while (len >= 64) {
+		size_t bytes = (len < CHUNK_SIZE ? len : CHUNK_SIZE) & ~63;
+		bool reenable_interrupts = kernel_fpu_begin();
+		set_chunk(d, &pattern, bytes / 64);
+		if (emms)
+			asm volatile("emms");
+		kernel_fpu_end(reenable_interrupts);
+		d += bytes; len -= bytes;
+	}
+
+	memset_rep(d, c, len);
+	return dst;
+}
+
+static void *memcpy_mmx(void *dst, const void *src, size_t len) {
+	return memcpy_simd(dst, src, len, 8, memcpy_mmx_chunk, true);
+}
+
+static void *memset_mmx(void *dst, int c, size_t len) {
+	return memset_simd(dst, c, len, 8, memset_mmx_chunk, true);
+}
+
+static void *memcpy_sse(void *dst, const void *src, size_t len) {
+	return memcpy_simd(dst, src, len, 16, memcpy_sse_chunk, false);
+}
+
+static void *memset_sse(void *dst, int c, size_t len) {
+	return memset_simd(dst, c, len, 16, memset_sse_chunk, false);
+}
+
+// Ordered from least to most preferred. The thresholds are rough guesses: saving the FPU
+// state isn't free, and non-temporal stores only pay off once the data doesn't fit in the cache.
+const mem_variant_t mem_variants[] = {
+	{ "rep", 0, 0xffffffff, memcpy_rep, memset_rep },
+	{ "mmx", CPU_FEATURE_MMX, 4096, memcpy_mmx, memset_mmx },
+	{ "sse", CPU_FEATURE_SSE, 256*1024, memcpy_sse, memset_sse },
+};
+const int num_mem_variants = sizeof(mem_variants) / sizeof(mem_variants[0]);
+
+static const mem_variant_t *current_variant = &mem_variants[0];
+
+// Until mem_select_variant() runs, memcpy.s and memset.s never call these
+void *(*memcpy_large)(void *dst, const void *src, size_t len) = memcpy_rep;
+void *(*memset_large)(void *dst, int c, size_t len) = memset_rep;
+size_t memcpy_large_threshold = 0xffffffff;
+size_t memset_large_threshold = 0xffffffff;
+
+void mem_select_variant(void) {
+	for (int i = num_mem_variants - 1; i >= 0; i--) {
+		if ((cpu_features & mem_variants[i].required_features) == mem_variants[i].required_features) {
+			current_variant = &mem_variants[i];
+			break;
+		}
+	}
+
+	memcpy_large = current_variant->memcpy;
+	memset_large = current_variant->memset;
+	memcpy_large_threshold = current_variant->threshold;
+	memset_large_threshold = current_variant->threshold;
+}
+
+const mem_variant_t *mem_current_variant(void) {
+	return current_variant;
+}
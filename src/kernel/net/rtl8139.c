@@ -259,6 +259,14 @@ bool init_rtl8139(void) {
 			return false;
 		}
 
+		/* Register an IRQ handler; IRQ:s are mapped to 32+ due to CPU exceptions being at 0-31.
+		 * The card's interrupts are masked until IMR is set below. */
+		if (!register_interrupt_handler(32 + dev->irq, rtl8139_interrupt_handler)) {
+			printk("WARNING: RTL8139 on IRQ %u, which another driver uses; ignoring it\n", dev->irq);
+			rtl_mmio_base = NULL;
+			return false;
+		}
+
 		my_mac = (uint8 *)(rtl_mmio_base); // MAC address is stored at register 0
 
 		//recv_buf = kmalloc_ap(RTL8139_RXBUFFER_SIZE + 16, &recv_buf_phys);
@@ -289,9 +297,6 @@ bool init_rtl8139(void) {
 		/* Software reset to get started */
 		rtl8139_reset();
 
-		/* Register an IRQ handler */
-		register_interrupt_handler(32 + dev->irq, rtl8139_interrupt_handler); /* IRQ:s are mapped to 32+ due to CPU exceptions being at 0-31 */
-
 		/* Initialize the recieve buffer */
 		rtl_dword_w(RTL_RBSTART, (uint32)recv_buf_phys);
 
@@ -14,9 +14,7 @@ sint8 standard_lessthan_predicate(type_t a, type_t b) {
 ordered_array_t create_ordered_array(uint32 max_size, lessthan_predicate_t less_than) {
 	ordered_array_t arr;
 
-	/* allocate one element extra; remove_ordered_array accesses one element past the end.
-	 * ugly, but easier (and prettier code, even if the idea is dirty) than changing the algorithm. */
-	arr.array = (void *)kmalloc( (max_size + 1) * sizeof(type_t));
+	arr.array = (void *)kmalloc(max_size * sizeof(type_t));
 	memset(arr.array, 0, max_size * sizeof(type_t));
 	arr.size = 0;
 	arr.max_size = max_size;
@@ -42,45 +40,52 @@ void destroy_ordered_array(ordered_array_t *array) {
 	kfree(array->array);
 }
 
+/* Binary search: returns the index of the first element that is not less than /item/ (array->size if there is none) */
+uint32 lowerbound_ordered_array(type_t item, ordered_array_t *array) {
+	assert(array->less_than != NULL);
+	uint32 low = 0, high = array->size;
+	while (low < high) {
+		uint32 mid = low + (high - low) / 2;
+		if (array->less_than(array->array[mid], item))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
 /* Insert an item into an ordered array */
 void insert_ordered_array(type_t item, ordered_array_t *array) {
 	assert(array->less_than != NULL);
 	assert(array->size + 1 <= array->max_size);
 
-	uint32 i = 0;
-
-	/* Figure out where the item should be placed */
-	while (i < array->size && array->less_than(array->array[i], item))
-		i++;
-
-	if (i == array->size) {
-		/* Just add this item at the end of the array */
-		array->array[array->size] = item;
-	}
-	else {
-		/* Save the current item */
-		type_t tmp = array->array[i];
-
-		array->array[i] = item;
-
-		/* Move the rest of the array one step forwards */
-		while (i < array->size) {
-			i++;
-			type_t tmp2 = array->array[i];
-			array->array[i] = tmp;
-			tmp = tmp2;
-		}
+	/* Figure out where the item should be placed; after any equal items, to keep insertion order among them */
+	uint32 low = 0, high = array->size;
+	while (low < high) {
+		uint32 mid = low + (high - low) / 2;
+		if (array->less_than(item, array->array[mid]))
+			high = mid;
+		else
+			low = mid + 1;
 	}
 
+	/* Move the rest of the array one step forwards */
+	for (uint32 i = array->size; i > low; i--)
+		array->array[i] = array->array[i - 1];
+
+	array->array[low] = item;
 	array->size++;
 }
 
 sint32 indexof_ordered_array(type_t item, ordered_array_t *array) {
 	/* Returns the index where this item is stored (or the first, if it exists multiple times), or -1 if nothing is found. */
-	sint32 i = 0;
-	for (i = 0; i < (sint32)array->size; i++) {
-		if (lookup_ordered_array(i, array) == item)
+	/* Only items that compare equal to /item/ need to be checked; they're all stored together, starting at the lower bound. */
+	for (uint32 i = lowerbound_ordered_array(item, array); i < array->size; i++) {
+		if (array->array[i] == item)
 			return i;
+		if (array->less_than(item, array->array[i]))
+			break;
 	}
 
 	return -1;
@@ -99,8 +104,9 @@ type_t lookup_ordered_array(uint32 i, ordered_array_t *array) {
 
 /* Remove the object at i from the array */
 void remove_ordered_array(uint32 i, ordered_array_t *array) {
+	assert(i < array->size);
 	/* Shrink the array, overrwriting the element to remove */
-	while (i < array->size) {
+	while (i + 1 < array->size) {
 		array->array[i] = array->array[i+1];
 		i++;
 	}
@@ -110,11 +116,7 @@ void remove_ordered_array(uint32 i, ordered_array_t *array) {
 
 /* Remove the item /item/; if multiple exist, the first is deleted */
 void remove_ordered_array_item(type_t item, ordered_array_t *array) {
-	for (uint32 i = 0; i < array->size; i++) {
-		if (lookup_ordered_array(i, array) == item) {
-			/* We found it! Now remove it: */
-			remove_ordered_array(i, array);
-			return;
-		}
-	}
+	sint32 i = indexof_ordered_array(item, array);
+	if (i >= 0)
+		remove_ordered_array((uint32)i, array);
 }
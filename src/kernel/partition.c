@@ -2,7 +2,7 @@
 #include <kernel/partition.h>
 #include <kernel/kernutil.h>
 #include <kernel/console.h>
-#include <kernel/ata.h>
+#include <kernel/blkdev.h>
 #include <string.h> /* memset */
 #include <kernel/heap.h>
 
@@ -21,26 +21,16 @@ struct mbr_ptable {
 } __attribute__((packed));
 
 /* Reads LBA0, and sets up the partition entries for the disk. */
-void parse_mbr(ata_device_t *dev) {
+void parse_mbr(blkdev_t *dev) {
 	assert(dev != NULL);
 	assert(sizeof(struct mbr_ptable) == 16);
 
 	memset(dev->partition, 0, sizeof(partition_t) * 4);
 
-	/* If this device is nonexistant or an ATAPI device, set all partitions to
-	 * not present. */
-	if (!dev->exists || dev->is_atapi) {
-		for (int i=0; i < 3; i++) {
-			dev->partition[i].exists = false;
-		}
-
-		return;
-	}
-
 	/* Read the MBR from disk */
 	unsigned char *buf = kmalloc(512);
-	int ret = ata_read(dev, /* LBA = */ 0, buf, 1);
-	assert(ret != 0);
+	int ret = blk_rw(dev, /* LBA = */ 0, buf, 1, false);
+	assert(ret == 0);
 
 	/* Last 2 bytes of the MBR should be 0xAA55.
 	 * If they're not, set all partitions to not present and return. */
@@ -34,6 +34,22 @@ uint32 pci_read_config(uint8 bus, uint8 slot, uint8 func, uint8 reg) {
 	return inl(PCI_CONFIG_DATA);
 }
 
+// Writes a dword to the PCI configuration space; to change 8 or 16 bits, read-modify-write the dword.
+void pci_write_config(uint8 bus, uint8 slot, uint8 func, uint8 reg, uint32 value) {
+	outl(PCI_CONFIG_ADDRESS, PCI_ENABLE | (bus << 16) | (slot << 11) | (func << 8) | (reg & ~0x3));
+	outl(PCI_CONFIG_DATA, value);
+}
+
+void pci_enable_bus_master(pci_device_t *dev) {
+	assert(dev != NULL);
+	uint32 reg = pci_read_config(dev->bus, dev->slot, dev->func, PCI_CONF_COMMAND);
+	if ((reg & PCI_COMMAND_BUS_MASTER) == 0) {
+		// Only write the command half; writing ones to the status half would clear its error bits
+		reg = (reg & 0xffff) | PCI_COMMAND_BUS_MASTER;
+		pci_write_config(dev->bus, dev->slot, dev->func, PCI_CONF_COMMAND, reg);
+	}
+}
+
 void init_pci(void) {
 	uint32 bus, slot, func;
 
@@ -77,6 +93,9 @@ void init_pci(void) {
 				dev->irq = interrupt;
 				dev->classcode = classcode;
 				dev->subclasscode = subclasscode;
+				dev->bus = bus;
+				dev->slot = slot;
+				dev->func = func;
 
 				list_append(pci_devices, dev);
 				// BARs are filled in below
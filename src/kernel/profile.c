@@ -0,0 +1,235 @@
+#include <kernel/profile.h>
+#include <kernel/task.h>
+#include <kernel/heap.h>
+#include <kernel/kernutil.h>
+#include <kernel/console.h>
+#include <kernel/serial.h>
+#include <kernel/timer.h>
+#include <kernel/backtrace.h>
+#include <string.h>
+#include <stdio.h>
+
+// The tasks seen while profiling. Samples refer to these by index, so that names and
+// user symbol tables remain available after the tasks have exited.
+#define PROF_MAX_TASKS 64
+#define PROF_OTHER_TASK 0xff /* used once the table is full */
+
+struct prof_task {
+	int pid;
+	char name[16];
+	struct symtab *symtab; // we hold a reference until the next prof_start()
+};
+
+struct prof_sample {
+	uint32 eip[PROF_STACK_DEPTH]; // [0] is the interrupted EIP; the rest are its callers (kernel mode only), or 0
+	uint8 task; // index into tasks[], or PROF_OTHER_TASK
+	bool user; // interrupted in user mode
+};
+
+static struct prof_sample samples[PROF_MAX_SAMPLES];
+static uint32 num_samples = 0; // the total taken, including those that have been overwritten
+static volatile bool profiling = false;
+static uint32 start_ticks = 0, stop_ticks = 0;
+
+static struct prof_task tasks[PROF_MAX_TASKS];
+static uint32 num_tasks = 0;
+
+void prof_start(void) {
+	INTERRUPT_LOCK;
+	profiling = false;
+	for (uint32 i = 0; i < num_tasks; i++) {
+		if (tasks[i].symtab)
+			symtab_put(tasks[i].symtab);
+	}
+	num_tasks = 0;
+	num_samples = 0;
+	start_ticks = gettickcount();
+	profiling = true;
+	INTERRUPT_UNLOCK;
+}
+
+void prof_stop(void) {
+	if (profiling) {
+		profiling = false;
+		stop_ticks = gettickcount();
+	}
+}
+
+static uint8 prof_task_index(task_t *task) {
+	for (uint32 i = 0; i < num_tasks; i++) {
+		// A task that has called execve() gets a new entry, since its symbols differ
+		if (tasks[i].pid == task->id && tasks[i].symtab == task->symtab)
+			return i;
+	}
+
+	if (num_tasks >= PROF_MAX_TASKS)
+		return PROF_OTHER_TASK;
+
+	struct prof_task *t = &tasks[num_tasks];
+	t->pid = task->id;
+	strlcpy(t->name, task->name, sizeof(t->name));
+	t->symtab = task->symtab ? symtab_get(task->symtab) : NULL;
+
+	return num_tasks++;
+}
+
+void prof_tick(registers_t *regs) {
+	if (!profiling)
+		return;
+
+	assert(interrupts_enabled() == false);
+
+	struct prof_sample *s = &samples[num_samples & (PROF_MAX_SAMPLES - 1)];
+	memset(s, 0, sizeof(struct prof_sample));
+	s->eip[0] = regs->eip;
+	s->user = ((regs->cs & 3) == 3);
+	s->task = prof_task_index((task_t *)current_task);
+
+	if (!s->user) {
+		// Follow the saved EBP chain, but never outside the interrupted task's kernel stack,
+		// since we can't afford a page fault here
+		uint32 ebp = regs->ebp;
+		uint32 prev = (uint32)regs;
+		uint32 top = (uint32)current_task->stack;
+		for (int i = 1; i < PROF_STACK_DEPTH; i++) {
+			if (ebp <= prev || ebp + 8 > top)
+				break;
+			s->eip[i] = *((uint32 *)ebp + 1);
+			prev = ebp;
+			ebp = *(uint32 *)ebp;
+		}
+	}
+
+	num_samples++;
+}
+
+static const char *prof_task_name(struct prof_sample *s) {
+	return (s->task == PROF_OTHER_TASK) ? "(other)" : tasks[s->task].name;
+}
+
+static struct symbol *prof_symbol(struct prof_sample *s, uint32 eip) {
+	if (!s->user)
+		return symtab_find_addr(&kernel_symtab, eip);
+	else if (s->task != PROF_OTHER_TASK)
+		return symtab_find_addr(tasks[s->task].symtab, eip);
+	else
+		return NULL;
+}
+
+// The samples still in the buffer are those from this one up to num_samples, oldest first
+static uint32 prof_first_sample(void) {
+	return (num_samples > PROF_MAX_SAMPLES) ? num_samples - PROF_MAX_SAMPLES : 0;
+}
+
+struct prof_entry {
+	struct symbol *sym; // NULL for addresses without a symbol
+	bool user;
+	uint32 count;
+};
+
+#define PROF_REPORT_LINES 20
+
+void prof_report(void) {
+	prof_stop();
+
+	uint32 n = num_samples - prof_first_sample();
+	if (n == 0) {
+		printk("No samples; use profstart to start profiling\n");
+		return;
+	}
+
+	uint32 task_counts[PROF_MAX_TASKS + 1];
+	memset(task_counts, 0, sizeof(task_counts));
+	uint32 user_count = 0;
+
+	// Aggregate per symbol. There are usually a few hundred distinct ones at most, so a linear search will do.
+	struct prof_entry *entries = kmalloc(sizeof(struct prof_entry) * n);
+	uint32 num_entries = 0;
+	for (uint32 k = prof_first_sample(); k < num_samples; k++) {
+		struct prof_sample *s = &samples[k & (PROF_MAX_SAMPLES - 1)];
+		struct symbol *sym = prof_symbol(s, s->eip[0]);
+		uint32 i;
+		for (i = 0; i < num_entries; i++) {
+			if (entries[i].sym == sym && entries[i].user == s->user)
+				break;
+		}
+		if (i == num_entries) {
+			entries[i].sym = sym;
+			entries[i].user = s->user;
+			entries[i].count = 0;
+			num_entries++;
+		}
+		entries[i].count++;
+
+		task_counts[s->task == PROF_OTHER_TASK ? PROF_MAX_TASKS : s->task]++;
+		if (s->user)
+			user_count++;
+	}
+
+	// Insertion sort, most samples first
+	for (uint32 i = 1; i < num_entries; i++) {
+		struct prof_entry tmp = entries[i];
+		uint32 j = i;
+		for (; j > 0 && entries[j - 1].count < tmp.count; j--)
+			entries[j] = entries[j - 1];
+		entries[j] = tmp;
+	}
+
+	uint32 ms = (stop_ticks - start_ticks) * TIMER_MS;
+	printk("%u samples over %u.%02u seconds; %u%% user, %u%% kernel", n, ms / 1000, (ms % 1000) / 10, user_count * 100 / n, (n - user_count) * 100 / n);
+	if (num_samples > n)
+		printk(" (%u older samples were overwritten)", num_samples - n);
+	printk("\n\n%6s %6s  %s\n", "COUNT", "PCT", "FUNCTION");
+
+	for (uint32 i = 0; i < num_entries && i < PROF_REPORT_LINES; i++) {
+		uint32 permille = entries[i].count * 1000 / n;
+		const char *name = (entries[i].sym != NULL) ? entries[i].sym->name : "???";
+		printk("%6u %3u.%u%%  %s%s\n", entries[i].count, permille / 10, permille % 10, name, entries[i].user ? " (userspace)" : "");
+	}
+	if (num_entries > PROF_REPORT_LINES)
+		printk("(%u more functions not shown)\n", num_entries - PROF_REPORT_LINES);
+
+	printk("\n%6s %6s  %s\n", "COUNT", "PID", "TASK");
+	for (uint32 i = 0; i <= num_tasks; i++) {
+		uint32 idx = (i == num_tasks) ? PROF_MAX_TASKS : i;
+		if (task_counts[idx] == 0)
+			continue;
+		if (idx == PROF_MAX_TASKS)
+			printk("%6u %6s  %s\n", task_counts[idx], "-", "(other)");
+		else
+			printk("%6u %6d  %s\n", task_counts[idx], tasks[idx].pid, tasks[idx].name);
+	}
+
+	kfree(entries);
+}
+
+void prof_dump(void) {
+	prof_stop();
+
+	// One line per sample, e.g. "kshell;kshell_func_[k];printk_[k] 1", root first.
+	// flamegraph.pl adds up identical stacks; "--color=java" colors the _[k] (kernel) frames differently.
+	char line[384];
+	for (uint32 k = prof_first_sample(); k < num_samples; k++) {
+		struct prof_sample *s = &samples[k & (PROF_MAX_SAMPLES - 1)];
+		const size_t room = sizeof(line) - 4; // leave space for " 1\n"
+		size_t len = snprintf(line, room, "%s", prof_task_name(s));
+
+		for (int d = PROF_STACK_DEPTH - 1; d >= 0 && len < room; d--) {
+			if (s->eip[d] == 0)
+				continue;
+			struct symbol *sym = prof_symbol(s, s->eip[d]);
+			const char *suffix = s->user ? "" : "_[k]";
+			if (sym != NULL)
+				len += snprintf(line + len, room - len, ";%s%s", sym->name, suffix);
+			else
+				len += snprintf(line + len, room - len, ";0x%08x%s", s->eip[d], suffix);
+		}
+
+		if (len >= room)
+			len = room - 1;
+		strlcpy(line + len, " 1\n", 4);
+		serial_send(line);
+	}
+
+	printk("Wrote %u samples to the serial port\n", num_samples - prof_first_sample());
+}
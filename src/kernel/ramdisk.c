@@ -0,0 +1,106 @@
+#include <sys/types.h>
+#include <kernel/ramdisk.h>
+#include <kernel/blkdev.h>
+#include <kernel/kernutil.h>
+#include <kernel/console.h>
+#include <kernel/heap.h>
+#include <kernel/pmm.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef struct ramdisk {
+	uint8 *data;
+	blkdev_t blkdev;
+} ramdisk_t;
+
+static struct {
+	uint32 start;
+	uint32 end;
+} images[RAMDISK_MAX_IMAGES];
+static uint32 num_images = 0;
+static uint32 num_ignored = 0; /* past RAMDISK_MAX_IMAGES */
+
+static uint32 num_ramdisks = 0;
+
+extern char *kernel_cmdline;
+
+static int ramdisk_transfer(blkdev_t *dev, blk_request_t *req);
+
+static const blkdev_ops_t ramdisk_blkdev_ops = {
+	.transfer = ramdisk_transfer,
+};
+
+void ramdisk_add_image(uint32 start, uint32 end) {
+	// Too early to print anything; ramdisk_init() warns instead
+	if (num_images >= RAMDISK_MAX_IMAGES) {
+		num_ignored++;
+		return;
+	}
+
+	images[num_images].start = start;
+	images[num_images].end = end;
+	num_images++;
+}
+
+/* A plain copy; there's no point in having more than one request in flight */
+static int ramdisk_transfer(blkdev_t *dev, blk_request_t *req) {
+	ramdisk_t *rd = (ramdisk_t *)dev->driver_data;
+	uint8 *p = rd->data + (uint32)req->lba * 512;
+
+	for (blk_io_t *io = req->ios; io != NULL; io = io->next) {
+		if (req->write)
+			memcpy(p, io->buffer, io->sectors * 512);
+		else
+			memcpy(io->buffer, p, io->sectors * 512);
+		p += io->sectors * 512;
+	}
+
+	return 0;
+}
+
+static void ramdisk_create(uint8 *data, uint32 sectors) {
+	ramdisk_t *rd = kmalloc(sizeof(ramdisk_t));
+	memset(rd, 0, sizeof(ramdisk_t));
+	rd->data = data;
+
+	snprintf(rd->blkdev.name, sizeof(rd->blkdev.name), "ram%u", num_ramdisks++);
+	rd->blkdev.size = sectors;
+	rd->blkdev.max_sectors = RAMDISK_MAX_SECTORS;
+	rd->blkdev.ops = &ramdisk_blkdev_ops;
+	rd->blkdev.driver_data = rd;
+	blkdev_register(&rd->blkdev);
+}
+
+void ramdisk_init(void) {
+	if (num_ignored > 0)
+		printk("WARNING: more than %u RAM disk images; ignoring %u\n", RAMDISK_MAX_IMAGES, num_ignored);
+
+	for (uint32 i = 0; i < num_images; i++) {
+		uint32 sectors = (images[i].end - images[i].start) / 512;
+		if (sectors == 0) {
+			printk("WARNING: RAM disk image at 0x%08x is smaller than a sector; ignoring it\n", images[i].start);
+			continue;
+		}
+		ramdisk_create((uint8 *)images[i].start, sectors);
+	}
+
+	char *p = (kernel_cmdline != NULL) ? strstr(kernel_cmdline, "ramdisk=") : NULL;
+	if (p != NULL) {
+		int mib = atoi(p + 8);
+		// The disk comes from the kernel heap; leave at least half of it, and of the free RAM, for everything else
+		uint32 max_mib = (KHEAP_MAX_ADDR - KHEAP_START) / 2 / (1024 * 1024);
+		if (pmm_bytes_free() / 2 / (1024 * 1024) < max_mib)
+			max_mib = pmm_bytes_free() / 2 / (1024 * 1024);
+		if (mib > 0 && (uint32)mib > max_mib) {
+			printk("WARNING: ramdisk=%d is too large; using %u MiB instead\n", mib, max_mib);
+			mib = (int)max_mib;
+		}
+		if (mib > 0) {
+			uint32 bytes = (uint32)mib * 1024 * 1024;
+			uint8 *data = kmalloc(bytes);
+			memset(data, 0, bytes);
+			ramdisk_create(data, bytes / 512);
+		}
+	}
+}
@@ -0,0 +1,301 @@
+#include <sys/types.h>
+#include <kernel/rbtree.h>
+#include <kernel/kernutil.h>
+
+/*
+ * A red-black tree, with NULL leaves (which count as black).
+ * The invariants: the root is black, red nodes only have black children, and every path
+ * from a node down to its leaves has the same number of black nodes.
+ */
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+#define IS_RED(n) ((n) != NULL && (n)->color == RB_RED)
+#define IS_BLACK(n) ((n) == NULL || (n)->color == RB_BLACK)
+
+void rb_init(rb_tree_t *tree, rb_compare_t compare) {
+	assert(compare != NULL);
+	tree->root = NULL;
+	tree->count = 0;
+	tree->compare = compare;
+}
+
+/* Replaces /old/ with /new/ in old's parent (or as the root) */
+static void replace_child(rb_tree_t *tree, rb_node_t *old, rb_node_t *new) {
+	rb_node_t *parent = old->parent;
+	if (parent == NULL)
+		tree->root = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+
+	if (new != NULL)
+		new->parent = parent;
+}
+
+static void rotate_left(rb_tree_t *tree, rb_node_t *node) {
+	rb_node_t *right = node->right;
+	node->right = right->left;
+	if (right->left != NULL)
+		right->left->parent = node;
+	replace_child(tree, node, right);
+	right->left = node;
+	node->parent = right;
+}
+
+static void rotate_right(rb_tree_t *tree, rb_node_t *node) {
+	rb_node_t *left = node->left;
+	node->left = left->right;
+	if (left->right != NULL)
+		left->right->parent = node;
+	replace_child(tree, node, left);
+	left->right = node;
+	node->parent = left;
+}
+
+void rb_insert(rb_tree_t *tree, rb_node_t *node) {
+	assert(node != NULL);
+
+	// Plain binary search tree insert; equal keys go to the right
+	rb_node_t *parent = NULL;
+	rb_node_t **link = &tree->root;
+	while (*link != NULL) {
+		parent = *link;
+		if (tree->compare(node, parent) < 0)
+			link = &parent->left;
+		else
+			link = &parent->right;
+	}
+
+	node->parent = parent;
+	node->left = NULL;
+	node->right = NULL;
+	node->color = RB_RED;
+	*link = node;
+	tree->count++;
+
+	// Fix up red nodes with red parents
+	while (IS_RED(node->parent)) {
+		parent = node->parent;
+		rb_node_t *grandparent = parent->parent; // exists, since the root is black
+
+		if (parent == grandparent->left) {
+			rb_node_t *uncle = grandparent->right;
+			if (IS_RED(uncle)) {
+				// Push the blackness down from the grandparent, and continue from there
+				parent->color = RB_BLACK;
+				uncle->color = RB_BLACK;
+				grandparent->color = RB_RED;
+				node = grandparent;
+				continue;
+			}
+			if (node == parent->right) {
+				rotate_left(tree, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->color = RB_BLACK;
+			grandparent->color = RB_RED;
+			rotate_right(tree, grandparent);
+		}
+		else {
+			rb_node_t *uncle = grandparent->left;
+			if (IS_RED(uncle)) {
+				parent->color = RB_BLACK;
+				uncle->color = RB_BLACK;
+				grandparent->color = RB_RED;
+				node = grandparent;
+				continue;
+			}
+			if (node == parent->left) {
+				rotate_right(tree, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->color = RB_BLACK;
+			grandparent->color = RB_RED;
+			rotate_left(tree, grandparent);
+		}
+	}
+
+	tree->root->color = RB_BLACK;
+}
+
+void rb_remove(rb_tree_t *tree, rb_node_t *node) {
+	assert(node != NULL);
+	assert(tree->count > 0);
+
+	rb_node_t *child, *parent;
+	uint32 removed_color;
+
+	if (node->left != NULL && node->right != NULL) {
+		// Two children: put the successor (which has no left child) in node's place
+		rb_node_t *succ = node->right;
+		while (succ->left != NULL)
+			succ = succ->left;
+
+		removed_color = succ->color;
+		child = succ->right;
+
+		if (succ->parent == node)
+			parent = succ;
+		else {
+			parent = succ->parent;
+			parent->left = child;
+			if (child != NULL)
+				child->parent = parent;
+			succ->right = node->right;
+			node->right->parent = succ;
+		}
+
+		replace_child(tree, node, succ);
+		succ->left = node->left;
+		node->left->parent = succ;
+		succ->color = node->color;
+	}
+	else {
+		removed_color = node->color;
+		child = (node->left != NULL) ? node->left : node->right;
+		parent = node->parent;
+		replace_child(tree, node, child);
+	}
+
+	tree->count--;
+	node->parent = node->left = node->right = NULL;
+
+	if (removed_color == RB_RED)
+		return;
+
+	// A black node was removed, so paths through /child/ are one black node short
+	while (child != tree->root && IS_BLACK(child)) {
+		if (child == parent->left) {
+			rb_node_t *sibling = parent->right;
+			if (IS_RED(sibling)) {
+				sibling->color = RB_BLACK;
+				parent->color = RB_RED;
+				rotate_left(tree, parent);
+				sibling = parent->right;
+			}
+			if (IS_BLACK(sibling->left) && IS_BLACK(sibling->right)) {
+				sibling->color = RB_RED;
+				child = parent;
+				parent = child->parent;
+			}
+			else {
+				if (IS_BLACK(sibling->right)) {
+					sibling->left->color = RB_BLACK;
+					sibling->color = RB_RED;
+					rotate_right(tree, sibling);
+					sibling = parent->right;
+				}
+				sibling->color = parent->color;
+				parent->color = RB_BLACK;
+				sibling->right->color = RB_BLACK;
+				rotate_left(tree, parent);
+				child = tree->root;
+				break;
+			}
+		}
+		else {
+			rb_node_t *sibling = parent->left;
+			if (IS_RED(sibling)) {
+				sibling->color = RB_BLACK;
+				parent->color = RB_RED;
+				rotate_right(tree, parent);
+				sibling = parent->left;
+			}
+			if (IS_BLACK(sibling->left) && IS_BLACK(sibling->right)) {
+				sibling->color = RB_RED;
+				child = parent;
+				parent = child->parent;
+			}
+			else {
+				if (IS_BLACK(sibling->left)) {
+					sibling->right->color = RB_BLACK;
+					sibling->color = RB_RED;
+					rotate_left(tree, sibling);
+					sibling = parent->left;
+				}
+				sibling->color = parent->color;
+				parent->color = RB_BLACK;
+				sibling->left->color = RB_BLACK;
+				rotate_right(tree, parent);
+				child = tree->root;
+				break;
+			}
+		}
+	}
+
+	if (child != NULL)
+		child->color = RB_BLACK;
+}
+
+rb_node_t *rb_first(rb_tree_t *tree) {
+	rb_node_t *node = tree->root;
+	if (node == NULL)
+		return NULL;
+	while (node->left != NULL)
+		node = node->left;
+	return node;
+}
+
+rb_node_t *rb_last(rb_tree_t *tree) {
+	rb_node_t *node = tree->root;
+	if (node == NULL)
+		return NULL;
+	while (node->right != NULL)
+		node = node->right;
+	return node;
+}
+
+rb_node_t *rb_next(rb_node_t *node) {
+	if (node->right != NULL) {
+		node = node->right;
+		while (node->left != NULL)
+			node = node->left;
+		return node;
+	}
+
+	// Go up until we come from a left subtree
+	while (node->parent != NULL && node == node->parent->right)
+		node = node->parent;
+	return node->parent;
+}
+
+rb_node_t *rb_prev(rb_node_t *node) {
+	if (node->left != NULL) {
+		node = node->left;
+		while (node->right != NULL)
+			node = node->right;
+		return node;
+	}
+
+	while (node->parent != NULL && node == node->parent->left)
+		node = node->parent;
+	return node->parent;
+}
+
+rb_node_t *rb_lower_bound(rb_tree_t *tree, rb_key_compare_t compare, const void *key) {
+	rb_node_t *node = tree->root;
+	rb_node_t *best = NULL;
+	while (node != NULL) {
+		if (compare(key, node) <= 0) {
+			// node >= key; look for a smaller one to the left
+			best = node;
+			node = node->left;
+		}
+		else
+			node = node->right;
+	}
+
+	return best;
+}
+
+rb_node_t *rb_find(rb_tree_t *tree, rb_key_compare_t compare, const void *key) {
+	rb_node_t *node = rb_lower_bound(tree, compare, key);
+	if (node != NULL && compare(key, node) == 0)
+		return node;
+	return NULL;
+}
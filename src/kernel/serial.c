@@ -75,7 +75,7 @@ size_t prints(const char *fmt, ...) {
 	//mutex_lock(printk_mutex);
 
 	va_start(args, fmt);
-	i = vsprintf(_prints_buf, fmt, args);
+	i = vsnprintf(_prints_buf, sizeof(_prints_buf), fmt, args);
 	va_end(args);
 
 	if (i > 0) {
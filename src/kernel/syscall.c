@@ -6,6 +6,8 @@
 #include <kernel/vfs.h>
 #include <kernel/backtrace.h>
 #include <sys/time.h>
+#include <sys/taskstat.h>
+#include <sys/spawn.h>
 
 // strace-like mechanism that prints all syscalls and their parameters
 #define SYSCALL_DEBUG 0
@@ -37,6 +39,16 @@ int sys_execve(const char *path, char **argv, char **envp);
 char *sys_getcwd(char *buf, size_t size);
 int sys_pipe(int fildes[2]);
 ssize_t sys_readlink(const char *pathname, char *buf, size_t bufsiz);
+int sys_taskstats(struct taskstat *buf, int count);
+int sys_spawn(const char *path, char **argv, char **envp, const struct spawn_action *actions, int num_actions);
+int sys_clone(uint32 entry, uint32 stack, uint32 tls);
+void sys_thread_exit(void *retval);
+int sys_thread_join(int tid, void **retval);
+int sys_set_thread_area(uint32 base);
+int sys_futex(int *uaddr, int op, int val, const struct timespec *timeout);
+uint32 sys_cpu_features(void);
+int sys_sync(void);
+int sys_thread_detach(int tid);
 
 struct syscall_entry syscalls[] = {
 /*  { &function, num_args, return_size }, */
@@ -71,7 +83,18 @@ struct syscall_entry syscalls[] = {
 	{ &dup2, 2, 32 },
 	{ &sys_pipe, 1, 32 },
 	{ &sys_lstat, 2, 32 }, /* 30 */
-	{ &sys_readlink, 3, 32 }
+	{ &sys_readlink, 3, 32 },
+	{ &sys_taskstats, 2, 32 },
+	{ &sys_spawn, 5, 32 },
+	{ &sys_clone, 3, 32 },
+	{ &sys_thread_exit, 1, 32 }, /* 35 */
+	{ &sys_thread_join, 2, 32 },
+	{ &sys_set_thread_area, 1, 32 },
+	{ &sys_futex, 4, 32 },
+	{ &sys_cpu_features, 0, 32 },
+	{ &sys_sync, 0, 32 }, /* 40 */
+	{ &fsync, 1, 32 },
+	{ &sys_thread_detach, 1, 32 }
 };
 
 uint32 num_syscalls = 0;
@@ -98,6 +121,8 @@ uint32 syscall_handler(uint32 esp) {
 	// a Newlib syscalls.c bug that needs fixing.0
 	assert(func != NULL);
 
+	current_task->syscalls++;
+
 	enable_interrupts();
 	in_isr = false;
 
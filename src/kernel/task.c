@@ -12,12 +12,15 @@
 #include <kernel/vfs.h>
 #include <kernel/elf.h>
 #include <kernel/fpu.h>
+#include <kernel/profile.h>
 #include <path.h>
 #include <kernel/stdio.h>
 #include <reent.h>
 #include <sys/time.h> /* struct timespec */
 #include <sys/wait.h>
 #include <sys/errno.h>
+#include <sys/taskstat.h>
+#include <sys/spawn.h>
 
 /*
  * Here's a overview of how the multitasking works in exscapeOS.
@@ -52,6 +55,9 @@ task_t kernel_task = {
 	.state = TASK_RUNNING,
 	.wakeup_time = 0,
 	.console = &kernel_console,
+	.rq_node = { .prev = &ready_queue.head, .next = &ready_queue.head },
+	.children = ILIST_INIT(kernel_task.children),
+	.zombies = ILIST_INIT(kernel_task.zombies),
 };
 
 /* Our globals */
@@ -64,24 +70,40 @@ volatile task_t *current_task = &kernel_task;
  * the kernel console, and this is an easy way to do that. */
 volatile task_t *console_task = &kernel_task;
 
-extern volatile list_t ready_queue; /* "forward declare" the variable, since they link to each other */
-volatile node_t kernel_task_node = {
-	.data = (void *)&kernel_task,
-	.prev = NULL,
-	.next = NULL,
-	.list = (list_t *)&ready_queue,
-};
-
-volatile list_t ready_queue = {
-	.head = (node_t *)&kernel_task_node,
-	.tail = (node_t *)&kernel_task_node,
+ilist_t ready_queue = {
+	.head = { .prev = &kernel_task.rq_node, .next = &kernel_task.rq_node },
 	.count = 1,
-	.mutex =  NULL, // Set up ASAP in kmain
 };
 
+#define rq_task(node) ilist_entry(node, task_t, rq_node)
+#define sibling_task(node) ilist_entry(node, task_t, sibling)
+
+/* The main thread of the calling process; children and threads are attached to it */
+#define current_leader() ((task_t *)(current_task->is_thread ? current_task->parent : current_task))
+
+/* Adds a new task to the run queue, right after the current task, so that it runs next */
+static void rq_insert_next(task_t *task) {
+	INTERRUPT_LOCK;
+	if (ilist_linked((ilist_node_t *)&current_task->rq_node))
+		ilist_insert_after(&ready_queue, (ilist_node_t *)&current_task->rq_node, &task->rq_node);
+	else
+		ilist_append(&ready_queue, &task->rq_node);
+	INTERRUPT_UNLOCK;
+}
+
 /* true if the task exists and is running/sleeping; false if it has exited (or never even existed) */
 bool does_task_exist(task_t *task) {
-	return (list_find_first((list_t *)&ready_queue, (void *)task) != NULL);
+	// /task/ may have been freed already, so it can't be dereferenced; look for the pointer instead
+	bool found = false;
+	INTERRUPT_LOCK;
+	ilist_foreach(&ready_queue, it) {
+		if (rq_task(it) == task) {
+			found = true;
+			break;
+		}
+	}
+	INTERRUPT_UNLOCK;
+	return found;
 }
 
 extern list_t *pagedirs;
@@ -94,20 +116,98 @@ struct _reent *__getreent(void) {
 
 extern task_t *reaper_task;
 
+/* Tasks that have exited (or been killed), waiting for the reaper to destroy them; linked through ->exit_next */
+static task_t *exit_list = NULL;
+
+void wait_queue_sleep(wait_queue_t *wq) {
+	assert(wq != NULL);
+	assert(interrupts_enabled() == false);
+	assert(current_task->wq == NULL);
+
+	current_task->wq = wq;
+	current_task->wq_next = wq->head;
+	wq->head = (task_t *)current_task;
+	current_task->state = TASK_WAITING;
+
+	YIELD;
+}
+
+bool wait_queue_sleep_timeout(wait_queue_t *wq, uint32 milliseconds) {
+	assert(current_task->wakeup_time == 0);
+
+	current_task->wait_timed_out = false;
+	if (milliseconds > 0) {
+		// The scheduler takes the task off the queue when this passes; see scheduler_taskSwitch()
+		uint32 ticks = milliseconds / TIMER_MS;
+		if (ticks == 0)
+			ticks = 1;
+		current_task->wakeup_time = gettickcount() + ticks;
+	}
+
+	wait_queue_sleep(wq);
+
+	current_task->wakeup_time = 0;
+	return !current_task->wait_timed_out;
+}
+
+int wait_queue_wake(wait_queue_t *wq) {
+	return wait_queue_wake_match(wq, NULL, NULL, -1);
+}
+
+int wait_queue_wake_match(wait_queue_t *wq, bool (*match)(task_t *, void *), void *data, int max) {
+	assert(wq != NULL);
+	int n = 0;
+
+	INTERRUPT_LOCK;
+	task_t **pp = &wq->head;
+	while (*pp != NULL && n != max) {
+		task_t *t = *pp;
+		if (match != NULL && !match(t, data)) {
+			pp = &t->wq_next;
+			continue;
+		}
+		*pp = t->wq_next;
+		t->wq_next = NULL;
+		t->wq = NULL;
+		if (t->state == TASK_WAITING) {
+			t->state = TASK_RUNNING;
+			n++;
+		}
+	}
+	INTERRUPT_UNLOCK;
+
+	return n;
+}
+
+// Unlinks a task from the wait queue it is blocked on (if any), without waking it
+static void wait_queue_remove(task_t *task) {
+	wait_queue_t *wq = task->wq;
+	if (wq == NULL)
+		return;
+
+	task_t **pp = &wq->head;
+	while (*pp != NULL && *pp != task)
+		pp = &(*pp)->wq_next;
+	assert(*pp == task);
+	*pp = task->wq_next;
+	task->wq_next = NULL;
+	task->wq = NULL;
+}
+
+/* Frees a zombie child, and returns its PID. Interrupts must be disabled. */
 static int do_wait_one(task_t *parent, task_t *child, int *status) {
 	assert(parent != NULL);
 	assert(child != NULL);
+	assert(child->state == TASK_DEAD);
 
 	if (status != NULL)
 		*status = child->exit_code;
 
 	int child_pid = child->id;
-	int a = parent->children->count;
-	list_remove_first((list_t *)&ready_queue, child);
-	list_remove_first(parent->children, child);
+	assert(ilist_linked(&child->sibling));
+	ilist_remove(&parent->zombies, &child->sibling);
 	memset(child, 0, sizeof(task_t));
 	kfree(child);
-	assert(parent->children->count == (uint32)(a - 1));
 
 	return child_pid;
 }
@@ -122,122 +222,123 @@ void destroy_task(task_t *task) {
 	// Freed earlier on
 	assert(task->console == NULL);
 
-	if (task->children && task->children->count > 0) {
-		// Take care of orphaned tasks
+	// Take care of orphaned tasks.
+	// Dead children that were never wait()ed for are simply freed; live ones are
+	// moved to the reaper, which will wait() for them when they exit.
+	{
+	INTERRUPT_LOCK;
+	ilist_foreach_safe(&task->zombies, it, tmp) {
+		task_t *child = sibling_task(it);
+		assert(child->state == TASK_DEAD);
+		ilist_remove(&task->zombies, it);
+		memset(child, 0, sizeof(task_t));
+		kfree(child);
+	}
 
+	if (!ilist_empty(&task->children)) {
 		assert(reaper_task != NULL);
-		assert(reaper_task->children != NULL);
-
-		INTERRUPT_LOCK;
-		list_foreach(task->children, it) {
-			task_t *child = (task_t *)it->data;
-			// There ase two possibilities here, for each child that we encounter:
-			// 1) It might be dead: in that case, we free the memory associated with it, and be done with it.
-			// 2) It might be alive: in that case, we move it to a new parent process.
-			if (child->state == TASK_DEAD) {
-				list_remove_first((list_t *)&ready_queue, child);
-				memset(child, 0, sizeof(task_t));
-				kfree(child);
-			}
-			else {
-				// Task is alive; move it.
-				// And by move, I really mean "add it to another task": we don't want to
-				// modify this list while iterating over it. Since we need to act on ALL
-				// members either way, there's no point in modifying it. We'll destroy it
-				// when this loop has exited.
-				list_append(reaper_task->children, child);
-				child->parent = reaper_task;
-			}
+		ilist_foreach_safe(&task->children, it, tmp) {
+			task_t *child = sibling_task(it);
+			ilist_remove(&task->children, it);
+			ilist_append(&reaper_task->children, it);
+			child->parent = reaper_task;
 		}
-		INTERRUPT_UNLOCK;
-
 	}
-
-	if (task->children != NULL) {
-		list_destroy(task->children);
-		task->children = NULL;
-	}
-
-	if (task->symbols) {
-		kfree(task->symbols);
-		task->symbols = NULL;
+	INTERRUPT_UNLOCK;
 	}
 
-	if (task->symbol_string_table) {
-		kfree(task->symbol_string_table);
-		task->symbol_string_table = NULL;
+	if (task->symtab) {
+		symtab_put(task->symtab);
+		task->symtab = NULL;
 	}
 
-	// Free stuff in the file descriptor table (the table itself is in struct task)
-	for (int i=0; i < MAX_OPEN_FILES; i++) {
-		if (task->fdtable[i]) {
-			int ret = do_close(i, task);
-			assert(ret == 0); // only fails if there's a bug somewhere, since we only call it on non-NULL fds
-			assert(task->fdtable[i] == NULL);
+	// Free stuff in the file descriptor table, unless other threads still use it
+	if (fdtable_release(task->fdtable)) {
+		for (int i=0; i < task->fdtable->size; i++) {
+			if (task->fdtable->files[i]) {
+				int ret = do_close(i, task);
+				assert(ret == 0); // only fails if there's a bug somewhere, since we only call it on non-NULL fds
+				assert(task->fdtable->files[i] == NULL);
+			}
 		}
+
+		// Free the table itself
+		fdtable_destroy(task->fdtable);
 	}
+	task->fdtable = NULL;
 
+	fpu_forget_task(task);
 	kfree(task->fpu_state);
+	task->fpu_state = NULL;
 
-	// Free the table itself
-	kfree(task->fdtable);
-	task->fdtable = NULL;
-
-	if (task->privilege == 3) {
-		destroy_user_page_dir(task->mm->page_directory);
-	}
 	// Free all of this task's frames (user space stack, stuff loaded from ELF files, etc.)
-	vmm_destroy_task_mm(task->mm);
+	// and its page directory, once the last thread using them is gone
+	vmm_put_task_mm(task->mm);
 	task->mm = NULL;
 
-	if (task->pwd)
-		kfree(task->pwd);
+	if (task->pwd) {
+		pwd_put(task->pwd);
+		task->pwd = NULL;
+	}
 
-	/* Free the kernel stack, after re-mapping the guard pages again */
-	vmm_clear_guard((uint32)task->stack - KERNEL_STACK_SIZE - 4096, kernel_directory);
-	vmm_clear_guard((uint32)task->stack, kernel_directory);
-	kfree((void *)( (uint32)task->stack - KERNEL_STACK_SIZE - 2*4096 ));
+	/* Return the kernel stack; it is unmapped, or kept around for the next task */
+	vmm_free_kernel_stack(task->stack);
 
-	assert(task->children == NULL);
+	assert(ilist_empty(&task->children));
+
+	/* Delete this task from the run queue; it will never run again */
+	INTERRUPT_LOCK;
+	ilist_remove(&ready_queue, &task->rq_node);
 
 	if (task->parent != NULL) {
-		assert(task->parent->state != TASK_DEAD);
-		// The parent might be wait()ing on this task, either right now or later on.
-		// We can't free this task just yet. Set the state and notify the scheduler,
-		// in case the parent is wait()ing.
-		if (task->parent->state == TASK_WAITING) {
-			set_next_task(task->parent);
+		task_t *parent = task->parent;
+		assert(parent->state != TASK_DEAD);
+		ilist_remove(&parent->children, &task->sibling);
+		if (task->detached) {
+			// Nobody will join this thread, so there's no reason to keep it around
+			memset(task, 0, sizeof(task_t));
+			kfree(task);
+		}
+		else {
+			// The parent might be wait()ing on this task, either right now or later on.
+			// We can't free this task just yet; move it to the parent's zombie list,
+			// and wake the parent up, in case it is wait()ing.
+			ilist_append(&parent->zombies, &task->sibling);
 		}
-		YIELD;
+		// (Threads of the parent may be the ones waiting, in pthread_join or sys_thread_exit)
+		if (wait_queue_wake(&parent->child_exit_wq) > 0 && parent->state == TASK_RUNNING)
+			set_next_task(parent);
 	}
 	else {
-		/* Delete this task from the queue */
-		list_remove_first((list_t *)&ready_queue, task);
 		memset(task, 0, sizeof(task_t));
 		kfree(task);
 	}
+	INTERRUPT_UNLOCK;
 }
 
 task_t *reaper_task = NULL;
 
+/*
+ * Destroys exited tasks, and wait()s for orphans that were moved to it.
+ * Sleeps on its child_exit_wq in between; kill() wakes it, as do orphans exiting.
+ */
 void reaper_func(void *data, uint32 length) {
 	while(true) {
 		INTERRUPT_LOCK;
-		list_foreach_dot(ready_queue, it) {
-			task_t *p = (task_t *)it->data;
-			if (p->state == TASK_EXITING) {
-				destroy_task(p);
-				break; // We need to restart this loop, as the iterator may now be invalid! This solves a rare crash.
-			}
-			else if (p->state == TASK_DEAD) {
-				uint32 o = current_task->children->count;
-				do_wait_one((task_t *)current_task, p, NULL);
-				assert(current_task->children->count == o - 1);
-				break; // TODO: the list has been modified, so we need to restart. Fix this, such that it's safe to modify the list!
-			}
+		while (exit_list != NULL) {
+			task_t *t = exit_list;
+			exit_list = t->exit_next;
+			t->exit_next = NULL;
+			destroy_task(t);
 		}
+
+		while (!ilist_empty((ilist_t *)&current_task->zombies)) {
+			do_wait_one((task_t *)current_task, sibling_task(ilist_first((ilist_t *)&current_task->zombies)), NULL);
+		}
+
+		// Interrupts are disabled, so nothing can have been added since we checked
+		wait_queue_sleep((wait_queue_t *)&current_task->child_exit_wq);
 		INTERRUPT_UNLOCK;
-		sleep(20); // TODO: make sure that higher values won't cause lag!
 	}
 }
 
@@ -247,8 +348,8 @@ bool kill_pid(int pid) {
 
 	INTERRUPT_LOCK;
 
-	list_foreach_dot(ready_queue, it) {
-		task_t *t = (task_t *)it->data;
+	ilist_foreach(&ready_queue, it) {
+		task_t *t = rq_task(it);
 		if (t->id == pid) {
 			kill(t);
 			INTERRUPT_UNLOCK;
@@ -260,22 +361,67 @@ bool kill_pid(int pid) {
 	return false;
 }
 
-void kill(task_t *task) {
+static void do_kill(task_t *task, int exit_code);
+
+static void do_kill_threads(task_t *task, int exit_code) {
+	assert(!task->is_thread);
+
 	INTERRUPT_LOCK;
+	ilist_foreach(&task->children, it) {
+		task_t *child = sibling_task(it);
+		if (child->is_thread)
+			do_kill(child, exit_code);
+	}
+	INTERRUPT_UNLOCK;
+}
+
+void kill_threads(task_t *task) {
+	do_kill_threads(task, (1 << 8));
+}
+
+static void do_kill(task_t *task, int exit_code) {
+	INTERRUPT_LOCK;
+	if (task->state == TASK_EXITING || task->state == TASK_DEAD) {
+		// Already on its way out
+		INTERRUPT_UNLOCK;
+		return;
+	}
+
+	// If the task is blocked (e.g. in wait()), it must not be woken up later
+	wait_queue_remove(task);
+
 	task->state = TASK_EXITING;
-	current_task->exit_code = (1 << 8);
+	task->exit_code = exit_code;
 
 	if (task->console != NULL) {
 		/* Remove this task from the console chain */
 		list_remove_first(task->console->tasks, task);
 		task->console = NULL;
 	}
+
+	/* When the main thread goes, the entire process goes */
+	if (!task->is_thread)
+		do_kill_threads(task, exit_code);
+
+	/* Hand the task to the reaper */
+	task->exit_next = exit_list;
+	exit_list = task;
+	if (reaper_task != NULL)
+		wait_queue_wake(&reaper_task->child_exit_wq);
 	INTERRUPT_UNLOCK;
 }
 
+void kill(task_t *task) {
+	do_kill(task, (1 << 8));
+}
+
+/* Terminates the calling process, including all of its threads */
 void _exit(int status) {
-	kill((task_t *)current_task);
-	current_task->exit_code = ((status & 0xff) << 8);
+	task_t *task = (task_t *)current_task;
+	if (task->is_thread)
+		task = task->parent;
+	do_kill(task, ((status & 0xff) << 8));
+	set_next_task(reaper_task); // clean up right away, so that the parent's wait() returns quickly
 	YIELD;
 	panic("this should never be reached (in _exit after switching tasks)");
 }
@@ -409,6 +555,80 @@ task_t *create_task_elf(const char *path, console_t *con, void *data, uint32 dat
 	return task;
 }
 
+static void free_kernel_strings(char **arr) {
+	for (int i = 0; arr[i] != NULL; i++)
+		kfree(arr[i]);
+	kfree(arr);
+}
+
+/*
+ * Creates a child of the current (user mode) task, running the program at /path/.
+ * Unlike fork + execve, the parent's address space is never copied; the child is
+ * built directly by the ELF loader. It inherits the parent's open files (after applying
+ * /actions/), working directory and console.
+ * argv and envp must be on the kernel heap; they are freed. Returns the child's PID, or -errno.
+ */
+int spawn(const char *path, char *argv[], char *envp[], const struct spawn_action *actions, int num_actions) {
+	assert(path != NULL);
+	assert(current_task->privilege == 3);
+	task_t *parent = current_leader(); // children of threads belong to the process
+
+	INTERRUPT_LOCK;
+
+	char buf[1024] = {0};
+	strlcpy(buf, path, 1024);
+	path_basename(buf);
+
+	task_t *child = create_task_int((void *)0 /* set up by the ELF loader */, buf, parent->console, 3, NULL, 0);
+	child->state = TASK_IDLE; // Ensure the task doesn't start until the image is fully loaded
+
+	// Replace the default stdin/stdout/stderr with the parent's files
+	for (int i = 0; i < child->fdtable->size; i++) {
+		if (child->fdtable->files[i])
+			do_close(i, child);
+	}
+	fdtable_release(child->fdtable);
+	fdtable_destroy(child->fdtable);
+	child->fdtable = fdtable_clone(parent->fdtable);
+
+	int err = 0;
+	for (int i = 0; i < num_actions && err == 0; i++) {
+		const struct spawn_action *a = &actions[i];
+		if (a->type == SPAWN_ACTION_DUP2)
+			err = do_dup2(a->fd, a->newfd, child);
+		else if (a->type == SPAWN_ACTION_CLOSE)
+			err = do_close(a->fd, child);
+		else
+			err = -EINVAL;
+
+		if (err > 0)
+			err = 0; // do_dup2 returns the new fd
+	}
+
+	if (err == 0 && (err = elf_load_argv(path, child, argv, envp)) == 0) {
+		// The ELF loader has copied argv and envp to the child, and freed them
+		argv = envp = NULL;
+	}
+
+	if (err != 0) {
+		// Abort! The child was never attached to the parent, so the reaper frees it right away.
+		free_kernel_strings(argv);
+		free_kernel_strings(envp);
+		kill(child);
+		INTERRUPT_UNLOCK;
+		return err;
+	}
+
+	ilist_append(&parent->children, &child->sibling);
+	child->parent = parent;
+
+	// Okay, we can let it run now!
+	child->state = TASK_RUNNING;
+
+	INTERRUPT_UNLOCK;
+	return child->id;
+}
+
 uint32 *set_task_stack(task_t *task, void *data, uint32 data_len, uint32 entry_point) {
 	assert(task != NULL);
 	assert(task->stack != NULL);
@@ -469,41 +689,15 @@ static task_t *create_task_int( void (*entry_point)(void *, uint32), const char
 	task->id = next_pid++;
 	task->esp = 0;
 
-	/*
-	 * Use guard pages around the stack
-	 * This wastes a "lot" of memory (16 kB total, per task of course), to keep the code simple...
-	 * The heap adds a header and a footer around the allocated memory,
-	 * so to get page-aligned storage with guard pages around, we need
-	 * to allocate a bunch of memory extra for those full pages, AND to store
-	 * the heap stuff before and after them.
-	 */
-
-	// tmp: the entire memory area, including guard pages
-	uint32 tmp = (uint32)kmalloc_a(KERNEL_STACK_SIZE + 4*4096);
-	// start_guard: address to the guard page BEFORE the memory (protects against OVERflow)
-	uint32 start_guard = (uint32)(tmp + 4096);
-	task->stack = (void*) (tmp + 2*4096 + KERNEL_STACK_SIZE);
-	// end_guard: address to the guard page AFTER the memory (protects against UNDERflow)
-	uint32 end_guard = (uint32)task->stack;
-
-	assert(tmp + KERNEL_STACK_SIZE + 2*4096 == (uint32)task->stack);
-	assert((uint32)task->stack + 2*4096 == tmp + KERNEL_STACK_SIZE + 4*4096);
-
-	/* Zero the stack, so user applications can't peer in to what may have been on the kernel heap */
-	memset((void *)tmp, 0, KERNEL_STACK_SIZE + 4*4096);
-
-	/* Set the guard pages */
-	vmm_set_guard(start_guard, kernel_directory);
-	vmm_set_guard(end_guard,   kernel_directory);
+	/* Kernel stack, with unmapped guard pages below and above; see vmm_alloc_kernel_stack() */
+	task->stack = vmm_alloc_kernel_stack();
 
 	task->privilege = privilege;
 
-	task->pwd = kmalloc(PATH_MAX + 1);
-
 	if (current_task && current_task->pwd)
-		strlcpy(task->pwd, current_task->pwd, PATH_MAX+1);
+		task->pwd = pwd_get(current_task->pwd);
 	else
-		strcpy(task->pwd, "/");
+		task->pwd = pwd_create("/");
 
 	if (task->privilege == 0) {
 		strcpy(task->name, "[");
@@ -514,8 +708,7 @@ static task_t *create_task_int( void (*entry_point)(void *, uint32), const char
 		strlcpy(task->name, name, TASK_NAME_LEN);
 
 	// Set up the task's file descriptor table
-	task->fdtable = kmalloc(sizeof(struct open_file) * MAX_OPEN_FILES); // TODO: smaller size + dynamic resizing
-	memset(task->fdtable, 0, sizeof(struct open_file) * MAX_OPEN_FILES);
+	task->fdtable = fdtable_create();
 
 	task->parent = NULL;
 
@@ -536,7 +729,7 @@ static task_t *create_task_int( void (*entry_point)(void *, uint32), const char
 		stdin->fops.close = stdio_close;
 		stdin->fops.fstat = stdio_fstat;
 
-		task->fdtable[0] = stdin;
+		task->fdtable->files[0] = stdin;
 
 		// Copy this info for stdout and stderr
 		// Differences are handled in the IO functions
@@ -544,8 +737,9 @@ static task_t *create_task_int( void (*entry_point)(void *, uint32), const char
 		struct open_file *stderr = kmalloc(sizeof(struct open_file));
 		memcpy(stdout, stdin, sizeof(struct open_file));
 		memcpy(stderr, stdin, sizeof(struct open_file));
-		task->fdtable[1] = stdout;
-		task->fdtable[2] = stderr;
+		task->fdtable->files[1] = stdout;
+		task->fdtable->files[2] = stderr;
+		task->fdtable->used[0] |= 0x7; // fds 0, 1 and 2
 
 		stdin->ino  = 0; // used to identify this as the "keyboard input" file regardless of fd later on (redirects etc.)
 		stdout->ino = 1; // ditto for screen output
@@ -561,10 +755,10 @@ static task_t *create_task_int( void (*entry_point)(void *, uint32), const char
 	task->fpu_state = kmalloc_a(sizeof(fpu_mmx_state_t));
 	task->has_used_fpu = false;
 
-	task->children = list_create();
+	ilist_init(&task->children);
+	ilist_init(&task->zombies);
 
-	task->symbols = NULL; // Set up in elf_load
-	task->symbol_string_table = NULL; // As is this
+	task->symtab = NULL; // Set up in elf_load
 
 	/* All tasks are running by default */
 	task->state = TASK_RUNNING;
@@ -578,7 +772,7 @@ static task_t *create_task_int( void (*entry_point)(void *, uint32), const char
 	set_task_stack(task, data, data_len, (uint32)entry_point);
 
 	/* Add the new task in the ready queue; we'll insert it so it runs next */
-	list_node_insert_after(list_find_first((list_t *)&ready_queue, (void *)current_task), (void *)task);
+	rq_insert_next(task);
 
 	/* Switch to the new console */
 	//if (console)
@@ -592,47 +786,23 @@ int fork(void) {
 
 	registers_t *regs = (registers_t *)((uint32)current_task->stack - sizeof(registers_t));
 
+	// The child is a copy of the calling thread, but a child of the process (i.e. its main thread)
 	task_t *parent = (task_t *)current_task;
+	task_t *leader = current_leader();
 	task_t *child = kmalloc(sizeof(task_t));
 	memset(child, 0, sizeof(task_t));
 
 	child->id = next_pid++;
 	child->esp = 0;
 
-	/*
-	 * Use guard pages around the stack
-	 * This wastes a "lot" of memory (16 kB total, per task of course), to keep the code simple...
-	 * The heap adds a header and a footer around the allocated memory,
-	 * so to get page-aligned storage with guard pages around, we need
-	 * to allocate a bunch of memory extra for those full pages, AND to store
-	 * the heap stuff before and after them.
-	 */
-
-	// tmp: the entire memory area, including guard pages
-	uint32 tmp = (uint32)kmalloc_a(KERNEL_STACK_SIZE + 4*4096);
-	// start_guard: address to the guard page BEFORE the memory (protects against OVERflow)
-	uint32 start_guard = (uint32)(tmp + 4096);
-	child->stack = (void*) (tmp + 2*4096 + KERNEL_STACK_SIZE);
-	// end_guard: address to the guard page AFTER the memory (protects against UNDERflow)
-	uint32 end_guard = (uint32)child->stack;
-
-	assert(tmp + KERNEL_STACK_SIZE + 2*4096 == (uint32)child->stack);
-	assert((uint32)child->stack + 2*4096 == tmp + KERNEL_STACK_SIZE + 4*4096);
-
-	/* Zero the stack, so user applications can't peer in to what may have been on the kernel heap */
-	memset((void *)tmp, 0, KERNEL_STACK_SIZE + 4*4096);
-
-	/* Set the guard pages */
-	// TODO: why kernel_directory? Was that on purpose?
-	vmm_set_guard(start_guard, kernel_directory);
-	vmm_set_guard(end_guard,   kernel_directory);
+	/* Kernel stack, with unmapped guard pages below and above; see vmm_alloc_kernel_stack() */
+	child->stack = vmm_alloc_kernel_stack();
 
 	child->privilege = 3;
 
 	assert(current_task->pwd != NULL);
-	assert(current_task->pwd[0] != 0);
-	child->pwd = kmalloc(PATH_MAX+1);
-	strlcpy(child->pwd, current_task->pwd, PATH_MAX+1);
+	assert(current_task->pwd->path[0] != 0);
+	child->pwd = pwd_get(current_task->pwd);
 
 	strlcpy(child->name, parent->name, TASK_NAME_LEN);
 
@@ -641,26 +811,19 @@ int fork(void) {
 	child->mm = vmm_clone_mm(parent->mm);
 
 	// Set up the task's file descriptor table
-	child->fdtable = kmalloc(sizeof(struct open_file) * MAX_OPEN_FILES);
-	memcpy(child->fdtable, parent->fdtable, sizeof(struct open_file) * MAX_OPEN_FILES);
-	for (int i = 0; i < MAX_OPEN_FILES; i++) {
-		if (child->fdtable[i] != NULL) {
-			// Since we only copied the pointers, this increases for the parent as well, of course
-			assert(parent->fdtable[i]->count > 0);
-			child->fdtable[i]->count++;
-		}
-	}
+	child->fdtable = fdtable_clone(parent->fdtable);
 
-	// Clone the FPU state
+	// Clone the FPU state (which may only be in the FPU registers right now)
+	fpu_sync_state(parent);
 	child->fpu_state = kmalloc_a(sizeof(fpu_mmx_state_t));
 	memcpy(child->fpu_state, parent->fpu_state, sizeof(fpu_mmx_state_t));
 	child->has_used_fpu = parent->has_used_fpu;
 
 	// Keep track of the tasks
-	assert(parent->children != NULL);
-	list_append(parent->children, child);
-	child->parent = parent;
-	child->children = list_create();
+	ilist_append(&leader->children, &child->sibling);
+	child->parent = leader;
+	ilist_init(&child->children);
+	ilist_init(&child->zombies);
 
 	child->state = TASK_IDLE;
 	child->wakeup_time = 0;
@@ -674,31 +837,9 @@ int fork(void) {
 	assert(parent->link_count == 0);
 	child->link_count = 0;
 
-	if (parent->symbols) {
-		// Clone symbols and symbol string tables
-		int num = 0;
-		for (struct symbol *sym = parent->symbols; sym->eip && sym->name; sym++) { num++; }
-		size_t size = sizeof(struct symbol) * (num + 1);
-		child->symbols = kmalloc(size);
-		memcpy(child->symbols, parent->symbols, size);
-
-		assert(parent->symbol_string_table != NULL);
-		child->symbol_string_table = kmalloc(parent->symbol_string_table_size);
-		memcpy(child->symbol_string_table, parent->symbol_string_table, parent->symbol_string_table_size);
-		child->symbol_string_table_size = parent->symbol_string_table_size;
-
-		// OK, so now we've cloned that... however, we have a problem.
-		// The ->name entries in each struct symbol is a *pointer*, which is still
-		// pointing towards the *parent's* string table... we need to update them.
-		// This works because the entire thing is one big allocation,
-		// and the offsets into the table is constant.
-		for (int i=0; i < num; i++) {
-			child->symbols[i].name -= (uint32)parent->symbol_string_table;
-			child->symbols[i].name += (uint32)child->symbol_string_table;
-		}
-	}
-	else
-		assert(parent->symbol_string_table == NULL);
+	// The child runs the same executable, so it can share the symbol table
+	if (parent->symtab)
+		child->symtab = symtab_get(parent->symtab);
 
 	/* Set up the kernel stack of the new process */
 	uint32 *kernelStack = child->stack;
@@ -731,130 +872,273 @@ int fork(void) {
 
 	uint32 data_segment = 0x23;
 
-	/* Data segments (DS, ES, FS, GS) */
-	*(--kernelStack) = data_segment;
+	/* Data segments (DS, ES, FS, GS); GS may point to the TLS segment */
 	*(--kernelStack) = data_segment;
 	*(--kernelStack) = data_segment;
 	*(--kernelStack) = data_segment;
+	*(--kernelStack) = (regs->gs == GDT_TLS_SELECTOR) ? GDT_TLS_SELECTOR : data_segment;
+	child->tls_base = parent->tls_base;
 
 	/* Now that we're done on the stack, set the stack pointers in the task structure */
 	child->esp = (uint32)kernelStack;
 	child->ss = data_segment;
 
 	/* Add the new task in the ready queue; we'll insert it so it runs next */
-	list_node_insert_after(list_find_first((list_t *)&ready_queue, (void *)current_task), (void *)child);
+	rq_insert_next(child);
 
 	child->state = TASK_RUNNING;
 
 	return child->id;
 }
 
-int sys_wait(int *status) {
-	if (status != NULL && !CHECK_ACCESS_WRITE(status, sizeof(int)))
+/*
+ * Creates a new thread in the calling process. It shares the address space, file
+ * descriptor table and working directory with the rest of the process, but has its
+ * own kernel stack, registers and FPU state.
+ * The thread starts executing at /entry/ with ESP = /stack/; setting up the user
+ * stack (including any arguments) is up to the caller. If /tls/ is non-zero, GS
+ * points to a TLS segment with that base address (see sys_set_thread_area).
+ * Returns the new thread's ID.
+ */
+int sys_clone(uint32 entry, uint32 stack, uint32 tls) {
+	assert(current_task->privilege == 3);
+	if (!IS_USER_SPACE(entry) || !CHECK_ACCESS_WRITE(stack - sizeof(uint32), sizeof(uint32)))
+		return -EFAULT;
+	if (tls != 0 && !IS_USER_SPACE(tls))
 		return -EFAULT;
-	if (current_task->children == NULL || current_task->children->count <= 0)
-		return -ECHILD;
 
-	// Check if we have any unwaited-for (dead) children already
-	{
+	task_t *creator = (task_t *)current_task;
+	task_t *leader = creator->is_thread ? creator->parent : creator;
+
+	task_t *thread = kmalloc(sizeof(task_t));
+	memset(thread, 0, sizeof(task_t));
+
+	thread->id = next_pid++;
+	thread->privilege = 3;
+	thread->is_thread = true;
+	strlcpy(thread->name, leader->name, TASK_NAME_LEN);
+
+	/* Kernel stack, with unmapped guard pages below and above; see vmm_alloc_kernel_stack() */
+	thread->stack = vmm_alloc_kernel_stack();
+
+	// The shared parts
+	thread->mm = vmm_get_task_mm(leader->mm);
+	thread->fdtable = fdtable_get(leader->fdtable);
+	thread->pwd = pwd_get(leader->pwd);
+	thread->reent = leader->reent; // userspace finds the per-thread struct _reent via TLS
+	if (leader->symtab)
+		thread->symtab = symtab_get(leader->symtab);
+
+	thread->fpu_state = kmalloc_a(sizeof(fpu_mmx_state_t));
+	thread->has_used_fpu = false;
+
+	ilist_init(&thread->children);
+	ilist_init(&thread->zombies);
+	thread->tls_base = tls;
+
+	set_task_stack(thread, NULL, 0, entry);
+	registers_t *regs = (registers_t *)thread->esp;
+	regs->useresp = stack;
+	if (tls != 0)
+		regs->gs = GDT_TLS_SELECTOR;
+
 	INTERRUPT_LOCK;
-	assert(current_task->children->count > 0);
-	list_foreach(current_task->children, it) {
-		task_t *child = (task_t *)it->data;
-		if (child->state == TASK_DEAD) {
-			// Yup, found one! Handle it.
-			return do_wait_one((task_t *)current_task, child, status);
-		}
-	}
+	// All threads are children of the main thread; see sys_thread_join
+	ilist_append(&leader->children, &thread->sibling);
+	thread->parent = leader;
+
+	thread->console = leader->console;
+	if (thread->console)
+		list_append(thread->console->tasks, thread);
+
+	thread->state = TASK_RUNNING;
+	rq_insert_next(thread);
+	INTERRUPT_UNLOCK;
+
+	return thread->id;
+}
+
+/* Sets the base address of the calling thread's TLS segment, and loads it into GS. Returns the selector. */
+int sys_set_thread_area(uint32 base) {
+	assert(current_task->privilege == 3);
+	if (!IS_USER_SPACE(base))
+		return -EFAULT;
+
+	INTERRUPT_LOCK;
+	current_task->tls_base = base;
+	gdt_set_tls_base(base);
+	// GS is reloaded (with the new base) on the way back to user mode
+	registers_t *regs = (registers_t *)((uint32)current_task->stack - sizeof(registers_t));
+	regs->gs = GDT_TLS_SELECTOR;
 	INTERRUPT_UNLOCK;
+
+	return GDT_TLS_SELECTOR;
+}
+
+static bool has_live_threads(task_t *task) {
+	ilist_foreach(&task->children, it) {
+		if (sibling_task(it)->is_thread)
+			return true;
 	}
+	return false;
+}
 
-	// No, but we do have a child that is still alive. Wait for it.
-	current_task->state = TASK_WAITING;
+/*
+ * Terminates the calling thread; /retval/ is handed to sys_thread_join.
+ * If the main thread calls this, the process lives on until all other threads have exited.
+ */
+void sys_thread_exit(void *retval) {
+	assert(current_task->privilege == 3);
+
+	if (!current_task->is_thread) {
+		INTERRUPT_LOCK;
+		while (has_live_threads((task_t *)current_task))
+			wait_queue_sleep((wait_queue_t *)&current_task->child_exit_wq);
+		INTERRUPT_UNLOCK;
+		_exit(0);
+	}
+
+	do_kill((task_t *)current_task, (int)retval);
+	set_next_task(reaper_task);
 	YIELD;
+	panic("this should never be reached (in sys_thread_exit after switching tasks)");
+}
+
+/* Waits for the thread /tid/ (in the calling process) to exit, and frees it */
+int sys_thread_join(int tid, void **retval) {
+	assert(current_task->privilege == 3);
+	if (retval != NULL && !CHECK_ACCESS_WRITE(retval, sizeof(void *)))
+		return -EFAULT;
+	if (tid == current_task->id)
+		return -EDEADLK;
+
+	task_t *leader = current_leader();
+
+	INTERRUPT_LOCK;
+	while (true) {
+		ilist_foreach(&leader->zombies, it) {
+			task_t *t = sibling_task(it);
+			if (t->is_thread && t->id == tid) {
+				int code;
+				do_wait_one(leader, t, &code);
+				INTERRUPT_UNLOCK;
+				if (retval != NULL)
+					*retval = (void *)code;
+				return 0;
+			}
+		}
+
+		task_t *thread = NULL;
+		ilist_foreach(&leader->children, it) {
+			task_t *t = sibling_task(it);
+			if (t->is_thread && t->id == tid) {
+				thread = t;
+				break;
+			}
+		}
+
+		if (thread == NULL) {
+			INTERRUPT_UNLOCK;
+			return -ESRCH;
+		}
+		if (thread->detached) {
+			INTERRUPT_UNLOCK;
+			return -EINVAL;
+		}
+
+		// destroy_task() wakes everyone sleeping here when a thread exits
+		wait_queue_sleep(&leader->child_exit_wq);
+	}
+}
+
+/*
+ * Marks the thread /tid/ (in the calling process) as detached: nobody will join it,
+ * so it is freed as soon as it exits. If it has already exited, it is freed right away.
+ */
+int sys_thread_detach(int tid) {
+	assert(current_task->privilege == 3);
+	task_t *leader = current_leader();
 
-	// We should ONLY get here when _exit() has finished on at least one child.
-	{
 	INTERRUPT_LOCK;
-	assert(current_task->children->count > 0);
-	list_foreach(current_task->children, it) {
-		task_t *child = (task_t *)it->data;
-		if (child->state == TASK_DEAD) {
-			// Yup, found one! Handle it.
-			return do_wait_one((task_t *)current_task, child, status);
+	ilist_foreach(&leader->zombies, it) {
+		task_t *t = sibling_task(it);
+		if (t->is_thread && t->id == tid) {
+			do_wait_one(leader, t, NULL);
+			INTERRUPT_UNLOCK;
+			return 0;
 		}
 	}
-	INTERRUPT_UNLOCK;
+
+	ilist_foreach(&leader->children, it) {
+		task_t *t = sibling_task(it);
+		if (t->is_thread && t->id == tid) {
+			int ret = t->detached ? -EINVAL : 0;
+			t->detached = true;
+			INTERRUPT_UNLOCK;
+			return ret;
+		}
 	}
-	panic("wait(): task was scheduled with no dead child!");
-	return 0; // To silence the compiler
+
+	INTERRUPT_UNLOCK;
+	return -ESRCH;
 }
 
 pid_t sys_waitpid(pid_t pid, int *status, int options) {
 	if (status != NULL && !CHECK_ACCESS_WRITE(status, sizeof(int)))
 		return -EFAULT;
-	if (current_task->children == NULL || current_task->children->count <= 0)
-		return -ECHILD;
 	if ((options & ~(WNOHANG | WUNTRACED)) != 0) /* unknown flags used */
 		return -EINVAL;
-
-	if (pid == -1 && options == 0)
-		return sys_wait(status);
-	else if (pid < -1 || pid == 0) {
+	if (pid < -1 || pid == 0) {
 		panic("waitpid() with pid < -1, or pid == 0: process groups are not implemented!");
 		return -ENOSYS; // not reached
 	}
 	assert(pid > 0 || pid == -1);
 
-	// Check if we have any unwaited-for (dead) children already
-	{
-		bool child_found = false;
-		INTERRUPT_LOCK;
-		assert(current_task->children->count > 0);
-		list_foreach(current_task->children, it) {
-			task_t *child = (task_t *)it->data;
+	// Any thread may wait for the children of the process
+	task_t *leader = current_leader();
+
+	INTERRUPT_LOCK;
+	while (true) {
+		// Check if we have any unwaited-for (dead) children already
+		ilist_foreach(&leader->zombies, it) {
+			task_t *child = sibling_task(it);
+			if (child->is_thread)
+				continue; // see sys_thread_join
 			if (pid == -1 || child->id == pid) {
+				int ret = do_wait_one(leader, child, status);
+				INTERRUPT_UNLOCK;
+				return ret;
+			}
+		}
+
+		// No; is there a child alive that we can wait for?
+		bool child_found = false;
+		ilist_foreach(&leader->children, it) {
+			task_t *child = sibling_task(it);
+			if (!child->is_thread && (pid == -1 || child->id == pid)) {
 				child_found = true;
-				if (child->state == TASK_DEAD) {
-					return do_wait_one((task_t *)current_task, child, status);
-				}
+				break;
 			}
 		}
-		INTERRUPT_UNLOCK;
 
 		if (!child_found) {
 			// The child the caller wants to wait for doesn't exist / isn't a child of this task!
+			INTERRUPT_UNLOCK;
 			return -ECHILD;
 		}
-	}
-
-	// No, but we do have a child that is still alive.
-	// Should we wait for it?
-	if (options & WNOHANG) {
-		// No!
-		return 0;
-	}
 
-	// Otherwise, yes: wait for it.
-	while (true) {
-		current_task->state = TASK_WAITING;
-		YIELD;
-
-		// We should ONLY get here when _exit() has finished on at least one child.
-		INTERRUPT_LOCK;
-		assert(current_task->children->count > 0);
-		list_foreach(current_task->children, it) {
-			task_t *child = (task_t *)it->data;
-			if (child->state == TASK_DEAD && (child->id == pid || pid == -1)) {
-				// Yup, found it! Handle this one.
-				return do_wait_one((task_t *)current_task, child, status);
-			}
+		if (options & WNOHANG) {
+			INTERRUPT_UNLOCK;
+			return 0;
 		}
-		INTERRUPT_UNLOCK;
+
+		// Sleep until a child exits (destroy_task() wakes us), then check again
+		wait_queue_sleep(&leader->child_exit_wq);
 	}
-	assert(false); // This should never be reached
+}
 
-	return 0; // To silence the compiler
+int sys_wait(int *status) {
+	return sys_waitpid(-1, status, 0);
 }
 
 void set_entry_point(task_t *task, uint32 addr) {
@@ -868,43 +1152,28 @@ void scheduler_set_iowait(void) {
 	/* TODO: set a timeout? */
 }
 
-static bool task_iowait_predicate(node_t *node) {
-	assert(node != NULL);
-	assert(node->data != NULL);
-	task_t *t = (task_t *)node->data;
-	return (t->state == TASK_IOWAIT);
-}
-
-/* Finds the (TODO! shouldn't be singular) IOWAIT process and wakes it, i.e. switches to it.
- * This function *IS* called from ISRs. */
-uint32 scheduler_wake_iowait(uint32 esp) {
-	//assert(current_task->state != TASK_IOWAIT);
-
-	node_t *n = NULL;
-	if (current_task->state != TASK_IOWAIT) {
-		if (current_task != &kernel_task && kernel_task.state == TASK_IOWAIT)
-			n = ready_queue.head;
-		else {
-			/* Only do this if the CURRENT task isn't the task to "wake" */
-			n = list_node_find_next_predicate(ready_queue.head, task_iowait_predicate);
-			assert(n != NULL);
-		}
+/* Finds the next task after /task/ on the run queue (wrapping around) that the predicate returns true for.
+ * /task/ itself is not tested. Returns NULL if there is no such task. */
+static task_t *rq_find_next(task_t *task, bool (*predicate_func)(task_t *)) {
+	assert(ilist_linked(&task->rq_node));
+	for (ilist_node_t *it = ilist_next_wrap(&ready_queue, &task->rq_node); it != &task->rq_node; it = ilist_next_wrap(&ready_queue, it)) {
+		if (predicate_func(rq_task(it)))
+			return rq_task(it);
 	}
 
-	/* make sure this is the ONLY process in IOWAIT */
-	/* This needs work! */
-	if (n == NULL)
-		n = list_find_first((list_t *)&ready_queue, (void *)current_task);
-	if (n != NULL)
-		assert(list_node_find_next_predicate(n, task_iowait_predicate) == NULL);
+	return NULL;
+}
 
-	/* Wake the task up, and switch to it! */
-	task_t *iotask = (task_t *)n->data;
-	assert(iotask->state == TASK_IOWAIT);
+/* Wakes /task/, which is in IOWAIT, and switches to it right away.
+ * This function *IS* called from ISRs. */
+uint32 scheduler_wake_iowait(task_t *task, uint32 esp) {
+	assert(task != NULL);
+	if (task->state != TASK_IOWAIT)
+		return esp;
 
-	iotask->state = TASK_RUNNING;
+	task->state = TASK_RUNNING;
 
-	return switch_task(iotask, esp);
+	return switch_task(task, esp);
 }
 
 uint32 switch_task(task_t *new_task, uint32 esp) {
@@ -937,6 +1206,14 @@ uint32 switch_task(task_t *new_task, uint32 esp) {
 	if (new_task->state == TASK_WAKING_UP)
 		new_task->state = TASK_RUNNING;
 
+	/* If the outgoing task could have kept running, it was preempted (by the timer
+	 * or an IRQ); otherwise it gave up the CPU itself (sleep, I/O, wait, YIELD). */
+	registers_t *regs = (registers_t *)esp;
+	if ((current_task->state & TASK_RUNNING) && regs->int_no != 0x7e)
+		current_task->nivcsw++;
+	else
+		current_task->nvcsw++;
+
 	/* this should really be a no-op, since, interrupts should already be disabled from the ISR. */
 	//disable_interrupts();
 	//task_switching = false;
@@ -944,6 +1221,9 @@ uint32 switch_task(task_t *new_task, uint32 esp) {
 	if (new_task->mm->page_directory != current_task->mm->page_directory)
 		switch_page_directory(new_task->mm->page_directory);
 
+	if (new_task->privilege == 3)
+		gdt_set_tls_base(new_task->tls_base);
+
 	/* Store the current ESP */
 	current_task->esp = esp;
 
@@ -968,10 +1248,7 @@ uint32 switch_task(task_t *new_task, uint32 esp) {
 	return current_task->esp;
 }
 
-static bool task_running_predicate(node_t *node) {
-	assert(node != NULL);
-	assert(node->data != NULL);
-	task_t *t = (task_t *)node->data;
+static bool task_running_predicate(task_t *t) {
 	return (t->state & TASK_RUNNING);
 }
 
@@ -984,6 +1261,17 @@ void set_next_task(task_t *task) {
 /* This function is called by the IRQ handler whenever the timer fires (or a software interrupt 0x7e is sent). */
 uint32 scheduler_taskSwitch(uint32 esp) {
 	assert(interrupts_enabled() == false);
+
+	/* Charge this tick to the interrupted task, before we (possibly) switch away from it */
+	registers_t *regs = (registers_t *)esp;
+	if (regs->int_no == IRQ0) {
+		if ((regs->cs & 3) == 3)
+			current_task->utime_ticks++;
+		else
+			current_task->stime_ticks++;
+		prof_tick(regs);
+	}
+
 	if (task_switching == false || (current_task == &kernel_task && ready_queue.count == 1))
 		return esp;
 
@@ -1012,34 +1300,39 @@ uint32 scheduler_taskSwitch(uint32 esp) {
 	 * any are found, check whether they should be woken up now.
 	 */
 	const uint32 ticks = gettickcount(); /* fetch just the once; interrupts are disabled, so the tick count can't change */
-	list_foreach_dot(ready_queue, it) {
-		task_t *p = (task_t *)it->data;
+	ilist_foreach(&ready_queue, it) {
+		task_t *p = rq_task(it);
 		if (p->state == TASK_SLEEPING && p->wakeup_time <= ticks) {
 			/* Wake this task! */
 			p->wakeup_time = 0;
 			p->state = TASK_WAKING_UP;
 			//return switch_task(p, esp); // It turns out that this will cause some tasks to never run...
 		}
+		else if (p->state == TASK_WAITING && p->wakeup_time != 0 && p->wakeup_time <= ticks) {
+			/* A wait_queue_sleep_timeout() timed out */
+			wait_queue_remove(p);
+			p->wakeup_time = 0;
+			p->wait_timed_out = true;
+			p->state = TASK_RUNNING;
+		}
 	}
 
-	node_t *old_task_node = list_find_first((list_t *)&ready_queue, (void *)current_task);
-
 	task_t *old_task = (task_t *)current_task;
 	task_t *new_task = NULL;
 
-	if (old_task_node == NULL) {
+	if (!ilist_linked(&old_task->rq_node)) {
 		/* The "current task" is not on the run queue. This would happen if
 		 * it had just been killed. Start over from the beginning of the run queue,
 		 * since we don't know which task would've been the next one.  */
-		new_task = (task_t *)(ready_queue.head->data);
+		new_task = rq_task(ilist_first(&ready_queue));
 	}
 	else {
 		/* Find the next task to run (exclude tasks that are sleeping, in IOWAIT, exiting, etc.) */
-		node_t *new_task_node = list_node_find_next_predicate(old_task_node, task_running_predicate);
+		new_task = rq_find_next(old_task, task_running_predicate);
 
-		if (new_task_node == NULL) {
+		if (new_task == NULL) {
 			/* all tasks are asleep, possibly except for the current one! */
-			if ( ((task_t *)old_task_node->data)->state & TASK_RUNNING) {
+			if (old_task->state & TASK_RUNNING) {
 				/* only the current process is not sleeping; let's not switch, then! */
 				return (esp);
 			}
@@ -1048,8 +1341,6 @@ uint32 scheduler_taskSwitch(uint32 esp) {
 				return switch_task(idle_task, esp);
 			}
 		}
-
-		new_task = (task_t *)new_task_node->data;
 	}
 
 	assert(new_task != NULL);
@@ -1068,14 +1359,40 @@ uint32 scheduler_taskSwitch(uint32 esp) {
     return switch_task(new_task, esp);
 }
 
+/* Threads report the ID of the main thread, i.e. the process ID */
 int getpid(void) {
+	if (current_task->is_thread)
+		return current_task->parent->id;
 	return current_task->id;
 }
 
 int getppid(void) {
 	assert(current_task->privilege == 3);
-	assert(current_task->parent != NULL);
-	return current_task->parent->id;
+	task_t *task = (task_t *)current_task;
+	if (task->is_thread)
+		task = task->parent;
+	assert(task->parent != NULL);
+	return task->parent->id;
+}
+
+void task_set_pwd(task_t *task, struct pwd *pwd) {
+	assert(task != NULL);
+	assert(pwd != NULL);
+
+	INTERRUPT_LOCK;
+	ilist_foreach(&ready_queue, it) {
+		task_t *t = rq_task(it);
+		// Threads are exactly the tasks that share an mm
+		if (t == task || (t->privilege == 3 && t->mm == task->mm)) {
+			struct pwd *old = t->pwd;
+			t->pwd = pwd_get(pwd);
+			if (old)
+				pwd_put(old);
+		}
+	}
+	INTERRUPT_UNLOCK;
+
+	pwd_put(pwd);
 }
 
 /* Takes a task off the run queue until enough time has passed */
@@ -1114,3 +1431,92 @@ int sys_nanosleep(const struct timespec *rqtp, struct timespec *rmtp __attribute
 
 	return 0;
 }
+
+uint32 task_kernel_footprint(task_t *task) {
+	assert(task != NULL);
+	uint32 bytes = sizeof(task_t) + KERNEL_STACK_SIZE;
+
+	bytes += fdtable_footprint(task->fdtable);
+	if (task->pwd)
+		bytes += sizeof(struct pwd) + strlen(task->pwd->path) + 1; // possibly shared with other tasks
+	if (task->fpu_state)
+		bytes += sizeof(fpu_mmx_state_t);
+	if (task->symtab) // shared with other tasks running the same executable
+		bytes += sizeof(struct symtab) + task->symtab->num * sizeof(struct symbol) + task->symtab->strtab_size;
+
+	if (task->mm != NULL) {
+		bytes += sizeof(struct task_mm);
+		page_directory_t *dir = task->mm->page_directory;
+		if (task->privilege == 3 && dir != NULL) {
+			bytes += sizeof(page_directory_t);
+			// Page tables in kernel space are shared with all other tasks; only count the user space ones
+			for (uint32 i = 0x10000000 / PAGE_SIZE / 1024; i < 0xc0000000 / PAGE_SIZE / 1024; i++) {
+				if (dir->tables[i] != NULL)
+					bytes += sizeof(page_table_t);
+			}
+		}
+	}
+
+	return bytes;
+}
+
+static char task_state_char(task_t *task) {
+	switch (task->state) {
+		case TASK_RUNNING:
+		case TASK_WAKING_UP:
+			return 'R';
+		case TASK_SLEEPING:
+			return 'S';
+		case TASK_IOWAIT:
+			return 'D';
+		case TASK_WAITING:
+			return 'W';
+		case TASK_IDLE:
+			return 'I';
+		case TASK_EXITING:
+			return 'X';
+		case TASK_DEAD:
+			return 'Z';
+		default:
+			return '?';
+	}
+}
+
+/* Copies accounting info for up to /count/ tasks into /buf/; returns the number of entries written. */
+int sys_taskstats(struct taskstat *buf, int count) {
+	if (count < 0)
+		return -EINVAL;
+	// No more entries than there are tasks can be filled in, and a larger count could
+	// make the size below wrap around, so that only part of the buffer is checked
+	if ((uint32)count > ready_queue.count)
+		count = ready_queue.count;
+	if (!CHECK_ACCESS_WRITE(buf, count * sizeof(struct taskstat)))
+		return -EFAULT;
+
+	int n = 0;
+	INTERRUPT_LOCK;
+	ilist_foreach(&ready_queue, it) {
+		if (n >= count)
+			break;
+		task_t *t = rq_task(it);
+		struct taskstat *ts = &buf[n++];
+		memset(ts, 0, sizeof(struct taskstat));
+
+		ts->pid = t->id;
+		ts->ppid = (t->parent != NULL) ? t->parent->id : 0;
+		ts->state = task_state_char(t);
+		ts->privilege = t->privilege;
+		ts->utime = t->utime_ticks * TIMER_MS;
+		ts->stime = t->stime_ticks * TIMER_MS;
+		ts->nvcsw = t->nvcsw;
+		ts->nivcsw = t->nivcsw;
+		ts->page_faults = t->page_faults;
+		ts->syscalls = t->syscalls;
+		ts->rss = (t->mm != NULL) ? t->mm->frames_used * 4 : 0;
+		ts->kmem = task_kernel_footprint(t) / 1024;
+		strlcpy(ts->name, t->name, TASKSTAT_NAME_LEN);
+	}
+	INTERRUPT_UNLOCK;
+
+	return n;
+}
@@ -6,6 +6,7 @@
 #include <kernel/task.h>
 #include <kernel/kernutil.h>
 #include <sys/errno.h>
+#include <kernel/bcache.h>
 
 // Stores FS-specific data, indexed by device number
 // Cast to the correct pointer as needed
@@ -14,53 +15,193 @@ uint32 next_dev = 0;
 
 list_t *mountpoints = NULL;
 
-struct open_file *do_get_filp(int fd, task_t *task) {
-	if (fd < 0 || fd > MAX_OPEN_FILES)
-		return NULL;
-	return (struct open_file *)task->fdtable[fd];
+struct fdtable *fdtable_create(void) {
+	struct fdtable *fdt = kmalloc(sizeof(struct fdtable));
+	memset(fdt, 0, sizeof(struct fdtable));
+	fdt->size = FDTABLE_INITIAL_SIZE;
+	fdt->refcount = 1;
+	fdt->files = kmalloc(fdt->size * sizeof(struct open_file *));
+	memset(fdt->files, 0, fdt->size * sizeof(struct open_file *));
+
+	return fdt;
+}
+
+// Used by fork(); the new table shares all open files with the old one
+struct fdtable *fdtable_clone(struct fdtable *parent) {
+	assert(parent != NULL);
+	struct fdtable *fdt = kmalloc(sizeof(struct fdtable));
+	memcpy(fdt, parent, sizeof(struct fdtable));
+	fdt->refcount = 1;
+	fdt->files = kmalloc(fdt->size * sizeof(struct open_file *));
+	memcpy(fdt->files, parent->files, fdt->size * sizeof(struct open_file *));
+
+	for (int i = 0; i < fdt->size; i++) {
+		if (fdt->files[i] != NULL) {
+			// Since we only copied the pointers, this increases for the parent as well, of course
+			assert(fdt->files[i]->count > 0);
+			fdt->files[i]->count++;
+		}
+	}
+
+	return fdt;
 }
 
-struct open_file *get_filp(int fd) {
-	return do_get_filp(fd, (task_t *)current_task);
+struct fdtable *fdtable_get(struct fdtable *fdt) {
+	assert(fdt != NULL);
+	INTERRUPT_LOCK;
+	assert(fdt->refcount > 0);
+	fdt->refcount++;
+	INTERRUPT_UNLOCK;
+
+	return fdt;
+}
+
+bool fdtable_release(struct fdtable *fdt) {
+	assert(fdt != NULL);
+	INTERRUPT_LOCK;
+	assert(fdt->refcount > 0);
+	bool last = (--fdt->refcount == 0);
+	INTERRUPT_UNLOCK;
+
+	return last;
 }
 
-/*
-int get_free_fd(void) {
-	// TODO: optimize this
-	struct open_file *f;
-	for (int i = 0; i < MAX_OPEN_FILES; i++) {
-		if (current_task->fdtable[i] == NULL) {
-			return i;
+void fdtable_destroy(struct fdtable *fdt) {
+	assert(fdt != NULL);
+	assert(fdt->refcount == 0);
+	for (int i = 0; i < MAX_OPEN_FILES / 32; i++) {
+		assert(fdt->used[i] == 0);
+	}
+	kfree(fdt->files);
+	kfree(fdt);
+}
+
+size_t fdtable_footprint(struct fdtable *fdt) {
+	if (fdt == NULL)
+		return 0;
+	return sizeof(struct fdtable) + fdt->size * sizeof(struct open_file *);
+}
+
+// Grow the table (if necessary) so that /fd/ is a valid index.
+// Returns false if /fd/ is above the per-task limit.
+static bool fdtable_expand(struct fdtable *fdt, int fd) {
+	if (fd >= MAX_OPEN_FILES)
+		return false;
+	if (fd < fdt->size)
+		return true;
+
+	int new_size = fdt->size;
+	while (new_size <= fd)
+		new_size *= 2;
+	if (new_size > MAX_OPEN_FILES)
+		new_size = MAX_OPEN_FILES;
+
+	struct open_file **files = kmalloc(new_size * sizeof(struct open_file *));
+	memcpy(files, fdt->files, fdt->size * sizeof(struct open_file *));
+	memset(files + fdt->size, 0, (new_size - fdt->size) * sizeof(struct open_file *));
+	kfree(fdt->files);
+	fdt->files = files;
+	fdt->size = new_size;
+
+	return true;
+}
+
+static void fd_install(struct fdtable *fdt, int fd, struct open_file *file) {
+	assert(fd >= 0 && fd < fdt->size);
+	assert(fdt->files[fd] == NULL);
+	fdt->files[fd] = file;
+	fdt->used[fd / 32] |= (1 << (fd % 32));
+}
+
+static void fd_clear(struct fdtable *fdt, int fd) {
+	assert(fd >= 0 && fd < fdt->size);
+	fdt->files[fd] = NULL;
+	fdt->used[fd / 32] &= ~(1 << (fd % 32));
+}
+
+// Returns the lowest free fd, having grown the table to fit it if necessary; -EMFILE if there is none.
+int get_free_fd(task_t *task) {
+	struct fdtable *fdt = task->fdtable;
+	for (int i = 0; i < MAX_OPEN_FILES / 32; i++) {
+		if (fdt->used[i] != 0xffffffff) {
+			int fd = i * 32 + __builtin_ctz(~fdt->used[i]);
+			if (!fdtable_expand(fdt, fd))
+				return -EMFILE;
+			return fd;
 		}
 	}
 
-	return -1;
+	return -EMFILE;
 }
-*/
 
+struct open_file *do_get_filp(int fd, task_t *task) {
+	if (fd < 0 || fd >= task->fdtable->size)
+		return NULL;
+	return task->fdtable->files[fd];
+}
+
+struct open_file *get_filp(int fd) {
+	return do_get_filp(fd, (task_t *)current_task);
+}
+
+// Returns NULL (and sets *fd to -1) if the task has no free fds
 struct open_file *new_filp(int *fd) {
 	assert(fd != NULL);
-	size_t i = 0;
-	do {
-		if (current_task->fdtable[i] == NULL) {
-			current_task->fdtable[i] = kmalloc(sizeof(struct open_file));
-			memset(current_task->fdtable[i], 0, sizeof(struct open_file));
-			*fd = i;
-			return current_task->fdtable[i];
-		}
-	} while (++i <= MAX_OPEN_FILES);
 
-	panic("new_filp: no free files! TODO: create more dynamically");
-	return NULL;
+	INTERRUPT_LOCK;
+	int i = get_free_fd((task_t *)current_task);
+	if (i < 0) {
+		INTERRUPT_UNLOCK;
+		*fd = -1;
+		return NULL;
+	}
+
+	struct open_file *file = kmalloc(sizeof(struct open_file));
+	memset(file, 0, sizeof(struct open_file));
+	fd_install(current_task->fdtable, i, file);
+	INTERRUPT_UNLOCK;
+
+	*fd = i;
+	return file;
 }
 
 void destroy_filp(int fd) {
-	assert(fd >= 0);
-	assert(fd < MAX_OPEN_FILES);
-	assert(current_task->fdtable[fd] != NULL);
+	struct open_file *file = get_filp(fd);
+	assert(file != NULL);
 
-	kfree(current_task->fdtable[fd]);
-	current_task->fdtable[fd] = NULL;
+	fd_clear(current_task->fdtable, fd);
+	kfree(file);
+}
+
+struct pwd *pwd_create(const char *path) {
+	assert(path != NULL);
+	size_t len = strlen(path);
+	struct pwd *pwd = kmalloc(sizeof(struct pwd) + len + 1);
+	pwd->refcount = 1;
+	memcpy(pwd->path, path, len + 1);
+
+	return pwd;
+}
+
+struct pwd *pwd_get(struct pwd *pwd) {
+	assert(pwd != NULL);
+	INTERRUPT_LOCK;
+	assert(pwd->refcount > 0);
+	pwd->refcount++;
+	INTERRUPT_UNLOCK;
+
+	return pwd;
+}
+
+void pwd_put(struct pwd *pwd) {
+	assert(pwd != NULL);
+	INTERRUPT_LOCK;
+	assert(pwd->refcount > 0);
+	bool last = (--pwd->refcount == 0);
+	INTERRUPT_UNLOCK;
+
+	if (last)
+		kfree(pwd);
 }
 
 // Resolve any symbolic links, and return the "true" path into the buffer.
@@ -159,7 +300,7 @@ bool find_relpath(const char *in_path, char *relpath, mountpoint_t **mp_out) {
 		// e.g. "file.ext", "../file.ext" or "dir/file.ext"
 		// Use $PWD to construct an absolute path, which we need below.
 		if (current_task->pwd)
-			strlcpy(path, current_task->pwd, PATH_MAX+1);
+			strlcpy(path, current_task->pwd->path, PATH_MAX+1);
 		else
 			strcpy(path, "/");
 
@@ -428,6 +569,23 @@ int sys_getdents(int fd, void *dp, int count) {
 	return getdents(fd, dp, count);
 }
 
+int fsync(int fd) {
+	struct open_file *file = get_filp(fd);
+	if (file == NULL)
+		return -EBADF;
+
+	if (file->count < 1)
+		return -EBADF;
+
+	if (file->fops.fsync == NULL)
+		return -EINVAL; // e.g. pipes, and files on the initrd
+	return file->fops.fsync(fd);
+}
+
+int sys_sync(void) {
+	return bcache_sync(NULL);
+}
+
 int do_close(int fd, task_t *task) {
 	assert(task != NULL);
 
@@ -442,7 +600,7 @@ int do_close(int fd, task_t *task) {
 
 	int r = file->fops.close(fd, file);
 	file->count--;
-	task->fdtable[fd] = NULL;
+	fd_clear(task->fdtable, fd);
 	assert(file->count >= 0);
 
 	if (file->count == 0) {
@@ -502,7 +660,7 @@ int chdir(const char *in_path) {
 	}
 	else {
 		// Relative path
-		strlcpy(path, current_task->pwd, PATH_MAX+1);
+		strlcpy(path, current_task->pwd->path, PATH_MAX+1);
 		path_join(path, in_path);
 	}
 
@@ -511,7 +669,8 @@ int chdir(const char *in_path) {
 
 	int err;
 	if ((err = validate_path(path)) == 0) {
-		strlcpy(current_task->pwd, path, PATH_MAX + 1);
+		// Threads share the working directory, so this updates all of them
+		task_set_pwd((task_t *)current_task, pwd_create(path));
 		return 0;
 	}
 	else
@@ -532,11 +691,11 @@ char *sys_getcwd(char *buf, size_t size) {
 
 	assert(current_task->pwd != NULL);
 
-	if (strlen(current_task->pwd) >= size) {
+	if (strlen(current_task->pwd->path) >= size) {
 		return (char *)(-ERANGE);
 	}
 
-	strlcpy(buf, current_task->pwd, size);
+	strlcpy(buf, current_task->pwd->path, size);
 
 	return buf;
 }
@@ -570,49 +729,59 @@ int dup(int fd) {
 	}
 
 	// Find the lowest-numbered free file descriptor
-	for (int i = 0; i < MAX_OPEN_FILES; i++) {
-		if (current_task->fdtable[i] == NULL) {
-			// Found it!
-			current_task->fdtable[i] = file;
-			file->count++;
-			INTERRUPT_UNLOCK;
-			return i;
-		}
+	int i = get_free_fd((task_t *)current_task);
+	if (i < 0) {
+		// We found no free fds!
+		INTERRUPT_UNLOCK;
+		return -EMFILE;
 	}
 
-	// We found no free fds!
+	fd_install(current_task->fdtable, i, file);
+	file->count++;
 	INTERRUPT_UNLOCK;
-	return -EMFILE;
+	return i;
 }
 
-int dup2(int fd, int fd2) {
+int do_dup2(int fd, int fd2, task_t *task) {
+	assert(task != NULL);
 	if (fd2 < 0 || fd2 >= MAX_OPEN_FILES) {
-		/* fd is checked in get_filp */
+		/* fd is checked in do_get_filp */
 		return -EBADF;
 	}
 
 	INTERRUPT_LOCK;
-	struct open_file *file = get_filp(fd);
+	struct open_file *file = do_get_filp(fd, task);
 	if (file == NULL) {
 		INTERRUPT_UNLOCK;
 		return -EBADF;
 	}
 
-	struct open_file *tmp = get_filp(fd2);
+	if (fd == fd2) {
+		// Nothing to do; closing fd2 here would close the file we're about to duplicate
+		INTERRUPT_UNLOCK;
+		return fd2;
+	}
+
+	struct open_file *tmp = do_get_filp(fd2, task);
 	if (tmp != NULL) {
 		// We need to close this open file first!
-		close(fd2);
+		do_close(fd2, task);
 	}
 
 	// Now then: set fd2 to point at the file from fd
-	assert(current_task->fdtable[fd2] == NULL);
-	current_task->fdtable[fd2] = file;
+	bool ok = fdtable_expand(task->fdtable, fd2);
+	assert(ok); // fd2 was range checked above
+	fd_install(task->fdtable, fd2, file);
 	file->count++;
 
 	INTERRUPT_UNLOCK;
 	return fd2;
 }
 
+int dup2(int fd, int fd2) {
+	return do_dup2(fd, fd2, (task_t *)current_task);
+}
+
 mountpoint_t *find_mountpoint_for_path(const char *path) {
 	if (mountpoints == NULL || mountpoints->count == 0 || path == NULL)
 		return NULL;
@@ -0,0 +1,370 @@
+#include <sys/types.h>
+#include <kernel/virtio_blk.h>
+#include <kernel/kernutil.h>
+#include <kernel/console.h>
+#include <kernel/interrupts.h>
+#include <kernel/pci.h>
+#include <kernel/list.h>
+#include <kernel/vmm.h>
+#include <kernel/mutex.h>
+#include <kernel/blkdev.h>
+#include <sys/errno.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * How requests work:
+ * 1) The disk's worker task (see blkdev.c) picks a request off the queue, and calls vblk_submit()
+ * 2) vblk_submit() builds a descriptor chain for it: a header, one descriptor per physically
+ *    continuous piece of the buffers (so merged requests need no copying), and a status byte.
+ *    The chain goes on the avail ring, and the device is notified. The worker then goes on to
+ *    the next request, so that up to /queue_depth/ requests are in flight at once.
+ * 3) When the device is done with some requests, it puts them on the used ring and interrupts.
+ *    The interrupt handler frees their descriptors and hands them back to the block layer.
+ *
+ * A request with more pieces than a chain may have is split into one chain per blk_io_t;
+ * req->parts counts the chains still in flight.
+ */
+
+extern list_t *pci_devices;
+
+/* Per-chain state, indexed by the chain's head descriptor. The device reads the header and
+ * writes the status byte, so these live in the DMA area; 32 bytes each, so they never cross a page. */
+struct vblk_slot {
+	struct virtio_blk_req_hdr hdr;
+	volatile uint8 status;
+	uint8 reserved[3];
+	blk_request_t *req; /* NULL for a flush */
+	uint32 pad[2];
+} __attribute__((packed));
+
+typedef struct vblk {
+	pci_device_t *pci;
+	uint16 iobase;
+	uint32 features; /* those we accepted; VIRTIO_BLK_F_* */
+	uint16 qsize; /* descriptors in the queue; a power of two */
+	uint32 max_segs; /* data descriptors per chain */
+
+	/* The virtqueue, all in one physically continuous allocation */
+	volatile struct vring_desc *desc;
+	volatile struct vring_avail *avail;
+	volatile struct vring_used *used;
+	struct vblk_slot *slots;
+	uint32 ring_phys;
+	uint32 slots_phys;
+
+	/* Modified with interrupts disabled */
+	uint16 free_head; /* free descriptors, linked through /next/ */
+	uint16 num_free;
+	uint16 last_used; /* the used ring entries up to here have been handled */
+	wait_queue_t desc_wq; /* the worker waits here for free descriptors */
+
+	mutex_t *flush_mutex; /* one flush at a time */
+	volatile bool flush_done;
+	uint8 flush_status;
+	wait_queue_t flush_wq;
+
+	blkdev_t blkdev;
+} vblk_t;
+
+static vblk_t vblk_devices[VIRTIO_BLK_MAX_DEVICES];
+static uint32 num_vblk = 0;
+
+static void vblk_submit(blkdev_t *bdev, blk_request_t *req);
+static int vblk_flush(blkdev_t *bdev);
+
+static const blkdev_ops_t vblk_blkdev_ops = {
+	.submit = vblk_submit,
+	.flush = vblk_flush,
+};
+
+#define VBLK_WANTED_FEATURES (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH)
+
+/* Keeps the compiler from moving ring accesses across it; x86 doesn't reorder stores with other stores */
+#define vblk_barrier() asm volatile("" : : : "memory")
+
+/* Returns a chain to the free list; called with interrupts disabled */
+static void vblk_free_chain(vblk_t *vb, uint16 head) {
+	uint16 d = head;
+	uint16 n = 1;
+	while (vb->desc[d].flags & VRING_DESC_F_NEXT) {
+		d = vb->desc[d].next;
+		n++;
+	}
+
+	vb->desc[d].next = vb->free_head;
+	vb->free_head = head;
+	vb->num_free += n;
+}
+
+/* Handles the requests the device has completed; called with interrupts disabled */
+static void vblk_process_used(vblk_t *vb) {
+	while (vb->last_used != vb->used->idx) {
+		vblk_barrier();
+		uint16 head = vb->used->ring[vb->last_used % vb->qsize].id;
+		struct vblk_slot *slot = &vb->slots[head];
+		assert(head < vb->qsize);
+		vblk_free_chain(vb, head);
+		vb->last_used++;
+
+		if (slot->req == NULL) {
+			vb->flush_status = slot->status;
+			vb->flush_done = true;
+			wait_queue_wake(&vb->flush_wq);
+			continue;
+		}
+
+		blk_request_t *req = slot->req;
+		if (slot->status != VIRTIO_BLK_S_OK)
+			req->error = -EIO;
+		assert(req->parts > 0);
+		if (--req->parts == 0)
+			blk_end_request(&vb->blkdev, req, req->error);
+	}
+
+	wait_queue_wake(&vb->desc_wq);
+}
+
+static uint32 vblk_interrupt_handler(uint32 esp) {
+	uint8 irq = ((registers_t *)esp)->int_no - 32;
+
+	// All our devices may share an IRQ; reading the ISR register tells (and acknowledges) whether it was this one
+	for (uint32 i = 0; i < num_vblk; i++) {
+		vblk_t *vb = &vblk_devices[i];
+		if (vb->pci->irq != irq)
+			continue;
+
+		uint8 isr = inb(vb->iobase + VIRTIO_REG_ISR);
+		if (isr & VIRTIO_ISR_QUEUE)
+			vblk_process_used(vb);
+	}
+
+	return esp;
+}
+
+/* How many physically continuous pieces a kernel buffer consists of, at most */
+static uint32 vblk_count_segs(uint8 *buffer, uint32 bytes) {
+	uint32 offset = (uint32)buffer & (PAGE_SIZE - 1);
+	return (offset + bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+/* Fills in data descriptors for a buffer, starting at descriptor /d/; returns the descriptor after the last one used */
+static uint16 vblk_add_buffer(vblk_t *vb, uint16 d, uint8 *buffer, uint32 bytes, bool write) {
+	assert(IS_KERNEL_SPACE(buffer));
+
+	while (bytes > 0) {
+		uint32 len = PAGE_SIZE - ((uint32)buffer & (PAGE_SIZE - 1));
+		if (len > bytes)
+			len = bytes;
+
+		vb->desc[d].addr = vmm_get_phys((uint32)buffer, kernel_directory);
+		vb->desc[d].len = len;
+		vb->desc[d].flags = VRING_DESC_F_NEXT | (write ? 0 : VRING_DESC_F_WRITE); /* the device writes what we read */
+		d = vb->desc[d].next;
+
+		buffer += len;
+		bytes -= len;
+	}
+
+	return d;
+}
+
+/*
+ * Queues a chain for the I/O from /first/ up to (not including) /end/, which must be /segs/ descriptors
+ * of data; or, for a flush, with no data. Sleeps until enough descriptors are free.
+ */
+static void vblk_queue(vblk_t *vb, blk_request_t *req, uint32 type, uint64 lba, blk_io_t *first, blk_io_t *end, uint32 segs) {
+	uint32 needed = segs + 2;
+	assert(needed <= vb->qsize);
+
+	INTERRUPT_LOCK;
+	while (vb->num_free < needed)
+		wait_queue_sleep(&vb->desc_wq);
+
+	uint16 head = vb->free_head;
+	struct vblk_slot *slot = &vb->slots[head];
+	slot->hdr.type = type;
+	slot->hdr.ioprio = 0;
+	slot->hdr.sector = lba;
+	slot->status = 0xff;
+	slot->req = req;
+
+	vb->desc[head].addr = vb->slots_phys + head * sizeof(struct vblk_slot);
+	vb->desc[head].len = sizeof(struct virtio_blk_req_hdr);
+	vb->desc[head].flags = VRING_DESC_F_NEXT;
+	uint16 d = vb->desc[head].next;
+
+	for (blk_io_t *io = first; io != end; io = io->next) {
+		d = vblk_add_buffer(vb, d, io->buffer, io->sectors * 512, io->write);
+	}
+
+	// The status byte ends the chain; the free list continues where it points
+	vb->desc[d].addr = vb->slots_phys + head * sizeof(struct vblk_slot) + __builtin_offsetof(struct vblk_slot, status);
+	vb->desc[d].len = 1;
+	vb->desc[d].flags = VRING_DESC_F_WRITE;
+	vb->free_head = vb->desc[d].next;
+	vb->num_free -= needed;
+
+	vb->avail->ring[vb->avail->idx % vb->qsize] = head;
+	vblk_barrier();
+	vb->avail->idx++;
+	vblk_barrier();
+	if (!(vb->used->flags & VRING_USED_F_NO_NOTIFY))
+		outw(vb->iobase + VIRTIO_REG_QUEUE_NOTIFY, 0);
+	INTERRUPT_UNLOCK;
+}
+
+static void vblk_submit(blkdev_t *bdev, blk_request_t *req) {
+	vblk_t *vb = (vblk_t *)bdev->driver_data;
+
+	if (req->write && (vb->features & VIRTIO_BLK_F_RO)) {
+		blk_end_request(bdev, req, -EROFS);
+		return;
+	}
+
+	uint32 type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	uint32 segs = 0, ios = 0;
+	for (blk_io_t *io = req->ios; io != NULL; io = io->next) {
+		segs += vblk_count_segs(io->buffer, io->sectors * 512);
+		ios++;
+	}
+
+	req->error = 0;
+	if (segs <= vb->max_segs) {
+		req->parts = 1;
+		vblk_queue(vb, req, type, req->lba, req->ios, NULL, segs);
+		return;
+	}
+
+	// Too scattered for one chain; every blk_io_t fits in one, since max_sectors is chosen so
+	req->parts = ios;
+	for (blk_io_t *io = req->ios; io != NULL; io = io->next) {
+		vblk_queue(vb, req, type, io->lba, io, io->next, vblk_count_segs(io->buffer, io->sectors * 512));
+	}
+}
+
+static int vblk_flush(blkdev_t *bdev) {
+	vblk_t *vb = (vblk_t *)bdev->driver_data;
+	if (!(vb->features & VIRTIO_BLK_F_FLUSH))
+		return 0;
+
+	mutex_lock(vb->flush_mutex);
+	vb->flush_done = false;
+	vblk_queue(vb, NULL, VIRTIO_BLK_T_FLUSH, 0, NULL, NULL, 0);
+	{
+		INTERRUPT_LOCK;
+		while (!vb->flush_done)
+			wait_queue_sleep(&vb->flush_wq);
+		INTERRUPT_UNLOCK;
+	}
+	uint8 status = vb->flush_status;
+	mutex_unlock(vb->flush_mutex);
+
+	return (status == VIRTIO_BLK_S_OK) ? 0 : -EIO;
+}
+
+/* Allocates the virtqueue and the slots, and sets up the free list */
+static void vblk_alloc_ring(vblk_t *vb) {
+	uint32 n = vb->qsize;
+	uint32 avail_off = 16 * n;
+	uint32 used_off = (avail_off + 6 + 2*n + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1);
+	uint32 slots_off = (used_off + 6 + 8*n + 31) & ~31;
+	uint32 size = slots_off + n * sizeof(struct vblk_slot);
+
+	uint8 *ring = vmm_alloc_dma(size, &vb->ring_phys);
+	vb->desc = (struct vring_desc *)ring;
+	vb->avail = (struct vring_avail *)(ring + avail_off);
+	vb->used = (struct vring_used *)(ring + used_off);
+	vb->slots = (struct vblk_slot *)(ring + slots_off);
+	vb->slots_phys = vb->ring_phys + slots_off;
+
+	for (uint32 i = 0; i < n; i++) {
+		vb->desc[i].next = (i + 1) % n;
+	}
+	vb->free_head = 0;
+	vb->num_free = n;
+	vb->last_used = 0;
+}
+
+static bool vblk_init_device(pci_device_t *pci) {
+	if (num_vblk >= VIRTIO_BLK_MAX_DEVICES) {
+		printk("WARNING: more than %u virtio block devices found; ignoring the rest\n", VIRTIO_BLK_MAX_DEVICES);
+		return false;
+	}
+	if (pci->bar[0].type != BAR_IO || pci->bar[0].address == 0) {
+		printk("WARNING: virtio block device without an I/O BAR0; only the legacy interface is supported\n");
+		return false;
+	}
+	/* All our devices share one handler, but it can't be shared with other drivers */
+	if (!register_interrupt_handler(32 + pci->irq, vblk_interrupt_handler)) {
+		printk("WARNING: virtio block device on IRQ %u, which another driver uses; ignoring it\n", pci->irq);
+		return false;
+	}
+
+	vblk_t *vb = &vblk_devices[num_vblk];
+	memset(vb, 0, sizeof(vblk_t));
+	vb->pci = pci;
+	vb->iobase = (uint16)pci->bar[0].address;
+
+	// Reset, then tell the device that we've found it and know how to drive it
+	outb(vb->iobase + VIRTIO_REG_STATUS, 0);
+	outb(vb->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	outb(vb->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	vb->features = inl(vb->iobase + VIRTIO_REG_HOST_FEATURES) & VBLK_WANTED_FEATURES;
+	outl(vb->iobase + VIRTIO_REG_GUEST_FEATURES, vb->features);
+
+	uint16 cfg = vb->iobase + VIRTIO_REG_CONFIG;
+	uint64 capacity = inl(cfg + VIRTIO_BLK_CFG_CAPACITY) | ((uint64)inl(cfg + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+
+	outw(vb->iobase + VIRTIO_REG_QUEUE_SEL, 0);
+	vb->qsize = inw(vb->iobase + VIRTIO_REG_QUEUE_NUM);
+
+	// A chain holds at least the header, the status byte, and the pieces of one full-size blk_io_t
+	vb->max_segs = vb->qsize - 2;
+	if ((vb->features & VIRTIO_BLK_F_SEG_MAX) && inl(cfg + VIRTIO_BLK_CFG_SEG_MAX) < vb->max_segs)
+		vb->max_segs = inl(cfg + VIRTIO_BLK_CFG_SEG_MAX);
+
+	if (capacity == 0 || vb->qsize == 0 || (vb->qsize & (vb->qsize - 1)) != 0 || vb->max_segs < 2) {
+		outb(vb->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+		return false;
+	}
+
+	vblk_alloc_ring(vb);
+	outl(vb->iobase + VIRTIO_REG_QUEUE_PFN, vb->ring_phys >> 12);
+
+	vb->flush_mutex = mutex_create();
+	pci_enable_bus_master(pci);
+
+	num_vblk++;
+
+	outb(vb->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+	// A buffer of n sectors may be spread over n/8 + 1 pages
+	uint32 max_sectors = (vb->max_segs - 1) * (PAGE_SIZE / 512);
+	if (max_sectors > VIRTIO_BLK_MAX_SECTORS)
+		max_sectors = VIRTIO_BLK_MAX_SECTORS;
+
+	snprintf(vb->blkdev.name, sizeof(vb->blkdev.name), "vd%c", 'a' + num_vblk - 1);
+	vb->blkdev.size = capacity;
+	vb->blkdev.max_sectors = max_sectors;
+	vb->blkdev.queue_depth = vb->qsize / 4; /* requests usually take more than the minimum of 3 descriptors */
+	vb->blkdev.ops = &vblk_blkdev_ops;
+	vb->blkdev.driver_data = vb;
+	blkdev_register(&vb->blkdev);
+
+	return true;
+}
+
+void virtio_blk_init(void) {
+	assert(sizeof(struct vring_desc) == 16);
+	assert(sizeof(struct virtio_blk_req_hdr) == 16);
+	assert(sizeof(struct vblk_slot) == 32);
+	assert(pci_devices != NULL);
+
+	list_foreach(pci_devices, it) {
+		pci_device_t *dev = (pci_device_t *)it->data;
+		if (dev->vendor_id == VIRTIO_PCI_VENDOR && dev->device_id == VIRTIO_PCI_DEVICE_BLK)
+			vblk_init_device(dev);
+	}
+}
@@ -7,6 +7,7 @@
 #include <kernel/console.h> /* printk */
 #include <kernel/pmm.h>
 #include <kernel/elf.h> /* symbol lookup */
+#include <kernel/task.h> /* KERNEL_STACK_SIZE */
 
 // The kernel's page directory
 page_directory_t *kernel_directory = 0;
@@ -182,6 +183,130 @@ void vmm_destroy_task_mm(struct task_mm *mm) {
 	INTERRUPT_UNLOCK;
 }
 
+struct task_mm *vmm_get_task_mm(struct task_mm *mm) {
+	assert(mm != NULL);
+	INTERRUPT_LOCK;
+	assert(mm->users > 0);
+	mm->users++;
+	INTERRUPT_UNLOCK;
+
+	return mm;
+}
+
+void vmm_put_task_mm(struct task_mm *mm) {
+	assert(mm != NULL);
+	INTERRUPT_LOCK;
+	assert(mm->users > 0);
+	bool last = (--mm->users == 0);
+	INTERRUPT_UNLOCK;
+
+	if (!last)
+		return;
+
+	// Only user mode tasks have their own page directory; kernel tasks use kernel_directory
+	if (mm->page_directory != kernel_directory)
+		destroy_user_page_dir(mm->page_directory);
+	vmm_destroy_task_mm(mm);
+}
+
+/*
+ * Kernel stacks live in their own region of kernel space, instead of on the heap.
+ * The region is split into fixed-size slots: an unmapped guard page followed by
+ * KERNEL_STACK_SIZE bytes of stack. That way, every stack has an unmapped page
+ * directly below it (its own guard) and directly above it (the next slot's guard,
+ * or the unused page at the end of the region).
+ * Freed stacks are kept mapped in a small cache, so that creating a task usually
+ * needs neither frame allocation nor page table changes.
+ */
+#define KSTACK_SLOT_SIZE (KERNEL_STACK_SIZE + PAGE_SIZE)
+#define KSTACK_NUM_SLOTS ((KSTACK_REGION_END - KSTACK_REGION_START - PAGE_SIZE) / KSTACK_SLOT_SIZE)
+#define KSTACK_CACHE_SIZE 16
+
+static uint32 kstack_bitmap[(KSTACK_NUM_SLOTS + 31) / 32] = {0};
+static uint32 kstack_next_slot = 0; // where to start looking for a free slot
+
+static void *kstack_cache[KSTACK_CACHE_SIZE] = {0};
+static uint32 kstack_cache_count = 0;
+
+void *vmm_alloc_kernel_stack(void) {
+	INTERRUPT_LOCK;
+	if (kstack_cache_count > 0) {
+		// Reuse a stack that is still mapped; it still needs zeroing, as it belonged to some other task
+		void *stack = kstack_cache[--kstack_cache_count];
+		INTERRUPT_UNLOCK;
+		memset((void *)((uint32)stack - KERNEL_STACK_SIZE), 0, KERNEL_STACK_SIZE);
+		return stack;
+	}
+
+	uint32 slot = KSTACK_NUM_SLOTS;
+	for (uint32 i = 0; i < KSTACK_NUM_SLOTS; i++) {
+		uint32 s = (kstack_next_slot + i) % KSTACK_NUM_SLOTS;
+		if ((kstack_bitmap[s / 32] & (1 << (s % 32))) == 0) {
+			slot = s;
+			break;
+		}
+	}
+	if (slot == KSTACK_NUM_SLOTS)
+		panic("vmm_alloc_kernel_stack: out of kernel stack slots (%u in use)", KSTACK_NUM_SLOTS);
+
+	kstack_bitmap[slot / 32] |= (1 << (slot % 32));
+	kstack_next_slot = (slot + 1) % KSTACK_NUM_SLOTS;
+	INTERRUPT_UNLOCK;
+
+	// The guard page at the start of the slot is simply never mapped
+	uint32 bottom = KSTACK_REGION_START + slot * KSTACK_SLOT_SIZE + PAGE_SIZE;
+	vmm_alloc_kernel(bottom, bottom + KERNEL_STACK_SIZE, PAGE_ANY_PHYS, PAGE_RW);
+
+	/* Zero the stack, so user applications can't peer in to what may have been in these frames */
+	memset((void *)bottom, 0, KERNEL_STACK_SIZE);
+
+	return (void *)(bottom + KERNEL_STACK_SIZE);
+}
+
+void vmm_free_kernel_stack(void *stack) {
+	uint32 top = (uint32)stack;
+	assert(top > KSTACK_REGION_START && top < KSTACK_REGION_END);
+	assert((top - KSTACK_REGION_START) % KSTACK_SLOT_SIZE == 0);
+
+	INTERRUPT_LOCK;
+	if (kstack_cache_count < KSTACK_CACHE_SIZE) {
+		kstack_cache[kstack_cache_count++] = stack;
+		INTERRUPT_UNLOCK;
+		return;
+	}
+
+	uint32 slot = (top - KSTACK_REGION_START) / KSTACK_SLOT_SIZE - 1;
+	for (uint32 addr = top - KERNEL_STACK_SIZE; addr < top; addr += PAGE_SIZE) {
+		vmm_free(addr, kernel_directory);
+	}
+	kstack_bitmap[slot / 32] &= ~(1 << (slot % 32));
+	INTERRUPT_UNLOCK;
+}
+
+static uint32 dma_next = DMA_REGION_START;
+
+void *vmm_alloc_dma(uint32 size, uint32 *phys) {
+	assert(size > 0);
+	assert(phys != NULL);
+	if (size & (PAGE_SIZE - 1))
+		size = (size & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+
+	uint32 start;
+	{
+		INTERRUPT_LOCK;
+		start = dma_next;
+		if (size > DMA_REGION_END - start)
+			panic("vmm_alloc_dma: out of space for %u bytes (%u in use)", size, start - DMA_REGION_START);
+		dma_next += size;
+		INTERRUPT_UNLOCK;
+	}
+
+	*phys = vmm_alloc_kernel(start, start + size, PAGE_CONTINUOUS_PHYS, PAGE_RW);
+	memset((void *)start, 0, size);
+
+	return (void *)start;
+}
+
 void copy_page_physical(uint32 src, uint32 dst);
 
 page_directory_t *clone_user_page_directory(page_directory_t *parent_dir, struct task_mm *child_mm) {
@@ -251,6 +376,7 @@ struct task_mm *vmm_clone_mm(struct task_mm *parent_mm) {
 
 	child_mm->areas = list_copy(parent_mm->areas, copy_area);
 	child_mm->page_directory = clone_user_page_directory(parent_mm->page_directory, child_mm);
+	child_mm->users = 1;
 
 	return child_mm;
 }
@@ -433,6 +559,7 @@ struct task_mm *vmm_create_user_mm(void) {
 	mm->page_directory = create_user_page_dir();
 
 	mm->frames_used = 0;
+	mm->users = 1;
 
 	/* Set up a usermode stack for this task */
 	vmm_alloc_user(USER_STACK_START - (USER_STACK_SIZE + PAGE_SIZE), USER_STACK_START + PAGE_SIZE, mm, PAGE_RW);
@@ -451,6 +578,7 @@ struct task_mm *vmm_create_kernel_mm(void) {
 	struct task_mm *mm = kmalloc(sizeof(struct task_mm));
 	memset(mm, 0, sizeof(struct task_mm));
 	mm->page_directory = current_directory;
+	mm->users = 1;
 
 	return mm;
 }
@@ -574,6 +702,16 @@ void init_paging(unsigned long mbd_mmap_addr, unsigned long mbd_mmap_length, uns
 		_vmm_create_page_table(index, kernel_directory);
 	}
 
+	/* Ditto for the kernel stack region; user page directories share these tables, so they must exist before any are created */
+	for (uint32 index = (KSTACK_REGION_START / PAGE_SIZE / 1024); index < (KSTACK_REGION_END / PAGE_SIZE / 1024); index++) {
+		_vmm_create_page_table(index, kernel_directory);
+	}
+
+	/* ... and for the DMA region */
+	for (uint32 index = (DMA_REGION_START / PAGE_SIZE / 1024); index < (DMA_REGION_END / PAGE_SIZE / 1024); index++) {
+		_vmm_create_page_table(index, kernel_directory);
+	}
+
 	// We currently need the kernel's .text to be readable to user mode as well...
 	// Tasks created in-kernel (not via ELF files) run code here.
 	// This reads the start and end addresses of .text from the linker script,
@@ -736,6 +874,8 @@ uint32 page_fault_handler(uint32 esp) {
 	bool reserved_bit = regs->err_code & (1 << 3);	// was the fault caused by us setting a reserved bit to 1 in entry?
 	bool int_fetch_bit = regs->err_code & (1 << 4);   // was the fault caused by an instruction fetch?
 
+	current_task->page_faults++;
+
 	// If the conditions are right, grow the userspace stack, if this page fault occurred on the guard page.
 	struct task_mm *mm = current_task->mm;
 	if (current_task->privilege != 3 || current_task-> mm == NULL)
@@ -1,6 +1,16 @@
 section .text
 align 4
 global memcpy
+extern memcpy_large
+extern memcpy_large_threshold
+
+; void *memcpy(void *dst, const void *src, size_t len);
+; returns dst
+;
+; Copies of at least memcpy_large_threshold bytes are handed to memcpy_large,
+; which is set at boot to the best MMX/SSE variant the CPU supports (see memops.c).
+; Everything else is done here: small copies with plain moves, the rest with rep movsd
+; after aligning the destination.
 
 memcpy:
 	; set up the stack frame
@@ -8,34 +18,81 @@ memcpy:
 	mov ebp, esp
 
 	; save registers (we can only destroy EAX, ECX and EDX)
-	push ebx
 	push edi
 	push esi
 
 	mov edi, [ebp + 8]  ; param #1 (dst)
 	mov esi, [ebp + 12] ; param #2 (src)
-	mov eax, [ebp + 16] ; param #3 (len)
+	mov ecx, [ebp + 16] ; param #3 (len)
+
+	mov eax, edi ; the return value
+
+	cmp ecx, [memcpy_large_threshold]
+	jae .large
 
-	push edi ; save the first argument, since we need to return it
+	cmp ecx, 16
+	jb .small
 
-	; Set ecx to the number of dwords to copy
-	xor edx, edx ; clear edx before division
-	mov ebx, 4   ; div doesn't accept immediate operands
-	div ebx
-	mov ecx, eax ; len/4 dwords to copy (since each is 4 bytes!)
-	mov ebx, edx ; len%4 bytes left; store this in ebx for the moment
+	; Copy 0-3 bytes to make the destination dword aligned
+	mov edx, edi
+	neg edx
+	and edx, 3
+	sub ecx, edx ; ecx = length after the alignment bytes
+	xchg ecx, edx
+	rep movsb
+	mov ecx, edx
 
-	rep movsd    ; copy the dwords
-	mov ecx, ebx ; ebx = number of bytes remaining
-	rep movsb    ; copy the bytes, if any
+	; Copy the dwords, then the 0-3 trailing bytes
+	shr ecx, 2   ; len/4 dwords to copy
+	rep movsd
+	mov ecx, edx
+	and ecx, 3   ; len%4 bytes left
+	rep movsb
+	jmp .done
 
-	; pop the return value
-	pop eax
+.small:
+	; 0-15 bytes: copy 8, 4, 2 and 1 bytes depending on the bits of the length,
+	; which avoids the startup cost of the rep instructions
+	test ecx, 8
+	jz .small4
+	mov edx, [esi]
+	mov [edi], edx
+	mov edx, [esi + 4]
+	mov [edi + 4], edx
+	add esi, 8
+	add edi, 8
+.small4:
+	test ecx, 4
+	jz .small2
+	mov edx, [esi]
+	mov [edi], edx
+	add esi, 4
+	add edi, 4
+.small2:
+	test ecx, 2
+	jz .small1
+	mov dx, [esi]
+	mov [edi], dx
+	add esi, 2
+	add edi, 2
+.small1:
+	test ecx, 1
+	jz .done
+	mov dl, [esi]
+	mov [edi], dl
 
+.done:
 	; restore the registers we pushed
 	pop esi
 	pop edi
-	pop ebx
 
 	leave ; clean up the stack frame
 	ret
+
+.large:
+	push ecx
+	push esi
+	push edi
+	call [memcpy_large] ; returns dst in eax
+	add esp, 12
+	jmp .done
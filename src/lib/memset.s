@@ -1,9 +1,13 @@
 section .text
 align 4
 global memset
+extern memset_large
+extern memset_large_threshold
 
 ; void *memset(void *addr, int c, size_t n);
 ; returns the input addr
+;
+; As with memcpy, large fills are handed to memset_large (see memops.c).
 
 memset:
 	; set up the stack frame
@@ -11,58 +15,81 @@ memset:
 	mov ebp, esp
 
 	; save registers (we can only destroy EAX, ECX and EDX)
-	push ebx
 	push edi
 
 ;	slosl: Fill (E)CX dwords at ES:[(E)DI] with EAX
 ;	stosb: Fill (E)CX bytes at ES:[(E)DI] with AL
 
 	mov edi, [ebp + 8]  ; param #1 (addr)
-	mov ebx, [ebp + 12] ; param #2 (character)
 	mov ecx, [ebp + 16] ; param #3 (length)
 
-	; push the first argument; it's our return value
-	push edi
+	cmp ecx, [memset_large_threshold]
+	jae .large
 
 	; set up the value to write; since we should only use the lower 8 bits of it, we need to repeat it.
 	; i.e. the input may be 0x000000ab (meaning the user specified 0xab; the rest is padding for the int type used),
 	; meaning we want to write the dword 0xabababab.
-	; bl contains the bits to use and repeat.
-	and ebx, 0xff  ; clear any other bits
-	xor eax, eax ; clear the target register
-	or eax, ebx ; add the lowest two bits, 0x000000YY
-	shl ebx, 8
-	or eax, ebx ; add 0x0000YY00 bits
-	shl ebx, 8
-	or eax, ebx ; add 0x00YY0000 bits
-	shl ebx, 8
-	or eax, ebx ; add 0xYY000000 bits
+	movzx eax, byte [ebp + 12] ; param #2 (character), 0x000000YY
+	imul eax, eax, 0x01010101  ; 0xYYYYYYYY
 
 	; eax should now contain the pattern we want (for stosd), e.g. 0xabababab for the input 0xab
 	; likewise, al should contain the pattern we want (for stosb)
 
-	push eax ; store the value (temporarily, while we calculate the number of dwords and bytes)
-
-	; Set ecx to the number of dwords to set
-	mov eax, ecx ; ecx = number of bytes to set
-	xor edx, edx ; clear edx before division
-	mov ebx, 4   ; div doesn't accept immediate operands
-	div ebx
-	mov ecx, eax ; len/4 dwords to copy (since each is 4 bytes!)
-	mov ebx, edx ; len%4 bytes left; store this in ebx for the moment
+	cmp ecx, 16
+	jb .small
 
-	pop eax ; fetch the value to set into eax
+	; Set 0-3 bytes to make the destination dword aligned
+	mov edx, edi
+	neg edx
+	and edx, 3
+	sub ecx, edx ; ecx = length after the alignment bytes
+	xchg ecx, edx
+	rep stosb
+	mov ecx, edx
 
+	shr ecx, 2   ; len/4 dwords to set
 	rep stosd    ; set the dwords
-	mov ecx, ebx ; ebx = number of bytes remaining (i.e. len % 4)
+	mov ecx, edx
+	and ecx, 3   ; len%4 bytes left
 	rep stosb    ; set the bytes, if any
+	jmp .done
+
+.small:
+	; 0-15 bytes: avoid the startup cost of the rep instructions
+	test ecx, 8
+	jz .small4
+	mov [edi], eax
+	mov [edi + 4], eax
+	add edi, 8
+.small4:
+	test ecx, 4
+	jz .small2
+	mov [edi], eax
+	add edi, 4
+.small2:
+	test ecx, 2
+	jz .small1
+	mov [edi], ax
+	add edi, 2
+.small1:
+	test ecx, 1
+	jz .done
+	mov [edi], al
 
-	; pop the return value
-	pop eax
+.done:
+	; return the first argument
+	mov eax, [ebp + 8]
 
 	; restore the registers we pushed
 	pop edi
-	pop ebx
 
 	leave ; clean up the stack frame
 	ret
+
+.large:
+	push ecx
+	push dword [ebp + 12]
+	push edi
+	call [memset_large]
+	add esp, 12
+	jmp .done
@@ -31,20 +31,13 @@ memsetw:
 	; eax should now contain the pattern we want (for stosd)
 	; likewise, ax should contain the pattern we want (for stosw)
 
-	push eax ; store the value (temporarily, while we calculate the number of dwords and words)
-
 	; Set ecx to the number of dwords to set
-	mov eax, ecx ; ecx = number of words to set
-	xor edx, edx ; clear edx before division
-	mov ebx, 2   ; div doesn't accept immediate operands
-	div ebx
-	mov ecx, eax ; len/2 dwords to copy
-	mov ebx, edx ; len%2 words left; store this in ebx for the moment
-
-	pop eax ; fetch the value to set into eax
+	mov edx, ecx ; ecx = number of words to set
+	shr ecx, 1   ; len/2 dwords to copy
+	and edx, 1   ; len%2 words left
 
 	rep stosd    ; set the dwords
-	mov ecx, ebx ; ebx = number of words remaining (i.e. len % 2 - 0 or 1)
+	mov ecx, edx ; edx = number of words remaining (i.e. len % 2 - 0 or 1)
 	rep stosw    ; set the word, if any
 
 	; pop the return value
@@ -3,6 +3,18 @@
 
 /* memset and memcpy are implemented in assembly, and reside in separate source files */
 
+/*
+ * strlen, strchr, strcmp and memcmp work on a word (4 bytes) at a time once the pointers are aligned.
+ * An aligned word never crosses a page boundary, so reading a few bytes past the end of a string is safe.
+ * HAS_ZERO(w) is nonzero iff any byte in w is zero: subtracting 1 from a zero byte borrows into its
+ * high bit, which ~w limits to bytes that didn't already have the high bit set.
+ */
+typedef uint32 __attribute__((__may_alias__)) word_t;
+#define ONES 0x01010101U
+#define HIGHS 0x80808080U
+#define HAS_ZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+#define ALIGNED(p) (((uint32)(p) & (sizeof(word_t) - 1)) == 0)
+
 /* NOTE: this doesn't really belong in string.h... */
 int isspace(int c) {
 	if (c == ' ' || c == '\n' || c == '\t' || c == '\v' || c == '\f' || c == '\r')
@@ -12,18 +24,26 @@ int isspace(int c) {
 }
 
 char *strcpy(char *restrict s1, const char *restrict s2) {
-	char *ret = s1;
-
-	while (*s2 != 0) {
-		*s1++ = *s2++;
-	}
-
-	*s1 = 0;
-
-	return ret;
+	return memcpy(s1, s2, strlen(s2) + 1);
 }
 
 int strcmp(const char *s1, const char *s2) {
+	if (((uint32)s1 & (sizeof(word_t) - 1)) == ((uint32)s2 & (sizeof(word_t) - 1))) {
+		// Same alignment: compare bytes up to a word boundary, then whole words until they
+		// differ or contain the terminator; the byte loop below finds out which
+		for (; !ALIGNED(s1); ++s1, ++s2) {
+			if (*s1 != *s2 || *s1 == 0)
+				goto bytes;
+		}
+		const word_t *w1 = (const word_t *)s1, *w2 = (const word_t *)s2;
+		while (*w1 == *w2 && !HAS_ZERO(*w1)) {
+			w1++, w2++;
+		}
+		s1 = (const char *)w1;
+		s2 = (const char *)w2;
+	}
+
+bytes:
 	for (; *s1 == *s2; ++s1, ++s2) {
 		if (*s1 == 0)
 			return 0;
@@ -45,6 +65,20 @@ int stricmp(const char *s1, const char *s2) {
 
 char *strchr(const char *s, int c_) {
 	char c = (char)c_;
+	for (; !ALIGNED(s); s++) {
+		if (*s == c)
+			return (char *)s;
+		else if (*s == 0)
+			return NULL;
+	}
+
+	// Skip words that contain neither c nor the terminator
+	const uint32 mask = (uint8)c * ONES;
+	const word_t *w = (const word_t *)s;
+	while (!HAS_ZERO(*w) && !HAS_ZERO(*w ^ mask))
+		w++;
+	s = (const char *)w;
+
 	while (*s != 0 && *s != c)
 		s++;
 	if (*s == c)
@@ -118,6 +152,21 @@ int strnicmp(const char *s1, const char *s2, size_t n) {
 int memcmp(const void *lhs, const void *rhs, size_t count) {
 	const uint8 *us1 = (uint8 *)lhs;
 	const uint8 *us2 = (uint8 *)rhs;
+	if (count >= 2 * sizeof(word_t) && ((uint32)us1 & (sizeof(word_t) - 1)) == ((uint32)us2 & (sizeof(word_t) - 1))) {
+		for (; !ALIGNED(us1); us1++, us2++, count--) {
+			if (*us1 != *us2)
+				return (*us1 < *us2) ? -1 : 1;
+		}
+		// Skip equal words; the byte loop finds the difference, if any
+		const word_t *w1 = (const word_t *)us1, *w2 = (const word_t *)us2;
+		while (count >= sizeof(word_t) && *w1 == *w2) {
+			w1++, w2++;
+			count -= sizeof(word_t);
+		}
+		us1 = (const uint8 *)w1;
+		us2 = (const uint8 *)w2;
+	}
+
 	while (count-- != 0) {
 		if (*us1 != *us2) 
 			return (*us1 < *us2) ? -1 : 1;
@@ -128,13 +177,21 @@ int memcmp(const void *lhs, const void *rhs, size_t count) {
 }
 
 size_t strlen(const char *str) {
-	size_t len = 0;
+	const char *s = str;
 
-	while (*str++ != 0) {
-		len++;
+	for (; !ALIGNED(s); s++) {
+		if (*s == 0)
+			return s - str;
 	}
 
-	return len;
+	const word_t *w = (const word_t *)s;
+	while (!HAS_ZERO(*w))
+		w++;
+
+	// The terminator is somewhere in this word
+	for (s = (const char *)w; *s != 0; s++) { }
+
+	return s - str;
 }
 
 char *strstr(const char *haystack, const char *needle) {
@@ -179,18 +236,15 @@ size_t strlcpy(char *dst, const char *src, size_t size) {
 	const size_t len = strlen(src);
 
 	if (size >= len + 1) {
-		/* Everything fits, just use strcpy() instead */
-		strcpy(dst, src);
+		/* Everything fits, including the NULL terminator */
+		memcpy(dst, src, len + 1);
 		return len;
 	}
 	else if (size == 0)
 		return len;
 
 	/* Still here, so it didn't all fit. Copy what fits (leaving 1 byte for NULL termination) */
-	char *d = dst;
-	for (size_t i = 0; i < size - 1; i++) {
-		*d++ = *src++;
-	}
+	memcpy(dst, src, size - 1);
 
 	/* This is strLcpy - make sure to NULL terminate! */
 	dst[size - 1] = 0;
@@ -9,8 +9,15 @@
  * Wirzenius wrote this portably, Torvalds fucked it up :-)
  */
 
+/*
+ * Reworked for speed: everything is written straight into the destination, with bounds
+ * checks done once per field rather than per character, and numbers are converted without
+ * a divl per digit (two decimal digits per division, shifts for hex and octal).
+ */
+
 #include <stdarg.h>
 #include <string.h>
+#include <stdio.h>
 
 /* we use this so that we can do without the ctype library */
 #define is_digit(c)	((c) >= '0' && (c) <= '9')
@@ -32,24 +39,96 @@ static int skip_atoi(const char **s)
 #define SPECIAL	32		/* 0x */
 #define SMALL	64		/* use 'abcdef' instead of 'ABCDEF' */
 
-#define do_div(n,base) ({ \
-int __res; \
-__asm__("divl %4":"=a" (n),"=d" (__res):"0" (n),"1" (0),"r" (base)); \
-__res; })
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/*
+ * The output position. /str/ keeps counting past /end/ once the buffer is full,
+ * so that vsnprintf() can return the length the output would have had.
+ */
+struct out {
+	char *str;
+	char *end;
+};
+
+static inline void put_char(struct out *o, char c) {
+	if (o->str < o->end)
+		*o->str = c;
+	o->str++;
+}
+
+static void put_chars(struct out *o, const char *s, int n) {
+	if (n <= 0)
+		return;
+	if (o->str < o->end) {
+		int room = o->end - o->str;
+		memcpy(o->str, s, n < room ? n : room);
+	}
+	o->str += n;
+}
+
+static void put_fill(struct out *o, char c, int n) {
+	if (n <= 0)
+		return;
+	if (o->str < o->end) {
+		int room = o->end - o->str;
+		memset(o->str, c, n < room ? n : room);
+	}
+	o->str += n;
+}
+
+/* Writes the digits of num backwards, ending just before /end/; returns the number of digits */
+static int convert(char *end, uint32 num, int base, const char *digits)
+{
+	char *p = end;
 
-static char * number(char * str, int num, int base, int size, int precision
+	if (base == 10) {
+		while (num >= 100) {
+			uint32 r = num % 100;
+			num /= 100;
+			p -= 2;
+			p[0] = digit_pairs[2*r];
+			p[1] = digit_pairs[2*r + 1];
+		}
+		if (num >= 10) {
+			p -= 2;
+			p[0] = digit_pairs[2*num];
+			p[1] = digit_pairs[2*num + 1];
+		}
+		else
+			*--p = '0' + num;
+	}
+	else {
+		int shift = (base == 16) ? 4 : 3;
+		do {
+			*--p = digits[num & (base - 1)];
+			num >>= shift;
+		} while (num != 0);
+	}
+
+	return end - p;
+}
+
+static void number(struct out *o, uint32 num, int base, int size, int precision
 	,int type)
 {
-	char c,sign,tmp[36];
-	const char *digits="0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	char c,sign,tmp[12];
+	const char *digits="0123456789ABCDEF";
 	int i;
 
-	if (type&SMALL) digits="0123456789abcdefghijklmnopqrstuvwxyz";
+	if (type&SMALL) digits="0123456789abcdef";
 	if (type&LEFT) type &= ~ZEROPAD;
-	if (base<2 || base>36)
-		return 0;
 	c = (type & ZEROPAD) ? '0' : ' ' ;
-	if (type&SIGN && num<0) {
+	if (type&SIGN && (int)num<0) {
 		sign='-';
 		num = -num;
 	} else
@@ -59,46 +138,42 @@ static char * number(char * str, int num, int base, int size, int precision
 		if (base==16) size -= 2;
 		else if (base==8) size--;
 	}
-	i=0;
-	if (num==0)
-		tmp[i++]='0';
-	else while (num!=0) {
-		tmp[i++] = digits[do_div(num,base)];
-	}
+	i = convert(tmp + sizeof(tmp), num, base, digits);
 	if (i>precision) precision=i;
 	size -= precision;
-	if (!(type&(ZEROPAD+LEFT)))
-		while(size-->0)
-			*str++ = ' ';
+	if (!(type&(ZEROPAD+LEFT))) {
+		put_fill(o, ' ', size);
+		size = 0;
+	}
 	if (sign)
-		*str++ = sign;
+		put_char(o, sign);
 	if (type&SPECIAL) {
 		if (base==8)
-			*str++ = '0';
+			put_char(o, '0');
 		else if (base==16) {
-			*str++ = '0';
-			*str++ = digits[33];
+			put_char(o, '0');
+			put_char(o, (type&SMALL) ? 'x' : 'X');
 		}
 	}
-	if (!(type&LEFT))
-		while(size-->0)
-			*str++ = c;
-	while(i<precision--)
-		*str++ = '0';
-	while(i-->0)
-		*str++ = tmp[i];
-	while(size-->0)
-		*str++ = ' ';
-	return str;
+	if (!(type&LEFT)) {
+		put_fill(o, c, size);
+		size = 0;
+	}
+	put_fill(o, '0', precision - i);
+	put_chars(o, tmp + sizeof(tmp) - i, i);
+	put_fill(o, ' ', size);
 }
 
-int vsprintf(char *buf, const char *fmt, __gnuc_va_list args)
+/*
+ * Writes at most /size/ bytes to buf, including the NUL terminator (if size > 0).
+ * Returns the length the output would have had, given enough space.
+ */
+int vsnprintf(char *buf, size_t size, const char *fmt, __gnuc_va_list args)
 {
 	int len;
-	int i;
-	char * str;
-	char *s;
+	const char *s;
 	int *ip;
+	struct out o;
 
 	int flags;		/* flags to number() */
 
@@ -107,9 +182,19 @@ int vsprintf(char *buf, const char *fmt, __gnuc_va_list args)
 				   number of chars for from string */
 //	int qualifier;		/* 'h', 'l', or 'L' for integer fields */
 
-	for (str=buf ; *fmt ; ++fmt) {
+	o.str = buf;
+	if (size > ~(uint32)buf)
+		o.end = (char *)0xffffffff; /* for vsprintf(); avoid wrapping around */
+	else
+		o.end = buf + size;
+
+	while (*fmt) {
 		if (*fmt != '%') {
-			*str++ = *fmt;
+			/* copy everything up to the next conversion in one go */
+			s = fmt;
+			while (*fmt && *fmt != '%')
+				fmt++;
+			put_chars(&o, s, fmt - s);
 			continue;
 		}
 
@@ -130,6 +215,7 @@ int vsprintf(char *buf, const char *fmt, __gnuc_va_list args)
 		if (is_digit(*fmt))
 			field_width = skip_atoi(&fmt);
 		else if (*fmt == '*') {
+			++fmt;
 			/* it's the next argument */
 			field_width = va_arg(args, int);
 			if (field_width < 0) {
@@ -145,6 +231,7 @@ int vsprintf(char *buf, const char *fmt, __gnuc_va_list args)
 			if (is_digit(*fmt))
 				precision = skip_atoi(&fmt);
 			else if (*fmt == '*') {
+				++fmt;
 				/* it's the next argument */
 				precision = va_arg(args, int);
 			}
@@ -163,32 +250,32 @@ int vsprintf(char *buf, const char *fmt, __gnuc_va_list args)
 		switch (*fmt) {
 		case 'c':
 			if (!(flags & LEFT))
-				while (--field_width > 0)
-					*str++ = ' ';
-			*str++ = (unsigned char) va_arg(args, int);
-			while (--field_width > 0)
-				*str++ = ' ';
+				put_fill(&o, ' ', field_width - 1);
+			put_char(&o, (unsigned char) va_arg(args, int));
+			if (flags & LEFT)
+				put_fill(&o, ' ', field_width - 1);
 			break;
 
 		case 's':
 			s = va_arg(args, char *);
-			len = strlen(s);
+			if (s == NULL)
+				s = "(null)";
 			if (precision < 0)
-				precision = len;
-			else if (len > precision)
-				len = precision;
+				len = strlen(s);
+			else {
+				/* don't read past the precision; the string needn't be terminated */
+				for (len = 0; len < precision && s[len]; len++) { }
+			}
 
 			if (!(flags & LEFT))
-				while (len < field_width--)
-					*str++ = ' ';
-			for (i = 0; i < len; ++i)
-				*str++ = *s++;
-			while (len < field_width--)
-				*str++ = ' ';
+				put_fill(&o, ' ', field_width - len);
+			put_chars(&o, s, len);
+			if (flags & LEFT)
+				put_fill(&o, ' ', field_width - len);
 			break;
 
 		case 'o':
-			str = number(str, va_arg(args, unsigned long), 8,
+			number(&o, va_arg(args, unsigned long), 8,
 				field_width, precision, flags);
 			break;
 
@@ -197,7 +284,7 @@ int vsprintf(char *buf, const char *fmt, __gnuc_va_list args)
 				field_width = 8;
 				flags |= ZEROPAD;
 			}
-			str = number(str,
+			number(&o,
 				(unsigned long) va_arg(args, void *), 16,
 				field_width, precision, flags);
 			break;
@@ -205,7 +292,7 @@ int vsprintf(char *buf, const char *fmt, __gnuc_va_list args)
 		case 'x':
 			flags |= SMALL;
 		case 'X':
-			str = number(str, va_arg(args, unsigned long), 16,
+			number(&o, va_arg(args, unsigned long), 16,
 				field_width, precision, flags);
 			break;
 
@@ -213,25 +300,36 @@ int vsprintf(char *buf, const char *fmt, __gnuc_va_list args)
 		case 'i':
 			flags |= SIGN;
 		case 'u':
-			str = number(str, va_arg(args, unsigned long), 10,
+			number(&o, va_arg(args, unsigned long), 10,
 				field_width, precision, flags);
 			break;
 
 		case 'n':
 			ip = va_arg(args, int *);
-			*ip = (str - buf);
+			*ip = (o.str - buf);
 			break;
 
 		default:
 			if (*fmt != '%')
-				*str++ = '%';
+				put_char(&o, '%');
 			if (*fmt)
-				*str++ = *fmt;
+				put_char(&o, *fmt);
 			else
 				--fmt;
 			break;
 		}
+		++fmt;
 	}
-	*str = '\0';
-	return str-buf;
+
+	if (o.str < o.end)
+		*o.str = '\0';
+	else if (size > 0)
+		buf[size - 1] = '\0';
+
+	return o.str - buf;
+}
+
+int vsprintf(char *buf, const char *fmt, __gnuc_va_list args)
+{
+	return vsnprintf(buf, (size_t)-1, fmt, args);
 }
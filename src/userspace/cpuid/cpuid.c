@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <sys/cpufeature.h>
 
 int main(int argc, char **argv) {
 	int eax, ebx, ecx, edx;
@@ -15,22 +16,27 @@ int main(int argc, char **argv) {
 				 :
 				 : "eax", "ebx", "ecx", "edx");
 
+	// Features the kernel has enabled (e.g. SSE needs the kernel to save the XMM registers)
+	unsigned int enabled = cpu_features();
+
 #define EAX(n) ((eax & (1 << n)) ? "yes" : "no")
 #define EBX(n) ((ebx & (1 << n)) ? "yes" : "no")
 #define ECX(n) ((ecx & (1 << n)) ? "yes" : "no")
 #define EDX(n) ((edx & (1 << n)) ? "yes" : "no")
-	printf("FPU: %s\n", EDX(0));
-	printf("MMX: %s\n", EDX(23));
-	printf("FXSR: %s\n", EDX(24));
-	printf("SSE: %s\n", EDX(25));
-	printf("SSE2: %s\n", EDX(26));
-	printf("SSE3: %s\n", ECX(0));
-	printf("SSSE3: %s\n", ECX(9));
-	printf("SSSE4.1: %s\n", ECX(19));
-	printf("SSSE4.2: %s\n", ECX(20));
-	printf("AVX: %s\n", ECX(28));
-	printf("POPCNT: %s\n", ECX(23));
-	printf("AES-NI: %s\n", ECX(25));
+#define OS(bit) ((enabled & (bit)) ? "enabled" : "disabled")
+	printf("%-9s %-4s %s\n", "Feature", "CPU", "OS");
+	printf("FPU:      %-4s %s\n", EDX(0), OS(CPU_FEATURE_FPU));
+	printf("MMX:      %-4s %s\n", EDX(23), OS(CPU_FEATURE_MMX));
+	printf("FXSR:     %-4s %s\n", EDX(24), OS(CPU_FEATURE_FXSR));
+	printf("SSE:      %-4s %s\n", EDX(25), OS(CPU_FEATURE_SSE));
+	printf("SSE2:     %-4s %s\n", EDX(26), OS(CPU_FEATURE_SSE2));
+	printf("SSE3:     %-4s %s\n", ECX(0), OS(CPU_FEATURE_SSE3));
+	printf("SSSE3:    %-4s %s\n", ECX(9), OS(CPU_FEATURE_SSSE3));
+	printf("SSE4.1:   %-4s %s\n", ECX(19), OS(CPU_FEATURE_SSE4_1));
+	printf("SSE4.2:   %-4s %s\n", ECX(20), OS(CPU_FEATURE_SSE4_2));
+	printf("AVX:      %-4s %s\n", ECX(28), "disabled"); // needs XSAVE support
+	printf("POPCNT:   %-4s %s\n", ECX(23), OS(CPU_FEATURE_POPCNT));
+	printf("AES-NI:   %s\n", ECX(25));
 
 	return 0;
 }
@@ -11,6 +11,8 @@ extern char **environ;
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <spawn.h>
 #include <pwd.h>
 #include <glob.h>
 
@@ -258,6 +260,37 @@ void sigint_handler(int sig) {
 
 #define max(a,b) ( (a > b) ? a : b )
 
+// Returns a new environment array: environ, with the KEY=value entries in extra added or replacing
+// existing ones. Only the array is allocated; the strings are shared with environ and extra.
+static char **merge_env(char **extra) {
+	int n = 0, n_extra = 0;
+	while (environ[n] != NULL) n++;
+	while (extra[n_extra] != NULL) n_extra++;
+
+	char **env = malloc((n + n_extra + 1) * sizeof(char *));
+	int e = 0;
+	for (int i = 0; i < n; i++) {
+		// Skip this variable if it is overridden
+		size_t keylen = strcspn(environ[i], "=");
+		bool overridden = false;
+		for (int j = 0; j < n_extra; j++) {
+			if (strncmp(environ[i], extra[j], keylen) == 0 && extra[j][keylen] == '=') {
+				overridden = true;
+				break;
+			}
+		}
+		if (!overridden)
+			env[e++] = environ[i];
+	}
+	for (int j = 0; j < n_extra; j++) {
+		if (strchr(extra[j], '=') != NULL)
+			env[e++] = extra[j];
+	}
+	env[e] = NULL;
+
+	return env;
+}
+
 // Process an input string, e.g. "cmd1 2>/dev/null | cmd2 && cmd3"
 int process_input(char *cmd) {
 	// Pre-parse the command line and substitute variable values
@@ -458,176 +491,160 @@ int process_input(char *cmd) {
 		return 0;
 	}
 
-	int pid;
-	if ((pid = fork()) > 0) {
-		// Parent
-		// Clean up the arguments; WE don't need them, only the child does. We,
-		// on the other hand, will keep existing, so memory leaks matter!
-		for (i = 0; i < argc; i++) {
-			assert(argv[i] != NULL);
-			free(argv[i]);
-			argv[i] = NULL;
-		}
-		free(argv);
-		argv = NULL;
-
-		// Free the extra environment variables for the child
-		if (extra_env) {
-			i = 0;
-			while (extra_env[i] != NULL) {
-				free(extra_env[i]);
-				extra_env[i] = NULL;
-				i++;
+	// Take care of globbing, if necessary
+	for (i = 0; i < argc; i++) {
+		char *p = NULL;
+		if (argv[i] && (p = strchr(argv[i], '*')) != NULL) {
+			if (p > argv[i] && *(p-1) == '\\') {
+				// Escape this one
+				memmove(p-1, p, (argv[i] + strlen(argv[i])) - p + 1);
+				continue; // Might miss other asterisks in this SAME ARGUMENT, but
+						  // I'm not going to bother fixing that.
 			}
-			free(extra_env);
-			extra_env = NULL;
-		}
-
-		int stat = 0;
-		while (waitpid(-1, &stat, 0) != -1) { /* Wait for all child tasks to finish */ }
-		//printf("child existed with exit status %d\n", WEXITSTATUS(stat));
-		//last_exit = WEXITSTATUS(stat); // Extract the 8-bit return value
-	}
-	else if (pid == 0) {
-		// Child
-		// Re-enable the SIGINT signal
-#ifdef USE_SIGNALS
-		signal(SIGINT, SIG_DFL);
-#endif
 
-		// Take care of globbing, if necessary
-		for (i = 0; i < argc; i++) {
-			char *p = NULL;
-			if (argv[i] && (p = strchr(argv[i], '*')) != NULL) {
-				if (p > argv[i] && *(p-1) == '\\') {
-					// Escape this one
-					memmove(p-1, p, (argv[i] + strlen(argv[i])) - p + 1);
-					continue; // Might miss other asterisks in this SAME ARGUMENT, but
-							  // I'm not going to bother fixing that.
-				}
+			// Still here? Let's glob it!
+			glob_t gl;
+			if (glob(argv[i], GLOB_MARK, NULL, &gl) != 0) {
+				// Glob failed!
+				// Ignore this argument and pass it as-is.
+				continue;
+			}
 
-				// Still here? Let's glob it!
-				glob_t gl;
-				if (glob(argv[i], GLOB_MARK, NULL, &gl) != 0) {
-					// Glob failed!
-					// Ignore this argument and pass it as-is.
-					continue;
-				}
+			// Glob succeeded.
+			if (gl.gl_pathc == 0) {
+				// No matches, pass this on as-is
+				globfree(&gl);
+				continue;
+			}
 
-				// Glob succeeded.
-				if (gl.gl_pathc == 0) {
-					// No matches, pass this on as-is
-					continue;
-				}
+			// We're the ones to free the arguments (below), so don't leak the one being replaced
+			free(argv[i]);
 
-				if (gl.gl_pathc == 1) {
-					// Unlikely, but way easy
-					argv[i] = strdup(gl.gl_pathv[0]);
-					globfree(&gl);
-					continue;
-				}
+			if (gl.gl_pathc == 1) {
+				// Unlikely, but way easy
+				argv[i] = strdup(gl.gl_pathv[0]);
+				globfree(&gl);
+				continue;
+			}
 
-				int newargs = argc + gl.gl_pathc; // - 1, but eh
-				argv = realloc(argv, (newargs + 1) * sizeof(char *));
-				for (int j = argc; j < newargs + 1; j++) {
-					argv[j] = NULL;
-				}
+			int newargs = argc + gl.gl_pathc; // - 1, but eh
+			argv = realloc(argv, (newargs + 1) * sizeof(char *));
+			for (int j = argc; j < newargs + 1; j++) {
+				argv[j] = NULL;
+			}
 
-				char *start = (char *)&argv[i+1];
-				char *end = (char *)&argv[argc+1]; /* we copy to [argc+1] exclusive */
+			char *start = (char *)&argv[i+1];
+			char *end = (char *)&argv[argc+1]; /* we copy to [argc+1] exclusive */
 
-				char *ending = malloc(end - start);
-				memcpy(ending, start, end - start);
+			char *ending = malloc(end - start);
+			memcpy(ending, start, end - start);
 
-				// Copy the arguments in, one by one (so that we can strdup() them)
-				for (int g = 0; g < gl.gl_pathc; g++) {
-					argv[i + g] = strdup(gl.gl_pathv[g]);
-				}
+			// Copy the arguments in, one by one (so that we can strdup() them)
+			for (int g = 0; g < gl.gl_pathc; g++) {
+				argv[i + g] = strdup(gl.gl_pathv[g]);
+			}
 
-				// Copy the ending back after all that
-				memcpy(&argv[i + gl.gl_pathc], ending, end - start);
+			// Copy the ending back after all that
+			memcpy(&argv[i + gl.gl_pathc], ending, end - start);
+			free(ending);
 
-				// Adjust argc and i for the new stuff
-				argc += (gl.gl_pathc - 1); // - 1 because one was stored where the * was
-				i    += (gl.gl_pathc - 1);
-			}
+			// Adjust argc and i for the new stuff
+			argc += (gl.gl_pathc - 1); // - 1 because one was stored where the * was
+			i    += (gl.gl_pathc - 1);
+			globfree(&gl);
 		}
+	}
 
-#if 1
-		// Set up redirects
-		if (redir_stdin) {
-			if (freopen(redir_stdin, "r", stdin) == NULL) {
-				fprintf(stderr, "eshell: ");
-				perror(redir_stdin);
-				exit(-1);
-			}
+	// Set up redirects. We open the files here, and have the kernel move them
+	// into place (and close the originals) in the child.
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	int redir_fds[3] = { -1, -1, -1 };
+	bool redir_ok = true;
+	if (redir_stdin) {
+		if ((redir_fds[0] = open(redir_stdin, O_RDONLY)) < 0) {
+			fprintf(stderr, "eshell: ");
+			perror(redir_stdin);
+			redir_ok = false;
 		}
-		if (redir_stdout) {
-			if (freopen(redir_stdout, (redir_append_stdout ? "a" : "w"), stdout) == NULL) {
-				fprintf(stderr, "eshell: ");
-				perror(redir_stdout);
-				exit(-1);
-			}
+	}
+	if (redir_ok && redir_stdout) {
+		int flags = O_WRONLY | O_CREAT | (redir_append_stdout ? O_APPEND : O_TRUNC);
+		if ((redir_fds[1] = open(redir_stdout, flags, 0666)) < 0) {
+			fprintf(stderr, "eshell: ");
+			perror(redir_stdout);
+			redir_ok = false;
 		}
-		if (redir_stderr) {
-			if (redir_stderr == (char *)1) {
-				// Redirect stderr to stdout
-				if (dup2(fileno(stdout), fileno(stderr)) < 0) {
-					fprintf(stderr, "eshell: ");
-					perror("dup2");
-				}
-			}
-			else {
-				// Redirect stderr to a file
-				if (freopen(redir_stderr, (redir_append_stderr ? "a" : "w"), stderr) == NULL) {
-					fprintf(stderr, "eshell: ");
-					perror(redir_stderr);
-					exit(-1);
-				}
-			}
+	}
+	if (redir_ok && redir_stderr && redir_stderr != (char *)1) {
+		// Redirect stderr to a file
+		int flags = O_WRONLY | O_CREAT | (redir_append_stderr ? O_APPEND : O_TRUNC);
+		if ((redir_fds[2] = open(redir_stderr, flags, 0666)) < 0) {
+			fprintf(stderr, "eshell: ");
+			perror(redir_stderr);
+			redir_ok = false;
 		}
-#endif
+	}
 
-		// Set up environment variables specified before the command, e.g. A=B ls
-		if (extra_env) {
-			i = 0;
-			while (extra_env[i] != NULL) {
-				char *p = strchr(extra_env[i], '=');
-				if (!p) {
-					i++;
-					continue;
-				}
-				*p = 0;
-				char key[256] = {0};
-				char value[512] = {0};
-				strlcpy(key, extra_env[i], 256);
-				strlcpy(value, p + 1, 512);
+	for (i = 0; i < 3; i++) {
+		if (redir_fds[i] >= 0) {
+			posix_spawn_file_actions_adddup2(&actions, redir_fds[i], i);
+			posix_spawn_file_actions_addclose(&actions, redir_fds[i]);
+		}
+	}
+	if (redir_stderr == (char *)1) {
+		// Redirect stderr to stdout (after stdout has been redirected, if it was)
+		posix_spawn_file_actions_adddup2(&actions, 1, 2);
+	}
 
-				setenv(key, value, 1);
-				i++;
-			}
+	// Set up environment variables specified before the command, e.g. A=B ls
+	char **envp = environ;
+	if (extra_env)
+		envp = merge_env(extra_env);
 
-			// Free the extra environment variables now that setenv is done
-			i = 0;
-			while (extra_env[i] != NULL) {
-				free(extra_env[i]);
-				extra_env[i] = NULL;
-				i++;
-			}
-			free(extra_env);
-			extra_env = NULL;
+	if (redir_ok) {
+		pid_t pid;
+		int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, envp);
+		if (err != 0) {
+			fprintf(stderr, "eshell: %s: %s\n", argv[0], strerror(err));
+		}
+		else {
+			int stat = 0;
+			while (waitpid(-1, &stat, 0) != -1) { /* Wait for all child tasks to finish */ }
+			//printf("child existed with exit status %d\n", WEXITSTATUS(stat));
+			//last_exit = WEXITSTATUS(stat); // Extract the 8-bit return value
 		}
+	}
 
-		// Finally, switch to the child program
-		execvp(argv[0], argv);
-		fprintf(stderr, "eshell: ");
-		perror(argv[0]);
-		exit(-1);
+	// Clean up. The child has its own copies of everything (files included), so
+	// we free them all; we will keep existing, so memory (and fd) leaks matter!
+	posix_spawn_file_actions_destroy(&actions);
+	for (i = 0; i < 3; i++) {
+		if (redir_fds[i] >= 0)
+			close(redir_fds[i]);
+	}
+
+	if (envp != environ)
+		free(envp); // the strings themselves belong to environ and extra_env
+
+	for (i = 0; i < argc; i++) {
+		assert(argv[i] != NULL);
+		free(argv[i]);
+		argv[i] = NULL;
 	}
-	else {
-		// Error!
-		perror("fork");
-		exit(-1);
+	free(argv);
+	argv = NULL;
+
+	// Free the extra environment variables for the child
+	if (extra_env) {
+		i = 0;
+		while (extra_env[i] != NULL) {
+			free(extra_env[i]);
+			extra_env[i] = NULL;
+			i++;
+		}
+		free(extra_env);
+		extra_env = NULL;
 	}
 
 	free(buf);
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+// Measures process creation/teardown throughput: fork + _exit + wait, and fork + execve + wait.
+
+#define DEFAULT_ITERATIONS 200
+
+// Where to find ourselves, for the execve test
+static const char *self_paths[] = { "/bin/tests/forkbench", "/initrd/bin/tests/forkbench", NULL };
+static const char *self_path = NULL;
+
+static unsigned int now_ms(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void report(const char *name, int iterations, unsigned int ms) {
+	if (ms == 0)
+		ms = 1;
+	printf("%-18s %5d iterations in %5u ms: %4u.%02u ms each, %u per second\n", name, iterations, ms,
+			ms / iterations, ((ms * 100) / iterations) % 100, (iterations * 1000) / ms);
+}
+
+static int run(const char *name, int iterations, bool exec) {
+	unsigned int start = now_ms();
+	for (int i = 0; i < iterations; i++) {
+		int pid = fork();
+		if (pid == 0) {
+			if (exec) {
+				char *args[] = { (char *)self_path, (char *)"-x", NULL };
+				execve(self_path, args, NULL);
+				fprintf(stderr, "forkbench: execve(%s): %s\n", self_path, strerror(errno));
+				_exit(1);
+			}
+			_exit(0);
+		}
+		else if (pid < 0) {
+			fprintf(stderr, "forkbench: fork: %s\n", strerror(errno));
+			return 1;
+		}
+
+		int status;
+		if (waitpid(pid, &status, 0) != pid) {
+			fprintf(stderr, "forkbench: waitpid: %s\n", strerror(errno));
+			return 1;
+		}
+		if (status != 0) {
+			fprintf(stderr, "forkbench: child exited with status %04x\n", status);
+			return 1;
+		}
+	}
+
+	report(name, iterations, now_ms() - start);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1 && strcmp(argv[1], "-x") == 0) {
+		// We are the execve()d child; do nothing
+		return 0;
+	}
+
+	int iterations = DEFAULT_ITERATIONS;
+	if (argc > 1) {
+		iterations = atoi(argv[1]);
+		if (iterations <= 0) {
+			fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (run("fork/exit/wait", iterations, false) != 0)
+		return 1;
+
+	struct stat st;
+	for (int i = 0; self_paths[i] != NULL; i++) {
+		if (stat(self_paths[i], &st) == 0) {
+			self_path = self_paths[i];
+			break;
+		}
+	}
+	if (self_path == NULL) {
+		fprintf(stderr, "forkbench: unable to find own executable for the execve test\n");
+		return 1;
+	}
+
+	if (run("fork/execve/wait", iterations, true) != 0)
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+// Tests clone()-based threads: shared memory, per-thread errno, getpid(), join return values and a shared cwd,
+// plus futex-based mutexes and condition variables.
+
+#define NUM_THREADS 8
+#define ITERATIONS 100000
+
+static volatile int counters[NUM_THREADS];
+static int main_pid;
+
+static void *worker(void *arg) {
+	int n = (int)arg;
+
+	for (int i = 0; i < ITERATIONS; i++)
+		counters[n]++;
+
+	// errno is per-thread
+	errno = 1000 + n;
+	usleep(10000);
+	if (errno != 1000 + n) {
+		printf("thread %d: errno changed to %d!\n", n, errno);
+		return (void *)-1;
+	}
+
+	if (getpid() != main_pid) {
+		printf("thread %d: getpid() returned %d, expected %d\n", n, getpid(), main_pid);
+		return (void *)-1;
+	}
+
+	return (void *)(n * 2);
+}
+
+static void *chdir_worker(void *arg) {
+	return (void *)chdir("/");
+}
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int shared_counter = 0;
+
+static void *mutex_worker(void *arg) {
+	for (int i = 0; i < ITERATIONS; i++) {
+		pthread_mutex_lock(&lock);
+		shared_counter++;
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int queue[4];
+static int queue_len = 0;
+
+// Receives the numbers 1..ITEMS through a tiny queue; returns their sum
+#define ITEMS 1000
+static void *consumer(void *arg) {
+	int sum = 0;
+	for (int received = 0; received < ITEMS; received++) {
+		pthread_mutex_lock(&lock);
+		while (queue_len == 0)
+			pthread_cond_wait(&cond, &lock);
+		sum += queue[--queue_len];
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+	return (void *)sum;
+}
+
+int main(int argc, char **argv) {
+	pthread_t threads[NUM_THREADS];
+	main_pid = getpid();
+
+	for (int i = 0; i < NUM_THREADS; i++) {
+		int err = pthread_create(&threads[i], NULL, worker, (void *)i);
+		if (err != 0) {
+			printf("pthread_create: %s\n", strerror(err));
+			return 1;
+		}
+	}
+
+	int failed = 0;
+	for (int i = 0; i < NUM_THREADS; i++) {
+		void *ret;
+		int err = pthread_join(threads[i], &ret);
+		if (err != 0) {
+			printf("pthread_join: %s\n", strerror(err));
+			return 1;
+		}
+		if ((int)ret != i * 2 || counters[i] != ITERATIONS) {
+			printf("thread %d: returned %d, counter %d\n", i, (int)ret, counters[i]);
+			failed = 1;
+		}
+	}
+
+	if (pthread_join(threads[0], NULL) != ESRCH) {
+		printf("joining a thread twice didn't fail with ESRCH\n");
+		failed = 1;
+	}
+
+	// A chdir in one thread applies to all of them
+	if (chdir("/bin") != 0) {
+		printf("chdir(\"/bin\") failed\n");
+		return 1;
+	}
+	pthread_t t;
+	pthread_create(&t, NULL, chdir_worker, NULL);
+	pthread_join(t, NULL);
+	char buf[256];
+	if (getcwd(buf, sizeof(buf)) == NULL || strcmp(buf, "/") != 0) {
+		printf("cwd not shared: %s\n", buf);
+		failed = 1;
+	}
+
+	// Mutexes: no increments may be lost
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_create(&threads[i], NULL, mutex_worker, NULL);
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	if (shared_counter != NUM_THREADS * ITERATIONS) {
+		printf("mutex: counter is %d, expected %d\n", shared_counter, NUM_THREADS * ITERATIONS);
+		failed = 1;
+	}
+
+	// Condition variables: a producer/consumer pair
+	pthread_create(&t, NULL, consumer, NULL);
+	for (int i = 1; i <= ITEMS; i++) {
+		pthread_mutex_lock(&lock);
+		while (queue_len == 4)
+			pthread_cond_wait(&cond, &lock);
+		queue[queue_len++] = i;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+	void *sum;
+	pthread_join(t, &sum);
+	if ((int)sum != ITEMS * (ITEMS + 1) / 2) {
+		printf("condvar: consumer got a sum of %d, expected %d\n", (int)sum, ITEMS * (ITEMS + 1) / 2);
+		failed = 1;
+	}
+
+	// Detached threads can't be joined
+	pthread_create(&t, NULL, chdir_worker, NULL);
+	if (pthread_detach(t) != 0 || pthread_join(t, NULL) == 0) {
+		printf("pthread_detach failed, or the thread could still be joined\n");
+		failed = 1;
+	}
+
+	printf("threads: %s\n", failed ? "FAILED" : "all tests passed");
+	return failed;
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include <sys/taskstat.h>
+
+#define MAX_TASKS 256
+#define SCREEN_LINES 24
+
+void print_help(void) {
+	fprintf(stderr, "Usage: top [-d delay] [-n iterations]\n");
+	fprintf(stderr, "-d: seconds between updates (default 2)\n");
+	fprintf(stderr, "-n: exit after this many updates (default: run forever)\n");
+	fprintf(stderr, "-h: display this help message\n");
+}
+
+struct entry {
+	struct taskstat *ts;
+	uint32 cpu_delta; // ms of CPU time used since the last update
+};
+
+// Samples from the previous update, used to calculate CPU usage
+static struct taskstat prev[MAX_TASKS];
+static int num_prev = 0;
+
+static uint32 prev_cputime(int pid) {
+	for (int i = 0; i < num_prev; i++) {
+		if (prev[i].pid == pid)
+			return prev[i].utime + prev[i].stime;
+	}
+	return 0;
+}
+
+static int compare_cpu(const void *a, const void *b) {
+	const struct entry *ea = (const struct entry *)a;
+	const struct entry *eb = (const struct entry *)b;
+	if (ea->cpu_delta != eb->cpu_delta)
+		return (ea->cpu_delta < eb->cpu_delta) ? 1 : -1;
+
+	// Tie: sort by total CPU time, then by PID
+	uint32 ta = ea->ts->utime + ea->ts->stime;
+	uint32 tb = eb->ts->utime + eb->ts->stime;
+	if (ta != tb)
+		return (ta < tb) ? 1 : -1;
+	return ea->ts->pid - eb->ts->pid;
+}
+
+static uint32 now_ms(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int main(int argc, char **argv) {
+	int delay = 2;
+	int iterations = -1;
+
+	int c;
+	while ((c = getopt(argc, argv, "d:n:h")) != -1) {
+		switch (c) {
+			case 'd':
+				delay = atoi(optarg);
+				if (delay < 1)
+					delay = 1;
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			case 'h':
+			default:
+				print_help();
+				exit(1);
+		}
+	}
+
+	struct taskstat *cur = malloc(sizeof(struct taskstat) * MAX_TASKS);
+	struct entry *entries = malloc(sizeof(struct entry) * MAX_TASKS);
+	if (cur == NULL || entries == NULL) {
+		fprintf(stderr, "top: out of memory\n");
+		exit(1);
+	}
+
+	uint32 prev_time = now_ms();
+	bool first = true;
+
+	while (iterations != 0) {
+		int num = taskstats(cur, MAX_TASKS);
+		if (num < 0) {
+			fprintf(stderr, "top: taskstats: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		uint32 time = now_ms();
+		uint32 elapsed = time - prev_time;
+		if (elapsed == 0)
+			elapsed = 1;
+
+		uint32 total_csw = 0, total_faults = 0, total_syscalls = 0;
+		for (int i = 0; i < num; i++) {
+			uint32 cputime = cur[i].utime + cur[i].stime;
+			entries[i].ts = &cur[i];
+			entries[i].cpu_delta = first ? cputime : cputime - prev_cputime(cur[i].pid);
+			total_csw += cur[i].nvcsw + cur[i].nivcsw;
+			total_faults += cur[i].page_faults;
+			total_syscalls += cur[i].syscalls;
+		}
+
+		qsort(entries, num, sizeof(struct entry), compare_cpu);
+
+		// "Clear" the screen by scrolling the previous output away
+		if (!first) {
+			for (int i = 0; i < SCREEN_LINES; i++)
+				putchar('\n');
+		}
+
+		printf("top - %d tasks, %u context switches, %u page faults, %u syscalls\n", num, total_csw, total_faults, total_syscalls);
+		printf("%5s %5s S %5s %8s %8s %7s %7s %6s %8s %5s %s\n",
+				"PID", "PPID", "%CPU", "USER", "SYS", "VCSW", "IVCSW", "FAULTS", "SYSCALLS", "RSS", "NAME");
+
+		// Leave room for the two header lines
+		for (int i = 0; i < num && i < SCREEN_LINES - 3; i++) {
+			struct taskstat *ts = entries[i].ts;
+			uint32 pct10 = first ? 0 : (entries[i].cpu_delta * 1000) / elapsed; // tenths of a percent
+			if (pct10 > 1000)
+				pct10 = 1000;
+			printf("%5d %5d %c %3u.%u %5u.%02u %5u.%02u %7u %7u %6u %8u %4uk %s\n",
+					ts->pid, ts->ppid, ts->state, pct10 / 10, pct10 % 10,
+					ts->utime / 1000, (ts->utime % 1000) / 10,
+					ts->stime / 1000, (ts->stime % 1000) / 10,
+					ts->nvcsw, ts->nivcsw, ts->page_faults, ts->syscalls, ts->rss, ts->name);
+		}
+		fflush(stdout);
+
+		memcpy(prev, cur, sizeof(struct taskstat) * num);
+		num_prev = num;
+		prev_time = time;
+		first = false;
+
+		if (iterations > 0)
+			iterations--;
+		if (iterations != 0)
+			sleep(delay);
+	}
+
+	free(cur);
+	free(entries);
+
+	return 0;
+}
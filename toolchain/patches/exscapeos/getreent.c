@@ -5,13 +5,19 @@
 #undef __getreent
 #endif
 
+/* Set by pthread_create (see syscalls.c) once the main thread has a TLS segment */
+int __exscapeos_threaded = 0;
+
 struct _reent *
 _DEFUN_VOID(__getreent)
 {
-	// NULL is undeclared here
-	static struct _reent *ptr = (struct _reent *)0;
-	if (ptr == (struct _reent *)0)
-		ptr = sys___getreent();
+	if (__exscapeos_threaded) {
+		// Every thread has its own struct _reent; GS points to the thread's
+		// control block, which stores it at offset 4 (see struct pthread_tcb)
+		struct _reent *ptr;
+		__asm__ __volatile__("movl %%gs:4, %0" : "=r" (ptr));
+		return ptr;
+	}
 
-	return ptr;
+	return _impure_ptr;
 }
@@ -0,0 +1,87 @@
+#ifndef _PTHREAD_H
+#define _PTHREAD_H
+
+#include <sys/types.h>
+#include <sys/time.h> /* struct timespec */
+
+/*
+ * A minimal POSIX threads layer, built on the clone, thread_exit, thread_join and
+ * thread_detach syscalls. Threads share the address space, file descriptors and working directory;
+ * each has its own stack, and its own struct _reent (errno, stdio streams),
+ * found through the TLS segment.
+ * Mutexes and condition variables are futex-based: they only enter the kernel
+ * when there is contention.
+ */
+
+typedef int pthread_t; // the kernel's thread ID; the main thread's equals the process ID
+
+#define PTHREAD_STACK_MIN (16*1024)
+#define PTHREAD_STACK_DEFAULT (256*1024)
+
+typedef struct {
+	size_t stacksize;
+} pthread_attr_t;
+
+int pthread_attr_init(pthread_attr_t *attr);
+int pthread_attr_destroy(pthread_attr_t *attr);
+int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize);
+int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize);
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg);
+int pthread_join(pthread_t thread, void **retval);
+int pthread_detach(pthread_t thread);
+void pthread_exit(void *retval) __attribute__((noreturn));
+pthread_t pthread_self(void);
+int pthread_equal(pthread_t t1, pthread_t t2);
+
+#define PTHREAD_MUTEX_NORMAL 0
+#define PTHREAD_MUTEX_RECURSIVE 1
+#define PTHREAD_MUTEX_ERRORCHECK 2
+#define PTHREAD_MUTEX_DEFAULT PTHREAD_MUTEX_NORMAL
+
+typedef struct {
+	int type;
+} pthread_mutexattr_t;
+
+typedef struct {
+	int state; // 0: unlocked, 1: locked, 2: locked, and there may be waiters
+	int type;
+	pthread_t owner; // only maintained for recursive and error-checking mutexes
+	int count;
+} pthread_mutex_t;
+
+#define PTHREAD_MUTEX_INITIALIZER { 0, PTHREAD_MUTEX_NORMAL, 0, 0 }
+
+int pthread_mutexattr_init(pthread_mutexattr_t *attr);
+int pthread_mutexattr_destroy(pthread_mutexattr_t *attr);
+int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type);
+int pthread_mutexattr_gettype(const pthread_mutexattr_t *attr, int *type);
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
+int pthread_mutex_destroy(pthread_mutex_t *mutex);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+typedef struct {
+	int dummy;
+} pthread_condattr_t;
+
+typedef struct {
+	int seq; // bumped on every signal/broadcast; waiters sleep on it
+	int waiters; // so that signalling doesn't need a syscall when nobody waits
+} pthread_cond_t;
+
+#define PTHREAD_COND_INITIALIZER { 0, 0 }
+
+int pthread_condattr_init(pthread_condattr_t *attr);
+int pthread_condattr_destroy(pthread_condattr_t *attr);
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+int pthread_cond_destroy(pthread_cond_t *cond);
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime);
+int pthread_cond_signal(pthread_cond_t *cond);
+int pthread_cond_broadcast(pthread_cond_t *cond);
+
+#endif
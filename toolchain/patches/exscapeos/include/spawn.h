@@ -0,0 +1,6 @@
+#ifndef _SPAWN_H
+#define _SPAWN_H
+
+#include <sys/spawn.h>
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef _SYS_CPUFEATURE_H
+#define _SYS_CPUFEATURE_H
+
+/*
+ * CPU features that are both supported by the CPU and enabled by the kernel,
+ * as returned by the cpu_features() syscall. (E.g. SSE can't be used unless
+ * the kernel saves the SSE registers on task switches, regardless of what
+ * CPUID says.)
+ */
+#define CPU_FEATURE_FPU    (1 << 0)
+#define CPU_FEATURE_MMX    (1 << 1)
+#define CPU_FEATURE_FXSR   (1 << 2) // FXSAVE/FXRSTOR
+#define CPU_FEATURE_SSE    (1 << 3)
+#define CPU_FEATURE_SSE2   (1 << 4)
+#define CPU_FEATURE_SSE3   (1 << 5)
+#define CPU_FEATURE_SSSE3  (1 << 6)
+#define CPU_FEATURE_SSE4_1 (1 << 7)
+#define CPU_FEATURE_SSE4_2 (1 << 8)
+#define CPU_FEATURE_POPCNT (1 << 9)
+
+#ifndef _EXSCAPEOS_KERNEL
+unsigned int cpu_features(void);
+#endif
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _SYS_FUTEX_H
+#define _SYS_FUTEX_H
+
+/* Operations for the futex() syscall */
+#define FUTEX_WAIT 0 // sleep if *uaddr == val, until woken or the (relative) timeout passes
+#define FUTEX_WAKE 1 // wake up to val tasks waiting on uaddr; returns the number woken
+
+#ifndef _EXSCAPEOS_KERNEL
+#include <sys/time.h> /* struct timespec */
+int futex(int *uaddr, int op, int val, const struct timespec *timeout);
+#endif
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef __SYS_LOCK_H__
+#define __SYS_LOCK_H__
+
+/*
+ * Newlib's internal locks (malloc, stdio streams, atexit etc.).
+ * The default sys/lock.h makes these no-ops; with threads, they need to be real.
+ * They are futex-based (see syscalls.c), so uncontended locking never enters the kernel.
+ * state is 0 (unlocked), 1 (locked) or 2 (locked, with waiters).
+ */
+
+typedef struct {
+	int state;
+} _LOCK_T;
+
+typedef struct {
+	int state;
+	void *owner; // the owning thread's control block
+	int count;
+} _LOCK_RECURSIVE_T;
+
+#include <_ansi.h>
+
+#define __LOCK_INIT(class,lock) class _LOCK_T lock = { 0 };
+#define __LOCK_INIT_RECURSIVE(class,lock) class _LOCK_RECURSIVE_T lock = { 0, 0, 0 };
+#define __lock_init(lock) __exscapeos_lock_init(&(lock))
+#define __lock_init_recursive(lock) __exscapeos_lock_init_recursive(&(lock))
+#define __lock_close(lock) (_CAST_VOID 0)
+#define __lock_close_recursive(lock) (_CAST_VOID 0)
+#define __lock_acquire(lock) __exscapeos_lock_acquire(&(lock))
+#define __lock_acquire_recursive(lock) __exscapeos_lock_acquire_recursive(&(lock))
+#define __lock_try_acquire(lock) __exscapeos_lock_try_acquire(&(lock))
+#define __lock_try_acquire_recursive(lock) __exscapeos_lock_try_acquire_recursive(&(lock))
+#define __lock_release(lock) __exscapeos_lock_release(&(lock))
+#define __lock_release_recursive(lock) __exscapeos_lock_release_recursive(&(lock))
+
+void __exscapeos_lock_init(_LOCK_T *lock);
+void __exscapeos_lock_init_recursive(_LOCK_RECURSIVE_T *lock);
+void __exscapeos_lock_acquire(_LOCK_T *lock);
+void __exscapeos_lock_acquire_recursive(_LOCK_RECURSIVE_T *lock);
+int __exscapeos_lock_try_acquire(_LOCK_T *lock);
+int __exscapeos_lock_try_acquire_recursive(_LOCK_RECURSIVE_T *lock);
+void __exscapeos_lock_release(_LOCK_T *lock);
+void __exscapeos_lock_release_recursive(_LOCK_RECURSIVE_T *lock);
+
+#endif /* __SYS_LOCK_H__ */
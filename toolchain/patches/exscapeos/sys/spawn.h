@@ -0,0 +1,49 @@
+#ifndef _SYS_SPAWN_H
+#define _SYS_SPAWN_H
+
+#include <sys/types.h>
+
+/*
+ * File descriptor actions for the spawn() syscall; they are performed
+ * in order on the child's copy of the parent's fd table, before the
+ * new program starts.
+ */
+#define SPAWN_ACTION_DUP2  1 // dup2(fd, newfd)
+#define SPAWN_ACTION_CLOSE 2 // close(fd)
+
+#define SPAWN_MAX_ACTIONS 32
+
+struct spawn_action {
+	int type;
+	int fd;
+	int newfd; // SPAWN_ACTION_DUP2 only
+};
+
+#ifndef _EXSCAPEOS_KERNEL
+typedef struct {
+	int num_actions;
+	int max_actions;
+	struct spawn_action *actions;
+} posix_spawn_file_actions_t;
+
+typedef struct {
+	short flags; // no flags are supported at the moment
+} posix_spawnattr_t;
+
+int posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
+		const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]);
+int posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
+		const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]);
+
+int posix_spawn_file_actions_init(posix_spawn_file_actions_t *file_actions);
+int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *file_actions);
+int posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *file_actions, int fd, int newfd);
+int posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *file_actions, int fd);
+
+int posix_spawnattr_init(posix_spawnattr_t *attr);
+int posix_spawnattr_destroy(posix_spawnattr_t *attr);
+int posix_spawnattr_getflags(const posix_spawnattr_t *attr, short *flags);
+int posix_spawnattr_setflags(posix_spawnattr_t *attr, short flags);
+#endif
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _SYS_TASKSTAT_H
+#define _SYS_TASKSTAT_H
+
+#include <sys/types.h>
+
+#define TASKSTAT_NAME_LEN 64
+
+/* Per-task accounting info, as returned by the taskstats() syscall */
+struct taskstat {
+	int pid;
+	int ppid; // 0 if the task has no parent (kernel tasks)
+	char state; // R(unning), S(leeping), D (I/O wait), W(aiting for a child), I(dle), X (exiting), Z(ombie)
+	uint8 privilege; // 0 for kernel tasks, 3 for user mode tasks
+	uint16 __pad;
+	uint32 utime; // milliseconds spent in user mode
+	uint32 stime; // milliseconds spent in kernel mode
+	uint32 nvcsw; // voluntary context switches
+	uint32 nivcsw; // involuntary context switches
+	uint32 page_faults;
+	uint32 syscalls;
+	uint32 rss; // kiB of user memory (frames) used
+	uint32 kmem; // kiB of kernel memory used to manage the task (kernel stack, fd table, page tables etc.)
+	char name[TASKSTAT_NAME_LEN];
+};
+
+#ifndef _EXSCAPEOS_KERNEL
+int taskstats(struct taskstat *buf, int count);
+#endif
+
+#endif
@@ -10,6 +10,12 @@
 #include <reent.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/taskstat.h>
+#include <sys/spawn.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/futex.h>
+#include <sys/cpufeature.h>
 
 typedef signed   char  sint8;
 typedef unsigned char  uint8;
@@ -67,7 +73,7 @@ ret sys_##fn(P1 p1, P2 p2, P3 p3, P4 p4) \
   return a; \
 }
 
-#define DEFN_SYSCALL5(fn, ret, num) \
+#define DEFN_SYSCALL5(fn, ret, num, P1, P2, P3, P4, P5) \
 ret sys_##fn(P1 p1, P2 p2, P3 p3, P4 p4, P5 p5) \
 { \
   ret a; \
@@ -106,6 +112,16 @@ DECL_SYSCALL2(dup2, int, int, int);
 DECL_SYSCALL1(pipe, int, int *);
 DECL_SYSCALL2(lstat, int, const char *, struct stat *);
 //DECL_SYSCALL3(readlink, ssize_t, const char *, char *, size_t);
+DECL_SYSCALL2(taskstats, int, struct taskstat *, int);
+DECL_SYSCALL5(spawn, int, const char *, char * const *, char * const *, const struct spawn_action *, int);
+DECL_SYSCALL3(clone, int, void *, void *, void *);
+DECL_SYSCALL2(thread_join, int, int, void **);
+DECL_SYSCALL1(set_thread_area, int, void *);
+DECL_SYSCALL4(futex, int, int *, int, int, const struct timespec *);
+DECL_SYSCALL0(cpu_features, unsigned int);
+DECL_SYSCALL0(sync, int);
+DECL_SYSCALL1(fsync, int, int);
+DECL_SYSCALL1(thread_detach, int, int);
 
 void sys__exit(int status) {
 	asm volatile("int $0x80" : : "a" (0), "b" ((int)status));
@@ -143,6 +159,21 @@ DEFN_SYSCALL2(dup2, int, 28, int, int);
 DEFN_SYSCALL1(pipe, int, 29, int *);
 DEFN_SYSCALL2(lstat, int, 30, const char *, struct stat *);
 DEFN_SYSCALL3(readlink, ssize_t, 31, const char *, char *, size_t);
+DEFN_SYSCALL2(taskstats, int, 32, struct taskstat *, int);
+DEFN_SYSCALL5(spawn, int, 33, const char *, char * const *, char * const *, const struct spawn_action *, int);
+DEFN_SYSCALL3(clone, int, 34, void *, void *, void *);
+/* thread_exit is syscall 35; see below */
+DEFN_SYSCALL2(thread_join, int, 36, int, void **);
+DEFN_SYSCALL1(set_thread_area, int, 37, void *);
+DEFN_SYSCALL4(futex, int, 38, int *, int, int, const struct timespec *);
+DEFN_SYSCALL0(cpu_features, unsigned int, 39);
+DEFN_SYSCALL0(sync, int, 40);
+DEFN_SYSCALL1(fsync, int, 41, int);
+DEFN_SYSCALL1(thread_detach, int, 42, int);
+
+void sys_thread_exit(void *retval) {
+	asm volatile("int $0x80" : : "a" (35), "b" ((int)retval));
+}
 
 // When adding a syscall, don't forget to also add it to src/kernel/syscall.c!
 
@@ -445,6 +476,151 @@ int vfork(void)
 	}
 }
 
+unsigned int cpu_features(void) {
+	return sys_cpu_features();
+}
+
+void sync(void) {
+	sys_sync();
+}
+
+int fsync(int fd) {
+	int ret;
+	if ((ret = sys_fsync(fd)) != 0) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+int taskstats(struct taskstat *buf, int count) {
+	int ret;
+	if ((ret = sys_taskstats(buf, count)) >= 0)
+		return ret;
+	else {
+		errno = -ret;
+		return -1;
+	}
+}
+
+int posix_spawn_file_actions_init(posix_spawn_file_actions_t *file_actions) {
+	file_actions->num_actions = 0;
+	file_actions->max_actions = 0;
+	file_actions->actions = NULL;
+	return 0;
+}
+
+int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *file_actions) {
+	free(file_actions->actions);
+	file_actions->actions = NULL;
+	file_actions->num_actions = file_actions->max_actions = 0;
+	return 0;
+}
+
+static int spawn_add_action(posix_spawn_file_actions_t *file_actions, int type, int fd, int newfd) {
+	if (fd < 0 || newfd < 0)
+		return EBADF;
+	if (file_actions->num_actions >= SPAWN_MAX_ACTIONS)
+		return ENOMEM;
+
+	if (file_actions->num_actions == file_actions->max_actions) {
+		int new_max = (file_actions->max_actions == 0) ? 4 : file_actions->max_actions * 2;
+		struct spawn_action *tmp = realloc(file_actions->actions, new_max * sizeof(struct spawn_action));
+		if (tmp == NULL)
+			return ENOMEM;
+		file_actions->actions = tmp;
+		file_actions->max_actions = new_max;
+	}
+
+	struct spawn_action *a = &file_actions->actions[file_actions->num_actions++];
+	a->type = type;
+	a->fd = fd;
+	a->newfd = newfd;
+	return 0;
+}
+
+int posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *file_actions, int fd, int newfd) {
+	return spawn_add_action(file_actions, SPAWN_ACTION_DUP2, fd, newfd);
+}
+
+int posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *file_actions, int fd) {
+	return spawn_add_action(file_actions, SPAWN_ACTION_CLOSE, fd, 0);
+}
+
+int posix_spawnattr_init(posix_spawnattr_t *attr) {
+	attr->flags = 0;
+	return 0;
+}
+
+int posix_spawnattr_destroy(posix_spawnattr_t *attr) {
+	return 0;
+}
+
+int posix_spawnattr_getflags(const posix_spawnattr_t *attr, short *flags) {
+	*flags = attr->flags;
+	return 0;
+}
+
+int posix_spawnattr_setflags(posix_spawnattr_t *attr, short flags) {
+	if (flags != 0)
+		return EINVAL; // none are supported
+	attr->flags = flags;
+	return 0;
+}
+
+// Note that unlike most functions here, the posix_spawn functions return an error number, rather than setting errno.
+int posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
+		const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]) {
+	if (attrp != NULL && attrp->flags != 0)
+		return EINVAL;
+
+	int ret = sys_spawn(path, argv, envp == NULL ? environ : envp,
+			file_actions ? file_actions->actions : NULL, file_actions ? file_actions->num_actions : 0);
+	if (ret < 0)
+		return -ret;
+
+	if (pid != NULL)
+		*pid = ret;
+	return 0;
+}
+
+int posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *file_actions,
+		const posix_spawnattr_t *attrp, char *const argv[], char *const envp[]) {
+	if (strchr(file, '/') != NULL)
+		return posix_spawn(pid, file, file_actions, attrp, argv, envp);
+
+	const char *path = getenv("PATH");
+	if (path == NULL)
+		path = "/bin";
+
+	// Try each directory in $PATH, until one works, or fails for some other reason than the file not existing
+	int err = ENOENT;
+	char buf[PATH_MAX + 1];
+	while (*path != 0) {
+		const char *end = strchr(path, ':');
+		size_t len = (end != NULL) ? (size_t)(end - path) : strlen(path);
+		if (len + 1 + strlen(file) < sizeof(buf)) {
+			memcpy(buf, path, len);
+			buf[len] = 0;
+			if (len == 0)
+				strcpy(buf, ".");
+			if (buf[strlen(buf) - 1] != '/')
+				strcat(buf, "/");
+			strcat(buf, file);
+
+			err = posix_spawn(pid, buf, file_actions, attrp, argv, envp);
+			if (err != ENOENT)
+				return err;
+		}
+
+		if (end == NULL)
+			break;
+		path = end + 1;
+	}
+
+	return err;
+}
+
 int dup(int fd) {
 	return sys_dup(fd);
 }
@@ -494,3 +670,450 @@ char *getcwd(char *__buf, size_t __size) {
 			return ret;
 	}
 }
+
+/*
+ * pthreads
+ * Each thread has a control block, which the TLS segment (GS) points to; see getreent.c.
+ * The first two members are accessed through GS, so their offsets must not change.
+ */
+struct pthread_tcb {
+	struct pthread_tcb *self;
+	struct _reent *reent;
+	pthread_t tid;
+	void *stack; // NULL for the main thread
+	void *(*start_routine)(void *);
+	void *arg;
+	int detached;
+	struct pthread_tcb *next;
+};
+
+extern int __exscapeos_threaded; // getreent.c
+
+static struct pthread_tcb main_tcb;
+static struct pthread_tcb *tcb_list = NULL; // all threads that have not been joined or reclaimed; protected by tcb_lock
+__LOCK_INIT(static, tcb_lock);
+
+static void tcb_list_lock(void) {
+	__lock_acquire(tcb_lock);
+}
+
+static void tcb_list_unlock(void) {
+	__lock_release(tcb_lock);
+}
+
+static void tcb_free(struct pthread_tcb *tcb) {
+	_reclaim_reent(tcb->reent);
+	free(tcb->reent);
+	free(tcb->stack);
+	free(tcb);
+}
+
+/*
+ * Frees the stacks and _reents of detached threads that have exited.
+ * A detached thread can't free its own stack, and the kernel forgets it once it exits:
+ * joining it fails with EINVAL while it runs, and with ESRCH once it's gone.
+ * (Thread IDs are never reused.) Call with tcb_lock held.
+ */
+static void tcb_reclaim_detached(void) {
+	for (struct pthread_tcb **pp = &tcb_list; *pp != NULL;) {
+		struct pthread_tcb *tcb = *pp;
+		if (tcb->detached && sys_thread_join(tcb->tid, NULL) == -ESRCH) {
+			*pp = tcb->next;
+			tcb_free(tcb);
+		}
+		else
+			pp = &tcb->next;
+	}
+}
+
+static struct pthread_tcb *current_tcb(void) {
+	if (!__exscapeos_threaded)
+		return &main_tcb;
+
+	struct pthread_tcb *tcb;
+	asm volatile("movl %%gs:0, %0" : "=r" (tcb));
+	return tcb;
+}
+
+int futex(int *uaddr, int op, int val, const struct timespec *timeout) {
+	int ret;
+	if ((ret = sys_futex(uaddr, op, val, timeout)) >= 0)
+		return ret;
+	else {
+		errno = -ret;
+		return -1;
+	}
+}
+
+/*
+ * The basic lock used by both newlib's locks and pthread mutexes.
+ * *state is 0 when unlocked, 1 when locked, and 2 when locked with (possible) waiters;
+ * only the last case makes unlock enter the kernel, and lock only does so when it has to wait.
+ */
+static void futex_lock(int *state) {
+	int c = __sync_val_compare_and_swap(state, 0, 1);
+	if (c == 0)
+		return; // uncontended
+
+	if (c != 2)
+		c = __sync_lock_test_and_set(state, 2);
+	while (c != 0) {
+		sys_futex(state, FUTEX_WAIT, 2, NULL);
+		c = __sync_lock_test_and_set(state, 2);
+	}
+}
+
+static int futex_trylock(int *state) {
+	return (__sync_val_compare_and_swap(state, 0, 1) == 0);
+}
+
+static void futex_unlock(int *state) {
+	if (__sync_fetch_and_sub(state, 1) != 1) {
+		// There may be waiters
+		__sync_lock_release(state);
+		sys_futex(state, FUTEX_WAKE, 1, NULL);
+	}
+}
+
+// Newlib's internal locks; see sys/lock.h
+void __exscapeos_lock_init(_LOCK_T *lock) {
+	lock->state = 0;
+}
+
+void __exscapeos_lock_init_recursive(_LOCK_RECURSIVE_T *lock) {
+	lock->state = 0;
+	lock->owner = NULL;
+	lock->count = 0;
+}
+
+void __exscapeos_lock_acquire(_LOCK_T *lock) {
+	futex_lock(&lock->state);
+}
+
+int __exscapeos_lock_try_acquire(_LOCK_T *lock) {
+	return futex_trylock(&lock->state) ? 0 : EBUSY;
+}
+
+void __exscapeos_lock_release(_LOCK_T *lock) {
+	futex_unlock(&lock->state);
+}
+
+void __exscapeos_lock_acquire_recursive(_LOCK_RECURSIVE_T *lock) {
+	struct pthread_tcb *self = current_tcb();
+	if (lock->owner != self) {
+		futex_lock(&lock->state);
+		lock->owner = self;
+	}
+	lock->count++;
+}
+
+int __exscapeos_lock_try_acquire_recursive(_LOCK_RECURSIVE_T *lock) {
+	struct pthread_tcb *self = current_tcb();
+	if (lock->owner != self) {
+		if (!futex_trylock(&lock->state))
+			return EBUSY;
+		lock->owner = self;
+	}
+	lock->count++;
+	return 0;
+}
+
+void __exscapeos_lock_release_recursive(_LOCK_RECURSIVE_T *lock) {
+	if (--lock->count == 0) {
+		lock->owner = NULL;
+		futex_unlock(&lock->state);
+	}
+}
+
+int pthread_attr_init(pthread_attr_t *attr) {
+	attr->stacksize = PTHREAD_STACK_DEFAULT;
+	return 0;
+}
+
+int pthread_attr_destroy(pthread_attr_t *attr) {
+	return 0;
+}
+
+int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize) {
+	if (stacksize < PTHREAD_STACK_MIN)
+		return EINVAL;
+	attr->stacksize = stacksize;
+	return 0;
+}
+
+int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize) {
+	*stacksize = attr->stacksize;
+	return 0;
+}
+
+static void pthread_start(struct pthread_tcb *tcb) {
+	// pthread_create holds the lock until it has filled in tcb->tid
+	tcb_list_lock();
+	tcb_list_unlock();
+
+	pthread_exit(tcb->start_routine(tcb->arg));
+}
+
+// Note that like posix_spawn, the pthread functions return an error number, rather than setting errno.
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg) {
+	if (!__exscapeos_threaded) {
+		// First thread: give the main thread a TLS segment as well, so that
+		// __getreent() can find the current thread's _reent from now on
+		main_tcb.self = &main_tcb;
+		main_tcb.reent = _impure_ptr;
+		main_tcb.tid = sys_getpid();
+		int r = sys_set_thread_area(&main_tcb);
+		if (r < 0)
+			return -r;
+		__exscapeos_threaded = 1;
+	}
+
+	size_t stacksize = (attr != NULL) ? attr->stacksize : PTHREAD_STACK_DEFAULT;
+	struct pthread_tcb *tcb = malloc(sizeof(struct pthread_tcb));
+	struct _reent *reent = malloc(sizeof(struct _reent));
+	void *stack = malloc(stacksize);
+	if (tcb == NULL || reent == NULL || stack == NULL) {
+		free(tcb);
+		free(reent);
+		free(stack);
+		return EAGAIN;
+	}
+
+	_REENT_INIT_PTR(reent);
+	memset(tcb, 0, sizeof(struct pthread_tcb));
+	tcb->self = tcb;
+	tcb->reent = reent;
+	tcb->stack = stack;
+	tcb->start_routine = start_routine;
+	tcb->arg = arg;
+
+	// Set up the initial stack frame, as if pthread_start(tcb) had been called
+	uint32 *sp = (uint32 *)(((uint32)stack + stacksize) & ~0xf);
+	*(--sp) = (uint32)tcb;
+	*(--sp) = 0; // return address; pthread_start never returns
+
+	tcb_list_lock();
+	tcb_reclaim_detached();
+	int tid = sys_clone((void *)pthread_start, sp, tcb);
+	if (tid < 0) {
+		tcb_list_unlock();
+		free(tcb);
+		free(reent);
+		free(stack);
+		return -tid;
+	}
+	tcb->tid = tid;
+	tcb->next = tcb_list;
+	tcb_list = tcb;
+	tcb_list_unlock();
+
+	if (thread != NULL)
+		*thread = tid;
+	return 0;
+}
+
+int pthread_join(pthread_t thread, void **retval) {
+	int r = sys_thread_join(thread, retval);
+	if (r < 0)
+		return -r;
+
+	// The thread is gone; free its stack and _reent
+	tcb_list_lock();
+	for (struct pthread_tcb **pp = &tcb_list; *pp != NULL; pp = &(*pp)->next) {
+		struct pthread_tcb *tcb = *pp;
+		if (tcb->tid == thread) {
+			*pp = tcb->next;
+			tcb_list_unlock();
+			tcb_free(tcb);
+			return 0;
+		}
+	}
+	tcb_list_unlock();
+
+	return 0;
+}
+
+int pthread_detach(pthread_t thread) {
+	int r = sys_thread_detach(thread);
+	if (r < 0)
+		return -r;
+
+	// The kernel frees the thread when it exits; its stack and _reent are freed
+	// by a later pthread_create, since the thread may still be running on them
+	tcb_list_lock();
+	for (struct pthread_tcb *tcb = tcb_list; tcb != NULL; tcb = tcb->next) {
+		if (tcb->tid == thread)
+			tcb->detached = 1;
+	}
+	tcb_list_unlock();
+
+	return 0;
+}
+
+void pthread_exit(void *retval) {
+	// stdout/stderr are per-thread streams; don't lose buffered output
+	fflush(stdout);
+	fflush(stderr);
+	sys_thread_exit(retval);
+	for(;;) { } // silence noreturn warning
+}
+
+pthread_t pthread_self(void) {
+	if (!__exscapeos_threaded)
+		return sys_getpid();
+
+	return current_tcb()->tid;
+}
+
+int pthread_equal(pthread_t t1, pthread_t t2) {
+	return (t1 == t2);
+}
+
+int pthread_mutexattr_init(pthread_mutexattr_t *attr) {
+	attr->type = PTHREAD_MUTEX_DEFAULT;
+	return 0;
+}
+
+int pthread_mutexattr_destroy(pthread_mutexattr_t *attr) {
+	return 0;
+}
+
+int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type) {
+	if (type != PTHREAD_MUTEX_NORMAL && type != PTHREAD_MUTEX_RECURSIVE && type != PTHREAD_MUTEX_ERRORCHECK)
+		return EINVAL;
+	attr->type = type;
+	return 0;
+}
+
+int pthread_mutexattr_gettype(const pthread_mutexattr_t *attr, int *type) {
+	*type = attr->type;
+	return 0;
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
+	memset(mutex, 0, sizeof(pthread_mutex_t));
+	mutex->type = (attr != NULL) ? attr->type : PTHREAD_MUTEX_DEFAULT;
+	return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex) {
+	return (mutex->state != 0) ? EBUSY : 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+	if (mutex->type == PTHREAD_MUTEX_NORMAL) {
+		futex_lock(&mutex->state);
+		return 0;
+	}
+
+	pthread_t self = pthread_self();
+	if (mutex->state != 0 && mutex->owner == self) {
+		if (mutex->type == PTHREAD_MUTEX_ERRORCHECK)
+			return EDEADLK;
+		mutex->count++;
+		return 0;
+	}
+
+	futex_lock(&mutex->state);
+	mutex->owner = self;
+	mutex->count = 1;
+	return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex) {
+	if (mutex->type == PTHREAD_MUTEX_NORMAL)
+		return futex_trylock(&mutex->state) ? 0 : EBUSY;
+
+	pthread_t self = pthread_self();
+	if (mutex->state != 0 && mutex->owner == self) {
+		if (mutex->type == PTHREAD_MUTEX_ERRORCHECK)
+			return EBUSY;
+		mutex->count++;
+		return 0;
+	}
+
+	if (!futex_trylock(&mutex->state))
+		return EBUSY;
+	mutex->owner = self;
+	mutex->count = 1;
+	return 0;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex) {
+	if (mutex->type != PTHREAD_MUTEX_NORMAL) {
+		if (mutex->state == 0 || mutex->owner != pthread_self())
+			return EPERM;
+		if (--mutex->count > 0)
+			return 0;
+		mutex->owner = 0;
+	}
+
+	futex_unlock(&mutex->state);
+	return 0;
+}
+
+int pthread_condattr_init(pthread_condattr_t *attr) {
+	return 0;
+}
+
+int pthread_condattr_destroy(pthread_condattr_t *attr) {
+	return 0;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
+	cond->seq = 0;
+	cond->waiters = 0;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond) {
+	return (cond->waiters != 0) ? EBUSY : 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+	return pthread_cond_timedwait(cond, mutex, NULL);
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime) {
+	// A signal after we read seq (but before we sleep) changes it, so FUTEX_WAIT returns at once
+	int seq = cond->seq;
+	__sync_fetch_and_add(&cond->waiters, 1);
+	pthread_mutex_unlock(mutex);
+
+	int err = 0;
+	struct timespec rel, *relp = NULL;
+	if (abstime != NULL) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		rel.tv_sec = abstime->tv_sec - now.tv_sec;
+		rel.tv_nsec = abstime->tv_nsec - now.tv_usec * 1000;
+		if (rel.tv_nsec < 0) {
+			rel.tv_nsec += 1000000000;
+			rel.tv_sec--;
+		}
+		if (rel.tv_sec < 0)
+			err = ETIMEDOUT;
+		relp = &rel;
+	}
+
+	if (err == 0 && sys_futex(&cond->seq, FUTEX_WAIT, seq, relp) == -ETIMEDOUT)
+		err = ETIMEDOUT;
+
+	__sync_fetch_and_sub(&cond->waiters, 1);
+	pthread_mutex_lock(mutex);
+	return err;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	if (cond->waiters > 0)
+		sys_futex(&cond->seq, FUTEX_WAKE, 1, NULL);
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	if (cond->waiters > 0)
+		sys_futex(&cond->seq, FUTEX_WAKE, INT_MAX, NULL);
+	return 0;
+}